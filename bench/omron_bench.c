@@ -0,0 +1,553 @@
+/*
+ * Microbenchmarks of the host side protocol layer of libomron
+ *
+ * Each benchmark is run in batches of iterations long enough to time
+ * reliably, first for a number of warmup batches, then for the measured
+ * samples. Results are written as JSON, one object per benchmark with
+ * the per iteration time statistics in nanoseconds, so runs of different
+ * releases can be compared.
+ *
+ * Protocol benchmarks talk to a canned transport that answers every read
+ * with the next report of a fixed response and discards writes, so only
+ * the library's own work is measured. The dump benchmarks read the whole
+ * memory of a simulated device (omron_open_sim()) with all delays and
+ * faults turned off.
+ *
+ * Usage: omron_bench [-s samples] [-w warmup] [-t min_sample_us] [-f filter] [-o out.json]
+ *   -s  Measured samples per benchmark (default: 20)
+ *   -w  Warmup samples per benchmark (default: 3)
+ *   -t  Minimum duration of a sample [us] (default: 5000)
+ *   -f  Only run benchmarks whose name contains this string
+ *   -o  Write the JSON to a file instead of stdout
+ */
+
+#include "libomron/omron.h"
+#include "omron_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#ifndef OMRON_BENCH_VERSION
+#define OMRON_BENCH_VERSION "unknown"
+#endif
+
+#define MAX_SAMPLES 1000
+#define REPORT_SIZE 8
+/// Largest canned response, a GTD reply
+#define MAX_CANNED 64
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Canned transport
+//
+///////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Input reports of one response, returned in a loop. Each read hands out
+ * the next report, wrapping around after the last one.
+ */
+typedef struct {
+	uint8_t reports[MAX_CANNED / (REPORT_SIZE - 1) + 1][REPORT_SIZE];
+	int count;
+	int next;
+} canned_response;
+
+static int canned_set_mode(omron_device* dev, omron_mode mode)
+{
+	(void)dev;
+	(void)mode;
+	return 0;
+}
+
+static int canned_read_data(omron_device* dev, uint8_t* report_buf, int report_size, int timeout)
+{
+	canned_response* c = dev->transport_data;
+
+	(void)report_size;
+	(void)timeout;
+	memcpy(report_buf, c->reports[c->next], REPORT_SIZE);
+	if (++c->next == c->count) c->next = 0;
+	return REPORT_SIZE;
+}
+
+static int canned_write_data(omron_device* dev, uint8_t* report_buf, int report_size, int timeout)
+{
+	(void)dev;
+	(void)report_buf;
+	(void)timeout;
+	return report_size;
+}
+
+static int canned_drain_input(omron_device* dev)
+{
+	canned_response* c = dev->transport_data;
+
+	c->next = 0;
+	return 0;
+}
+
+static int canned_close(omron_device* dev)
+{
+	(void)dev;
+	return 0;
+}
+
+static const omron_transport canned_transport = {
+	"canned",
+	canned_set_mode,
+	canned_read_data,
+	canned_write_data,
+	canned_drain_input,
+	canned_close,
+	// Only blocking calls are benchmarked, no polling
+	NULL,
+	NULL
+};
+
+/*
+ * Build an "OK" response with size - 3 bytes of pseudo random payload and
+ * a valid checksum, split into input reports.
+ */
+static void canned_fill(canned_response* c, int size, uint32_t seed)
+{
+	uint8_t response[MAX_CANNED];
+	uint8_t checksum = 0;
+	int i;
+
+	response[0] = 'O';
+	response[1] = 'K';
+	for (i = 2; i < size - 1; ++i) {
+		seed = seed * 1103515245 + 12345;
+		response[i] = (seed >> 16) & 0xff;
+		checksum ^= response[i];
+	}
+	response[size - 1] = checksum;
+
+	memset(c, 0, sizeof(*c));
+	for (i = 0; i < size; i += REPORT_SIZE - 1) {
+		int chunk = size - i < REPORT_SIZE - 1 ? size - i : REPORT_SIZE - 1;
+
+		c->reports[c->count][0] = chunk;
+		memcpy(c->reports[c->count] + 1, response + i, chunk);
+		c->count++;
+	}
+}
+
+static omron_device* canned_open(canned_response* c)
+{
+	omron_device* dev = omron_create();
+
+	if (!dev) return NULL;
+	dev->input_size = REPORT_SIZE;
+	dev->output_size = REPORT_SIZE;
+	if (omron_alloc_arena(dev) < 0) {
+		omron_delete(dev);
+		return NULL;
+	}
+	dev->transport = &canned_transport;
+	dev->transport_data = c;
+	// Skip the mode change and clear on the first command
+	dev->device_mode = PEDOMETER_MODE;
+	return dev;
+}
+
+static void canned_delete(omron_device* dev)
+{
+	omron_close(dev);
+	omron_delete(dev);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Benchmarks
+//
+// Each runs `iterations` times and returns < 0 on failure.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+	omron_device* dev;
+	canned_response canned;
+	uint8_t raw[256 * OMRON_PD_DAILY_RECORD_SIZE];
+	omron_pd_daily_data daily[256];
+	omron_bp_day_info bp[256];
+	int status[256];
+	omron_pd_history* history;
+	int bp_count;
+	int pd_days;
+	/// Keeps the compiler from dropping results
+	volatile int sink;
+} bench_ctx;
+
+static int bench_send_command(bench_ctx* b, long iterations)
+{
+	static const unsigned char command[] = { 'G', 'M', 'E', 0x00, 0x00, 0x05, 0x00, 0x05 };
+	long i;
+
+	for (i = 0; i < iterations; ++i) {
+		if (omron_send_command(b->dev, sizeof(command), command) < 0) return -1;
+	}
+	b->dev->pending_responses = 0;
+	return 0;
+}
+
+static int bench_command_return(bench_ctx* b, long iterations)
+{
+	unsigned char response[17];
+	long i;
+
+	for (i = 0; i < iterations; ++i) {
+		if (omron_get_command_return(b->dev, sizeof(response), response) != sizeof(response)) return -1;
+	}
+	return 0;
+}
+
+static int bench_bcd_to_int2(bench_ctx* b, long iterations)
+{
+	unsigned char* data = b->raw;
+	int sum = 0;
+	long i;
+
+	for (i = 0; i < iterations; ++i) {
+		// Odd nibble start and length, like the MES distance field
+		sum += bcd_to_int2(data + (i & 0xff), 3, 5);
+	}
+	b->sink = sum;
+	return 0;
+}
+
+static int bench_pd_daily_decode(bench_ctx* b, long iterations)
+{
+	long i;
+
+	for (i = 0; i < iterations; ++i) {
+		omron_decode_pd_daily_records(b->raw, 1, 0, b->daily);
+	}
+	b->sink = b->daily[0].total_steps;
+	return 0;
+}
+
+static int bench_pd_hourly(bench_ctx* b, long iterations)
+{
+	long i;
+
+	for (i = 0; i < iterations; ++i) {
+		omron_pd_hourly_data* h = omron_get_pd_hourly_data(b->dev, 0);
+
+		if (!h) return -1;
+		b->sink = h[23].regular_steps;
+		free(h);
+	}
+	return 0;
+}
+
+static int bench_dump_bp(bench_ctx* b, long iterations)
+{
+	long i;
+	int j;
+
+	for (i = 0; i < iterations; ++i) {
+		if (omron_get_daily_bp_range(b->dev, 0, 0, b->bp_count - 1, b->bp, b->status) < 0) return -1;
+		for (j = 0; j < b->bp_count; ++j) {
+			if (b->status[j] < 0) return -1;
+		}
+	}
+	b->sink = b->bp[0].sys;
+	return 0;
+}
+
+static int bench_dump_pd(bench_ctx* b, long iterations)
+{
+	omron_pd_hourly_data hourly[24];
+	long i;
+	int day;
+
+	for (i = 0; i < iterations; ++i) {
+		for (day = 0; day < b->pd_days; ++day) {
+			if (omron_read_pd_daily_data(b->dev, day, &b->daily[day]) < 0) return -1;
+			if (omron_read_pd_hourly_data(b->dev, day, hourly) < 0) return -1;
+		}
+	}
+	b->sink = hourly[0].regular_steps;
+	return 0;
+}
+
+static int bench_dump_pd_history(bench_ctx* b, long iterations)
+{
+	long i;
+	int day;
+
+	for (i = 0; i < iterations; ++i) {
+		if (omron_get_pd_history(b->dev, 0, b->pd_days - 1, b->history) < 0) return -1;
+		for (day = 0; day < b->pd_days; ++day) {
+			if (b->history->status[day] < 0) return -1;
+		}
+	}
+	b->sink = b->history->regular_steps[0];
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Setup
+//
+///////////////////////////////////////////////////////////////////////////////
+
+static int setup_canned(bench_ctx* b, int response_size)
+{
+	canned_fill(&b->canned, response_size, 1);
+	b->dev = canned_open(&b->canned);
+	return b->dev ? 0 : -1;
+}
+
+static int setup_framing(bench_ctx* b)
+{
+	return setup_canned(b, 17);
+}
+
+static int setup_reassembly(bench_ctx* b)
+{
+	// GME reply
+	return setup_canned(b, 17);
+}
+
+static int setup_hourly(bench_ctx* b)
+{
+	// GTD reply
+	return setup_canned(b, 37);
+}
+
+static int setup_bcd(bench_ctx* b)
+{
+	uint32_t seed = 1;
+	size_t i;
+
+	// Valid BCD digits in every nibble
+	for (i = 0; i < sizeof(b->raw); ++i) {
+		seed = seed * 1103515245 + 12345;
+		b->raw[i] = (((seed >> 16) % 10) << 4) | ((seed >> 24) % 10);
+	}
+	b->dev = NULL;
+	return 0;
+}
+
+static int setup_sim(bench_ctx* b)
+{
+	omron_sim_config config;
+	omron_pd_count_info count;
+
+	omron_sim_default_config(&config);
+	config.latency_us = 0;
+	config.jitter_us = 0;
+	config.corrupt_rate = 0;
+	config.negative_rate = 0;
+	b->dev = omron_create();
+	if (!b->dev) return -1;
+	if (omron_open_sim(b->dev, &config) < 0) return -1;
+	b->bp_count = omron_get_daily_data_count(b->dev, 0);
+	if (b->bp_count <= 0) return -1;
+	count = omron_get_pd_data_count(b->dev);
+	b->pd_days = count.daily_count;
+	if (b->pd_days <= 0) return -1;
+	b->history = omron_pd_history_create(b->pd_days);
+	return b->history ? 0 : -1;
+}
+
+static void teardown(bench_ctx* b)
+{
+	omron_pd_history_delete(b->history);
+	b->history = NULL;
+	if (!b->dev) return;
+	if (b->dev->transport == &canned_transport) {
+		canned_delete(b->dev);
+	} else {
+		omron_close(b->dev);
+		omron_delete(b->dev);
+	}
+	b->dev = NULL;
+}
+
+typedef struct {
+	const char* name;
+	const char* description;
+	int (*setup)(bench_ctx* b);
+	int (*run)(bench_ctx* b, long iterations);
+} benchmark;
+
+static const benchmark benchmarks[] = {
+	{ "send_command", "omron_send_command() framing of an 8 byte command into output reports",
+	  setup_framing, bench_send_command },
+	{ "get_command_return", "omron_get_command_return() reassembly and checksum of a 17 byte response",
+	  setup_reassembly, bench_command_return },
+	{ "bcd_to_int2", "bcd_to_int2() of a 5 nibble field at an odd nibble",
+	  setup_bcd, bench_bcd_to_int2 },
+	{ "pd_daily_decode", "omron_decode_pd_daily_records() of one MES record",
+	  setup_bcd, bench_pd_daily_decode },
+	{ "pd_hourly", "omron_get_pd_hourly_data() of one day, 3 GTD exchanges and unpacking",
+	  setup_hourly, bench_pd_hourly },
+	{ "dump_bp", "omron_get_daily_bp_range() of bank A of a simulated 790IT",
+	  setup_sim, bench_dump_bp },
+	{ "dump_pd", "Daily and hourly data of all days of a simulated 720IT",
+	  setup_sim, bench_dump_pd },
+	{ "dump_pd_history", "omron_get_pd_history() of all days of a simulated 720IT",
+	  setup_sim, bench_dump_pd_history },
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Measurement
+//
+///////////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+	long iterations;
+	int samples;
+	double min, median, mean, p90, max, stddev;
+} bench_result;
+
+static int compare_double(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+
+	return (x > y) - (x < y);
+}
+
+/// Time one batch, returns ns per iteration or < 0 on failure
+static double run_batch(const benchmark* bm, bench_ctx* b, long iterations)
+{
+	int64_t start = omron_now_us();
+
+	if (bm->run(b, iterations) < 0) return -1;
+	return (omron_now_us() - start) * 1000.0 / iterations;
+}
+
+static int measure(const benchmark* bm, bench_ctx* b, int warmup, int samples, int64_t min_sample_us, bench_result* r)
+{
+	double ns[MAX_SAMPLES];
+	double sum = 0, sq = 0;
+	long iterations = 1;
+	int i;
+
+	// Grow the batch until one takes long enough to time
+	while (1) {
+		double t = run_batch(bm, b, iterations);
+
+		if (t < 0) return -1;
+		if (t * iterations >= min_sample_us * 1000.0) break;
+		iterations *= 2;
+	}
+	for (i = 0; i < warmup; ++i) {
+		if (run_batch(bm, b, iterations) < 0) return -1;
+	}
+	for (i = 0; i < samples; ++i) {
+		ns[i] = run_batch(bm, b, iterations);
+		if (ns[i] < 0) return -1;
+		sum += ns[i];
+	}
+	qsort(ns, samples, sizeof(ns[0]), compare_double);
+
+	r->iterations = iterations;
+	r->samples = samples;
+	r->min = ns[0];
+	r->max = ns[samples - 1];
+	r->median = (samples % 2) ? ns[samples / 2] : (ns[samples / 2 - 1] + ns[samples / 2]) / 2;
+	r->p90 = ns[(int)ceil(0.9 * samples) - 1];
+	r->mean = sum / samples;
+	for (i = 0; i < samples; ++i) {
+		sq += (ns[i] - r->mean) * (ns[i] - r->mean);
+	}
+	r->stddev = samples > 1 ? sqrt(sq / (samples - 1)) : 0;
+	return 0;
+}
+
+static void usage(const char* prog)
+{
+	fprintf(stderr, "Usage: %s [-s samples] [-w warmup] [-t min_sample_us] [-f filter] [-o out.json]\n", prog);
+}
+
+int main(int argc, char** argv)
+{
+	int samples = 20;
+	int warmup = 3;
+	int64_t min_sample_us = 5000;
+	const char* filter = NULL;
+	const char* out_path = NULL;
+	FILE* out = stdout;
+	int first = 1;
+	int failed = 0;
+	size_t n;
+	int i;
+
+	for (i = 1; i < argc; ++i) {
+		if (i + 1 >= argc) {
+			usage(argv[0]);
+			return 1;
+		}
+		if (!strcmp(argv[i], "-s")) samples = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-w")) warmup = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-t")) min_sample_us = atol(argv[++i]);
+		else if (!strcmp(argv[i], "-f")) filter = argv[++i];
+		else if (!strcmp(argv[i], "-o")) out_path = argv[++i];
+		else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (samples < 1 || samples > MAX_SAMPLES || warmup < 0 || min_sample_us < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (out_path) {
+		out = fopen(out_path, "w");
+		if (!out) {
+			perror(out_path);
+			return 1;
+		}
+	}
+
+	fprintf(out, "{\n  \"library\": \"libomron\",\n  \"version\": \"%s\",\n", OMRON_BENCH_VERSION);
+	fprintf(out, "  \"time\": %ld,\n", (long)time(NULL));
+	fprintf(out, "  \"config\": { \"samples\": %d, \"warmup\": %d, \"min_sample_us\": %ld },\n",
+		samples, warmup, (long)min_sample_us);
+	fprintf(out, "  \"benchmarks\": [");
+	for (n = 0; n < sizeof(benchmarks) / sizeof(benchmarks[0]); ++n) {
+		const benchmark* bm = &benchmarks[n];
+		bench_ctx* b;
+		bench_result r;
+		int status;
+
+		if (filter && !strstr(bm->name, filter)) continue;
+		b = calloc(1, sizeof(*b));
+		if (!b) return 1;
+		fprintf(stderr, "%s...\n", bm->name);
+		status = bm->setup(b);
+		if (status >= 0) status = measure(bm, b, warmup, samples, min_sample_us, &r);
+		teardown(b);
+		free(b);
+		if (status < 0) {
+			fprintf(stderr, "%s failed\n", bm->name);
+			failed = 1;
+			continue;
+		}
+
+		fprintf(out, "%s\n    {\n", first ? "" : ",");
+		fprintf(out, "      \"name\": \"%s\",\n", bm->name);
+		fprintf(out, "      \"description\": \"%s\",\n", bm->description);
+		fprintf(out, "      \"unit\": \"ns\",\n");
+		fprintf(out, "      \"iterations\": %ld,\n", r.iterations);
+		fprintf(out, "      \"samples\": %d,\n", r.samples);
+		fprintf(out, "      \"min\": %.1f,\n", r.min);
+		fprintf(out, "      \"median\": %.1f,\n", r.median);
+		fprintf(out, "      \"mean\": %.1f,\n", r.mean);
+		fprintf(out, "      \"p90\": %.1f,\n", r.p90);
+		fprintf(out, "      \"max\": %.1f,\n", r.max);
+		fprintf(out, "      \"stddev\": %.1f\n", r.stddev);
+		fprintf(out, "    }");
+		first = 0;
+	}
+	fprintf(out, "\n  ]\n}\n");
+	if (out != stdout) fclose(out);
+	return failed;
+}
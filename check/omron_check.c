@@ -0,0 +1,1312 @@
+/*
+ * Regression checks of libomron against simulated devices
+ *
+ * Each check reads from one or more simulated devices (omron_open_sim())
+ * and compares what the library returns with what a clean simulator of
+ * the same seed holds, so faults the simulator injects must never show up
+ * as wrong data. A check prints "ok" or what went wrong, the exit status
+ * is the number of checks that failed.
+ *
+ * Usage: omron_check [-f filter] [-t traces]
+ *   -f  Only run checks whose name contains this string. Checks that are
+ *       slow or need a lot of disk (archive_2g, events_wrap) only run when
+ *       named in full
+ *   -t  Trace of the captures in doc/logs (made by omron_capture_convert),
+ *       the captures check is skipped without one
+ */
+
+#include "libomron/omron.h"
+#include "omron_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(OMRON_HAVE_SQLITE3)
+#include <sqlite3.h>
+#endif
+
+/// Seeds every fault injecting check is run with
+#define CHECK_SEEDS 4
+/// Records read from bank A by the BP checks
+#define CHECK_BP_COUNT 24
+/// Days read by the pedometer checks
+#define CHECK_PD_DAYS 6
+
+typedef struct {
+	const char* name;
+	const char* description;
+	/// Returns 0 if the check passed, prints why and returns < 0 if not
+	int (*run)(void);
+	/// Only run when named in full with -f
+	int on_request;
+} check;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Helpers
+//
+///////////////////////////////////////////////////////////////////////////////
+
+/// Simulator config of a unit that answers at once and never garbles anything
+static void clean_config(omron_sim_config* config, uint32_t seed)
+{
+	omron_sim_default_config(config);
+	config->latency_us = 0;
+	config->jitter_us = 0;
+	config->turnaround_us = 0;
+	config->corrupt_rate = 0;
+	config->negative_rate = 0;
+	config->seed = seed;
+	config->bp_count[0] = CHECK_BP_COUNT;
+	config->bp_count[1] = 0;
+	config->pd_days = CHECK_PD_DAYS;
+}
+
+static omron_device* open_sim(const omron_sim_config* config)
+{
+	omron_device* dev = omron_create();
+
+	if (!dev) return NULL;
+	if (omron_open_sim(dev, config) < 0) {
+		omron_delete(dev);
+		return NULL;
+	}
+	return dev;
+}
+
+static void close_sim(omron_device* dev)
+{
+	omron_close(dev);
+	omron_delete(dev);
+}
+
+static int same_bp(const omron_bp_day_info* a, const omron_bp_day_info* b)
+{
+	return a->year == b->year && a->month == b->month && a->day == b->day &&
+		a->hour == b->hour && a->minute == b->minute && a->second == b->second &&
+		a->sys == b->sys && a->dia == b->dia && a->pulse == b->pulse &&
+		a->present == b->present;
+}
+
+/// Step a started command to the end, sleeping while it waits
+static int run_cmd(omron_device* dev, omron_async_cmd* cmd)
+{
+	while (omron_cmd_step(dev, cmd)) {
+		omron_sleep_until_us(omron_now_us() + omron_cmd_timeout(dev, cmd) * (int64_t)1000);
+	}
+	return cmd->status;
+}
+
+/// Compare day i of two histories, returns 1 if they hold the same data
+static int same_pd_day(const omron_pd_history* a, const omron_pd_history* b, int i)
+{
+	const omron_pd_daily_data* x = &a->daily[i];
+	const omron_pd_daily_data* y = &b->daily[i];
+	int h;
+
+	if (x->total_steps != y->total_steps ||
+		x->total_aerobic_steps != y->total_aerobic_steps ||
+		x->total_aerobic_walking_time != y->total_aerobic_walking_time ||
+		x->total_calories != y->total_calories ||
+		x->total_distance != y->total_distance ||
+		x->total_fat_burn != y->total_fat_burn ||
+		x->day_serial != y->day_serial) return 0;
+	for (h = i * 24; h < (i + 1) * 24; ++h) {
+		if (a->regular_steps[h] != b->regular_steps[h] ||
+			a->aerobic_steps[h] != b->aerobic_steps[h] ||
+			a->is_attached[h] != b->is_attached[h] ||
+			a->event[h] != b->event[h]) return 0;
+	}
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Checks
+//
+///////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Pipelined downloads from a unit that, like a real one, takes longer to
+ * start an answer than the input takes to go quiet. When a garbled or
+ * negative answer breaks the pipeline the answers still owed for the
+ * commands behind it come in late, and must be drained before the records
+ * are read again one at a time rather than be taken as their answers.
+ */
+static int check_late_replies(void)
+{
+	omron_bp_day_info ref_bp[CHECK_BP_COUNT], bp[CHECK_BP_COUNT];
+	int status[CHECK_BP_COUNT];
+	omron_pd_history* ref_pd = omron_pd_history_create(CHECK_PD_DAYS);
+	omron_pd_history* pd = omron_pd_history_create(CHECK_PD_DAYS);
+	uint32_t breaks = 0;
+	int failed = 0;
+	uint32_t seed;
+	int i;
+
+	if (!ref_pd || !pd) {
+		printf("  out of memory\n");
+		omron_pd_history_delete(ref_pd);
+		omron_pd_history_delete(pd);
+		return -1;
+	}
+	for (seed = 1; seed <= CHECK_SEEDS && !failed; ++seed) {
+		omron_sim_config config;
+		omron_device* dev;
+		omron_stats stats;
+		int ret;
+
+		clean_config(&config, seed);
+		dev = open_sim(&config);
+		if (!dev) {
+			printf("  seed %u: cannot open clean simulator\n", seed);
+			failed = 1;
+			break;
+		}
+		ret = omron_get_daily_bp_range(dev, 0, 0, CHECK_BP_COUNT - 1, ref_bp, NULL);
+		if (ret == CHECK_BP_COUNT) ret = omron_get_pd_history(dev, 0, CHECK_PD_DAYS - 1, ref_pd);
+		close_sim(dev);
+		if (ret != CHECK_PD_DAYS) {
+			printf("  seed %u: clean simulator read failed (%d)\n", seed, ret);
+			failed = 1;
+			break;
+		}
+
+		config.latency_us = 1000;
+		config.turnaround_us = 30000;
+		config.corrupt_rate = 0.03;
+		config.negative_rate = 0.03;
+		dev = open_sim(&config);
+		if (!dev) {
+			printf("  seed %u: cannot open simulator\n", seed);
+			failed = 1;
+			break;
+		}
+
+		ret = omron_get_daily_bp_range(dev, 0, 0, CHECK_BP_COUNT - 1, bp, status);
+		if (ret < 0) {
+			printf("  seed %u: omron_get_daily_bp_range() failed: %s\n", seed, omron_strerror(ret));
+			failed = 1;
+		}
+		for (i = 0; ret >= 0 && i < CHECK_BP_COUNT; ++i) {
+			if (status[i] == 0 && !same_bp(&bp[i], &ref_bp[i])) {
+				printf("  seed %u: BP record %d differs from the clean read\n", seed, i);
+				failed = 1;
+			}
+		}
+
+		ret = omron_get_pd_history(dev, 0, CHECK_PD_DAYS - 1, pd);
+		if (ret < 0) {
+			printf("  seed %u: omron_get_pd_history() failed: %s\n", seed, omron_strerror(ret));
+			failed = 1;
+		}
+		for (i = 0; ret >= 0 && i < CHECK_PD_DAYS; ++i) {
+			if (pd->status[i] == 0 && !same_pd_day(pd, ref_pd, i)) {
+				printf("  seed %u: pedometer day %d differs from the clean read\n", seed, i);
+				failed = 1;
+			}
+		}
+
+		if (omron_get_stats(dev, &stats) == 0) breaks += stats.pipeline_breaks;
+		close_sim(dev);
+	}
+	omron_pd_history_delete(ref_pd);
+	omron_pd_history_delete(pd);
+
+	if (!failed && !breaks) {
+		printf("  no pipeline break was injected, nothing checked\n");
+		failed = 1;
+	}
+	return failed ? -1 : 0;
+}
+
+/*
+ * Non-blocking commands: a second command can't start while one runs,
+ * and the answer to a cancelled command, which comes in after the
+ * input went quiet, isn't taken for the next command's.
+ */
+static int check_cmd_cancel(void)
+{
+	omron_sim_config config;
+	omron_bp_day_info ref_bp[3], r;
+	omron_async_cmd cmd, other;
+	omron_device* dev;
+	int failed = 0;
+	int ret;
+
+	clean_config(&config, 1);
+	dev = open_sim(&config);
+	if (!dev) {
+		printf("  cannot open clean simulator\n");
+		return -1;
+	}
+	ret = omron_get_daily_bp_range(dev, 0, 0, 2, ref_bp, NULL);
+	close_sim(dev);
+	if (ret != 3) {
+		printf("  clean simulator read failed (%d)\n", ret);
+		return -1;
+	}
+
+	config.latency_us = 1000;
+	config.turnaround_us = 60000;
+	dev = open_sim(&config);
+	if (!dev) {
+		printf("  cannot open simulator\n");
+		return -1;
+	}
+
+	// Get the mode set, so the command below goes out on the first step
+	omron_cmd_daily_bp_data(&cmd, 0, 0);
+	ret = omron_cmd_start(dev, &cmd);
+	if (ret == 0) ret = run_cmd(dev, &cmd);
+	if (ret < 0) {
+		printf("  first command failed: %s\n", omron_strerror(ret));
+		close_sim(dev);
+		return -1;
+	}
+
+	omron_cmd_daily_bp_data(&cmd, 0, 1);
+	omron_cmd_daily_bp_data(&other, 0, 2);
+	ret = omron_cmd_start(dev, &cmd);
+	if (ret == 0 && omron_cmd_step(dev, &cmd)) {
+		ret = omron_cmd_start(dev, &other);
+		if (ret != OMRON_ERR_BUSY) {
+			printf("  second command started while one was running (%d)\n", ret);
+			failed = 1;
+			if (ret == 0) omron_cmd_cancel(dev, &other);
+		}
+		omron_cmd_cancel(dev, &cmd);
+	} else {
+		printf("  command did not start (%d)\n", ret < 0 ? ret : cmd.status);
+		failed = 1;
+	}
+
+	ret = omron_cmd_start(dev, &other);
+	if (ret == 0) ret = run_cmd(dev, &other);
+	if (ret >= 0) ret = omron_decode_daily_bp_data(&other, &r);
+	if (ret < 0) {
+		printf("  command after cancel failed: %s\n", omron_strerror(ret));
+		failed = 1;
+	} else if (!same_bp(&r, &ref_bp[2])) {
+		printf("  command after cancel got another record\n");
+		failed = 1;
+	}
+	close_sim(dev);
+	return failed ? -1 : 0;
+}
+
+/*
+ * The retry budget is per operation: a long lived handle on a flaky link
+ * keeps retrying instead of running dry after the first few bad answers.
+ */
+static int check_retry_budget(void)
+{
+	omron_sim_config config;
+	omron_retry_policy policy;
+	omron_bp_day_info r;
+	omron_device* dev;
+	omron_stats stats;
+	int i;
+
+	clean_config(&config, 1);
+	config.latency_us = 100;
+	config.corrupt_rate = 0.1;
+	dev = open_sim(&config);
+	if (!dev) {
+		printf("  cannot open simulator\n");
+		return -1;
+	}
+	omron_default_retry_policy(&policy);
+	policy.retry_budget = 2;
+	omron_set_retry_policy(dev, &policy);
+
+	for (i = 0; i < CHECK_BP_COUNT; ++i) {
+		omron_get_daily_bp_range(dev, 0, i, i, &r, NULL);
+	}
+	omron_get_stats(dev, &stats);
+	close_sim(dev);
+	if (stats.retries + stats.resyncs <= (uint32_t)policy.retry_budget) {
+		printf("  %u resends in %d calls, the budget was not refilled\n",
+		       stats.retries + stats.resyncs, CHECK_BP_COUNT);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * A session recorded on a simulated device replays to the same records,
+ * faults and recovery included.
+ */
+static int check_replay(void)
+{
+	static const char* path = "omron_check.trace";
+	omron_bp_day_info bp[2][CHECK_BP_COUNT];
+	int status[2][CHECK_BP_COUNT];
+	omron_pd_history* pd[2];
+	omron_sim_config config;
+	omron_device* dev;
+	int failed = 0;
+	int pass;
+	int ret;
+	int i;
+
+	pd[0] = omron_pd_history_create(CHECK_PD_DAYS);
+	pd[1] = omron_pd_history_create(CHECK_PD_DAYS);
+	if (!pd[0] || !pd[1]) {
+		printf("  out of memory\n");
+		failed = 1;
+	}
+	remove(path);
+	clean_config(&config, 3);
+	config.latency_us = 100;
+	config.corrupt_rate = 0.02;
+	config.negative_rate = 0.02;
+
+	// Pass 0 records the simulator, pass 1 replays the recording
+	for (pass = 0; pass < 2 && !failed; ++pass) {
+		dev = omron_create();
+		if (!dev) {
+			printf("  out of memory\n");
+			failed = 1;
+			break;
+		}
+		if (pass == 0) {
+			ret = omron_open_sim(dev, &config);
+			if (ret == 0) ret = omron_trace_start(dev, path);
+		} else {
+			ret = omron_open_replay(dev, path, -1, 0);
+			if (ret != OMRON_ERR_BADARG) {
+				printf("  negative session not rejected (%d)\n", ret);
+				failed = 1;
+				if (ret == 0) omron_close(dev);
+			}
+			ret = omron_open_replay(dev, path, 0, 0);
+		}
+		if (ret < 0) {
+			printf("  cannot open %s: %s\n", pass ? "replay" : "simulator", omron_strerror(ret));
+			omron_delete(dev);
+			failed = 1;
+			break;
+		}
+		ret = omron_get_daily_bp_range(dev, 0, 0, CHECK_BP_COUNT - 1, bp[pass], status[pass]);
+		if (ret >= 0) ret = omron_get_pd_history(dev, 0, CHECK_PD_DAYS - 1, pd[pass]);
+		close_sim(dev);
+		if (ret < 0) {
+			printf("  %s read failed: %s\n", pass ? "replayed" : "recorded", omron_strerror(ret));
+			failed = 1;
+		}
+	}
+
+	for (i = 0; !failed && i < CHECK_BP_COUNT; ++i) {
+		if (status[0][i] != status[1][i] || !same_bp(&bp[0][i], &bp[1][i])) {
+			printf("  BP record %d differs in the replay\n", i);
+			failed = 1;
+		}
+	}
+	for (i = 0; !failed && i < CHECK_PD_DAYS; ++i) {
+		if (pd[0]->status[i] != pd[1]->status[i] || !same_pd_day(pd[0], pd[1], i)) {
+			printf("  pedometer day %d differs in the replay\n", i);
+			failed = 1;
+		}
+	}
+	omron_pd_history_delete(pd[0]);
+	omron_pd_history_delete(pd[1]);
+	remove(path);
+	return failed ? -1 : 0;
+}
+
+/// Records handed to sync_bp_record()
+typedef struct {
+	omron_bp_day_info records[CHECK_BP_COUNT];
+	int count;
+} sync_records;
+
+static int sync_bp_record(void* user_data, int index, const omron_bp_day_info* record)
+{
+	sync_records* s = user_data;
+
+	(void)index;
+	if (s->count == CHECK_BP_COUNT) return 1;
+	s->records[s->count++] = *record;
+	return 0;
+}
+
+static int sync_pd_day(void* user_data, const omron_pd_daily_data* daily, const omron_pd_hourly_data* hourly)
+{
+	int* days = user_data;
+
+	(void)daily;
+	(void)hourly;
+	++*days;
+	return 0;
+}
+
+/*
+ * Incremental sync: readings taken after the device clock was set back
+ * sort before the last one synced, and must still be found by where the
+ * record count says they are. Pedometer sync delivers the day it left
+ * off on again.
+ */
+static int check_sync(void)
+{
+	omron_bp_day_info ref_bp[CHECK_BP_COUNT];
+	omron_sim_config config;
+	omron_sync_state state;
+	omron_device* dev;
+	sync_records got;
+	unsigned char serial[9];
+	char bp_path[64], pd_path[64];
+	int failed = 0;
+	int days;
+	int ret;
+	int i;
+
+	clean_config(&config, 5);
+	config.bp_clock_back = 3;
+	dev = open_sim(&config);
+	if (!dev) {
+		printf("  cannot open simulator\n");
+		return -1;
+	}
+	ret = omron_get_device_serial(dev, serial, sizeof(serial));
+	memset(&state, 0, sizeof(state));
+	for (i = 0; i < ret; ++i) {
+		sprintf(state.serial + i * 2, "%02x", serial[i]);
+	}
+	if (ret > 0) ret = omron_get_daily_bp_range(dev, 0, 0, CHECK_BP_COUNT - 1, ref_bp, NULL);
+	if (ret != CHECK_BP_COUNT) {
+		printf("  clean simulator read failed (%d)\n", ret);
+		close_sim(dev);
+		return -1;
+	}
+
+	// As if the last sync saw all but the three newest readings
+	sprintf(bp_path, "./%s.bp0", state.serial);
+	sprintf(pd_path, "./%s.pd", state.serial);
+	remove(pd_path);
+	state.last_timestamp = omron_bp_timestamp(&ref_bp[3]);
+	state.record_count = CHECK_BP_COUNT - 3;
+	if (omron_sync_save_state(bp_path, &state) < 0) {
+		printf("  cannot write %s\n", bp_path);
+		failed = 1;
+	}
+
+	got.count = 0;
+	ret = failed ? 0 : omron_sync_daily_bp(dev, 0, ".", sync_bp_record, &got);
+	if (!failed && (ret != 3 || got.count != 3)) {
+		printf("  %d readings synced after the clock was set back, expected 3\n", got.count);
+		failed = 1;
+	}
+	for (i = 0; !failed && i < got.count; ++i) {
+		if (!same_bp(&got.records[i], &ref_bp[2 - i])) {
+			printf("  synced reading %d is not record %d\n", i, 2 - i);
+			failed = 1;
+		}
+	}
+	if (!failed && (omron_sync_load_state(bp_path, &state) != 1 ||
+			state.last_timestamp != omron_bp_timestamp(&ref_bp[0]) ||
+			state.record_count != CHECK_BP_COUNT)) {
+		printf("  high-water mark not moved to the newest reading\n");
+		failed = 1;
+	}
+	got.count = 0;
+	ret = failed ? 0 : omron_sync_daily_bp(dev, 0, ".", sync_bp_record, &got);
+	if (ret != 0 || got.count) {
+		printf("  %d readings synced again (%d)\n", got.count, ret);
+		failed = 1;
+	}
+
+	days = 0;
+	ret = failed ? 0 : omron_sync_pd(dev, ".", sync_pd_day, &days);
+	if (!failed && (ret != config.pd_days || days != ret)) {
+		printf("  first pedometer sync delivered %d of %d days (%d)\n", days, config.pd_days, ret);
+		failed = 1;
+	}
+	days = 0;
+	ret = failed ? 0 : omron_sync_pd(dev, ".", sync_pd_day, &days);
+	if (!failed && (ret != 1 || days != 1)) {
+		printf("  second pedometer sync delivered %d days, expected today again\n", days);
+		failed = 1;
+	}
+
+	close_sim(dev);
+	remove(bp_path);
+	remove(pd_path);
+	return failed ? -1 : 0;
+}
+
+static const char* archive_path = "omron_check.arch";
+
+/*
+ * Append a copy of len bytes at offset of a file to its end, as a write
+ * cut short by a crash leaves behind. Returns 0 on success.
+ */
+static int append_copy(const char* path, long offset, int len)
+{
+	unsigned char data[256];
+	FILE* f = fopen(path, "r+b");
+	int ok;
+
+	if (!f) return -1;
+	ok = len <= (int)sizeof(data) && fseek(f, offset, SEEK_SET) == 0 &&
+		fread(data, 1, len, f) == (size_t)len && fseek(f, 0, SEEK_END) == 0 &&
+		fwrite(data, 1, len, f) == (size_t)len;
+	return fclose(f) || !ok ? -1 : 0;
+}
+
+/// Flip the bits of the byte at offset of a file
+static int damage(const char* path, long offset)
+{
+	FILE* f = fopen(path, "r+b");
+	int c = EOF;
+
+	if (!f) return -1;
+	if (fseek(f, offset, SEEK_SET) == 0) c = fgetc(f);
+	if (c != EOF && fseek(f, offset, SEEK_SET) == 0) c = fputc(c ^ 0xff, f);
+	return fclose(f) || c == EOF ? -1 : 0;
+}
+
+static long file_size(const char* path)
+{
+	FILE* f = fopen(path, "rb");
+	long size = -1;
+
+	if (!f) return -1;
+	if (fseek(f, 0, SEEK_END) == 0) size = ftell(f);
+	fclose(f);
+	return size;
+}
+
+/// Rows of table in a mapped archive, or < 0 if it cannot be mapped
+static int archive_rows(const char* path, int table)
+{
+	omron_archive_map* map = omron_archive_map_open(path);
+	omron_archive_block block;
+	int rows = 0;
+	int i;
+
+	if (!map) return -1;
+	for (i = 0; i < omron_archive_map_blocks(map); ++i) {
+		omron_archive_map_block(map, i, &block);
+		if (block.table == table) rows += block.rows;
+	}
+	omron_archive_map_close(map);
+	return rows;
+}
+
+/*
+ * Readings written to an archive map back unchanged, a block cut short
+ * by a crash is cut off when the archive is opened again, and an archive
+ * damaged anywhere else is neither opened nor changed.
+ */
+static int check_archive(void)
+{
+	omron_bp_day_info ref_bp[CHECK_BP_COUNT];
+	omron_pd_history* ref_pd = omron_pd_history_create(CHECK_PD_DAYS);
+	omron_pd_hourly_data hours[24];
+	omron_archive_block block;
+	omron_archive_map* map;
+	omron_archive* archive;
+	omron_sim_config config;
+	omron_device* dev;
+	long size;
+	int failed = 0;
+	int ret = -1;
+	int i, h;
+
+	clean_config(&config, 6);
+	dev = ref_pd ? open_sim(&config) : NULL;
+	if (dev) {
+		ret = omron_get_daily_bp_range(dev, 0, 0, CHECK_BP_COUNT - 1, ref_bp, NULL);
+		if (ret == CHECK_BP_COUNT) ret = omron_get_pd_history(dev, 0, CHECK_PD_DAYS - 1, ref_pd);
+		close_sim(dev);
+	}
+	if (ret != CHECK_PD_DAYS) {
+		printf("  clean simulator read failed (%d)\n", ret);
+		omron_pd_history_delete(ref_pd);
+		return -1;
+	}
+
+	// Two sources make two blood pressure blocks, the close writes the last one and the pedometer block
+	remove(archive_path);
+	archive = omron_archive_open(archive_path);
+	if (!archive) {
+		printf("  cannot create %s\n", archive_path);
+		omron_pd_history_delete(ref_pd);
+		return -1;
+	}
+	ret = omron_archive_set_source(archive, "first");
+	for (i = 0; ret >= 0 && i < CHECK_BP_COUNT; ++i) {
+		if (i == CHECK_BP_COUNT / 2) ret = omron_archive_set_source(archive, "second");
+		if (ret >= 0) ret = omron_archive_add_bp(archive, &ref_bp[i]);
+	}
+	for (i = 0; ret >= 0 && i < CHECK_PD_DAYS; ++i) {
+		omron_pd_history_hours(ref_pd, i, hours);
+		ret = omron_archive_add_pd(archive, 20100630000000LL - i * 1000000, &ref_pd->daily[i], hours);
+	}
+	if (omron_archive_close(archive) < 0 || ret < 0) {
+		printf("  cannot write %s\n", archive_path);
+		failed = 1;
+	}
+
+	map = failed ? NULL : omron_archive_map_open(archive_path);
+	if (!failed && (!map || omron_archive_map_blocks(map) != 3)) {
+		printf("  %d blocks mapped, expected 3\n", map ? omron_archive_map_blocks(map) : -1);
+		failed = 1;
+	}
+	for (i = 0; !failed && i < CHECK_BP_COUNT; ++i) {
+		const omron_bp_day_info* r = &ref_bp[i];
+		int row = i % (CHECK_BP_COUNT / 2);
+
+		omron_archive_map_block(map, i / (CHECK_BP_COUNT / 2), &block);
+		if (block.table != OMRON_ARCHIVE_BP || strcmp(block.source, i < CHECK_BP_COUNT / 2 ? "first" : "second") ||
+		    block.timestamp[row] != omron_bp_timestamp(r) ||
+		    block.sys[row] != r->sys || block.dia[row] != r->dia || block.pulse[row] != r->pulse) {
+			printf("  reading %d differs in the archive\n", i);
+			failed = 1;
+		}
+	}
+	if (!failed) omron_archive_map_block(map, 2, &block);
+	for (i = 0; !failed && i < CHECK_PD_DAYS; ++i) {
+		const omron_pd_daily_data* d = &ref_pd->daily[i];
+
+		if (block.table != OMRON_ARCHIVE_PD || block.timestamp[i] != 20100630000000LL - i * 1000000 ||
+		    block.total_steps[i] != d->total_steps || block.total_aerobic_steps[i] != d->total_aerobic_steps ||
+		    block.total_calories[i] != d->total_calories || block.total_distance[i] != d->total_distance) {
+			printf("  pedometer day %d differs in the archive\n", i);
+			failed = 1;
+		}
+		for (h = 0; !failed && h < 24; ++h) {
+			if (block.hourly_steps[i * 24 + h] != ref_pd->regular_steps[i * 24 + h] ||
+			    block.hourly_aerobic_steps[i * 24 + h] != ref_pd->aerobic_steps[i * 24 + h]) {
+				printf("  hour %d of pedometer day %d differs in the archive\n", h, i);
+				failed = 1;
+			}
+		}
+	}
+	omron_archive_map_close(map);
+
+	// A crash while writing a block, once in its header and once after it
+	size = file_size(archive_path);
+	for (i = 0; !failed && i < 2; ++i) {
+		int torn = i ? 200 : 10;
+
+		if (append_copy(archive_path, 16, torn) < 0) {
+			printf("  cannot tear %s\n", archive_path);
+			failed = 1;
+			break;
+		}
+		archive = omron_archive_open(archive_path);
+		if (!archive || omron_archive_close(archive) < 0 || file_size(archive_path) != size) {
+			printf("  torn block of %d bytes not cut off\n", torn);
+			failed = 1;
+		}
+	}
+	archive = failed ? NULL : omron_archive_open(archive_path);
+	if (archive) {
+		ret = omron_archive_add_bp(archive, &ref_bp[0]);
+		if (omron_archive_close(archive) < 0) ret = -1;
+		if (ret < 0 || archive_rows(archive_path, OMRON_ARCHIVE_BP) != CHECK_BP_COUNT + 1) {
+			printf("  reading appended after the cut not mapped\n");
+			failed = 1;
+		}
+	}
+
+	// Damage in the first block must not cost the blocks after it
+	size = file_size(archive_path);
+	if (!failed && damage(archive_path, 16) < 0) {
+		printf("  cannot damage %s\n", archive_path);
+		failed = 1;
+	}
+	archive = failed ? NULL : omron_archive_open(archive_path);
+	if (!failed && (archive || file_size(archive_path) != size)) {
+		printf("  damaged archive %s\n", archive ? "opened" : "changed");
+		omron_archive_close(archive);
+		failed = 1;
+	}
+
+	omron_pd_history_delete(ref_pd);
+	remove(archive_path);
+	return failed ? -1 : 0;
+}
+
+/*
+ * Archives past 2 GB: offsets that don't fit 32 bits must still find the
+ * torn tail and the blocks after it.
+ */
+static int check_archive_2g(void)
+{
+	omron_pd_daily_data daily;
+	omron_archive* archive;
+	int64_t rows = 0;
+	int failed = 0;
+	int ret = 0;
+
+	memset(&daily, 0, sizeof(daily));
+	remove(archive_path);
+	archive = omron_archive_open(archive_path);
+	if (!archive) {
+		printf("  cannot create %s\n", archive_path);
+		return -1;
+	}
+	// Full pedometer blocks are half a megabyte
+	while (ret >= 0 && rows < ((int64_t)1 << 31) / 128 + OMRON_ARCHIVE_BLOCK_ROWS) {
+		daily.total_steps = (int32_t)rows;
+		ret = omron_archive_add_pd(archive, 20100630000000LL, &daily, NULL);
+		rows++;
+	}
+	if (omron_archive_close(archive) < 0 || ret < 0) {
+		printf("  cannot write %s\n", archive_path);
+		failed = 1;
+	}
+	if (!failed && append_copy(archive_path, 16, 200) < 0) {
+		printf("  cannot tear %s\n", archive_path);
+		failed = 1;
+	}
+	archive = failed ? NULL : omron_archive_open(archive_path);
+	if (archive) {
+		ret = omron_archive_add_pd(archive, 20100630000000LL, &daily, NULL);
+		if (omron_archive_close(archive) < 0) ret = -1;
+		if (ret < 0 || archive_rows(archive_path, OMRON_ARCHIVE_PD) != rows + 1) {
+			printf("  %d rows mapped, expected %lld\n", archive_rows(archive_path, OMRON_ARCHIVE_PD), (long long)rows + 1);
+			failed = 1;
+		}
+	} else if (!failed) {
+		printf("  cannot open %s again\n", archive_path);
+		failed = 1;
+	}
+	remove(archive_path);
+	return failed ? -1 : 0;
+}
+
+/// Capacity of the event logs of the event checks
+#define CHECK_EVENTS 16
+
+/*
+ * Take all unread events out of a device's event log and check that they
+ * follow on from *next. Returns the number of events, or < 0 if they did
+ * not follow on or lost differs from expect_lost.
+ */
+static int read_events(omron_device* dev, uint32_t* next, uint32_t expect_lost, int* ids)
+{
+	omron_event events[CHECK_EVENTS];
+	uint32_t lost;
+	int total = 0;
+	int count, i;
+
+	count = omron_read_events(dev, events, CHECK_EVENTS, &lost);
+	if (count < 0 || lost != expect_lost) {
+		printf("  %u events lost, expected %u (%d)\n", lost, expect_lost, count);
+		return -1;
+	}
+	while (count > 0) {
+		for (i = 0; i < count; ++i) {
+			if (events[i].sequence != *next + lost) {
+				printf("  event %u read, expected %u\n", events[i].sequence, *next + lost);
+				return -1;
+			}
+			*next = events[i].sequence + 1;
+			lost = 0;
+			if (ids && events[i].id < 8) ids[events[i].id] = 1;
+		}
+		total += count;
+		count = omron_read_events(dev, events, CHECK_EVENTS, &lost);
+		if (count < 0 || lost) {
+			printf("  %u events lost on a second read (%d)\n", lost, count);
+			return -1;
+		}
+	}
+	return total;
+}
+
+/*
+ * The event log hands out every event of a command in order, and counts
+ * the ones it had to overwrite as lost.
+ */
+static int check_events(void)
+{
+	omron_bp_day_info record;
+	omron_sim_config config;
+	omron_device* dev;
+	uint32_t next = 0;
+	int ids[8];
+	int failed = 0;
+	int ret;
+	int i;
+
+	clean_config(&config, 8);
+	dev = open_sim(&config);
+	if (!dev || omron_set_event_log(dev, CHECK_EVENTS) < 0) {
+		printf("  cannot open the simulator with an event log\n");
+		if (dev) close_sim(dev);
+		return -1;
+	}
+	memset(ids, 0, sizeof(ids));
+	ret = omron_get_daily_bp_range(dev, 0, 0, 0, &record, NULL);
+	if (ret < 0 || read_events(dev, &next, 0, ids) <= 0 ||
+	    !ids[OMRON_EVENT_COMMAND] || !ids[OMRON_EVENT_RESPONSE]) {
+		printf("  command and response not in the event log (%d)\n", ret);
+		failed = 1;
+	}
+
+	// Three times the capacity: all but the last CHECK_EVENTS are lost
+	omron_lock(dev);
+	for (i = 0; i < 3 * CHECK_EVENTS; ++i) omron_log_event(dev, OMRON_EVENT_MODE, i, NULL, 0);
+	omron_unlock(dev);
+	if (!failed && read_events(dev, &next, 2 * CHECK_EVENTS, NULL) != CHECK_EVENTS) {
+		printf("  event log overflow not counted\n");
+		failed = 1;
+	}
+
+	// Turning the log off and on again starts it over
+	omron_set_event_log(dev, 0);
+	if (omron_read_events(dev, NULL, 0, NULL) != 0) {
+		printf("  events read from a log that is off\n");
+		failed = 1;
+	}
+	omron_set_event_log(dev, CHECK_EVENTS);
+	next = 0;
+	omron_lock(dev);
+	omron_log_event(dev, OMRON_EVENT_MODE, 0, NULL, 0);
+	omron_unlock(dev);
+	if (!failed && read_events(dev, &next, 0, NULL) != 1) {
+		printf("  event log not started over\n");
+		failed = 1;
+	}
+	close_sim(dev);
+	return failed ? -1 : 0;
+}
+
+/*
+ * Sequence numbers wrap after 2^32 events, the events around the wrap
+ * (the stamp of the last one before it is special) must still be read.
+ */
+static int check_events_wrap(void)
+{
+	omron_sim_config config;
+	omron_device* dev;
+	uint32_t next = 0;
+	uint32_t i;
+	int failed = 0;
+
+	clean_config(&config, 8);
+	dev = open_sim(&config);
+	if (!dev || omron_set_event_log(dev, CHECK_EVENTS) < 0) {
+		printf("  cannot open the simulator with an event log\n");
+		if (dev) close_sim(dev);
+		return -1;
+	}
+	omron_lock(dev);
+	for (i = 0; i < 0xffffffffu - CHECK_EVENTS / 2; ++i) omron_log_event(dev, OMRON_EVENT_MODE, 0, NULL, 0);
+	omron_unlock(dev);
+	if (read_events(dev, &next, 0xffffffffu - CHECK_EVENTS / 2 - CHECK_EVENTS, NULL) != CHECK_EVENTS) {
+		printf("  events before the wrap not read\n");
+		failed = 1;
+	}
+	// One at a time across the wrap
+	for (i = 0; !failed && i < CHECK_EVENTS; ++i) {
+		omron_lock(dev);
+		omron_log_event(dev, OMRON_EVENT_MODE, (int)i, NULL, 0);
+		omron_unlock(dev);
+		if (read_events(dev, &next, 0, NULL) != 1) {
+			printf("  event %u not read\n", next);
+			failed = 1;
+		}
+	}
+	close_sim(dev);
+	return failed ? -1 : 0;
+}
+
+#if defined(OMRON_HAVE_SQLITE3)
+
+static const char* db_path = "omron_check.db";
+
+/// Result of a count query, run on a connection of its own, or < 0 on error
+static int db_count(const char* sql)
+{
+	sqlite3_stmt* stmt = NULL;
+	sqlite3* db = NULL;
+	int count = -1;
+
+	if (sqlite3_open(db_path, &db) == SQLITE_OK &&
+	    sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK &&
+	    sqlite3_step(stmt) == SQLITE_ROW) {
+		count = sqlite3_column_int(stmt, 0);
+	}
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+	return count;
+}
+
+static void db_remove(void)
+{
+	char path[64];
+
+	remove(db_path);
+	snprintf(path, sizeof(path), "%s-wal", db_path);
+	remove(path);
+	snprintf(path, sizeof(path), "%s-shm", db_path);
+	remove(path);
+}
+
+/*
+ * Database rows are seen by others once committed and never when rolled
+ * back, and a handle whose add failed on a locked database rolls back and
+ * commits again once the lock is gone.
+ */
+static int check_db(void)
+{
+	omron_bp_day_info ref_bp[CHECK_BP_COUNT];
+	omron_pd_hourly_data hours[24];
+	omron_pd_daily_data daily;
+	omron_bp_day_info later;
+	omron_sim_config config;
+	omron_device* dev;
+	sqlite3* lock = NULL;
+	omron_db* db;
+	int failed = 0;
+	int ret = -1;
+	int i;
+
+	clean_config(&config, 7);
+	dev = open_sim(&config);
+	if (dev) {
+		ret = omron_get_daily_bp_range(dev, 0, 0, CHECK_BP_COUNT - 1, ref_bp, NULL);
+		close_sim(dev);
+	}
+	if (ret != CHECK_BP_COUNT) {
+		printf("  clean simulator read failed (%d)\n", ret);
+		return -1;
+	}
+	db_remove();
+	db = omron_db_open(db_path, "omron_check");
+	if (!db) {
+		printf("  cannot create %s\n", db_path);
+		return -1;
+	}
+
+	for (i = 0; i < CHECK_BP_COUNT / 2; ++i) omron_db_add_bp(db, &ref_bp[i]);
+	if (db_count("select count(*) from omron_check") != 0) {
+		printf("  readings seen before the commit\n");
+		failed = 1;
+	}
+	ret = omron_db_rollback(db);
+	if (ret == 0) ret = omron_db_commit(db);
+	if (ret < 0 || db_count("select count(*) from omron_check") != 0) {
+		printf("  rolled back readings committed (%d)\n", ret);
+		failed = 1;
+	}
+
+	// Readings added twice replace the first ones
+	for (i = 0; i < 2 * CHECK_BP_COUNT; ++i) omron_db_add_bp(db, &ref_bp[i % CHECK_BP_COUNT]);
+	memset(&daily, 0, sizeof(daily));
+	memset(hours, 0, sizeof(hours));
+	omron_db_add_pd(db, 20100630000000LL, &daily, hours);
+	ret = omron_db_commit(db);
+	if (ret < 0 || db_count("select count(*) from omron_check") != CHECK_BP_COUNT ||
+	    db_count("select count(*) from omron_check_pd") != 1 ||
+	    db_count("select count(*) from omron_check_pd_hourly") != 24) {
+		printf("  %d readings committed, expected %d (%d)\n",
+		       db_count("select count(*) from omron_check"), CHECK_BP_COUNT, ret);
+		failed = 1;
+	}
+
+	// Another writer holds the database
+	later = ref_bp[0];
+	later.sys = 999;
+	if (sqlite3_open(db_path, &lock) != SQLITE_OK || sqlite3_exec(lock, "BEGIN IMMEDIATE", NULL, NULL, NULL) != SQLITE_OK) {
+		printf("  cannot lock %s\n", db_path);
+		failed = 1;
+	} else if (omron_db_add_bp(db, &later) >= 0) {
+		printf("  reading added to a locked database\n");
+		failed = 1;
+	}
+	if (omron_db_rollback(db) < 0) {
+		printf("  rollback after a failed add failed\n");
+		failed = 1;
+	}
+	sqlite3_exec(lock, "ROLLBACK", NULL, NULL, NULL);
+	sqlite3_close(lock);
+	ret = omron_db_add_bp(db, &later);
+	if (ret == 0) ret = omron_db_commit(db);
+	if (ret < 0 || db_count("select count(*) from omron_check where sys = 999") != 1) {
+		printf("  reading not committed once the lock was gone (%d)\n", ret);
+		failed = 1;
+	}
+
+	// Closing commits what is pending
+	later.year++;
+	omron_db_add_bp(db, &later);
+	ret = omron_db_close(db);
+	if (ret < 0 || db_count("select count(*) from omron_check where sys = 999") != 2) {
+		printf("  reading not committed by the close (%d)\n", ret);
+		failed = 1;
+	}
+	db_remove();
+	return failed ? -1 : 0;
+}
+
+#else
+
+static int check_db(void)
+{
+	printf("  built without SQLite, skipped\n");
+	return 0;
+}
+
+#endif
+
+/// Trace of the captures in doc/logs, set with -t
+static const char* capture_traces;
+
+/// What the vendor software sent and got back in a capture, see check_captures()
+typedef struct {
+	int session;
+	long position;
+	/// Command being sent or answered, and its length
+	unsigned char command[OMRON_TRACE_MAX_PAYLOAD];
+	int command_len;
+	/// 1 while the command is still being written
+	int writing;
+	/// Response put together so far, and whether it is complete
+	unsigned char response[OMRON_MAX_RESPONSE_SIZE];
+	int received;
+	int answered;
+	/// Command whose response the library rejected, if any
+	unsigned char rejected[OMRON_TRACE_MAX_PAYLOAD];
+	int rejected_len;
+	long rejected_position;
+	long responses;
+	long rejections;
+} capture_state;
+
+/// Nonzero if a command is a clear (all zeroes)
+static int is_clear(const unsigned char* command, int len)
+{
+	int i;
+
+	for (i = 0; i < len; ++i) {
+		if (command[i]) return 0;
+	}
+	return 1;
+}
+
+/*
+ * Judge a complete (or cut short) response like the library would, and
+ * remember the command if it was rejected.
+ */
+static void capture_answered(omron_device* dev, capture_state* c)
+{
+	int ret = omron_check_response(dev, c->received, c->response, c->received);
+
+	c->answered = 1;
+	c->received = 0;
+	c->responses++;
+	if (ret >= 0 || ret == OMRON_ERR_NEGRESP || ret == OMRON_ERR_ENDRESP) return;
+	c->rejections++;
+	memcpy(c->rejected, c->command, c->command_len);
+	c->rejected_len = c->command_len;
+	c->rejected_position = c->position;
+}
+
+/*
+ * A new command went out. If the response to an earlier one was rejected,
+ * this must be that command again (clears in between are part of a
+ * resync, and the vendor software sends those in runs of any length).
+ * Returns 0 if it is fine.
+ */
+static int capture_command(capture_state* c)
+{
+	int clear = is_clear(c->command, c->command_len);
+
+	if (!c->rejected_len) return 0;
+	if ((c->command_len == c->rejected_len && !memcmp(c->command, c->rejected, c->command_len)) ||
+	    (clear && is_clear(c->rejected, c->rejected_len))) {
+		c->rejected_len = 0;
+		return 0;
+	}
+	if (clear) return 0;
+	printf("  session %d, record %ld: response rejected, but the vendor software did not resend\n",
+	       c->session, c->rejected_position);
+	c->rejected_len = 0;
+	return -1;
+}
+
+/*
+ * The responses in the captures of the vendor software (doc/logs, turned
+ * into traces by omron_capture_convert) go through the library's
+ * reassembly and checks. The vendor software uses its own mode values,
+ * so the captures can't be replayed call for call. Instead, the library
+ * has to accept what the vendor software took as an answer, and reject
+ * only responses the vendor software sent the command again for.
+ */
+static int check_captures(void)
+{
+	omron_trace_record record;
+	omron_trace* trace;
+	omron_device* dev;
+	capture_state* c;
+	int failed = 0;
+	int ret;
+
+	if (!capture_traces) {
+		printf("  no capture traces given (-t), skipped\n");
+		return 0;
+	}
+	trace = omron_trace_open(capture_traces, 0);
+	if (!trace) {
+		printf("  cannot open %s\n", capture_traces);
+		return -1;
+	}
+	dev = omron_create();
+	c = calloc(1, sizeof(*c));
+	if (!dev || !c) {
+		if (dev) omron_delete(dev);
+		free(c);
+		omron_trace_close(trace);
+		printf("  out of memory\n");
+		return -1;
+	}
+	c->session = -1;
+
+	while ((ret = omron_trace_read(trace, &record)) > 0) {
+		int len = record.size > 0 ? record.data[0] : 0;
+
+		c->position++;
+		if (len > record.size - 1) len = record.size - 1;
+		switch (record.type) {
+		case OMRON_TRACE_OPEN:
+		case OMRON_TRACE_CLOSE:
+			if (c->rejected_len) {
+				printf("  session %d, record %ld: response rejected, but the vendor software went on\n",
+				       c->session, c->rejected_position);
+				failed = 1;
+			}
+			c->rejected_len = 0;
+			c->received = 0;
+			c->answered = 1;
+			c->writing = 0;
+			if (record.type == OMRON_TRACE_OPEN) {
+				c->session++;
+				dev->input_size = record.size == 2 ? record.data[0] : 8;
+			}
+			break;
+
+		case OMRON_TRACE_MODE:
+			// Anything cut short by a mode change is a timed out response
+			if (c->received) capture_answered(dev, c);
+			c->writing = 0;
+			break;
+
+		case OMRON_TRACE_WRITE:
+			if (c->received) capture_answered(dev, c);
+			if (!c->writing) {
+				c->command_len = 0;
+				c->answered = 0;
+				c->writing = 1;
+			}
+			if (len > (int)sizeof(c->command) - c->command_len) len = sizeof(c->command) - c->command_len;
+			memcpy(c->command + c->command_len, record.data + 1, len);
+			c->command_len += len;
+			break;
+
+		case OMRON_TRACE_READ:
+			// Empty reports only turn up right after a mode change,
+			// even halfway through writing a command; they answer
+			// nothing
+			if (len == 0) break;
+			if (c->writing) {
+				c->writing = 0;
+				if (capture_command(c) < 0) failed = 1;
+			}
+			// Anything after a complete response is flushed before the
+			// next command
+			if (c->answered) break;
+			ret = omron_add_response_report(dev, record.data, sizeof(c->response), c->response, &c->received);
+			if (ret <= 0) capture_answered(dev, c);
+			break;
+		}
+	}
+	if (ret < 0) {
+		printf("  cannot read %s\n", capture_traces);
+		failed = 1;
+	}
+	if (!failed && !c->responses) {
+		printf("  no responses in %s\n", capture_traces);
+		failed = 1;
+	}
+	if (!failed) {
+		printf("  %ld responses in %d sessions, %ld rejected and resent\n",
+		       c->responses, c->session + 1, c->rejections);
+	}
+	free(c);
+	omron_delete(dev);
+	omron_trace_close(trace);
+	return failed ? -1 : 0;
+}
+
+static const check checks[] = {
+	{ "late_replies", "Pipelined reads recover from faults when answers start late",
+	  check_late_replies, 0 },
+	{ "cmd_cancel", "One non-blocking command at a time, no answers left over by a cancel",
+	  check_cmd_cancel, 0 },
+	{ "retry_budget", "The retry budget is refilled for every call",
+	  check_retry_budget, 0 },
+	{ "replay", "A recorded simulator session replays to the same records",
+	  check_replay, 0 },
+	{ "sync", "Incremental sync finds new readings after the clock was set back",
+	  check_sync, 0 },
+	{ "captures", "Responses in the captures of the vendor software are accepted",
+	  check_captures, 0 },
+	{ "archive", "Archives map back what was written and survive a torn last block",
+	  check_archive, 0 },
+	{ "archive_2g", "Archives larger than 2 GB are opened and mapped",
+	  check_archive_2g, 1 },
+	{ "db", "Database rows are only kept once committed",
+	  check_db, 0 },
+	{ "events", "The event log hands out every event in order and counts lost ones",
+	  check_events, 0 },
+	{ "events_wrap", "The event log reads on across the wrap of its sequence numbers",
+	  check_events_wrap, 1 },
+};
+
+static void usage(const char* prog)
+{
+	fprintf(stderr, "Usage: %s [-f filter] [-t traces]\n", prog);
+}
+
+int main(int argc, char** argv)
+{
+	const char* filter = NULL;
+	int failed = 0;
+	size_t n;
+	int i;
+
+	for (i = 1; i < argc; ++i) {
+		if (i + 1 >= argc) {
+			usage(argv[0]);
+			return 1;
+		}
+		if (!strcmp(argv[i], "-f")) filter = argv[++i];
+		else if (!strcmp(argv[i], "-t")) capture_traces = argv[++i];
+		else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	for (n = 0; n < sizeof(checks) / sizeof(checks[0]); ++n) {
+		const check* c = &checks[n];
+
+		if (filter && !strstr(c->name, filter)) continue;
+		if (c->on_request && (!filter || strcmp(c->name, filter))) continue;
+		printf("%s: %s\n", c->name, c->description);
+		fflush(stdout);
+		if (c->run() < 0) {
+			printf("%s FAILED\n", c->name);
+			failed++;
+		}
+		else printf("%s ok\n", c->name);
+	}
+	return failed;
+}
@@ -0,0 +1,192 @@
+/*
+ * Checks of the C++20 coroutine interface (libomron/omron.hpp)
+ *
+ * Runs sessions on two simulated devices at once through an omron::loop
+ * and compares what they read with the blocking calls on simulators of
+ * the same seeds. Prints "ok" or what went wrong, the exit status is the
+ * number of checks that failed.
+ */
+
+#include "libomron/omron.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+/// Records and days the simulators hold
+#define CHECK_BP_COUNT 24
+#define CHECK_PD_DAYS 6
+
+namespace {
+
+/// Simulator config of a unit that answers after a while and never garbles anything
+void slow_config(omron_sim_config* config, uint32_t seed)
+{
+	omron_sim_default_config(config);
+	config->latency_us = 2000;
+	config->jitter_us = 0;
+	config->turnaround_us = 0;
+	config->corrupt_rate = 0;
+	config->negative_rate = 0;
+	config->seed = seed;
+	config->bp_count[0] = CHECK_BP_COUNT;
+	config->bp_count[1] = 0;
+	config->pd_days = CHECK_PD_DAYS;
+}
+
+struct session_result
+{
+	int count = -1;
+	std::vector<omron_bp_day_info> records;
+	std::vector<omron_pd_daily_data> days;
+};
+
+omron::task<void> session(omron::device& dev, session_result& result)
+{
+	result.count = co_await dev.daily_count(0);
+	result.records = co_await dev.daily_bp(0, {0, result.count - 1});
+	auto days = dev.pd_days();
+	while (auto day = co_await days.next()) result.days.push_back(*day);
+}
+
+bool same_bp(const omron_bp_day_info& a, const omron_bp_day_info& b)
+{
+	return a.year == b.year && a.month == b.month && a.day == b.day &&
+		a.hour == b.hour && a.minute == b.minute && a.second == b.second &&
+		a.sys == b.sys && a.dia == b.dia && a.pulse == b.pulse;
+}
+
+/// Compare a session with the blocking reads of a simulator of the same seed
+int compare(const session_result& result, uint32_t seed)
+{
+	omron_bp_day_info ref[CHECK_BP_COUNT];
+	omron_pd_history* history = omron_pd_history_create(CHECK_PD_DAYS);
+	omron_sim_config config;
+	omron_device* dev = omron_create();
+	int failed = 0;
+	int ret = -1;
+
+	slow_config(&config, seed);
+	if (dev && history && omron_open_sim(dev, &config) >= 0) {
+		ret = omron_get_daily_bp_range(dev, 0, 0, CHECK_BP_COUNT - 1, ref, nullptr);
+		if (ret == CHECK_BP_COUNT) ret = omron_get_pd_history(dev, 0, CHECK_PD_DAYS - 1, history);
+		omron_close(dev);
+	}
+	if (ret != CHECK_PD_DAYS) {
+		std::printf("  simulator read failed (%d)\n", ret);
+		failed = 1;
+	} else if (result.count != CHECK_BP_COUNT || result.records.size() != CHECK_BP_COUNT ||
+		   result.days.size() != CHECK_PD_DAYS) {
+		std::printf("  seed %u: %d records, %d read, %d days, expected %d, %d\n", (unsigned)seed,
+			    result.count, (int)result.records.size(), (int)result.days.size(),
+			    CHECK_BP_COUNT, CHECK_PD_DAYS);
+		failed = 1;
+	}
+	for (int i = 0; !failed && i < CHECK_BP_COUNT; ++i) {
+		if (!same_bp(result.records[i], ref[i])) {
+			std::printf("  seed %u: record %d differs\n", (unsigned)seed, i);
+			failed = 1;
+		}
+	}
+	for (int i = 0; !failed && i < CHECK_PD_DAYS; ++i) {
+		const omron_pd_daily_data& a = result.days[i];
+		const omron_pd_daily_data& b = history->daily[i];
+
+		if (a.total_steps != b.total_steps || a.total_aerobic_steps != b.total_aerobic_steps ||
+		    a.total_calories != b.total_calories || a.day_serial != b.day_serial) {
+			std::printf("  seed %u: day %d differs\n", (unsigned)seed, i);
+			failed = 1;
+		}
+	}
+	omron_pd_history_delete(history);
+	if (dev) omron_delete(dev);
+	return failed ? -1 : 0;
+}
+
+/*
+ * Sessions on two devices, with the blocking range read of one running
+ * while the loop drives the commands of the other, read what the blocking
+ * calls read.
+ */
+int check_sessions()
+{
+	omron_sim_config config_a, config_b;
+	session_result a_result, b_result;
+	omron::loop loop;
+	omron::device a(loop), b(loop);
+
+	slow_config(&config_a, 1);
+	slow_config(&config_b, 2);
+	try {
+		a.open_sim(&config_a);
+		b.open_sim(&config_b);
+		loop.spawn(session(a, a_result));
+		loop.spawn(session(b, b_result));
+		loop.run();
+	} catch (const omron::error& e) {
+		std::printf("  session failed: %s\n", e.what());
+		return -1;
+	}
+	if (loop.active()) {
+		std::printf("  %d sessions still running\n", loop.active());
+		return -1;
+	}
+	return compare(a_result, 1) < 0 || compare(b_result, 2) < 0 ? -1 : 0;
+}
+
+/// A bad range is thrown as OMRON_ERR_BADARG
+int check_errors()
+{
+	omron_sim_config config;
+	omron::loop loop;
+	omron::device dev(loop);
+	int code = 0;
+
+	slow_config(&config, 3);
+	dev.open_sim(&config);
+	loop.spawn([](omron::device& d, int& c) -> omron::task<void> {
+		try {
+			co_await d.daily_bp(0, {2, 1});
+		} catch (const omron::error& e) {
+			c = e.code();
+		}
+	}(dev, code));
+	loop.run();
+	if (code != OMRON_ERR_BADARG) {
+		std::printf("  bad range gave %d, expected %d\n", code, OMRON_ERR_BADARG);
+		return -1;
+	}
+	return 0;
+}
+
+struct check
+{
+	const char* name;
+	const char* description;
+	int (*run)();
+};
+
+const check checks[] = {
+	{ "sessions", "Sessions on two devices at once read what the blocking calls read",
+	  check_sessions },
+	{ "errors", "Errors are thrown as omron::error",
+	  check_errors },
+};
+
+} // namespace
+
+int main()
+{
+	int failed = 0;
+
+	for (const check& c : checks) {
+		std::printf("%s: %s\n", c.name, c.description);
+		if (c.run() < 0) {
+			std::printf("%s FAILED\n", c.name);
+			failed++;
+		} else {
+			std::printf("%s ok\n", c.name);
+		}
+	}
+	return failed;
+}
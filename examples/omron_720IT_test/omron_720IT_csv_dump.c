@@ -14,6 +14,7 @@ int main(int argc, char** argv)
 	int data_count;
 	unsigned char str[30];
 	omron_pd_count_info c;
+	omron_pd_history* history;
 	char time_str[20];
 	struct tm *timeptr;
 	time_t today_secs, other_secs;
@@ -70,39 +71,49 @@ int main(int argc, char** argv)
 	
 	if(data_count > 0) {
 		printf("Date,Total Steps,Aerobic Steps,Aerobic Walking Time,Calories,Distance,Fat Burned,Steps 12AM,Steps 1AM,Steps 2AM,Steps 3AM,Steps 4AM,Steps 5AM,Steps 6AM,Steps 7AM,Steps 8AM,Steps 9AM,Steps 10AM,Steps 11AM,Steps 12PM,Steps 1PM,Steps 2PM,Steps 3PM,Steps 4PM,Steps 5PM,Steps 6PM,Steps 7PM,Steps 8PM,Steps 9PM,Steps 10PM,Steps 11PM,Aerobic Steps 12AM,Aerobic Steps 1AM,Aerobic Steps 2AM,Aerobic Steps 3AM,Aerobic Steps 4AM,Aerobic Steps 5AM,Aerobic Steps 6AM,Aerobic Steps 7AM,Aerobic Steps 8AM,Aerobic Steps 9AM,Aerobic Steps 10AM,Aerobic Steps 11AM,Aerobic Steps 12PM,Aerobic Steps 1PM,Aerobic Steps 2PM,Aerobic Steps 3PM,Aerobic Steps 4PM,Aerobic Steps 5PM,Aerobic Steps 6PM,Aerobic Steps 7PM,Aerobic Steps 8PM,Aerobic Steps 9PM,Aerobic Steps 10PM,Aerobic Steps 11PM,Used 12AM,Used 1AM,Used 2AM,Used 3AM,Used 4AM,Used 5AM,Used 6AM,Used 7AM,Used 8AM,Used 9AM,Used 10AM,Used 11AM,Used 12PM,Used 1PM,Used 2PM,Used 3PM,Used 4PM,Used 5PM,Used 6PM,Used 7PM,Used 8PM,Used 9PM,Used 10PM,Used 11PM,Event 12AM,Event 1AM,Event 2AM,Event 3AM,Event 4AM,Event 5AM,Event 6AM,Event 7AM,Event 8AM,Event 9AM,Event 10AM,Event 11AM,Event 12PM,Event 1PM,Event 2PM,Event 3PM,Event 4PM,Event 5PM,Event 6PM,Event 7PM,Event 8PM,Event 9PM,Event 10PM,Event 11PM\n");
+		history = omron_pd_history_create(data_count);
+		if (!history) {
+			fprintf(stderr, "Out of memory\n");
+			return 1;
+		}
+		ret = omron_get_pd_history(test, 0, data_count - 1, history);
+		if (ret < 0) {
+			fprintf(stderr, "Cannot read pedometer data: %s\n", omron_strerror(ret));
+		}
 		today_secs = time(NULL);
-		for(i = 0; i < data_count; ++i) {
+		for(i = 0; i < data_count && ret >= 0; ++i) {
 			other_secs = (time_t)(today_secs - i * SECONDS_PER_DAY);
 			timeptr = localtime(&other_secs);
 			strftime(time_str, 20, "%m/%d/%Y", timeptr);
 		
-			omron_pd_daily_data d = omron_get_pd_daily_data(test, i);
+			omron_pd_daily_data d = history->daily[i];
 			printf("%s,%d,%d,%d,%d,%0.2f,%0.1f", time_str, d.total_steps, d.total_aerobic_steps, d.total_aerobic_walking_time, d.total_calories, d.total_distance, d.total_fat_burn);
 
-			omron_pd_hourly_data* h = omron_get_pd_hourly_data(test, i);
-			// hour loops
+			if (history->status[i] < 0) {
+				printf("\n");
+				continue;
+			}
+			// hour loops, each column is 24 consecutive entries per day
 			int j;
 			for(j = 0; j < 24; ++j)
 			{
-				printf(",%d", h[j].regular_steps);
-				//printf("d: %d Hour: %d - On: %d - Steps:  %d roby: %d Event: %d \n", h[j].day_serial, h[j].hour_serial, h[j].is_attached > 0, h[j].regular_steps, h[j].aerobic_steps, h[j].event);
+				printf(",%d", history->regular_steps[i * 24 + j]);
 			}
 			for(j = 0; j < 24; ++j)
 			{
-				printf(",%d", h[j].aerobic_steps);
+				printf(",%d", history->aerobic_steps[i * 24 + j]);
 			}
 			for(j = 0; j < 24; ++j)
 			{
-				printf(",%d", h[j].is_attached);
+				printf(",%d", history->is_attached[i * 24 + j]);
 			}
 			for(j = 0; j < 24; ++j)
 			{
-				printf(",%d", h[j].event);
+				printf(",%d", history->event[i * 24 + j]);
 			}
 			printf("\n");
-			
-			free(h);
 		}
+		omron_pd_history_delete(history);
 	}
 	if(clear_flag) {
 		ret = omron_clear_pd_memory(test);
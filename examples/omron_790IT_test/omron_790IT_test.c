@@ -1,6 +1,6 @@
 #include "libomron/omron.h"
 #include <stdio.h>
-#include <stdlib.h>		/* atoi */
+#include <stdlib.h>		/* atoi, malloc */
 
 int main(int argc, char** argv)
 {
@@ -55,15 +55,25 @@ int main(int argc, char** argv)
 		printf("Cannot get data count: %s\n", omron_strerror(ret));
 	}
 
-	for(i = data_count - 1; i >= 0; --i)
-	{
-		omron_bp_day_info r = omron_get_daily_bp_data(test, bank, i);
-		if(!r.present)
+	if (data_count > 0) {
+		omron_bp_day_info* r = malloc(data_count * sizeof(omron_bp_day_info));
+		int* status = malloc(data_count * sizeof(int));
+
+		ret = omron_get_daily_bp_range(test, bank, 0, data_count - 1, r, status);
+		if (ret < 0) {
+			printf("Cannot get readings: %s\n", omron_strerror(ret));
+		}
+		for(i = data_count - 1; ret >= 0 && i >= 0; --i)
 		{
-			i = i + 1;
-			continue;
+			if(status[i] < 0)
+			{
+				printf("Reading %d: %s\n", i, omron_strerror(status[i]));
+				continue;
+			}
+			printf("%.2d/%.2d/20%.2d %.2d:%.2d:%.2d SYS: %3d DIA: %3d PULSE: %3d\n", r[i].day, r[i].month, r[i].year, r[i].hour, r[i].minute, r[i].second, r[i].sys, r[i].dia, r[i].pulse);
 		}
-		printf("%.2d/%.2d/20%.2d %.2d:%.2d:%.2d SYS: %3d DIA: %3d PULSE: %3d\n", r.day, r.month, r.year, r.hour, r.minute, r.second, r.sys, r.dia, r.pulse);
+		free(r);
+		free(status);
 	}
 
 
@@ -0,0 +1,831 @@
+/*
+ * Converts USB captures of the vendor software talking to a device into
+ * libomron session traces, which omron_trace_read() can consume (the
+ * vendor software uses its own mode values, so they don't replay call for
+ * call; omron_check runs their responses through the library instead).
+ * Understands the formats of the captures in doc/logs:
+ *
+ *   snoopyxml  XML export of SnoopyPro (pedometerLog*.xml)
+ *   usblyzer   HTML report of USBlyzer (the .html files in hem790it)
+ *   usblog     Binary SnoopyPro log (pedometerSniff*.usblog)
+ *
+ * Every capture is read in a single pass through a fixed size window, so
+ * memory use does not depend on the size of the capture. Each capture is
+ * appended to the output as one session of mode changes, report writes
+ * and report reads, timed as captured.
+ *
+ * Usage: omron_capture_convert [-t type] -o out.trace capture...
+ *   -t  Capture type (snoopyxml, usblyzer, usblog; default: guess)
+ *   -o  Trace file to append sessions to
+ */
+
+#include "libomron/omron.h"
+#include <stdio.h>
+#include <stdlib.h>		/* strtol, strtod */
+#include <string.h>
+#include <ctype.h>
+
+/// All supported devices use 8 byte HID reports in both directions
+#define REPORT_SIZE 8
+/// Input window; the largest thing looked at in one piece is a usblog URB
+#define WINDOW_SIZE 4096
+/// Longest tag or text run kept by the markup scanner, the rest is dropped
+#define TOKEN_SIZE 256
+
+enum capture_type {
+	CAPTURE_GUESS,
+	CAPTURE_SNOOPYXML,
+	CAPTURE_USBLYZER,
+	CAPTURE_USBLOG
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Input window
+//
+///////////////////////////////////////////////////////////////////////////////
+
+struct input {
+	FILE* file;
+	uint8_t buf[WINDOW_SIZE];
+	size_t pos;
+	size_t len;
+};
+
+/*
+ * Make at least n bytes available at in->buf + in->pos, returns how many
+ * are (less than n only at the end of the input).
+ */
+static size_t in_fill(struct input* in, size_t n)
+{
+	if (in->len - in->pos >= n) return in->len - in->pos;
+	memmove(in->buf, in->buf + in->pos, in->len - in->pos);
+	in->len -= in->pos;
+	in->pos = 0;
+	in->len += fread(in->buf + in->len, 1, sizeof(in->buf) - in->len, in->file);
+	return in->len;
+}
+
+static int in_getc(struct input* in)
+{
+	if (!in_fill(in, 1)) return EOF;
+	return in->buf[in->pos++];
+}
+
+/// Skip n bytes, returns 0 if the input ended first
+static int in_skip(struct input* in, size_t n)
+{
+	while (n) {
+		size_t avail = in_fill(in, 1);
+		size_t step = n < avail ? n : avail;
+
+		if (!avail) return 0;
+		in->pos += step;
+		n -= step;
+	}
+	return 1;
+}
+
+static uint16_t get16(const uint8_t* p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t* p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Trace output
+//
+///////////////////////////////////////////////////////////////////////////////
+
+struct session {
+	omron_trace* trace;
+	int open;
+	int64_t last_us;
+	long reports;
+	long modes;
+	int error;
+};
+
+static void emit(struct session* s, int type, int64_t time_us, int status, const uint8_t* data, int size)
+{
+	omron_trace_record record;
+	int64_t delta;
+
+	if (!s->open) {
+		record.type = OMRON_TRACE_OPEN;
+		record.size = 2;
+		record.status = 0;
+		record.delta_us = 0;
+		record.data[0] = REPORT_SIZE;
+		record.data[1] = REPORT_SIZE;
+		if (omron_trace_write(s->trace, &record) < 0) s->error = 1;
+		s->open = 1;
+		s->last_us = time_us;
+	}
+	delta = time_us - s->last_us;
+	if (delta < 0) delta = 0;
+	if (delta > 0xffffffffLL) delta = 0xffffffffLL;
+	s->last_us = time_us;
+
+	record.type = type;
+	record.size = size;
+	record.status = status;
+	record.delta_us = (uint32_t)delta;
+	memcpy(record.data, data, size);
+	if (omron_trace_write(s->trace, &record) < 0) s->error = 1;
+	if (type == OMRON_TRACE_MODE) ++s->modes;
+	else ++s->reports;
+}
+
+/// Mode changes are captured as the 2 byte feature report sent to the device
+static void emit_mode(struct session* s, int64_t time_us, const uint8_t* data, int size)
+{
+	if (size != 2) return;
+	emit(s, OMRON_TRACE_MODE, time_us, 0, data, size);
+}
+
+static void emit_report(struct session* s, int type, int64_t time_us, const uint8_t* data, int size)
+{
+	if (size <= 0 || size > OMRON_TRACE_MAX_PAYLOAD) return;
+	emit(s, type, time_us, size, data, size);
+}
+
+static void finish(struct session* s)
+{
+	omron_trace_record record;
+
+	if (!s->open) return;
+	record.type = OMRON_TRACE_CLOSE;
+	record.size = 0;
+	record.status = 0;
+	record.delta_us = 0;
+	if (omron_trace_write(s->trace, &record) < 0) s->error = 1;
+}
+
+/*
+ * Parse hex digits, ignoring anything else, into at most max bytes.
+ * Returns the number of bytes, or -1 if there were more than max.
+ */
+static int parse_hex(const char* text, uint8_t* data, int max)
+{
+	int n = 0;
+	int high = -1;
+
+	for (; *text; ++text) {
+		int v;
+
+		if (!isxdigit((unsigned char)*text)) continue;
+		v = isdigit((unsigned char)*text) ? *text - '0' : (tolower((unsigned char)*text) - 'a' + 10);
+		if (high < 0) {
+			high = v;
+			continue;
+		}
+		if (n == max) return -1;
+		data[n++] = (high << 4) | v;
+		high = -1;
+	}
+	return n;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Markup scanner
+//
+// Just enough of an XML/HTML tokenizer for the two capture formats: start
+// tags, end tags and text, reported as they are read. Comments, processing
+// instructions and declarations are skipped, entities are left alone.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+struct markup_handler {
+	void (*start)(void* ctx, const char* name, const char* attrs);
+	void (*end)(void* ctx, const char* name);
+	void (*text)(void* ctx, const char* text, int len);
+};
+
+static void markup_tag(char* tag, const struct markup_handler* h, void* ctx)
+{
+	char* attrs;
+	size_t len = strlen(tag);
+	int empty = 0;
+
+	if (len && tag[len - 1] == '/') {
+		tag[--len] = '\0';
+		empty = 1;
+	}
+	for (attrs = tag; *attrs && !isspace((unsigned char)*attrs); ++attrs) {
+		*attrs = tolower((unsigned char)*attrs);
+	}
+	if (*attrs) *attrs++ = '\0';
+
+	if (tag[0] == '/') {
+		h->end(ctx, tag + 1);
+		return;
+	}
+	h->start(ctx, tag, attrs);
+	if (empty) h->end(ctx, tag);
+}
+
+static void markup_scan(struct input* in, const struct markup_handler* h, void* ctx)
+{
+	char token[TOKEN_SIZE];
+	int len = 0;
+	int c;
+
+	while ((c = in_getc(in)) != EOF) {
+		if (c != '<') {
+			if (len == TOKEN_SIZE - 1) {
+				token[len] = '\0';
+				h->text(ctx, token, len);
+				len = 0;
+			}
+			token[len++] = c;
+			continue;
+		}
+		if (len) {
+			token[len] = '\0';
+			h->text(ctx, token, len);
+			len = 0;
+		}
+
+		c = in_getc(in);
+		if (c == '!' || c == '?') {
+			int dashes = 0;
+			int comment = 0;
+
+			// <!-- may contain '>', everything else ends at the first one
+			if (c == '!' && (c = in_getc(in)) == '-' && (c = in_getc(in)) == '-') {
+				comment = 1;
+			}
+			while (c != EOF) {
+				if (c == '>' && (!comment || dashes >= 2)) break;
+				dashes = (c == '-') ? dashes + 1 : 0;
+				c = in_getc(in);
+			}
+			continue;
+		}
+		while (c != EOF && c != '>') {
+			if (len < TOKEN_SIZE - 1) token[len++] = c;
+			c = in_getc(in);
+		}
+		token[len] = '\0';
+		len = 0;
+		markup_tag(token, h, ctx);
+	}
+}
+
+/// Appends text to a bounded field buffer
+static void field_append(char* field, size_t size, const char* text)
+{
+	size_t len = strlen(field);
+
+	if (len < size - 1) {
+		strncat(field, text, size - 1 - len);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// SnoopyPro XML
+//
+// Every URB shows up twice under the same sequence number, once when it is
+// submitted and once when it completes. Written data is in the submission,
+// read data in the completion. The endpoint is -1 if SnoopyPro missed the
+// configuration of the device; the direction then follows from which of
+// the two a payload comes with.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+/// Submitted URBs not completed yet, oldest overwritten when full
+#define SNOOPY_PENDING 64
+
+enum snoopy_field {
+	SNOOPY_NONE,
+	SNOOPY_FUNCTION,
+	SNOOPY_TIMESTAMP,
+	SNOOPY_ENDPOINT,
+	SNOOPY_PAYLOAD
+};
+
+struct snoopy {
+	struct session* session;
+	enum snoopy_field field;
+	long sequence;
+	char function[64];
+	char timestamp[32];
+	char endpoint[16];
+	char payload[2 * OMRON_TRACE_MAX_PAYLOAD + 1];
+	int payload_overflow;
+	long pending[SNOOPY_PENDING];
+	int pending_next;
+};
+
+/// Returns 1 if the URB was pending (so this is its completion)
+static int snoopy_complete(struct snoopy* x, long sequence)
+{
+	int i;
+
+	for (i = 0; i < SNOOPY_PENDING; ++i) {
+		if (x->pending[i] == sequence) {
+			x->pending[i] = -1;
+			return 1;
+		}
+	}
+	x->pending[x->pending_next] = sequence;
+	x->pending_next = (x->pending_next + 1) % SNOOPY_PENDING;
+	return 0;
+}
+
+static void snoopy_start(void* ctx, const char* name, const char* attrs)
+{
+	struct snoopy* x = ctx;
+	const char* seq;
+
+	x->field = SNOOPY_NONE;
+	if (!strcmp(name, "urb")) {
+		seq = strstr(attrs, "sequence=");
+		x->sequence = seq ? strtol(seq + 10, NULL, 10) : -1;
+		x->function[0] = x->timestamp[0] = x->endpoint[0] = x->payload[0] = '\0';
+		x->payload_overflow = 0;
+	}
+	else if (!strcmp(name, "function")) x->field = SNOOPY_FUNCTION;
+	else if (!strcmp(name, "timestamp")) x->field = SNOOPY_TIMESTAMP;
+	else if (!strcmp(name, "endpoint")) x->field = SNOOPY_ENDPOINT;
+	else if (!strcmp(name, "payloadbytes")) x->field = SNOOPY_PAYLOAD;
+}
+
+static void snoopy_text(void* ctx, const char* text, int len)
+{
+	struct snoopy* x = ctx;
+
+	switch (x->field) {
+	case SNOOPY_FUNCTION:
+		field_append(x->function, sizeof(x->function), text);
+		break;
+	case SNOOPY_TIMESTAMP:
+		field_append(x->timestamp, sizeof(x->timestamp), text);
+		break;
+	case SNOOPY_ENDPOINT:
+		field_append(x->endpoint, sizeof(x->endpoint), text);
+		break;
+	case SNOOPY_PAYLOAD:
+		if (strlen(x->payload) + len >= sizeof(x->payload)) x->payload_overflow = 1;
+		field_append(x->payload, sizeof(x->payload), text);
+		break;
+	default:
+		break;
+	}
+}
+
+static void snoopy_end(void* ctx, const char* name)
+{
+	struct snoopy* x = ctx;
+	uint8_t data[OMRON_TRACE_MAX_PAYLOAD];
+	int64_t time_us;
+	int completion;
+	int endpoint;
+	int size;
+
+	x->field = SNOOPY_NONE;
+	if (strcmp(name, "urb")) return;
+
+	completion = snoopy_complete(x, x->sequence);
+	time_us = (int64_t)(strtod(x->timestamp, NULL) * 1000);
+	endpoint = x->endpoint[0] ? atoi(x->endpoint) : -1;
+	size = x->payload_overflow ? -1 : parse_hex(x->payload, data, sizeof(data));
+	if (size <= 0) return;
+
+	if (!strcmp(x->function, "CLASS_INTERFACE") && !completion) {
+		emit_mode(x->session, time_us, data, size);
+	}
+	else if (!strcmp(x->function, "BULK_OR_INTERRUPT_TRANSFER")) {
+		int in = (endpoint < 0) ? completion : (endpoint & 0x80) != 0;
+
+		if (in == completion) {
+			emit_report(x->session, in ? OMRON_TRACE_READ : OMRON_TRACE_WRITE, time_us, data, size);
+		}
+	}
+}
+
+static int convert_snoopyxml(struct input* in, struct session* s)
+{
+	static const struct markup_handler handler = { snoopy_start, snoopy_end, snoopy_text };
+	struct snoopy x;
+
+	memset(&x, 0, sizeof(x));
+	memset(x.pending, 0xff, sizeof(x.pending));
+	x.session = s;
+	markup_scan(in, &handler, &x);
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// USBlyzer HTML
+//
+// One table row per event. Each request passes several filter drivers and
+// is listed once per driver, only the rows of the USBlyzer driver itself
+// (hhdusbh) are used. Completions have a "completion-request" sequence.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+enum usblyzer_column {
+	USBLYZER_TYPE = 0,
+	USBLYZER_SEQ = 1,
+	USBLYZER_TIME = 2,
+	USBLYZER_REQUEST = 3,
+	USBLYZER_DATA = 5,
+	USBLYZER_IO = 6,
+	USBLYZER_DRIVER = 10,
+	USBLYZER_COLUMNS = 11
+};
+
+#define USBLYZER_DAY_US (86400LL * 1000000)
+
+struct usblyzer {
+	struct session* session;
+	int column;
+	int in_cell;
+	char cell[USBLYZER_COLUMNS][3 * OMRON_TRACE_MAX_PAYLOAD + 1];
+	int data_overflow;
+	int64_t day_us;
+	int64_t last_us;
+};
+
+static void usblyzer_start(void* ctx, const char* name, const char* attrs)
+{
+	struct usblyzer* x = ctx;
+
+	(void)attrs; // the cells carry everything, no attributes needed
+
+	if (!strcmp(name, "tr")) {
+		memset(x->cell, 0, sizeof(x->cell));
+		x->column = -1;
+		x->data_overflow = 0;
+	}
+	else if (!strcmp(name, "td")) {
+		++x->column;
+		x->in_cell = 1;
+	}
+}
+
+static void usblyzer_text(void* ctx, const char* text, int len)
+{
+	struct usblyzer* x = ctx;
+	char* cell;
+
+	if (!x->in_cell || x->column < 0 || x->column >= USBLYZER_COLUMNS) return;
+	cell = x->cell[x->column];
+	if (x->column == USBLYZER_DATA && strlen(cell) + len >= sizeof(x->cell[0])) {
+		x->data_overflow = 1;
+	}
+	field_append(cell, sizeof(x->cell[0]), text);
+}
+
+/// hh:mm:ss.sss, continuing past midnight
+static int64_t usblyzer_time(struct usblyzer* x, const char* text)
+{
+	int hh = 0, mm = 0;
+	double ss = 0;
+	int64_t t;
+
+	sscanf(text, " %d:%d:%lf", &hh, &mm, &ss);
+	t = ((int64_t)hh * 3600 + mm * 60) * 1000000 + (int64_t)(ss * 1000000) + x->day_us;
+	if (t < x->last_us - USBLYZER_DAY_US / 2) {
+		x->day_us += USBLYZER_DAY_US;
+		t += USBLYZER_DAY_US;
+	}
+	x->last_us = t;
+	return t;
+}
+
+static void usblyzer_end(void* ctx, const char* name)
+{
+	struct usblyzer* x = ctx;
+	uint8_t data[OMRON_TRACE_MAX_PAYLOAD];
+	int64_t time_us;
+	int completion;
+	int in;
+	int size;
+
+	if (!strcmp(name, "td")) {
+		x->in_cell = 0;
+		return;
+	}
+	if (strcmp(name, "tr") || x->column < USBLYZER_DRIVER) return;
+	if (strcmp(x->cell[USBLYZER_TYPE], "URB") || strcmp(x->cell[USBLYZER_DRIVER], "hhdusbh")) return;
+
+	time_us = usblyzer_time(x, x->cell[USBLYZER_TIME]);
+	completion = strchr(x->cell[USBLYZER_SEQ], '-') != NULL;
+	in = !strcmp(x->cell[USBLYZER_IO], "in");
+	size = x->data_overflow ? -1 : parse_hex(x->cell[USBLYZER_DATA], data, sizeof(data));
+	if (size <= 0) return;
+
+	if (!strcmp(x->cell[USBLYZER_REQUEST], "Class Interface") && !completion) {
+		emit_mode(x->session, time_us, data, size);
+	}
+	else if (!strcmp(x->cell[USBLYZER_REQUEST], "Bulk or Interrupt Transfer") && in == completion) {
+		emit_report(x->session, in ? OMRON_TRACE_READ : OMRON_TRACE_WRITE, time_us, data, size);
+	}
+}
+
+static int convert_usblyzer(struct input* in, struct session* s)
+{
+	static const struct markup_handler handler = { usblyzer_start, usblyzer_end, usblyzer_text };
+	struct usblyzer x;
+
+	memset(&x, 0, sizeof(x));
+	x.session = s;
+	x.column = -1;
+	markup_scan(in, &handler, &x);
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// SnoopyPro binary log
+//
+// An MFC archive: a counted table of 32 bit words, then the URBs as
+// serialized objects. Each object starts with a class tag, either 0xffff
+// followed by the schema, name length and name of a class seen for the
+// first time, or 0x8000 | n for the n-th class seen. The object data of all
+// URB classes begins with
+//
+//   0   sequence (32)       4  URB function (16)  6  timestamp, ms (32)
+//   12  pipe handle (32)    32 completion flag (32)
+//   36  sequence (32)       40 timestamp (32)     44 URB header (20)
+//
+// where the URB header starts with the length of the raw URB. Transfer
+// classes continue with a 32 bit byte count, then if it is non-zero a 16
+// bit flag telling whether that many bytes of data follow, then the raw
+// URB. Objects of other classes are skipped by scanning for the next one,
+// recognised by the sequence and timestamp both appearing twice.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define USBLOG_MAX_CLASSES 16
+#define USBLOG_CLASS_NAME 64
+#define USBLOG_HEADER 64
+#define USBLOG_NEW_CLASS 0xffff
+#define USBLOG_CLASS_INDEX 0x8000
+/// Offset of TransferFlags in a raw bulk/interrupt URB
+#define USBLOG_TRANSFER_FLAGS 20
+#define USBD_TRANSFER_DIRECTION_IN 0x01
+#define URB_FUNCTION_CLASS_INTERFACE 0x001b
+
+enum usblog_class {
+	USBLOG_OTHER,
+	USBLOG_URB,
+	USBLOG_CONTROL,
+	USBLOG_BULK
+};
+
+struct usblog {
+	int class_count;
+	enum usblog_class classes[USBLOG_MAX_CLASSES];
+};
+
+static int usblog_signature(const uint8_t* p)
+{
+	return get32(p) == get32(p + 36) && get32(p + 6) == get32(p + 40);
+}
+
+static enum usblog_class usblog_classify(const char* name)
+{
+	if (!strcmp(name, "CURB")) return USBLOG_URB;
+	if (!strcmp(name, "CURB_ControlTransfer")) return USBLOG_CONTROL;
+	if (!strcmp(name, "CURB_BulkOrInterruptTransfer")) return USBLOG_BULK;
+	return USBLOG_OTHER;
+}
+
+/*
+ * Find the next object at or after the current position. Leaves the window
+ * at its data and returns its class, or -1 at the end of the log.
+ */
+static int usblog_next(struct input* in, struct usblog* x)
+{
+	while (in_fill(in, 6 + USBLOG_CLASS_NAME + USBLOG_HEADER) >= 2 + USBLOG_HEADER) {
+		const uint8_t* p = in->buf + in->pos;
+		size_t avail = in->len - in->pos;
+		uint16_t tag = get16(p);
+
+		if (tag == USBLOG_NEW_CLASS) {
+			uint16_t name_len = get16(p + 4);
+
+			if (name_len >= 4 && name_len < USBLOG_CLASS_NAME && (size_t)(6 + name_len + USBLOG_HEADER) <= avail &&
+			    !memcmp(p + 6, "CURB", 4) && usblog_signature(p + 6 + name_len)) {
+				char name[USBLOG_CLASS_NAME];
+				enum usblog_class cls;
+
+				memcpy(name, p + 6, name_len);
+				name[name_len] = '\0';
+				cls = usblog_classify(name);
+				if (x->class_count < USBLOG_MAX_CLASSES) {
+					x->classes[x->class_count++] = cls;
+				}
+				in->pos += 6 + name_len;
+				return cls;
+			}
+		}
+		else if ((tag & USBLOG_CLASS_INDEX) && (tag & ~USBLOG_CLASS_INDEX) >= 1 &&
+			 (tag & ~USBLOG_CLASS_INDEX) <= x->class_count && usblog_signature(p + 2)) {
+			in->pos += 2;
+			return x->classes[(tag & ~USBLOG_CLASS_INDEX) - 1];
+		}
+		++in->pos;
+	}
+	return -1;
+}
+
+static int convert_usblog(struct input* in, struct session* s)
+{
+	struct usblog x;
+	uint32_t count;
+	int cls;
+
+	memset(&x, 0, sizeof(x));
+	if (in_fill(in, 6) < 6) return -1;
+	count = get16(in->buf + in->pos);
+	in->pos += 2;
+	if (count == 0xffff) {
+		count = get32(in->buf + in->pos);
+		in->pos += 4;
+	}
+	if (!in_skip(in, (size_t)count * 4)) return -1;
+
+	while ((cls = usblog_next(in, &x)) >= 0) {
+		const uint8_t* p;
+		uint8_t data[OMRON_TRACE_MAX_PAYLOAD];
+		int64_t time_us;
+		uint32_t size;
+		uint16_t urb_len;
+		int completion;
+		int function;
+		int present = 0;
+
+		if (cls != USBLOG_CONTROL && cls != USBLOG_BULK) {
+			// Resynchronised by usblog_next()
+			if (cls == USBLOG_URB) in->pos += USBLOG_HEADER;
+			continue;
+		}
+		if (in_fill(in, USBLOG_HEADER + 6) < USBLOG_HEADER + 6) break;
+		p = in->buf + in->pos;
+		function = get16(p + 4);
+		time_us = (int64_t)get32(p + 6) * 1000;
+		completion = get32(p + 32) != 0;
+		urb_len = get16(p + 44);
+		size = get32(p + USBLOG_HEADER);
+		in->pos += USBLOG_HEADER + 4;
+		if (size) {
+			present = get16(in->buf + in->pos);
+			in->pos += 2;
+		}
+		if (!present) size = 0;
+		if (size > OMRON_TRACE_MAX_PAYLOAD) {
+			// Not a report, skip the data and let usblog_next() find the next object
+			if (!in_skip(in, size)) break;
+			continue;
+		}
+		if (in_fill(in, size + USBLOG_TRANSFER_FLAGS + 4) < size + USBLOG_TRANSFER_FLAGS + 4) break;
+		p = in->buf + in->pos;
+		memcpy(data, p, size);
+
+		if (cls == USBLOG_CONTROL) {
+			if (function == URB_FUNCTION_CLASS_INTERFACE && !completion) {
+				emit_mode(s, time_us, data, size);
+			}
+		}
+		else {
+			int in_dir = (get32(p + size + USBLOG_TRANSFER_FLAGS) & USBD_TRANSFER_DIRECTION_IN) != 0;
+
+			if (in_dir == completion) {
+				emit_report(s, in_dir ? OMRON_TRACE_READ : OMRON_TRACE_WRITE, time_us, data, size);
+			}
+		}
+		if (!in_skip(in, size + urb_len)) break;
+	}
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Driver
+//
+///////////////////////////////////////////////////////////////////////////////
+
+static enum capture_type guess_type(struct input* in)
+{
+	char head[257];
+	size_t n = in_fill(in, sizeof(head) - 1);
+	size_t i;
+
+	if (n > sizeof(head) - 1) n = sizeof(head) - 1;
+	for (i = 0; i < n; ++i) {
+		head[i] = tolower(in->buf[in->pos + i]);
+		if (!head[i]) head[i] = ' ';
+	}
+	head[n] = '\0';
+	if (strstr(head, "<html") || strstr(head, "<!doctype html")) return CAPTURE_USBLYZER;
+	if (strstr(head, "<?xml") || strstr(head, "<snoopyprolog")) return CAPTURE_SNOOPYXML;
+	return CAPTURE_USBLOG;
+}
+
+static int convert(const char* path, enum capture_type type, omron_trace* trace)
+{
+	struct input in;
+	struct session s;
+	int status;
+
+	memset(&s, 0, sizeof(s));
+	s.trace = trace;
+	in.file = fopen(path, "rb");
+	in.pos = in.len = 0;
+	if (!in.file) {
+		perror(path);
+		return -1;
+	}
+	if (type == CAPTURE_GUESS) type = guess_type(&in);
+	switch (type) {
+	case CAPTURE_SNOOPYXML:
+		status = convert_snoopyxml(&in, &s);
+		break;
+	case CAPTURE_USBLYZER:
+		status = convert_usblyzer(&in, &s);
+		break;
+	default:
+		status = convert_usblog(&in, &s);
+		break;
+	}
+	fclose(in.file);
+	finish(&s);
+
+	if (status < 0) {
+		fprintf(stderr, "%s: not a capture\n", path);
+		return -1;
+	}
+	if (s.error) {
+		fprintf(stderr, "%s: error writing trace\n", path);
+		return -1;
+	}
+	if (!s.open) {
+		fprintf(stderr, "%s: no device traffic found\n", path);
+		return -1;
+	}
+	fprintf(stderr, "%s: %ld reports, %ld mode changes\n", path, s.reports, s.modes);
+	return 0;
+}
+
+static void usage(const char* prog)
+{
+	fprintf(stderr, "Usage: %s [-t snoopyxml|usblyzer|usblog] -o out.trace capture...\n", prog);
+}
+
+int main(int argc, char** argv)
+{
+	enum capture_type type = CAPTURE_GUESS;
+	const char* out = NULL;
+	omron_trace* trace;
+	int failed = 0;
+	int i;
+
+	// Plain argument parsing, so the converter also builds without getopt
+	for (i = 1; i < argc && argv[i][0] == '-'; ++i) {
+		if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+			++i;
+			if (!strcmp(argv[i], "snoopyxml")) type = CAPTURE_SNOOPYXML;
+			else if (!strcmp(argv[i], "usblyzer")) type = CAPTURE_USBLYZER;
+			else if (!strcmp(argv[i], "usblog")) type = CAPTURE_USBLOG;
+			else {
+				usage(argv[0]);
+				return 1;
+			}
+		}
+		else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+			out = argv[++i];
+		}
+		else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (!out || i >= argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	trace = omron_trace_open(out, 1);
+	if (!trace) {
+		fprintf(stderr, "Cannot open %s\n", out);
+		return 1;
+	}
+	for (; i < argc; ++i) {
+		if (convert(argv[i], type, trace) < 0) failed = 1;
+	}
+	if (omron_trace_close(trace) < 0) failed = 1;
+	return failed;
+}
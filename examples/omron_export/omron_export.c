@@ -0,0 +1,579 @@
+/*
+ * Exports blood pressure readings or pedometer days, from a device or from
+ * an archive written by omron_archive_*(), as CSV, JSON Lines or another
+ * archive.
+ *
+ * Output goes through a single buffer with its own number formatting, and
+ * records from a device are written out as each batch arrives, so the
+ * output can be piped on while the download runs.
+ *
+ * Usage: omron_export [-p] [-b bank] [-f csv|jsonl|binary] [-o out] [-i archive | -S]
+ *   -p  Export pedometer days instead of blood pressure readings
+ *   -b  Blood pressure memory bank (default: 0)
+ *   -f  Output format (default: csv); binary is an archive and needs -o
+ *   -o  Output file (default: stdout)
+ *   -i  Read from an archive instead of the first device
+ *   -S  Read from a simulated device
+ */
+
+#include "libomron/omron.h"
+#include <stdio.h>
+#include <stdlib.h>		/* atoi */
+#include <string.h>
+#include <time.h>
+
+/// Output buffer, written out whenever it fills up and after each batch from a device
+#define OUT_BUFFER_SIZE 65536
+/// Most bytes a single formatted value takes
+#define OUT_VALUE_MAX 32
+/// Readings fetched from a device per batch
+#define BP_BATCH 32
+/// Pedometer days fetched from a device per batch
+#define PD_BATCH 8
+
+enum format {
+	FORMAT_CSV,
+	FORMAT_JSONL,
+	FORMAT_BINARY
+};
+
+/// Pedometer day, as read from a device or an archive
+struct pd_row {
+	/// YYYYMMDD000000
+	int64_t day;
+	omron_pd_daily_data daily;
+	int steps[24];
+	int aerobic_steps[24];
+};
+
+struct exporter {
+	enum format format;
+	FILE* file;
+	omron_archive* archive;
+	char buf[OUT_BUFFER_SIZE];
+	int len;
+	int failed;
+	long rows;
+};
+
+static const char* hour_names[24] = {
+	"12AM", "1AM", "2AM", "3AM", "4AM", "5AM", "6AM", "7AM", "8AM", "9AM", "10AM", "11AM",
+	"12PM", "1PM", "2PM", "3PM", "4PM", "5PM", "6PM", "7PM", "8PM", "9PM", "10PM", "11PM"
+};
+
+//buffered writer
+
+static void out_flush(struct exporter* e)
+{
+	if (!e->file) return;
+	if (e->len && fwrite(e->buf, 1, e->len, e->file) != (size_t)e->len) e->failed = 1;
+	e->len = 0;
+	if (fflush(e->file)) e->failed = 1;
+}
+
+static void out_str(struct exporter* e, const char* s, int len)
+{
+	if (e->len + len > OUT_BUFFER_SIZE) out_flush(e);
+	if (len > OUT_BUFFER_SIZE) {
+		if (fwrite(s, 1, len, e->file) != (size_t)len) e->failed = 1;
+		return;
+	}
+	memcpy(e->buf + e->len, s, len);
+	e->len += len;
+}
+
+#define OUT_LITERAL(e, s) out_str(e, s, sizeof(s) - 1)
+
+static void out_char(struct exporter* e, char c)
+{
+	if (e->len == OUT_BUFFER_SIZE) out_flush(e);
+	e->buf[e->len++] = c;
+}
+
+/// Room for one formatted value at the end of the buffer
+static char* out_reserve(struct exporter* e)
+{
+	if (e->len + OUT_VALUE_MAX > OUT_BUFFER_SIZE) out_flush(e);
+	return e->buf + e->len;
+}
+
+static void out_int(struct exporter* e, int64_t value)
+{
+	char digits[24];
+	char* p = out_reserve(e);
+	uint64_t v = value < 0 ? -(uint64_t)value : (uint64_t)value;
+	int n = 0;
+
+	do {
+		digits[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	if (value < 0) *p++ = '-';
+	while (n) *p++ = digits[--n];
+	e->len = p - e->buf;
+}
+
+/// Zero padded to width digits
+static void out_uint_padded(struct exporter* e, unsigned value, int width)
+{
+	char* p = out_reserve(e) + width;
+
+	e->len += width;
+	while (width--) {
+		*--p = '0' + value % 10;
+		value /= 10;
+	}
+}
+
+/// Fixed point with decimals (1 or 2) digits after the point, like %0.2f
+static void out_fixed(struct exporter* e, double value, int decimals)
+{
+	int64_t scale = decimals == 1 ? 10 : 100;
+	int64_t scaled = (int64_t)(value * scale + (value < 0 ? -0.5 : 0.5));
+	uint64_t v = scaled < 0 ? -(uint64_t)scaled : (uint64_t)scaled;
+
+	if (scaled < 0) out_char(e, '-');
+	out_int(e, v / scale);
+	out_char(e, '.');
+	out_uint_padded(e, (unsigned)(v % scale), decimals);
+}
+
+/// YYYYMMDDhhmmss as "YYYY-MM-DD hh:mm:ss", or just the date
+static void out_timestamp(struct exporter* e, int64_t ts, int with_time)
+{
+	unsigned date = (unsigned)(ts / 1000000);
+	unsigned time = (unsigned)(ts % 1000000);
+
+	out_uint_padded(e, date / 10000, 4);
+	out_char(e, '-');
+	out_uint_padded(e, date / 100 % 100, 2);
+	out_char(e, '-');
+	out_uint_padded(e, date % 100, 2);
+	if (!with_time) return;
+	out_char(e, ' ');
+	out_uint_padded(e, time / 10000, 2);
+	out_char(e, ':');
+	out_uint_padded(e, time / 100 % 100, 2);
+	out_char(e, ':');
+	out_uint_padded(e, time % 100, 2);
+}
+
+//records
+
+static void export_header(struct exporter* e, int pedometer)
+{
+	int i;
+
+	if (e->format != FORMAT_CSV) return;
+	if (!pedometer) {
+		OUT_LITERAL(e, "Time,Systolic,Diastolic,Pulse\n");
+		return;
+	}
+	OUT_LITERAL(e, "Date,Total Steps,Aerobic Steps,Aerobic Walking Time,Calories,Distance,Fat Burned");
+	for (i = 0; i < 24; ++i) {
+		OUT_LITERAL(e, ",Steps ");
+		out_str(e, hour_names[i], strlen(hour_names[i]));
+	}
+	for (i = 0; i < 24; ++i) {
+		OUT_LITERAL(e, ",Aerobic Steps ");
+		out_str(e, hour_names[i], strlen(hour_names[i]));
+	}
+	out_char(e, '\n');
+}
+
+static void export_bp(struct exporter* e, int64_t ts, int sys, int dia, int pulse)
+{
+	e->rows++;
+	switch (e->format) {
+	case FORMAT_CSV:
+		out_timestamp(e, ts, 1);
+		out_char(e, ',');
+		out_int(e, sys);
+		out_char(e, ',');
+		out_int(e, dia);
+		out_char(e, ',');
+		out_int(e, pulse);
+		out_char(e, '\n');
+		break;
+	case FORMAT_JSONL:
+		OUT_LITERAL(e, "{\"time\":\"");
+		out_timestamp(e, ts, 1);
+		OUT_LITERAL(e, "\",\"sys\":");
+		out_int(e, sys);
+		OUT_LITERAL(e, ",\"dia\":");
+		out_int(e, dia);
+		OUT_LITERAL(e, ",\"pulse\":");
+		out_int(e, pulse);
+		OUT_LITERAL(e, "}\n");
+		break;
+	case FORMAT_BINARY:
+	{
+		omron_bp_day_info r;
+		unsigned date = (unsigned)(ts / 1000000);
+		unsigned time = (unsigned)(ts % 1000000);
+
+		memset(&r, 0, sizeof(r));
+		r.year = date / 10000 - 2000;
+		r.month = date / 100 % 100;
+		r.day = date % 100;
+		r.hour = time / 10000;
+		r.minute = time / 100 % 100;
+		r.second = time % 100;
+		r.sys = sys;
+		r.dia = dia;
+		r.pulse = pulse;
+		r.present = 1;
+		if (omron_archive_add_bp(e->archive, &r) < 0) e->failed = 1;
+		break;
+	}
+	}
+}
+
+static void out_hours(struct exporter* e, const int* values, int leading_comma)
+{
+	int i;
+
+	for (i = 0; i < 24; ++i) {
+		if (i || leading_comma) out_char(e, ',');
+		out_int(e, values[i]);
+	}
+}
+
+static void export_pd(struct exporter* e, const struct pd_row* row)
+{
+	const omron_pd_daily_data* d = &row->daily;
+
+	e->rows++;
+	switch (e->format) {
+	case FORMAT_CSV:
+		out_timestamp(e, row->day, 0);
+		out_char(e, ',');
+		out_int(e, d->total_steps);
+		out_char(e, ',');
+		out_int(e, d->total_aerobic_steps);
+		out_char(e, ',');
+		out_int(e, d->total_aerobic_walking_time);
+		out_char(e, ',');
+		out_int(e, d->total_calories);
+		out_char(e, ',');
+		out_fixed(e, d->total_distance, 2);
+		out_char(e, ',');
+		out_fixed(e, d->total_fat_burn, 1);
+		out_hours(e, row->steps, 1);
+		out_hours(e, row->aerobic_steps, 1);
+		out_char(e, '\n');
+		break;
+	case FORMAT_JSONL:
+		OUT_LITERAL(e, "{\"date\":\"");
+		out_timestamp(e, row->day, 0);
+		OUT_LITERAL(e, "\",\"total_steps\":");
+		out_int(e, d->total_steps);
+		OUT_LITERAL(e, ",\"total_aerobic_steps\":");
+		out_int(e, d->total_aerobic_steps);
+		OUT_LITERAL(e, ",\"aerobic_walking_time\":");
+		out_int(e, d->total_aerobic_walking_time);
+		OUT_LITERAL(e, ",\"calories\":");
+		out_int(e, d->total_calories);
+		OUT_LITERAL(e, ",\"distance\":");
+		out_fixed(e, d->total_distance, 2);
+		OUT_LITERAL(e, ",\"fat_burn\":");
+		out_fixed(e, d->total_fat_burn, 1);
+		OUT_LITERAL(e, ",\"steps\":[");
+		out_hours(e, row->steps, 0);
+		OUT_LITERAL(e, "],\"aerobic_steps\":[");
+		out_hours(e, row->aerobic_steps, 0);
+		OUT_LITERAL(e, "]}\n");
+		break;
+	case FORMAT_BINARY:
+	{
+		omron_pd_hourly_data h[24];
+		int i;
+
+		memset(h, 0, sizeof(h));
+		for (i = 0; i < 24; ++i) {
+			h[i].regular_steps = row->steps[i];
+			h[i].aerobic_steps = row->aerobic_steps[i];
+		}
+		if (omron_archive_add_pd(e->archive, row->day, d, h) < 0) e->failed = 1;
+		break;
+	}
+	}
+}
+
+//sources
+
+static int export_archive(struct exporter* e, const char* path, int pedometer)
+{
+	omron_archive_map* map;
+	omron_archive_block b;
+	struct pd_row row;
+	int blocks;
+	int i, r, h;
+
+	map = omron_archive_map_open(path);
+	if (!map) {
+		fprintf(stderr, "Cannot read archive %s\n", path);
+		return -1;
+	}
+	blocks = omron_archive_map_blocks(map);
+	for (i = 0; i < blocks; ++i) {
+		omron_archive_map_block(map, i, &b);
+		if (b.table != (pedometer ? OMRON_ARCHIVE_PD : OMRON_ARCHIVE_BP)) continue;
+		if (e->archive) omron_archive_set_source(e->archive, b.source);
+		for (r = 0; r < b.rows; ++r) {
+			if (!pedometer) {
+				export_bp(e, b.timestamp[r], b.sys[r], b.dia[r], b.pulse[r]);
+				continue;
+			}
+			row.day = b.timestamp[r];
+			row.daily.total_steps = b.total_steps[r];
+			row.daily.total_aerobic_steps = b.total_aerobic_steps[r];
+			row.daily.total_aerobic_walking_time = b.total_aerobic_walking_time[r];
+			row.daily.total_calories = b.total_calories[r];
+			row.daily.total_distance = b.total_distance[r];
+			row.daily.total_fat_burn = b.total_fat_burn[r];
+			for (h = 0; h < 24; ++h) {
+				row.steps[h] = b.hourly_steps[r * 24 + h];
+				row.aerobic_steps[h] = b.hourly_aerobic_steps[r * 24 + h];
+			}
+			export_pd(e, &row);
+		}
+	}
+	omron_archive_map_close(map);
+	return 0;
+}
+
+static int export_device_bp(struct exporter* e, omron_device* dev, int bank)
+{
+	omron_bp_day_info records[BP_BATCH];
+	int status[BP_BATCH];
+	int count;
+	int first, last;
+	int ret;
+	int i;
+
+	count = omron_get_daily_data_count(dev, bank);
+	if (count < 0) {
+		fprintf(stderr, "Cannot get reading count: %s\n", omron_strerror(count));
+		return count;
+	}
+	// Index 0 is the newest reading, export oldest first
+	for (last = count - 1; last >= 0; last = first - 1) {
+		first = last - BP_BATCH + 1;
+		if (first < 0) first = 0;
+		ret = omron_get_daily_bp_range(dev, bank, first, last, records, status);
+		if (ret < 0) {
+			fprintf(stderr, "Cannot read readings %d-%d: %s\n", first, last, omron_strerror(ret));
+			return ret;
+		}
+		for (i = last - first; i >= 0; --i) {
+			const omron_bp_day_info* r = &records[i];
+
+			if (status[i] < 0) {
+				fprintf(stderr, "Skipping reading %d: %s\n", first + i, omron_strerror(status[i]));
+				continue;
+			}
+			export_bp(e, (((((int64_t)(2000 + r->year) * 100 + r->month) * 100 + r->day) * 100
+				       + r->hour) * 100 + r->minute) * 100 + r->second,
+				  r->sys, r->dia, r->pulse);
+		}
+		out_flush(e);
+	}
+	return 0;
+}
+
+/// Days since 1970-01-01 of a civil date
+static int64_t days_from_civil(int y, int m, int d)
+{
+	int64_t era;
+	int yoe, doy;
+
+	y -= m <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = y - era * 400;
+	doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+/// YYYYMMDD000000 of a day since 1970-01-01
+static int64_t civil_from_days(int64_t z)
+{
+	int64_t era, y;
+	int doe, yoe, doy, mp, d, m;
+
+	z += 719468;
+	era = (z >= 0 ? z : z - 146096) / 146097;
+	doe = (int)(z - era * 146097);
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	y = yoe + era * 400;
+	doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * doy + 2) / 153;
+	d = doy - (153 * mp + 2) / 5 + 1;
+	m = mp + (mp < 10 ? 3 : -9);
+	y += m <= 2;
+	return ((y * 100 + m) * 100 + d) * 1000000;
+}
+
+static int export_device_pd(struct exporter* e, omron_device* dev)
+{
+	omron_pd_count_info c;
+	omron_pd_history* history;
+	struct pd_row row;
+	time_t now = time(NULL);
+	struct tm* t = localtime(&now);
+	int64_t today = days_from_civil(t->tm_year + 1900, t->tm_mon + 1, t->tm_mday);
+	int count;
+	int first, last;
+	int ret = 0;
+	int i, j;
+
+	c = omron_get_pd_data_count(dev);
+	count = c.daily_count < c.hourly_count ? c.daily_count : c.hourly_count;
+	if (count < 1) return 0;
+	history = omron_pd_history_create(PD_BATCH);
+	if (!history) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+	// Day 0 is today, export oldest first
+	for (last = count - 1; last >= 0; last = first - 1) {
+		first = last - PD_BATCH + 1;
+		if (first < 0) first = 0;
+		ret = omron_get_pd_history(dev, first, last, history);
+		if (ret < 0) {
+			fprintf(stderr, "Cannot read days %d-%d: %s\n", first, last, omron_strerror(ret));
+			break;
+		}
+		for (i = last - first; i >= 0; --i) {
+			if (history->status[i] < 0) {
+				fprintf(stderr, "Skipping day %d: %s\n", first + i, omron_strerror(history->status[i]));
+				continue;
+			}
+			row.daily = history->daily[i];
+			row.day = civil_from_days(today - (first + i));
+			for (j = 0; j < 24; ++j) {
+				row.steps[j] = history->regular_steps[i * 24 + j];
+				row.aerobic_steps[j] = history->aerobic_steps[i * 24 + j];
+			}
+			export_pd(e, &row);
+		}
+		out_flush(e);
+	}
+	omron_pd_history_delete(history);
+	return ret < 0 ? ret : 0;
+}
+
+static int export_device(struct exporter* e, int sim, int pedometer, int bank)
+{
+	omron_device* dev = omron_create();
+	unsigned char serial[9];
+	char source[17];
+	int ret;
+	int i;
+
+	if (!dev) {
+		fprintf(stderr, "Cannot initialize USB core!\n");
+		return -1;
+	}
+	ret = sim ? omron_open_sim(dev, NULL) : omron_open(dev, OMRON_VID, OMRON_PID, 0);
+	if (ret < 0) {
+		fprintf(stderr, "Cannot open device: %s\n", omron_strerror(ret));
+		omron_delete(dev);
+		return ret;
+	}
+	if (e->archive) {
+		ret = omron_get_device_serial(dev, serial, sizeof(serial));
+		for (i = 0; i < ret; ++i) {
+			sprintf(source + i * 2, "%02x", serial[i]);
+		}
+		source[ret > 0 ? ret * 2 : 0] = 0;
+		omron_archive_set_source(e->archive, source);
+	}
+	ret = pedometer ? export_device_pd(e, dev) : export_device_bp(e, dev, bank);
+	omron_close(dev);
+	omron_delete(dev);
+	return ret;
+}
+
+static void usage(const char* prog)
+{
+	fprintf(stderr, "Usage: %s [-p] [-b bank] [-f csv|jsonl|binary] [-o out] [-i archive | -S]\n", prog);
+}
+
+int main(int argc, char** argv)
+{
+	static struct exporter e;
+	const char* out = NULL;
+	const char* in = NULL;
+	int pedometer = 0;
+	int bank = 0;
+	int sim = 0;
+	int ret;
+	int i;
+
+	// Plain argument parsing, so the exporter also builds without getopt
+	for (i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "-p")) {
+			pedometer = 1;
+		}
+		else if (!strcmp(argv[i], "-S")) {
+			sim = 1;
+		}
+		else if (!strcmp(argv[i], "-b") && i + 1 < argc) {
+			bank = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-f") && i + 1 < argc) {
+			++i;
+			if (!strcmp(argv[i], "csv")) e.format = FORMAT_CSV;
+			else if (!strcmp(argv[i], "jsonl")) e.format = FORMAT_JSONL;
+			else if (!strcmp(argv[i], "binary")) e.format = FORMAT_BINARY;
+			else {
+				usage(argv[0]);
+				return 1;
+			}
+		}
+		else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+			out = argv[++i];
+		}
+		else if (!strcmp(argv[i], "-i") && i + 1 < argc) {
+			in = argv[++i];
+		}
+		else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if ((e.format == FORMAT_BINARY && !out) || (in && sim)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (e.format == FORMAT_BINARY) {
+		e.archive = omron_archive_open(out);
+		if (!e.archive) {
+			fprintf(stderr, "Cannot open archive %s\n", out);
+			return 1;
+		}
+	} else if (out) {
+		e.file = fopen(out, "wb");
+		if (!e.file) {
+			fprintf(stderr, "Cannot open %s\n", out);
+			return 1;
+		}
+	} else {
+		e.file = stdout;
+	}
+
+	export_header(&e, pedometer);
+	ret = in ? export_archive(&e, in, pedometer) : export_device(&e, sim, pedometer, bank);
+
+	if (e.archive) {
+		if (omron_archive_close(e.archive) < 0) e.failed = 1;
+	} else {
+		out_flush(&e);
+		if (e.file != stdout && fclose(e.file)) e.failed = 1;
+	}
+	if (e.failed) fprintf(stderr, "Cannot write output\n");
+	fprintf(stderr, "Exported %ld %s\n", e.rows, pedometer ? "days" : "readings");
+	return ret < 0 || e.failed;
+}
@@ -0,0 +1,349 @@
+/*
+ * Waits for omron devices to be plugged in and syncs new readings from
+ * each one as CSV on stdout. Sync state is kept per device serial, so a
+ * device that is plugged in again only reports what it recorded since.
+ *
+ * With -a or -d, a sync runs on a copy of its state file in the staged
+ * subdirectory of the state directory. The copy replaces the state file
+ * once the new readings are stored, so readings that failed to store come
+ * again on the next sync.
+ *
+ * A pedometer sync delivers the day the last one ended on again. The
+ * database replaces that day, but rows can't be replaced in the archive,
+ * so it only gets a day once it is over (today goes in on a later sync).
+ *
+ * Usage: omron_sync_daemon [-s state_dir] [-b bank] [-p] [-a archive] [-d database]
+ *   -s  Directory for sync state files (default: current directory)
+ *   -b  Blood pressure memory bank to sync (default: 0)
+ *   -p  Sync pedometer data instead of blood pressure readings
+ *   -a  Also append the new readings to a columnar archive file
+ *   -d  Also store the new readings in a SQLite database, one transaction per sync
+ */
+
+#include "libomron/omron.h"
+#include <stdio.h>
+#include <stdlib.h>		/* atoi */
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>		/* getopt, sleep */
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/stat.h>		/* mkdir */
+
+static const char* state_dir = ".";
+static char staged_dir[OMRON_SYNC_PATH_MAX];
+static int bank = 0;
+static int pedometer = 0;
+static omron_archive* archive = NULL;
+static omron_db* db = NULL;
+static volatile sig_atomic_t quit = 0;
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Per-job state passed to the sync callbacks
+struct job_ctx {
+	char serial[17];
+	/// Readings (or pedometer days) synced so far, stored in one go at the end
+	omron_bp_day_info* readings;
+	int count;
+	int readings_size;
+	omron_pd_daily_data* daily;
+	omron_pd_hourly_data* hourly;
+	int days;
+	int days_size;
+	/// Day the pedometer sync took as today (day_serial 0), as YYYYMMDDhhmmss
+	int64_t today;
+};
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	quit = 1;
+}
+
+static int bp_record(void* user_data, int index, const omron_bp_day_info* r)
+{
+	struct job_ctx* ctx = user_data;
+
+	(void)index;
+	pthread_mutex_lock(&out_lock);
+	printf("%s,20%.2d-%.2d-%.2d %.2d:%.2d:%.2d,%d,%d,%d\n", ctx->serial,
+	       r->year, r->month, r->day, r->hour, r->minute, r->second,
+	       r->sys, r->dia, r->pulse);
+	fflush(stdout);
+	pthread_mutex_unlock(&out_lock);
+
+	if (archive || db) {
+		if (ctx->count == ctx->readings_size) {
+			int size = ctx->readings_size ? 2 * ctx->readings_size : 64;
+			omron_bp_day_info* readings = realloc(ctx->readings, size * sizeof(*readings));
+
+			if (!readings) return 1;
+			ctx->readings = readings;
+			ctx->readings_size = size;
+		}
+		ctx->readings[ctx->count++] = *r;
+	}
+	return 0;
+}
+
+static int pd_record(void* user_data, const omron_pd_daily_data* d, const omron_pd_hourly_data* h)
+{
+	struct job_ctx* ctx = user_data;
+	int i;
+
+	pthread_mutex_lock(&out_lock);
+	printf("%s,%d,%d,%d,%d", ctx->serial, d->day_serial, d->total_steps,
+	       d->total_aerobic_steps, d->total_calories);
+	for (i = 0; i < 24; ++i) {
+		printf(",%d", h[i].regular_steps);
+	}
+	printf("\n");
+	fflush(stdout);
+	pthread_mutex_unlock(&out_lock);
+
+	if (archive || db) {
+		if (ctx->days == ctx->days_size) {
+			int size = ctx->days_size ? 2 * ctx->days_size : 64;
+			omron_pd_daily_data* daily = realloc(ctx->daily, size * sizeof(*daily));
+			omron_pd_hourly_data* hourly = daily ? realloc(ctx->hourly, size * 24 * sizeof(*hourly)) : NULL;
+
+			if (daily) ctx->daily = daily;
+			if (!hourly) return 1;
+			ctx->hourly = hourly;
+			ctx->days_size = size;
+		}
+		ctx->daily[ctx->days] = *d;
+		memcpy(ctx->hourly + ctx->days * 24, h, 24 * sizeof(*h));
+		ctx->days++;
+	}
+	return 0;
+}
+
+/*
+ * Date days_back calendar days before today, both as YYYYMMDDhhmmss.
+ * mktime() moves the date on, so month ends and DST changes don't matter.
+ */
+static int64_t days_before(int64_t today, int days_back)
+{
+	int date = (int)(today / 1000000);
+	struct tm tm;
+
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year = date / 10000 - 1900;
+	tm.tm_mon = (date / 100) % 100 - 1;
+	tm.tm_mday = date % 100 - days_back;
+	tm.tm_hour = 12;
+	tm.tm_isdst = -1;
+	mktime(&tm);
+	return ((int64_t)(tm.tm_year + 1900) * 10000 + (tm.tm_mon + 1) * 100 + tm.tm_mday) * 1000000;
+}
+
+/*
+ * Store what a sync delivered in the archive (as blocks of their own for
+ * the device) and the database (as one transaction). Pedometer days are
+ * dated by their index back from the day the sync took as today. Returns
+ * < 0 if either could not take them, the database transaction is rolled
+ * back then.
+ */
+static int store_job(struct job_ctx* ctx)
+{
+	int status = 0;
+	int db_status = 0;
+	int i;
+
+	pthread_mutex_lock(&out_lock);
+	if (archive) status = omron_archive_set_source(archive, ctx->serial);
+	for (i = 0; i < ctx->count && status >= 0 && db_status >= 0; ++i) {
+		if (archive) status = omron_archive_add_bp(archive, &ctx->readings[i]);
+		if (db) db_status = omron_db_add_bp(db, &ctx->readings[i]);
+	}
+	for (i = 0; i < ctx->days && status >= 0 && db_status >= 0; ++i) {
+		int64_t day = days_before(ctx->today, ctx->daily[i].day_serial);
+
+		// Today is not over yet, and the next sync delivers it again
+		if (archive && ctx->daily[i].day_serial > 0) {
+			status = omron_archive_add_pd(archive, day, &ctx->daily[i], &ctx->hourly[i * 24]);
+		}
+		if (db) db_status = omron_db_add_pd(db, day, &ctx->daily[i], &ctx->hourly[i * 24]);
+	}
+	if (archive && status >= 0) status = omron_archive_flush(archive);
+	if (status < 0) {
+		fprintf(stderr, "Cannot store readings of %s in the archive\n", ctx->serial);
+	}
+	if (db) {
+		if (status >= 0 && db_status >= 0) db_status = omron_db_commit(db);
+		if (status < 0 || db_status < 0) omron_db_rollback(db);
+		if (db_status < 0) {
+			fprintf(stderr, "Cannot store readings of %s in the database\n", ctx->serial);
+			status = db_status;
+		}
+	}
+	pthread_mutex_unlock(&out_lock);
+	return status;
+}
+
+/*
+ * Copy a state file, or remove the copy if there is none. The copy is
+ * replaced in one go, so a crash leaves either the old or the new one.
+ */
+static int copy_state(const char* from, const char* to)
+{
+	omron_sync_state state;
+	int ret;
+
+	ret = omron_sync_load_state(from, &state);
+	if (ret < 0) return ret;
+	if (ret == 0) return remove(to) && errno != ENOENT ? OMRON_ERR_BADARG : 0;
+	return omron_sync_save_state(to, &state);
+}
+
+static int sync_job(omron_device* dev, void* user_data)
+{
+	struct job_ctx ctx;
+	unsigned char serial[9];
+	char name[32];
+	char state_path[OMRON_SYNC_PATH_MAX];
+	char staged_path[OMRON_SYNC_PATH_MAX];
+	const char* sync_dir = state_dir;
+	int ret;
+	int i;
+
+	(void)user_data;
+	memset(&ctx, 0, sizeof(ctx));
+	ret = omron_get_device_serial(dev, serial, sizeof(serial));
+	if (ret < 0) {
+		fprintf(stderr, "Cannot get device serial: %s\n", omron_strerror(ret));
+		return ret;
+	}
+	for (i = 0; i < ret; ++i) {
+		sprintf(ctx.serial + i * 2, "%02x", serial[i]);
+	}
+	ctx.serial[ret * 2] = 0;
+
+	// Named like the state files of omron_sync_daily_bp() and omron_sync_pd()
+	if (pedometer) {
+		sprintf(name, "%s.pd", ctx.serial);
+	} else {
+		sprintf(name, "%s.bp%d", ctx.serial, bank);
+	}
+	if (snprintf(state_path, sizeof(state_path), "%s/%s", state_dir, name) >= (int)sizeof(state_path) ||
+	    snprintf(staged_path, sizeof(staged_path), "%s/%s", staged_dir, name) >= (int)sizeof(staged_path)) {
+		fprintf(stderr, "State directory path too long\n");
+		return OMRON_ERR_BADARG;
+	}
+	if (archive || db) {
+		sync_dir = staged_dir;
+		ret = copy_state(state_path, staged_path);
+		if (ret < 0) {
+			fprintf(stderr, "Cannot stage sync state of %s\n", ctx.serial);
+			return ret;
+		}
+	}
+
+	if (pedometer) {
+		ret = omron_sync_pd(dev, sync_dir, pd_record, &ctx);
+	} else {
+		ret = omron_sync_daily_bp(dev, bank, sync_dir, bp_record, &ctx);
+	}
+	// The sync only moves on once everything it delivered is stored
+	if (ret >= 0 && (archive || db)) {
+		omron_sync_state synced;
+		int status = omron_sync_load_state(staged_path, &synced);
+
+		// A pedometer sync keeps the day it took as today as its mark
+		ctx.today = status == 1 ? synced.last_timestamp : 0;
+		if (pedometer && status != 1) {
+			fprintf(stderr, "Cannot read the sync state of %s\n", ctx.serial);
+			status = OMRON_ERR_BADARG;
+		}
+		if (status >= 0) status = store_job(&ctx);
+		if (status >= 0) status = copy_state(staged_path, state_path);
+		if (status < 0) ret = status;
+	}
+	free(ctx.readings);
+	free(ctx.daily);
+	free(ctx.hourly);
+	if (ret < 0) {
+		fprintf(stderr, "Sync of %s failed: %s\n", ctx.serial, omron_strerror(ret));
+	} else {
+		fprintf(stderr, "Synced %d new %s from %s\n", ret, pedometer ? "days" : "readings", ctx.serial);
+	}
+	return ret;
+}
+
+int main(int argc, char** argv)
+{
+	omron_fleet* fleet;
+	int ret;
+	int c;
+
+	while ((c = getopt(argc, argv, "s:b:pa:d:")) != -1) {
+		switch (c) {
+		case 's':
+			state_dir = optarg;
+			break;
+		case 'b':
+			bank = atoi(optarg);
+			break;
+		case 'p':
+			pedometer = 1;
+			break;
+		case 'a':
+			archive = omron_archive_open(optarg);
+			if (!archive) {
+				fprintf(stderr, "Cannot open archive %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'd':
+			db = omron_db_open(optarg, NULL);
+			if (!db) {
+				fprintf(stderr, "Cannot open database %s\n", optarg);
+				return 1;
+			}
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-s state_dir] [-b bank] [-p] [-a archive] [-d database]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (snprintf(staged_dir, sizeof(staged_dir), "%s/staged", state_dir) >= (int)sizeof(staged_dir)) {
+		fprintf(stderr, "State directory path too long\n");
+		return 1;
+	}
+	if ((archive || db) && mkdir(staged_dir, 0777) < 0 && errno != EEXIST) {
+		fprintf(stderr, "Cannot create %s\n", staged_dir);
+		return 1;
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	fleet = omron_fleet_create();
+	if (!fleet) {
+		fprintf(stderr, "Cannot initialize libusb\n");
+		return 1;
+	}
+
+	ret = omron_fleet_watch(fleet, OMRON_VID, OMRON_PID, sync_job, NULL);
+	if (ret < 0) {
+		fprintf(stderr, "Cannot watch for devices: %s\n", omron_strerror(ret));
+		omron_fleet_delete(fleet);
+		return 1;
+	}
+	fprintf(stderr, "Waiting for devices, press Ctrl-C to stop\n");
+
+	// The signal may land on any thread, so poll the flag rather than
+	// waiting in pause()
+	while (!quit) {
+		sleep(1);
+	}
+
+	fprintf(stderr, "Stopping, waiting for running syncs\n");
+	omron_fleet_delete(fleet);
+	omron_archive_close(archive);
+	omron_db_close(db);
+	return 0;
+}
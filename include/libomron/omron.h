@@ -27,6 +27,15 @@
 #define OMRON_ERR_NEGRESP (-5)
 #define OMRON_ERR_ENDRESP (-6)
 #define OMRON_ERR_BADDATA (-7)
+#define OMRON_ERR_UNSUPPORTED (-8)
+#define OMRON_ERR_TIMEOUT (-9)
+#define OMRON_ERR_ABORTED (-10)
+#define OMRON_ERR_BUSY    (-11)
+
+/// Default number of commands kept in flight by bulk downloads
+#define OMRON_DEFAULT_PIPELINE_DEPTH 4
+/// Largest pipeline depth accepted by omron_set_pipeline_depth()
+#define OMRON_MAX_PIPELINE_DEPTH 16
 
 #define OMRON_DEBUG_ERROR   1
 #define OMRON_DEBUG_WARNING 2
@@ -61,9 +70,15 @@ typedef struct {
 #else
 #define OMRON_DECLSPEC
 #include "libusb-1.0/libusb.h"
+struct omron_libusb_async;
+struct omron_libusb_enum;
 typedef struct {
 	struct libusb_context* _context;
 	struct libusb_device_handle* _device;
+	/// Asynchronous transfer state (pre-posted input reports, in-flight output reports)
+	struct omron_libusb_async* _async;
+	/// Last enumeration snapshot, reused by omron_open() and omron_open_path()
+	struct omron_libusb_enum* _enum;
 	int _is_open;
 } omron_device_impl;
 #endif
@@ -108,6 +123,63 @@ typedef enum
 	PEDOMETER_MODE		= 0x0102
 } omron_mode;
 
+/**
+ * Per-device scratch buffers
+ *
+ * One allocation, made when the device is opened, carved into the buffers
+ * the command layer needs so that talking to the device does not touch
+ * the heap (or build variable length arrays on the stack).
+ */
+typedef struct
+{
+	/// Backing allocation
+	uint8_t* base;
+	/// Size of base (in bytes), kept across reopens
+	int size;
+	/// Outgoing report being built (output_size bytes)
+	uint8_t* output_report;
+	/// Incoming report being parsed (input_size bytes)
+	uint8_t* input_report;
+	/// Reassembled command response (OMRON_MAX_RESPONSE_SIZE bytes)
+	uint8_t* response;
+	/// Scratch for the platform backend (max(input_size, output_size) + 1 bytes)
+	uint8_t* platform;
+} omron_arena;
+
+/// Largest response any command returns, including "OK" and checksum
+#define OMRON_MAX_RESPONSE_SIZE 64
+
+/**
+ * How a device recovers from garbled or late responses, see
+ * omron_set_retry_policy()
+ *
+ * A command whose response is garbled or does not come in time is first
+ * resent after a flush (retries times), then after setting the mode again
+ * and clearing (resyncs times). Response timeouts follow the measured
+ * round trip time of the device, doubling with each further attempt.
+ */
+typedef struct
+{
+	/// Resends after a flush
+	int retries;
+	/// Resends after a mode set and clear, once the retries are used up
+	int resyncs;
+	/// Attempts at the clear handshake
+	int clear_attempts;
+	/// Shortest response timeout [ms]
+	int min_timeout_ms;
+	/// Longest response timeout [ms], also used until a round trip has been measured
+	int max_timeout_ms;
+	/// Response timeout is the smoothed round trip time plus this many mean deviations
+	int rtt_deviations;
+	/// Pause before the first resend [ms], doubling for each one after
+	int backoff_ms;
+	/// Longest pause before a resend [ms]
+	int max_backoff_ms;
+	/// Resends allowed per operation, a public call or an omron_lock() hold (commands and clears together), -1 for no limit
+	int retry_budget;
+} omron_retry_policy;
+
 /**
  * Structure for device state
  *
@@ -123,8 +195,63 @@ typedef struct
 	int output_size;
 	/// Mode the device is currently in
 	omron_mode device_mode;
+	/// Maximum number of commands kept in flight by the bulk download functions
+	int pipeline_depth;
+	/// Commands sent whose response has not been read yet
+	int pending_responses;
+	/// 1 if the input stream may hold stray data (after errors or at open), 0 if known empty
+	int input_dirty;
+	/// Scratch buffers, sized when the device is opened
+	omron_arena arena;
+	/// Backend the device was opened on (USB or simulator), NULL when closed
+	const struct omron_transport* transport;
+	/// Backend private state
+	void* transport_data;
+	/// Event log ring, NULL when off (see omron_set_event_log())
+	struct omron_event_log* events;
+	/// Counters and latency histograms, allocated on first use (see omron_get_stats())
+	struct omron_stats_state* stats;
+	/// Recovery policy (see omron_set_retry_policy())
+	omron_retry_policy retry_policy;
+	/// Smoothed command round trip time [us], 0 until measured
+	int32_t rtt_us;
+	/// Mean deviation of the round trip time [us]
+	int32_t rtt_var_us;
+	/// Resends left of retry_policy.retry_budget in the current operation
+	int retries_left;
+	/// 1 while a non-blocking command is running (see omron_cmd_start())
+	int cmd_active;
+	/// Recursive lock serializing threads on the device (see omron_lock())
+	struct omron_lock* lock;
 } omron_device;
 
+/// Longest port path string, "bus-p.p.p.p.p.p.p" (USB allows 7 tiers of ports)
+#define OMRON_PORT_PATH_MAX 32
+
+/**
+ * One matching device from an enumeration snapshot
+ *
+ * Filled by omron_enumerate(). Descriptor fields are cached at
+ * enumeration time, so looking at them does not touch the bus.
+ */
+typedef struct
+{
+	/// USB bus number
+	uint8_t bus_number;
+	/// Device address on the bus (changes when the device is re-plugged)
+	uint8_t address;
+	/// Physical location, "<bus>-<port>[.<port>...]" as in sysfs (stable across re-plugs)
+	char port_path[OMRON_PORT_PATH_MAX];
+	/// Vendor ID from the device descriptor
+	uint16_t vid;
+	/// Product ID from the device descriptor
+	uint16_t pid;
+	/// Device release number (BCD) from the device descriptor
+	uint16_t bcd_device;
+	/// Backend handle for the device, do not touch
+	void* _handle;
+} omron_device_entry;
+
 /*******************************************************************************
  *
  * Blood pressure monitor specific structures
@@ -243,6 +370,9 @@ typedef struct
 	int32_t day_serial;
 } omron_pd_daily_data;
 
+/// Size of a raw daily pedometer record (MES response, including "OK")
+#define OMRON_PD_DAILY_RECORD_SIZE 20
+
 /**
  * Structure for hourly data packets from pedometer
  *
@@ -264,6 +394,551 @@ typedef struct
 	int32_t aerobic_steps;
 } omron_pd_hourly_data;
 
+/**
+ * Daily and hourly pedometer data of a range of days, hours stored
+ * column by column
+ *
+ * Allocated by omron_pd_history_create() and filled by
+ * omron_get_pd_history(). Entry i of every array belongs to day
+ * first_day + i, hour h of it is at [i * 24 + h] of the hourly columns.
+ */
+typedef struct
+{
+	/// Number of days there is room for
+	int32_t max_days;
+	/// Day index of the first entry (0 = today)
+	int32_t first_day;
+	/// Number of days held
+	int32_t days;
+	/// Per day result (0 or < 0 error code), days entries
+	int32_t* status;
+	/// Daily totals, days entries
+	omron_pd_daily_data* daily;
+	/// Regular steps per hour, days * 24 entries
+	int32_t* regular_steps;
+	/// Aerobic steps per hour, days * 24 entries
+	int32_t* aerobic_steps;
+	/// Attached flag per hour (see omron_pd_hourly_data), days * 24 entries
+	uint8_t* is_attached;
+	/// Event flag per hour, days * 24 entries
+	uint8_t* event;
+} omron_pd_history;
+
+
+/*******************************************************************************
+ *
+ * Request planner structures
+ *
+ ******************************************************************************/
+
+/**
+ * Enumeration of the queries that can be batched with omron_execute_requests()
+ */
+typedef enum
+{
+	/// omron_get_device_version(), result in str
+	OMRON_REQ_DEVICE_VERSION,
+	/// omron_get_device_serial(), result in str
+	OMRON_REQ_DEVICE_SERIAL,
+	/// omron_get_bp_profile(), result in str
+	OMRON_REQ_BP_PROFILE,
+	/// omron_get_daily_data_count(), result in count
+	OMRON_REQ_DAILY_DATA_COUNT,
+	/// omron_get_daily_bp_data(), result in bp_day
+	OMRON_REQ_DAILY_BP_DATA,
+	/// omron_get_weekly_bp_data(), result in bp_week
+	OMRON_REQ_WEEKLY_BP_DATA,
+	/// omron_get_pd_profile(), result in pd_profile
+	OMRON_REQ_PD_PROFILE,
+	/// omron_get_pd_data_count(), result in pd_count
+	OMRON_REQ_PD_DATA_COUNT,
+	/// omron_get_pd_daily_data(), result in pd_daily
+	OMRON_REQ_PD_DAILY_DATA,
+	/// omron_get_pd_hourly_data(), result in pd_hourly
+	OMRON_REQ_PD_HOURLY_DATA
+} omron_request_type;
+
+/**
+ * A single queued query for omron_execute_requests()
+ *
+ * Fill in type and the arguments the query needs; status and result are
+ * filled in when the request runs.
+ */
+typedef struct
+{
+	/// Query to run
+	omron_request_type type;
+	/// Memory bank, for blood pressure queries
+	int bank;
+	/// Record, week or day index
+	int index;
+	/// For OMRON_REQ_WEEKLY_BP_DATA: 0 for morning, 1 for evening average
+	int evening;
+	/// 0 (or bytes read for string results) on success, or < 0 on error
+	int status;
+	/// Query result, member depends on type
+	union
+	{
+		uint8_t str[16];
+		int count;
+		omron_bp_day_info bp_day;
+		omron_bp_week_info bp_week;
+		omron_pd_profile_info pd_profile;
+		omron_pd_count_info pd_count;
+		omron_pd_daily_data pd_daily;
+		omron_pd_hourly_data pd_hourly[24];
+	} result;
+} omron_request;
+
+/*******************************************************************************
+ *
+ * Non-blocking command structures
+ *
+ ******************************************************************************/
+
+/// Longest command an omron_async_cmd holds
+#define OMRON_MAX_COMMAND_SIZE 16
+
+/**
+ * A descriptor an event loop has to watch for a device, see
+ * omron_get_pollfds()
+ */
+typedef struct
+{
+	int fd;
+	/// POLLIN/POLLOUT bits to wait for
+	short events;
+} omron_pollfd;
+
+/**
+ * A command run by an event loop instead of a blocking call, see
+ * omron_cmd_start()
+ *
+ * Fill in the fields up to response_len (omron_cmd_init() does); status
+ * and response are filled in once the command is done. The fields after
+ * them belong to the state machine.
+ */
+typedef struct
+{
+	/// Mode the command is sent in
+	omron_mode mode;
+	/// Command bytes, as sent
+	uint8_t command[OMRON_MAX_COMMAND_SIZE];
+	/// Number of valid bytes in command
+	int command_len;
+	/// Size of the expected response, including "OK" and checksum
+	int response_len;
+	/// Bytes of response on success, or < 0 on error
+	int status;
+	/// The response, including "OK" and checksum
+	uint8_t response[OMRON_MAX_RESPONSE_SIZE];
+
+	int state;
+	int next_state;
+	int clearing;
+	int attempt;
+	int clear_attempt;
+	int received;
+	int flushed;
+	int64_t deadline_us;
+	int64_t clear_start_us;
+} omron_async_cmd;
+
+/*******************************************************************************
+ *
+ * Incremental sync structures
+ *
+ ******************************************************************************/
+
+/// Longest state file path built by the sync functions
+#define OMRON_SYNC_PATH_MAX 1024
+
+/**
+ * High-water mark kept on disk for each device serial
+ *
+ * Records the newest reading already handed to the application, so the
+ * next sync only downloads what was taken since.
+ */
+typedef struct
+{
+	/// Device serial number, hex encoded SRL response
+	char serial[17];
+	/// Newest record already ingested, as YYYYMMDDhhmmss (device local time)
+	int64_t last_timestamp;
+	/// Number of records on the device at the last sync
+	int32_t record_count;
+} omron_sync_state;
+
+/**
+ * Callback for blood pressure records found by omron_sync_daily_bp()
+ *
+ * Records are delivered oldest first. Return 0 to continue, anything else
+ * aborts the sync (with OMRON_ERR_ABORTED) without updating the high-water
+ * mark.
+ */
+typedef int (*omron_bp_sync_cb)(void* user_data, int index, const omron_bp_day_info* record);
+
+/**
+ * Callback for pedometer days found by omron_sync_pd()
+ *
+ * Days are delivered oldest first, with the 24 hourly records for the
+ * day. The first day is the last one of the previous sync, again.
+ * Return 0 to continue, anything else aborts the sync (with
+ * OMRON_ERR_ABORTED) without updating the high-water mark.
+ */
+typedef int (*omron_pd_sync_cb)(void* user_data, const omron_pd_daily_data* daily, const omron_pd_hourly_data* hourly);
+
+/*******************************************************************************
+ *
+ * Simulated device structures
+ *
+ ******************************************************************************/
+
+/**
+ * Behaviour of a simulated device (see omron_open_sim())
+ *
+ * The simulated unit answers the same commands as a real 790IT/720IT
+ * combination, from records generated out of seed, with report timings
+ * and faults as configured here.
+ */
+typedef struct
+{
+	/// Time each report takes on the wire [us] (real units poll every 10ms)
+	int32_t latency_us;
+	/// Random extra time added to each report, 0..jitter_us [us]
+	int32_t jitter_us;
+	/// Time the unit takes to start answering a command [us] (real units take 60-190ms, the default 0 answers at once)
+	int32_t turnaround_us;
+	/// Probability (0..1) that an input report arrives with a flipped bit
+	double corrupt_rate;
+	/// Probability (0..1) that a GME request is answered "NO", as real units sometimes do
+	double negative_rate;
+	/// Seed for the generated records and the random faults
+	uint32_t seed;
+	/// Number of blood pressure records in banks A and B (0..255)
+	int32_t bp_count[2];
+	/// Number of days of pedometer data (0..255)
+	int32_t pd_days;
+	/// Newest blood pressure readings of each bank taken after the clock was set back a week
+	int32_t bp_clock_back;
+} omron_sim_config;
+
+/*******************************************************************************
+ *
+ * Session trace structures
+ *
+ ******************************************************************************/
+
+/// Start of a traced session, payload is input_size, output_size
+#define OMRON_TRACE_OPEN  1
+/// omron_set_mode() call, payload is the mode (big endian)
+#define OMRON_TRACE_MODE  2
+/// omron_write_data() call, payload is the report
+#define OMRON_TRACE_WRITE 3
+/// omron_read_data() call or a poll that got a report, payload is the report read (if any)
+#define OMRON_TRACE_READ  4
+/// Input drain, status is the number of bytes discarded
+#define OMRON_TRACE_DRAIN 5
+/// omron_close() call
+#define OMRON_TRACE_CLOSE 6
+
+/// Largest payload of a trace record
+#define OMRON_TRACE_MAX_PAYLOAD 64
+
+/// Replay with the recorded timing (default is as fast as possible)
+#define OMRON_REPLAY_REALTIME 0x01
+
+/**
+ * One transport call in a session trace
+ *
+ * Trace files are a "OMTRACE1" header followed by records of an 8 byte
+ * little endian header (type, size, status, delta_us) and size bytes of
+ * payload, so they can be written as a stream and appended to.
+ */
+typedef struct
+{
+	/// OMRON_TRACE_* record type
+	uint8_t type;
+	/// Payload size (in bytes)
+	uint8_t size;
+	/// Return value of the traced call
+	int16_t status;
+	/// Time since the previous record [us]
+	uint32_t delta_us;
+	/// Payload
+	uint8_t data[OMRON_TRACE_MAX_PAYLOAD];
+} omron_trace_record;
+
+/**
+ * Opaque trace file handle
+ */
+typedef struct omron_trace omron_trace;
+
+/*******************************************************************************
+ *
+ * Archive structures
+ *
+ ******************************************************************************/
+
+/// Blood pressure readings table of an archive
+#define OMRON_ARCHIVE_BP 1
+/// Pedometer days table of an archive
+#define OMRON_ARCHIVE_PD 2
+
+/// Most rows an archive writer collects before it writes a block
+#define OMRON_ARCHIVE_BLOCK_ROWS 4096
+/// Size of the source tag of archive blocks, including the terminating 0
+#define OMRON_ARCHIVE_SOURCE_LEN 32
+
+/**
+ * Opaque handle of an archive opened for appending
+ */
+typedef struct omron_archive omron_archive;
+
+/**
+ * Opaque handle of an archive mapped for reading
+ */
+typedef struct omron_archive_map omron_archive_map;
+
+/**
+ * One block of an archive, as handed out by omron_archive_map_block()
+ *
+ * Archives are a "OMARCH1" header followed by blocks, each holding up to
+ * OMRON_ARCHIVE_BLOCK_ROWS rows of one table from one source, stored column
+ * by column. The column pointers point straight into the mapped file, so a
+ * scan only touches the columns it reads. Columns of the other table are
+ * NULL. Timestamps are YYYYMMDDhhmmss in device local time, as in
+ * omron_sync_state.
+ */
+typedef struct
+{
+	/// OMRON_ARCHIVE_* table the rows belong to
+	int table;
+	/// Number of rows
+	int rows;
+	/// Source tag given to omron_archive_set_source() (e.g. the device serial)
+	const char* source;
+	/// Range of the timestamps in the block
+	int64_t min_timestamp;
+	int64_t max_timestamp;
+
+	/// Time of the reading, or day (hhmmss 0) of the pedometer data
+	const int64_t* timestamp;
+
+	/// OMRON_ARCHIVE_BP columns
+	const uint16_t* sys;
+	const uint16_t* dia;
+	const uint16_t* pulse;
+
+	/// OMRON_ARCHIVE_PD columns
+	const int32_t* total_steps;
+	const int32_t* total_aerobic_steps;
+	const int32_t* total_aerobic_walking_time;
+	const int32_t* total_calories;
+	const float* total_distance;
+	const float* total_fat_burn;
+	/// 24 values per row, row r at [r * 24]
+	const uint16_t* hourly_steps;
+	const uint16_t* hourly_aerobic_steps;
+} omron_archive_block;
+
+/*******************************************************************************
+ *
+ * Database structures
+ *
+ ******************************************************************************/
+
+/// Longest base table name accepted by omron_db_open()
+#define OMRON_DB_TABLE_MAX 48
+
+/**
+ * Opaque handle of a SQLite database readings are written to
+ */
+typedef struct omron_db omron_db;
+
+/*******************************************************************************
+ *
+ * Event log structures
+ *
+ ******************************************************************************/
+
+/// Mode change, data is the new mode (big endian)
+#define OMRON_EVENT_MODE     1
+/// Output report written, data is the report
+#define OMRON_EVENT_WRITE    2
+/// Input report read, data is the report
+#define OMRON_EVENT_READ     3
+/// Input drained, status is the number of bytes discarded
+#define OMRON_EVENT_DRAIN    4
+/// Command sent, data is the command
+#define OMRON_EVENT_COMMAND  5
+/// Response reassembled, data is the response
+#define OMRON_EVENT_RESPONSE 6
+
+/// Most data bytes kept per event, enough for any report or response
+#define OMRON_EVENT_MAX_DATA 64
+
+/**
+ * One entry of a device's event log (see omron_set_event_log())
+ */
+typedef struct
+{
+	/// Position in the device's event stream
+	uint32_t sequence;
+	/// OMRON_EVENT_* type
+	uint16_t id;
+	/// Mode the device was in
+	uint16_t mode;
+	/// Monotonic time [us]
+	int64_t time_us;
+	/// Bytes transferred, or < 0 error code
+	int32_t status;
+	/// Valid bytes in data
+	uint16_t size;
+	/// Raw bytes, truncated to OMRON_EVENT_MAX_DATA
+	uint8_t data[OMRON_EVENT_MAX_DATA];
+} omron_event;
+
+struct omron_event_log;
+
+/*******************************************************************************
+ *
+ * Statistics structures
+ *
+ ******************************************************************************/
+
+/// Histogram buckets: 4 per power of two from 1us up to 2^29us (about 9 minutes)
+#define OMRON_HISTOGRAM_BUCKETS 112
+
+/**
+ * Latency histogram with logarithmic buckets (within 25% of the true
+ * value), see omron_histogram_percentile()
+ */
+typedef struct
+{
+	/// Number of samples
+	uint32_t count;
+	/// Smallest sample [us]
+	uint32_t min_us;
+	/// Largest sample [us]
+	uint32_t max_us;
+	/// Sum of all samples [us]
+	uint64_t total_us;
+	/// Samples per bucket
+	uint32_t buckets[OMRON_HISTOGRAM_BUCKETS];
+} omron_histogram;
+
+/// Entries in omron_stats::commands, the last one ("*") lumps together any commands beyond
+#define OMRON_STATS_MAX_COMMANDS 16
+
+/**
+ * Outcomes and round trip times (command sent to response read) of one
+ * command mnemonic
+ */
+typedef struct
+{
+	/// Mnemonic, e.g. "VER" or "GME"
+	char command[4];
+	/// "OK" responses
+	uint32_t ok;
+	/// "NO" responses
+	uint32_t negative;
+	/// "END" responses
+	uint32_t end;
+	/// Garbled responses
+	uint32_t bad_data;
+	/// Transfer errors
+	uint32_t errors;
+	/// Round trip times of all responses
+	omron_histogram latency;
+} omron_command_stats;
+
+/**
+ * Snapshot of the counters of a device, see omron_get_stats()
+ */
+typedef struct
+{
+	/// Durations of omron_set_mode()
+	omron_histogram set_mode;
+	/// Failed omron_set_mode() calls
+	uint32_t set_mode_errors;
+	/// Durations of clear/resync handshakes
+	omron_histogram clear;
+	/// Clear handshakes that failed after all retries
+	uint32_t clear_errors;
+	/// Flushes that drained the input
+	uint32_t flushes;
+	/// Flushes skipped because the input was known to be empty
+	uint32_t flushes_skipped;
+	/// Stray bytes discarded by flushes
+	uint64_t flushed_bytes;
+	/// Garbled responses to any command, clears included
+	uint32_t bad_data;
+	/// Commands resent after a flush because of a garbled response
+	uint32_t retries;
+	/// Commands resent after a full mode set and clear
+	uint32_t resyncs;
+	/// Commands given up on after the resync too
+	uint32_t failed_exchanges;
+	/// Resends not made because the retry budget was used up
+	uint32_t retries_denied;
+	/// Pipelined downloads that fell back to one command at a time
+	uint32_t pipeline_breaks;
+	/// Number of valid entries in commands
+	int num_commands;
+	/// Per command counters, in order of first use
+	omron_command_stats commands[OMRON_STATS_MAX_COMMANDS];
+} omron_stats;
+
+struct omron_stats_state;
+
+/*******************************************************************************
+ *
+ * Fleet structures (libusb only)
+ *
+ ******************************************************************************/
+
+#if !defined(WIN32)
+/**
+ * Opaque set of devices sharing one libusb context and event thread
+ */
+typedef struct omron_fleet omron_fleet;
+
+/**
+ * Work function run once per fleet device, each on its own thread
+ *
+ * @return 0 or a positive count on success, < 0 on error
+ */
+typedef int (*omron_fleet_job)(omron_device* dev, int device_index, void* user_data);
+
+/**
+ * Callback for blood pressure records streamed from a fleet
+ *
+ * Calls are serialized across all devices. Return 0 to continue, anything
+ * else aborts the sync of that device.
+ */
+typedef int (*omron_fleet_bp_cb)(void* user_data, int device_index, const omron_bp_day_info* record);
+
+/**
+ * Callback for pedometer days streamed from a fleet
+ *
+ * Calls are serialized across all devices. Return 0 to continue, anything
+ * else aborts the sync of that device.
+ */
+typedef int (*omron_fleet_pd_cb)(void* user_data, int device_index, const omron_pd_daily_data* daily, const omron_pd_hourly_data* hourly);
+
+/**
+ * Work function run on its own thread for each device plugged in while a
+ * fleet is watching (see omron_fleet_watch())
+ *
+ * The device is already open and is closed when the function returns. If
+ * the device is unplugged, pending calls fail and the function should
+ * return.
+ *
+ * @return 0 or a positive count on success, < 0 on error
+ */
+typedef int (*omron_hotplug_job)(omron_device* dev, void* user_data);
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -289,6 +964,47 @@ extern "C" {
 	 */
 	OMRON_DECLSPEC void omron_delete(omron_device* dev);
 
+	////////////////////////////////////////////////////////////////////////////////////
+	//
+	// Thread Safety
+	//
+	////////////////////////////////////////////////////////////////////////////////////
+
+	/*
+	 * Threading model: different devices can be used from different
+	 * threads freely. A device can be shared between threads too, every
+	 * command exchange holds the device lock while it runs, so commands
+	 * of different threads never interleave on the wire (a bulk download
+	 * like omron_get_daily_bp_range() runs as a whole). Only opening a
+	 * device (omron_open() and its variants) and omron_delete() must not
+	 * race with anything else on it, and the event log has a single
+	 * reader (see omron_read_events()).
+	 *
+	 * To run several calls as one session (e.g. read a record count and
+	 * then the records, without another thread changing the mode in
+	 * between) take the lock with omron_lock() around them. The lock is
+	 * recursive, so the calls inside take it again without deadlocking.
+	 * Calls run that way also share one retry budget (see
+	 * omron_retry_policy), which is otherwise refilled for each call.
+	 *
+	 * omron_set_debug_level() may be called from any thread at any time.
+	 */
+
+	/**
+	 * Take a device for exclusive use by the calling thread, waiting for
+	 * other threads to finish with it. Must be paired with omron_unlock().
+	 *
+	 * @param dev Device pointer
+	 */
+	OMRON_DECLSPEC void omron_lock(omron_device* dev);
+
+	/**
+	 * Give up a device taken with omron_lock()
+	 *
+	 * @param dev Device pointer
+	 */
+	OMRON_DECLSPEC void omron_unlock(omron_device* dev);
+
 	/**
 	 * Returns the number of devices connected, though does not specify device type
 	 *
@@ -312,6 +1028,51 @@ extern "C" {
 	 */
 	OMRON_DECLSPEC int omron_open(omron_device* dev, int VID, int PID, uint32_t device_index);
 
+	/**
+	 * Take a snapshot of all connected devices matching VID/PID
+	 *
+	 * The bus is enumerated once and the result cached in dev, so a
+	 * following omron_open(), omron_open_handle() or omron_open_path()
+	 * does not enumerate again. omron_get_count() refreshes the snapshot
+	 * as well.
+	 *
+	 * @param dev Device pointer
+	 * @param VID Vendor ID, defaults to 0x0590
+	 * @param PID Product ID, defaults to 0x0028
+	 * @param entries Set to the snapshot array (owned by dev, valid until the next enumeration or omron_delete()), may be NULL
+	 *
+	 * @return Number of matching devices, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_enumerate(omron_device* dev, int VID, int PID, const omron_device_entry** entries);
+
+	/**
+	 * Open a device from an enumeration snapshot, without enumerating
+	 * again
+	 *
+	 * @param dev Device pointer
+	 * @param entry Entry returned by omron_enumerate()
+	 *
+	 * @return 0 on success, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_open_handle(omron_device* dev, const omron_device_entry* entry);
+
+	/**
+	 * Open the device plugged into a given port, e.g. "1-4.2"
+	 *
+	 * Unlike the ordinal index taken by omron_open(), a port path names
+	 * the same device no matter what else is plugged in, so several
+	 * processes or threads can open distinct devices safely. The cached
+	 * snapshot is used if there is one.
+	 *
+	 * @param dev Device pointer
+	 * @param VID Vendor ID, defaults to 0x0590
+	 * @param PID Product ID, defaults to 0x0028
+	 * @param port_path Port path as in omron_device_entry::port_path
+	 *
+	 * @return 0 on success, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_open_path(omron_device* dev, int VID, int PID, const char* port_path);
+
 	/**
 	 * Closes an open omron device
 	 *
@@ -357,21 +1118,161 @@ extern "C" {
 
 	////////////////////////////////////////////////////////////////////////////////////
 	//
-	// Device Information Retrieval Functions
+	// Simulated Device
 	//
 	////////////////////////////////////////////////////////////////////////////////////
 
 	/**
-	 * Retrieves the serial number of the device.
-	 * Returns the result as a zero-terminated string.
+	 * Fill a simulator configuration with defaults: real unit timings
+	 * (10ms per report, no jitter), no faults, full memory banks.
 	 *
-	 * @param dev Device to get serial number from
-	 * @param data buffer to read serial number into (must be >= 8 bytes)
-	 * @param data_size Size of data buffer (in bytes)
+	 * Any of the LIBOMRON_SIM_LATENCY_US, LIBOMRON_SIM_JITTER_US,
+	 * LIBOMRON_SIM_TURNAROUND_US, LIBOMRON_SIM_CORRUPT,
+	 * LIBOMRON_SIM_NEGATIVE and LIBOMRON_SIM_SEED environment variables
+	 * override the matching default.
 	 *
-	 * @return Number of bytes read, or < 0 on error
+	 * @param config Structure to fill
 	 */
-	OMRON_DECLSPEC int omron_get_device_serial(omron_device* dev, uint8_t* data, int data_size);
+	OMRON_DECLSPEC void omron_sim_default_config(omron_sim_config* config);
+
+	/**
+	 * Open a simulated device instead of real hardware. All other
+	 * functions work on it as on a real device.
+	 *
+	 * Setting the LIBOMRON_BACKEND environment variable to "sim" makes
+	 * omron_get_count() report one device and omron_open() open the
+	 * simulator with the default configuration, so existing programs can
+	 * run without hardware.
+	 *
+	 * @param dev Device pointer
+	 * @param config Simulator configuration, NULL for omron_sim_default_config()
+	 *
+	 * @return 0 on success, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_open_sim(omron_device* dev, const omron_sim_config* config);
+
+	////////////////////////////////////////////////////////////////////////////////////
+	//
+	// Session Recording and Replay
+	//
+	////////////////////////////////////////////////////////////////////////////////////
+
+	/**
+	 * Record every mode change, report and drain on an open device to a
+	 * trace file, until the device is closed. Records are appended through
+	 * a buffered stream, so recording does not hold up the transfer.
+	 *
+	 * Setting the LIBOMRON_TRACE environment variable to a file name
+	 * records every device opened with omron_open().
+	 *
+	 * @param dev Open device
+	 * @param path Trace file, created or appended to
+	 *
+	 * @return 0 on success, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_trace_start(omron_device* dev, const char* path);
+
+	/**
+	 * Open a device that replays a recorded session instead of talking to
+	 * hardware. The library must make the same calls it made while
+	 * recording (same functions, same pipeline depth); if it does not,
+	 * the call that diverged fails with OMRON_ERR_DEVIO.
+	 *
+	 * @param dev Device pointer
+	 * @param path Trace file
+	 * @param session Index of the session to replay (0 for the first), for files with several appended
+	 * @param flags 0 to replay as fast as possible, or OMRON_REPLAY_REALTIME
+	 *
+	 * @return 0 on success, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_open_replay(omron_device* dev, const char* path, int session, int flags);
+
+	/**
+	 * Open a trace file for reading, or for appending records
+	 *
+	 * @param path Trace file
+	 * @param append 0 to read, 1 to create or append
+	 *
+	 * @return Trace handle, or NULL on error
+	 */
+	OMRON_DECLSPEC omron_trace* omron_trace_open(const char* path, int append);
+
+	/**
+	 * Read the next record of a trace
+	 *
+	 * @return 1 if a record was read, 0 at end of file, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_trace_read(omron_trace* trace, omron_trace_record* record);
+
+	/**
+	 * Append a record to a trace
+	 *
+	 * @return 0 on success, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_trace_write(omron_trace* trace, const omron_trace_record* record);
+
+	/**
+	 * Flush and close a trace file
+	 *
+	 * @return 0 on success, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_trace_close(omron_trace* trace);
+
+	////////////////////////////////////////////////////////////////////////////////////
+	//
+	// Transfer Settings
+	//
+	////////////////////////////////////////////////////////////////////////////////////
+
+	/**
+	 * Set how many commands the bulk download functions (e.g.
+	 * omron_get_daily_bp_range()) may send before reading the first
+	 * response back. A depth of 1 is plain stop-and-wait.
+	 *
+	 * @param dev Device pointer
+	 * @param depth Number of commands in flight (1..OMRON_MAX_PIPELINE_DEPTH)
+	 *
+	 * @return 0 on success, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_set_pipeline_depth(omron_device* dev, int depth);
+
+	/**
+	 * Fill in the default retry policy: one resend after a flush, one
+	 * after a resync, four clear attempts, 100..1000ms timeouts, 10..200ms
+	 * backoff and 32 resends per operation.
+	 *
+	 * @param policy Structure to fill
+	 */
+	OMRON_DECLSPEC void omron_default_retry_policy(omron_retry_policy* policy);
+
+	/**
+	 * Set how a device recovers from garbled or late responses. Takes
+	 * effect at once, the retry budget is refilled.
+	 *
+	 * @param dev Device pointer
+	 * @param policy Policy, NULL for the default (see omron_default_retry_policy())
+	 *
+	 * @return 0 on success, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_set_retry_policy(omron_device* dev, const omron_retry_policy* policy);
+
+	////////////////////////////////////////////////////////////////////////////////////
+	//
+	// Device Information Retrieval Functions
+	//
+	////////////////////////////////////////////////////////////////////////////////////
+
+	/**
+	 * Retrieves the serial number of the device.
+	 * Returns the result as a zero-terminated string.
+	 *
+	 * @param dev Device to get serial number from
+	 * @param data buffer to read serial number into (must be >= 8 bytes)
+	 * @param data_size Size of data buffer (in bytes)
+	 *
+	 * @return Number of bytes read, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_get_device_serial(omron_device* dev, uint8_t* data, int data_size);
 
 	/**
 	 * Retrieves the model and version of the device.
@@ -422,6 +1323,28 @@ extern "C" {
 	 */
 	OMRON_DECLSPEC omron_bp_day_info omron_get_daily_bp_data(omron_device* dev, int bank, int index);
 
+	/**
+	 * Get daily BP info for a range of indexes in one call. The GME
+	 * commands for the range are pipelined (see
+	 * omron_set_pipeline_depth()), falling back to one command at a
+	 * time if the device gets out of sync. A record read again that way
+	 * must sort strictly between its neighbours in the range, or that
+	 * record fails with OMRON_ERR_BADDATA (it may be a late answer to
+	 * another index, or a reading taken after the device clock was set
+	 * back). Reading such an index on its own (first == last) skips the
+	 * check.
+	 *
+	 * @param dev Device to query
+	 * @param bank Memory bank to query (A=0, B=1)
+	 * @param first First index to read
+	 * @param last Last index to read (inclusive)
+	 * @param data Array of (last - first + 1) structures to fill, data[0] is index first
+	 * @param status Optional array of (last - first + 1) per-record results (0 or < 0 error code), may be NULL
+	 *
+	 * @return Number of records read successfully, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_get_daily_bp_range(omron_device* dev, int bank, int first, int last, omron_bp_day_info* data, int* status);
+
 	/**
 	 * Get weekly BP morning or evening info for a particular bank/week
 	 *
@@ -449,6 +1372,16 @@ extern "C" {
 	 */
 	OMRON_DECLSPEC omron_pd_profile_info omron_get_pd_profile(omron_device* dev);
 
+	/**
+	 * Get pedometer profile information into a caller supplied structure
+	 *
+	 * @param dev Device to query
+	 * @param profile Structure to fill (zeroed on error)
+	 *
+	 * @return 0 on success, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_read_pd_profile(omron_device* dev, omron_pd_profile_info* profile);
+
 	/**
 	 * Query device for number of valid data packets
 	 *
@@ -458,6 +1391,17 @@ extern "C" {
 	 */
 	OMRON_DECLSPEC omron_pd_count_info omron_get_pd_data_count(omron_device* dev);
 
+	/**
+	 * Query device for number of valid data packets into a caller
+	 * supplied structure
+	 *
+	 * @param dev Device to query
+	 * @param count Structure to fill (zeroed on error)
+	 *
+	 * @return 0 on success, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_read_pd_data_count(omron_device* dev, omron_pd_count_info* count);
+
 	/**
 	 * Get daily pedometer averages for a specific day
 	 *
@@ -478,6 +1422,99 @@ extern "C" {
 	 */
 	OMRON_DECLSPEC omron_pd_hourly_data* omron_get_pd_hourly_data(omron_device* dev, int day);
 
+	/**
+	 * Get daily pedometer averages for a specific day into a caller
+	 * supplied structure
+	 *
+	 * @param dev Device to query
+	 * @param day Day index (should be between 0 and info retrieved from omron_get_pd_data_count)
+	 * @param data Structure to fill (zeroed on error)
+	 *
+	 * @return 0 on success, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_read_pd_daily_data(omron_device* dev, int day, omron_pd_daily_data* data);
+
+	/**
+	 * Get the undecoded daily pedometer record for a specific day, e.g.
+	 * to archive it and decode it later with omron_decode_pd_daily_records()
+	 *
+	 * @param dev Device to query
+	 * @param day Day index (should be between 0 and info retrieved from omron_get_pd_data_count)
+	 * @param raw Buffer of OMRON_PD_DAILY_RECORD_SIZE bytes to fill
+	 *
+	 * @return 0 on success, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_read_pd_daily_raw(omron_device* dev, int day, uint8_t* raw);
+
+	/**
+	 * Decode raw daily pedometer records, as returned by
+	 * omron_read_pd_daily_raw(), in one pass. Does not talk to the device.
+	 *
+	 * @param raw count records of OMRON_PD_DAILY_RECORD_SIZE bytes, back to back
+	 * @param count Number of records
+	 * @param first_day Day index of the first record, the others follow consecutively
+	 * @param data Array of count structures to fill
+	 */
+	OMRON_DECLSPEC void omron_decode_pd_daily_records(const uint8_t* raw, int count, int first_day, omron_pd_daily_data* data);
+
+	/**
+	 * Get hourly pedometer data for a specific day into a caller supplied
+	 * array. Unlike omron_get_pd_hourly_data() this does not allocate.
+	 *
+	 * @param dev Device to query
+	 * @param day Day index (should be between 0 and info retrieved from omron_get_pd_data_count)
+	 * @param data Array of 24 structures to fill, one per hour
+	 *
+	 * @return 0 on success, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_read_pd_hourly_data(omron_device* dev, int day, omron_pd_hourly_data* data);
+
+	/**
+	 * Allocate a pedometer history able to hold a number of days, in
+	 * one block
+	 *
+	 * @param days Number of days
+	 *
+	 * @return New history, or NULL on error
+	 */
+	OMRON_DECLSPEC omron_pd_history* omron_pd_history_create(int days);
+
+	/**
+	 * Free a history allocated by omron_pd_history_create()
+	 *
+	 * @param history History to free, may be NULL
+	 */
+	OMRON_DECLSPEC void omron_pd_history_delete(omron_pd_history* history);
+
+	/**
+	 * Get daily and hourly pedometer data for a range of days in one
+	 * call. The MES and GTD commands of all days are pipelined (see
+	 * omron_set_pipeline_depth()) and decoded as they come in, falling
+	 * back to one command at a time if the device gets out of sync. A day
+	 * whose step totals don't match the sum of its hours (checked for
+	 * all days but today) is read again that way too, and if it still
+	 * doesn't add up that day is left zeroed with status
+	 * OMRON_ERR_BADDATA and the other days are kept.
+	 *
+	 * @param dev Device to query
+	 * @param first First day index to read
+	 * @param last Last day index to read (inclusive)
+	 * @param history History with room for (last - first + 1) days to fill
+	 *
+	 * @return Number of days read successfully, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_get_pd_history(omron_device* dev, int first, int last, omron_pd_history* history);
+
+	/**
+	 * Copy one day of a history out into an array of hourly structures.
+	 * Does not talk to the device.
+	 *
+	 * @param history History to read
+	 * @param index Entry of the day in the history (not its day index)
+	 * @param data Array of 24 structures to fill, one per hour
+	 */
+	OMRON_DECLSPEC void omron_pd_history_hours(const omron_pd_history* history, int index, omron_pd_hourly_data* data);
+
 	/**
 	 * Clear all readings from the pedometer device
 	 *
@@ -487,6 +1524,578 @@ extern "C" {
 	 */
 	OMRON_DECLSPEC int omron_clear_pd_memory(omron_device* dev);
 
+	////////////////////////////////////////////////////////////////////////////////////
+	//
+	// Request Planner
+	//
+	////////////////////////////////////////////////////////////////////////////////////
+
+	/**
+	 * Run a batch of queries, grouped by the device mode they need
+	 *
+	 * Requests are reordered (stably) so that every mode is entered at most
+	 * once: requests for the current mode run first, then each other
+	 * mode in order of first appearance. Results are stored in the
+	 * request array itself, so the caller sees them in the original order.
+	 *
+	 * @param dev Device to query
+	 * @param requests Array of requests
+	 * @param count Number of requests
+	 *
+	 * @return Number of requests that succeeded, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_execute_requests(omron_device* dev, omron_request* requests, int count);
+
+	////////////////////////////////////////////////////////////////////////////////////
+	//
+	// Non-blocking Commands
+	//
+	////////////////////////////////////////////////////////////////////////////////////
+
+	/*
+	 * These run a command as a state machine that an event loop drives,
+	 * so a single thread can keep many devices busy. A loop runs
+	 *
+	 *   omron_cmd_start(dev, &cmd);
+	 *   do {
+	 *       n = omron_get_pollfds(dev, fds, max_fds);
+	 *       (wait for fds, or omron_cmd_timeout(dev, &cmd) ms to pass)
+	 *   } while (omron_cmd_step(dev, &cmd));
+	 *
+	 * for each device, with the waits of all devices folded into a
+	 * single poll (epoll, libuv, asio...). Retries, resyncs and timeouts
+	 * follow the retry policy of the device, like the blocking calls.
+	 *
+	 * A started command holds the device lock until it is done or
+	 * cancelled, so other threads wait for it and only one command runs
+	 * on a device at a time. Only the thread that started a command may
+	 * step or cancel it, other threads get OMRON_ERR_BUSY (and a
+	 * cancel is ignored). Setting the mode is a control transfer that
+	 * still blocks briefly, everything else returns at once.
+	 */
+
+	/**
+	 * Fill in a command to run with omron_cmd_start()
+	 *
+	 * @param cmd Command to fill in
+	 * @param mode Mode to send the command in
+	 * @param command Command bytes
+	 * @param command_len Number of command bytes
+	 * @param response_len Size of the expected response, including "OK" and checksum
+	 *
+	 * @return 0 on success, or OMRON_ERR_BADARG if a size is out of range
+	 */
+	OMRON_DECLSPEC int omron_cmd_init(omron_async_cmd* cmd, omron_mode mode, const uint8_t* command, int command_len, int response_len);
+
+	/**
+	 * Start a command on a device
+	 *
+	 * Nothing is sent yet, the first omron_cmd_step() does that.
+	 *
+	 * @param dev Device to run the command on
+	 * @param cmd Command, which must stay in place until it is done
+	 *
+	 * @return 0 on success, OMRON_ERR_UNSUPPORTED if the device was
+	 * opened on a transport that cannot read without blocking,
+	 * OMRON_ERR_BUSY if another command is still running on it, or < 0
+	 * on error
+	 */
+	OMRON_DECLSPEC int omron_cmd_start(omron_device* dev, omron_async_cmd* cmd);
+
+	/**
+	 * Move a started command on as far as it goes without waiting
+	 *
+	 * Call when a descriptor of the device is ready or the time returned
+	 * by omron_cmd_timeout() has passed; extra calls do no harm.
+	 *
+	 * @param dev Device the command runs on
+	 * @param cmd Command
+	 *
+	 * @return 1 while the command is still running, 0 once it is done
+	 * (the result is in cmd->status), or OMRON_ERR_BUSY if called from a
+	 * thread other than the one that started the command
+	 */
+	OMRON_DECLSPEC int omron_cmd_step(omron_device* dev, omron_async_cmd* cmd);
+
+	/**
+	 * Time until a command has to be stepped even if no descriptor of
+	 * the device is ready
+	 *
+	 * @param dev Device the command runs on
+	 * @param cmd Command
+	 *
+	 * @return Milliseconds to wait (0 to step right away), or -1 if the
+	 * command is done
+	 */
+	OMRON_DECLSPEC int omron_cmd_timeout(omron_device* dev, omron_async_cmd* cmd);
+
+	/**
+	 * Give up on a started command and release the device
+	 *
+	 * The command ends with status OMRON_ERR_TIMEOUT. A response may
+	 * still be on its way, so the next command resyncs with the device.
+	 * Only the thread that started the command may cancel it.
+	 *
+	 * @param dev Device the command runs on
+	 * @param cmd Command
+	 */
+	OMRON_DECLSPEC void omron_cmd_cancel(omron_device* dev, omron_async_cmd* cmd);
+
+	/**
+	 * Get the file descriptors an event loop has to watch for a device
+	 *
+	 * The descriptors can change when devices are opened or closed, so
+	 * fetch them again after that. libusb devices that share a context
+	 * (see omron_fleet_create()) share their descriptors. Transports without
+	 * descriptors (win32, the simulator, replay) return 0, and the loop
+	 * relies on omron_cmd_timeout() alone.
+	 *
+	 * @param dev Device pointer
+	 * @param fds Array to fill in
+	 * @param max_fds Size of fds
+	 *
+	 * @return Number of descriptors (which may be more than max_fds, then
+	 * only the first max_fds are filled in), or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_get_pollfds(omron_device* dev, omron_pollfd* fds, int max_fds);
+
+	/*
+	 * Ready-made commands: each omron_cmd_*() fills in a command for
+	 * omron_cmd_start() (returning 0, or < 0 on a bad argument), and the
+	 * matching omron_decode_*() unpacks the response once it is done,
+	 * returning what the blocking call returns.
+	 */
+
+	/**
+	 * Command for omron_get_daily_data_count()
+	 *
+	 * @param cmd Command to fill in
+	 * @param bank Memory bank to count
+	 *
+	 * @return 0 on success, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_cmd_daily_data_count(omron_async_cmd* cmd, int bank);
+
+	/**
+	 * Result of a command from omron_cmd_daily_data_count()
+	 *
+	 * @param cmd Finished command
+	 *
+	 * @return Number of records, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_decode_daily_data_count(const omron_async_cmd* cmd);
+
+	/**
+	 * Command for omron_get_daily_bp_data()
+	 *
+	 * @param cmd Command to fill in
+	 * @param bank Memory bank
+	 * @param index Record index
+	 *
+	 * @return 0 on success, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_cmd_daily_bp_data(omron_async_cmd* cmd, int bank, int index);
+
+	/**
+	 * Result of a command from omron_cmd_daily_bp_data()
+	 *
+	 * @param cmd Finished command
+	 * @param data Record to fill in
+	 *
+	 * @return 0 on success, OMRON_ERR_NEGRESP if the device asks for the
+	 * record to be requested again, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_decode_daily_bp_data(const omron_async_cmd* cmd, omron_bp_day_info* data);
+
+	/**
+	 * Command for omron_get_pd_data_count()
+	 *
+	 * @param cmd Command to fill in
+	 *
+	 * @return 0 on success, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_cmd_pd_data_count(omron_async_cmd* cmd);
+
+	/**
+	 * Result of a command from omron_cmd_pd_data_count()
+	 *
+	 * @param cmd Finished command
+	 * @param data Counts to fill in
+	 *
+	 * @return 0 on success, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_decode_pd_data_count(const omron_async_cmd* cmd, omron_pd_count_info* data);
+
+	/**
+	 * Command for omron_read_pd_daily_data()
+	 *
+	 * @param cmd Command to fill in
+	 * @param day Day index
+	 *
+	 * @return 0 on success, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_cmd_pd_daily_data(omron_async_cmd* cmd, int day);
+
+	/**
+	 * Result of a command from omron_cmd_pd_daily_data()
+	 *
+	 * @param cmd Finished command
+	 * @param data Day to fill in
+	 *
+	 * @return 0 on success, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_decode_pd_daily_data(const omron_async_cmd* cmd, omron_pd_daily_data* data);
+
+	////////////////////////////////////////////////////////////////////////////////////
+	//
+	// Incremental Sync Functions
+	//
+	////////////////////////////////////////////////////////////////////////////////////
+
+	/**
+	 * Load a sync state file
+	 *
+	 * @param path File to read
+	 * @param state Structure to fill
+	 *
+	 * @return 1 if loaded, 0 if the file does not exist, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_sync_load_state(const char* path, omron_sync_state* state);
+
+	/**
+	 * Atomically write a sync state file
+	 *
+	 * @param path File to write
+	 * @param state State to store
+	 *
+	 * @return 0 on success, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_sync_save_state(const char* path, const omron_sync_state* state);
+
+	/**
+	 * Download only the blood pressure records taken since the last sync
+	 *
+	 * The high-water mark is kept in state_dir, in a file named after the
+	 * device serial and bank. Without a state file, or with a NULL
+	 * state_dir, this is a full download. The last record synced is found
+	 * by its index (from the change in the record count) and its
+	 * timestamp, so readings taken after the device clock was set back
+	 * are not mistaken for old ones.
+	 *
+	 * @param dev Device to sync
+	 * @param bank Memory bank to sync (A=0, B=1)
+	 * @param state_dir Directory holding state files (NULL for a full download)
+	 * @param cb Called once per new record, oldest first
+	 * @param user_data Passed through to cb
+	 *
+	 * @return Number of new records, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_sync_daily_bp(omron_device* dev, int bank, const char* state_dir, omron_bp_sync_cb cb, void* user_data);
+
+	/**
+	 * Download only the pedometer days not yet fully synced
+	 *
+	 * Day indexes are relative to the current day, so this fetches the days
+	 * elapsed since the last sync plus the (possibly partial) day that sync
+	 * ended on. That day reaches cb a second time, so callbacks must
+	 * replace a day they already got rather than add it again. A day whose
+	 * totals don't match its hours even when read on its own is skipped.
+	 * If the day count cannot be read the sync fails and the high-water
+	 * mark is left alone.
+	 *
+	 * @param dev Device to sync
+	 * @param state_dir Directory holding state files (NULL for a full download)
+	 * @param cb Called once per day, oldest first
+	 * @param user_data Passed through to cb
+	 *
+	 * @return Number of days delivered, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_sync_pd(omron_device* dev, const char* state_dir, omron_pd_sync_cb cb, void* user_data);
+
+	////////////////////////////////////////////////////////////////////////////////////
+	//
+	// Archive Functions
+	//
+	////////////////////////////////////////////////////////////////////////////////////
+
+	/**
+	 * Open an archive for appending, creating it if needed
+	 *
+	 * A block left half written by a crash is cut off the end of the
+	 * file. An archive damaged anywhere else is not opened (and not
+	 * changed). Only one writer may have an archive open at a time.
+	 *
+	 * @param path Archive file
+	 *
+	 * @return Archive handle, or NULL on error or if the archive is damaged
+	 */
+	OMRON_DECLSPEC omron_archive* omron_archive_open(const char* path);
+
+	/**
+	 * Tag the rows added from now on with a source, e.g. the serial of
+	 * the device they came from. Rows already added are written out first.
+	 *
+	 * @param archive Archive handle
+	 * @param source Tag (shorter than OMRON_ARCHIVE_SOURCE_LEN), NULL or "" for none
+	 *
+	 * @return 0 on success, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_archive_set_source(omron_archive* archive, const char* source);
+
+	/**
+	 * Add a blood pressure reading
+	 *
+	 * @param archive Archive handle
+	 * @param record Reading, e.g. from omron_sync_daily_bp()
+	 *
+	 * @return 0 on success, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_archive_add_bp(omron_archive* archive, const omron_bp_day_info* record);
+
+	/**
+	 * Add a pedometer day
+	 *
+	 * @param archive Archive handle
+	 * @param day Date of the day as YYYYMMDD000000
+	 * @param daily Totals of the day
+	 * @param hourly The 24 hourly records of the day, NULL if not known
+	 *
+	 * @return 0 on success, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_archive_add_pd(omron_archive* archive, int64_t day, const omron_pd_daily_data* daily, const omron_pd_hourly_data* hourly);
+
+	/**
+	 * Write out the rows added so far as (possibly short) blocks
+	 *
+	 * @param archive Archive handle
+	 *
+	 * @return 0 on success, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_archive_flush(omron_archive* archive);
+
+	/**
+	 * Flush and close an archive opened for appending
+	 *
+	 * @return 0 on success, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_archive_close(omron_archive* archive);
+
+	/**
+	 * Map an archive into memory for reading
+	 *
+	 * The map shows the blocks complete at the time of the call.
+	 *
+	 * @param path Archive file
+	 *
+	 * @return Map handle, or NULL on error
+	 */
+	OMRON_DECLSPEC omron_archive_map* omron_archive_map_open(const char* path);
+
+	/**
+	 * Number of blocks in a mapped archive
+	 */
+	OMRON_DECLSPEC int omron_archive_map_blocks(omron_archive_map* map);
+
+	/**
+	 * Get the columns of a block, without copying them
+	 *
+	 * The pointers stay valid until omron_archive_map_close().
+	 *
+	 * @param map Map handle
+	 * @param index Block index (0..omron_archive_map_blocks() - 1)
+	 * @param block Structure to fill
+	 *
+	 * @return 0 on success, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_archive_map_block(omron_archive_map* map, int index, omron_archive_block* block);
+
+	/**
+	 * Unmap an archive
+	 */
+	OMRON_DECLSPEC void omron_archive_map_close(omron_archive_map* map);
+
+	////////////////////////////////////////////////////////////////////////////////////
+	//
+	// Database Functions (need SQLite, OMRON_ERR_UNSUPPORTED otherwise)
+	//
+	////////////////////////////////////////////////////////////////////////////////////
+
+	/**
+	 * Open (or create) a SQLite database for readings, in WAL mode
+	 *
+	 * Blood pressure readings go to the table, with the schema of
+	 * python/store.py: timestamp (seconds since the epoch, from the device
+	 * local time), sys, dia, pulse and type (0 for readings, 1 for weekly
+	 * averages). Pedometer days go to table_pd and their hours to
+	 * table_pd_hourly. Rows with a timestamp already stored replace it.
+	 *
+	 * A handle must only be used by one thread at a time.
+	 *
+	 * @param path Database file
+	 * @param table Base table name (letters, digits and _), NULL for "omron"
+	 *
+	 * @return Database handle, or NULL on error
+	 */
+	OMRON_DECLSPEC omron_db* omron_db_open(const char* path, const char* table);
+
+	/**
+	 * Add a blood pressure reading
+	 *
+	 * Rows are added inside a transaction, begun by the first add after
+	 * open or commit, so nothing reaches the disk until omron_db_commit().
+	 *
+	 * @param db Database handle
+	 * @param record Reading, e.g. from omron_sync_daily_bp()
+	 *
+	 * @return 0 on success, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_db_add_bp(omron_db* db, const omron_bp_day_info* record);
+
+	/**
+	 * Add a weekly blood pressure average (type 1), see omron_db_add_bp()
+	 *
+	 * @param db Database handle
+	 * @param record Average from omron_get_weekly_bp_data()
+	 *
+	 * @return 0 on success, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_db_add_weekly_bp(omron_db* db, const omron_bp_week_info* record);
+
+	/**
+	 * Add a pedometer day, see omron_db_add_bp()
+	 *
+	 * @param db Database handle
+	 * @param day Date of the day as YYYYMMDD000000
+	 * @param daily Totals of the day
+	 * @param hourly The 24 hourly records of the day, NULL if not known
+	 *
+	 * @return 0 on success, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_db_add_pd(omron_db* db, int64_t day, const omron_pd_daily_data* daily, const omron_pd_hourly_data* hourly);
+
+	/**
+	 * Commit the rows added since the last commit, typically once per sync
+	 *
+	 * If the commit fails the rows may still be pending, to be committed
+	 * again or thrown away with omron_db_rollback().
+	 *
+	 * @return 0 on success, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_db_commit(omron_db* db);
+
+	/**
+	 * Throw away the rows added since the last commit
+	 *
+	 * @return 0 on success, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_db_rollback(omron_db* db);
+
+	/**
+	 * Commit and close a database
+	 *
+	 * @return 0 on success, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_db_close(omron_db* db);
+
+#if !defined(WIN32)
+	////////////////////////////////////////////////////////////////////////////////////
+	//
+	// Fleet Functions (libusb only)
+	//
+	////////////////////////////////////////////////////////////////////////////////////
+
+	/**
+	 * Create an empty fleet, with its own libusb context and event thread
+	 *
+	 * @return Fleet pointer, or NULL on error
+	 */
+	OMRON_DECLSPEC omron_fleet* omron_fleet_create(void);
+
+	/**
+	 * Close all fleet devices, stop the event thread and free the fleet
+	 *
+	 * @param fleet Fleet pointer
+	 */
+	OMRON_DECLSPEC void omron_fleet_delete(omron_fleet* fleet);
+
+	/**
+	 * Enumerate the bus once and open every matching device
+	 *
+	 * Devices that fail to open are skipped (and logged).
+	 *
+	 * @param fleet Fleet pointer
+	 * @param VID Vendor ID, usually OMRON_VID
+	 * @param PID Product ID, usually OMRON_PID
+	 *
+	 * @return Number of devices opened, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_fleet_open_all(omron_fleet* fleet, int VID, int PID);
+
+	/**
+	 * @return Number of open devices in the fleet
+	 */
+	OMRON_DECLSPEC int omron_fleet_get_count(omron_fleet* fleet);
+
+	/**
+	 * Access a single fleet device (e.g. for omron_get_device_serial())
+	 *
+	 * @return Device pointer, or NULL if index is out of range
+	 */
+	OMRON_DECLSPEC omron_device* omron_fleet_get_device(omron_fleet* fleet, int device_index);
+
+	/**
+	 * Run job on every device at once, one worker thread per device, and
+	 * wait for all of them to finish
+	 *
+	 * @param fleet Fleet pointer
+	 * @param job Work function
+	 * @param user_data Passed through to job
+	 * @param results Optional array of omron_fleet_get_count() job results, may be NULL
+	 *
+	 * @return Number of devices whose job succeeded, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_fleet_run(omron_fleet* fleet, omron_fleet_job job, void* user_data, int* results);
+
+	/**
+	 * Sync blood pressure records from every device at once (see
+	 * omron_sync_daily_bp()), streaming them into a single callback
+	 *
+	 * @return Number of devices synced successfully, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_fleet_sync_bp(omron_fleet* fleet, int bank, const char* state_dir, omron_fleet_bp_cb cb, void* user_data, int* results);
+
+	/**
+	 * Sync pedometer days from every device at once (see omron_sync_pd()),
+	 * streaming them into a single callback
+	 *
+	 * @return Number of devices synced successfully, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_fleet_sync_pd(omron_fleet* fleet, const char* state_dir, omron_fleet_pd_cb cb, void* user_data, int* results);
+
+	/**
+	 * Start watching for devices being plugged in, using libusb hotplug
+	 * notifications on the fleet event thread (no bus polling). Each
+	 * matching device that arrives is opened and handed to job on a new
+	 * thread. Devices already attached are reported too.
+	 *
+	 * @param fleet Fleet pointer
+	 * @param VID Vendor ID, usually OMRON_VID
+	 * @param PID Product ID, usually OMRON_PID
+	 * @param job Work function
+	 * @param user_data Passed through to job
+	 *
+	 * @return 0 on success, OMRON_ERR_UNSUPPORTED if libusb lacks hotplug support, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_fleet_watch(omron_fleet* fleet, int VID, int PID, omron_hotplug_job job, void* user_data);
+
+	/**
+	 * Stop watching for new devices and wait for running jobs to finish
+	 *
+	 * @param fleet Fleet pointer
+	 */
+	OMRON_DECLSPEC void omron_fleet_unwatch(omron_fleet* fleet);
+#endif
+
 	////////////////////////////////////////////////////////////////////////////////////
 	//
 	// Debugging / Errors
@@ -500,6 +2109,91 @@ extern "C" {
 	 */
 	OMRON_DECLSPEC void omron_set_debug_level(int level);
 
+	/**
+	 * Turn the binary event log of a device on or off
+	 *
+	 * The log is a fixed size lock-free ring of the mode changes, reports,
+	 * commands and responses of the device, recorded without formatting
+	 * or locking, so it can stay on in production. When it is full the
+	 * oldest events are overwritten. While the log is on the
+	 * OMRON_DEBUG_PROTO and OMRON_DEBUG_DEVIO hex dumps of these events
+	 * are left to the log instead of being printed.
+	 *
+	 * Must not be called while another thread reads the log.
+	 *
+	 * @param dev Device pointer
+	 * @param capacity Number of events kept (rounded up to a power of 2), 0 to turn the log off
+	 *
+	 * @return 0 on success, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_set_event_log(omron_device* dev, int capacity);
+
+	/**
+	 * Take the oldest unread events out of a device's event log
+	 *
+	 * Never blocks the threads recording events. Only one thread may read
+	 * the log of a device at a time.
+	 *
+	 * @param dev Device pointer
+	 * @param events Array to fill
+	 * @param max Size of events
+	 * @param lost If not NULL, set to the number of events overwritten before they could be read
+	 *
+	 * @return Number of events stored in events, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_read_events(omron_device* dev, omron_event* events, int max, uint32_t* lost);
+
+	/**
+	 * Format an event as a line of text (without newline)
+	 *
+	 * @param event Event
+	 * @param buf Buffer for the text
+	 * @param size Size of buf, 128 + 3 * OMRON_EVENT_MAX_DATA always suffices
+	 *
+	 * @return Length of the text
+	 */
+	OMRON_DECLSPEC int omron_format_event(const omron_event* event, char* buf, int size);
+
+	/**
+	 * Print all unread events of a device's event log to stderr
+	 *
+	 * @param dev Device pointer
+	 *
+	 * @return Number of events printed, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_dump_events(omron_device* dev);
+
+	/**
+	 * Take a snapshot of the counters and latency histograms of a device
+	 *
+	 * The counters are kept from omron_create() on, across opens, and
+	 * are always on. The snapshot is only consistent if no other thread
+	 * is talking to the device meanwhile.
+	 *
+	 * @param dev Device pointer
+	 * @param stats Structure to fill
+	 *
+	 * @return 0 on success, or < 0 on error
+	 */
+	OMRON_DECLSPEC int omron_get_stats(omron_device* dev, omron_stats* stats);
+
+	/**
+	 * Zero the counters and latency histograms of a device
+	 *
+	 * @param dev Device pointer
+	 */
+	OMRON_DECLSPEC void omron_reset_stats(omron_device* dev);
+
+	/**
+	 * Estimate a percentile of the samples in a histogram
+	 *
+	 * @param histogram Histogram
+	 * @param percentile Percentile (0..100), e.g. 50 for the median
+	 *
+	 * @return Upper bound of the bucket holding the percentile [us], 0 if the histogram is empty
+	 */
+	OMRON_DECLSPEC uint32_t omron_histogram_percentile(const omron_histogram* histogram, double percentile);
+
 	/**
 	 * Return an error message for a given error code (similar to
 	 * strerror() but for errors returned by libomron)
@@ -0,0 +1,652 @@
+/*
+ * C++20 coroutine interface to libomron
+ *
+ * Copyright (c) 2009-2010 Kyle Machulis <kyle@nonpolynomial.com>
+ *
+ * More info on Nonpolynomial Labs @ http://www.nonpolynomial.com
+ *
+ * Sourceforge project @ http://www.github.com/qdot/libomron/
+ *
+ * This library is covered by the BSD License
+ * Read LICENSE_BSD.txt for details.
+ */
+
+#ifndef LIBOMRON_HPP
+#define LIBOMRON_HPP
+
+/*
+ * Header only, on top of the non-blocking commands of omron.h. A loop
+ * drives the commands of any number of devices from one thread:
+ *
+ *   omron::task<void> session(omron::device& dev)
+ *   {
+ *       int count = co_await dev.daily_count(0);
+ *       auto records = co_await dev.daily_bp(0, {0, count - 1});
+ *       auto days = dev.pd_days();
+ *       while (auto day = co_await days.next()) ...
+ *   }
+ *
+ *   omron::loop loop;
+ *   omron::device a(loop), b(loop);
+ *   a.open(0); b.open(1);
+ *   loop.spawn(session(a));
+ *   loop.spawn(session(b));
+ *   loop.run();
+ *
+ * Errors are thrown as omron::error. Everything here belongs to the
+ * thread that runs the loop, except the pipelined reads (daily_bp()),
+ * which the non-blocking commands cannot do: they run the blocking call
+ * in a thread of their own while the loop goes on with the other devices.
+ */
+
+#include "libomron/omron.h"
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <poll.h>
+#else
+#include <windows.h>
+#endif
+
+namespace omron {
+
+/// A libomron error code as an exception
+class error : public std::runtime_error
+{
+public:
+	explicit error(int code) : std::runtime_error(omron_strerror(code)), code_(code) {}
+
+	/// The OMRON_ERR_* code
+	int code() const noexcept { return code_; }
+
+private:
+	int code_;
+};
+
+/// Throw the error a libomron call returned, if it did
+inline int check(int status)
+{
+	if (status < 0) throw error(status);
+	return status;
+}
+
+/// Records first to last, inclusive
+struct range
+{
+	int first;
+	int last;
+};
+
+template <typename T> class task;
+
+namespace detail {
+
+/*
+ * Coroutines resume whoever awaits them when they finish (or the loop, if
+ * nobody does).
+ */
+struct final_awaiter
+{
+	bool await_ready() const noexcept { return false; }
+
+	template <typename Promise>
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) const noexcept
+	{
+		std::coroutine_handle<> next = h.promise().continuation;
+		return next ? next : std::noop_coroutine();
+	}
+
+	void await_resume() const noexcept {}
+};
+
+struct task_promise_base
+{
+	std::coroutine_handle<> continuation;
+	std::exception_ptr exception;
+
+	std::suspend_always initial_suspend() const noexcept { return {}; }
+	final_awaiter final_suspend() const noexcept { return {}; }
+	void unhandled_exception() noexcept { exception = std::current_exception(); }
+};
+
+template <typename T>
+struct task_promise : task_promise_base
+{
+	std::optional<T> value;
+
+	task<T> get_return_object() noexcept;
+	void return_value(T v) { value.emplace(std::move(v)); }
+	T result()
+	{
+		if (exception) std::rethrow_exception(exception);
+		return std::move(*value);
+	}
+};
+
+template <>
+struct task_promise<void> : task_promise_base
+{
+	task<void> get_return_object() noexcept;
+	void return_void() const noexcept {}
+	void result()
+	{
+		if (exception) std::rethrow_exception(exception);
+	}
+};
+
+} // namespace detail
+
+/**
+ * A coroutine that runs when awaited and returns a T
+ */
+template <typename T = void>
+class task
+{
+public:
+	using promise_type = detail::task_promise<T>;
+	using handle_type = std::coroutine_handle<promise_type>;
+
+	explicit task(handle_type h) noexcept : h_(h) {}
+	task(task&& other) noexcept : h_(std::exchange(other.h_, {})) {}
+	task& operator=(task&& other) noexcept
+	{
+		if (this != &other) {
+			if (h_) h_.destroy();
+			h_ = std::exchange(other.h_, {});
+		}
+		return *this;
+	}
+	task(const task&) = delete;
+	task& operator=(const task&) = delete;
+	~task()
+	{
+		if (h_) h_.destroy();
+	}
+
+	auto operator co_await() && noexcept
+	{
+		struct awaiter
+		{
+			handle_type h;
+
+			bool await_ready() const noexcept { return false; }
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept
+			{
+				h.promise().continuation = caller;
+				return h;
+			}
+			T await_resume() { return h.promise().result(); }
+		};
+		return awaiter{h_};
+	}
+
+private:
+	handle_type h_;
+};
+
+template <typename T>
+inline task<T> detail::task_promise<T>::get_return_object() noexcept
+{
+	return task<T>(std::coroutine_handle<task_promise<T>>::from_promise(*this));
+}
+
+inline task<void> detail::task_promise<void>::get_return_object() noexcept
+{
+	return task<void>(std::coroutine_handle<task_promise<void>>::from_promise(*this));
+}
+
+/**
+ * A coroutine that produces a sequence of T, one per co_await next()
+ */
+template <typename T>
+class generator
+{
+public:
+	struct promise_type
+	{
+		std::coroutine_handle<> continuation;
+		std::exception_ptr exception;
+		std::optional<T> value;
+
+		generator get_return_object() noexcept
+		{
+			return generator(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+		std::suspend_always initial_suspend() const noexcept { return {}; }
+		detail::final_awaiter final_suspend() const noexcept { return {}; }
+		detail::final_awaiter yield_value(T v)
+		{
+			value.emplace(std::move(v));
+			return {};
+		}
+		void return_void() const noexcept {}
+		void unhandled_exception() noexcept { exception = std::current_exception(); }
+	};
+	using handle_type = std::coroutine_handle<promise_type>;
+
+	explicit generator(handle_type h) noexcept : h_(h) {}
+	generator(generator&& other) noexcept : h_(std::exchange(other.h_, {})) {}
+	generator& operator=(generator&& other) noexcept
+	{
+		if (this != &other) {
+			if (h_) h_.destroy();
+			h_ = std::exchange(other.h_, {});
+		}
+		return *this;
+	}
+	generator(const generator&) = delete;
+	generator& operator=(const generator&) = delete;
+	~generator()
+	{
+		if (h_) h_.destroy();
+	}
+
+	/// Awaitable for the next value, empty once the sequence has ended
+	auto next() noexcept
+	{
+		struct awaiter
+		{
+			handle_type h;
+
+			bool await_ready() const noexcept { return h.done(); }
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept
+			{
+				h.promise().continuation = caller;
+				h.promise().value.reset();
+				return h;
+			}
+			std::optional<T> await_resume()
+			{
+				promise_type& p = h.promise();
+				if (p.exception) std::rethrow_exception(std::exchange(p.exception, nullptr));
+				if (h.done()) return std::nullopt;
+				return std::move(p.value);
+			}
+		};
+		return awaiter{h_};
+	}
+
+private:
+	handle_type h_;
+};
+
+/**
+ * Drives the non-blocking commands of the devices attached to it
+ *
+ * Commands of one device run one after the other, commands of different
+ * devices at the same time. run() does its own polling; to run inside
+ * another event loop, watch pollfds() and call dispatch() when one is
+ * ready or timeout() ms have passed.
+ */
+class loop
+{
+public:
+	loop() = default;
+	loop(const loop&) = delete;
+	loop& operator=(const loop&) = delete;
+
+	/// Start a coroutine, which then runs as the loop is run
+	void spawn(task<void> t)
+	{
+		detach(this, std::move(t));
+	}
+
+	/// Number of spawned coroutines that have not finished yet
+	int active() const noexcept { return active_; }
+
+	/// Start and step the commands that can make progress, and resume their coroutines
+	void dispatch()
+	{
+		std::vector<std::coroutine_handle<>> done;
+
+		for (std::size_t i = 0; i < pending_.size();) {
+			pending_cmd& p = pending_[i];
+			if (!p.started) {
+				if (busy(p.dev)) {
+					++i;
+					continue;
+				}
+				if (p.call) {
+					blocking_call* c = p.call;
+					c->thread = std::thread([c] {
+						c->run();
+						c->done.store(true, std::memory_order_release);
+					});
+					p.started = true;
+				} else {
+					int status = omron_cmd_start(p.dev, p.cmd);
+					if (status < 0) {
+						p.cmd->status = status;
+					} else {
+						p.started = true;
+					}
+				}
+			}
+			if (p.call) {
+				if (!p.call->done.load(std::memory_order_acquire)) {
+					++i;
+					continue;
+				}
+				p.call->thread.join();
+			} else if (p.started && omron_cmd_step(p.dev, p.cmd)) {
+				++i;
+				continue;
+			}
+			done.push_back(p.waiter);
+			pending_.erase(pending_.begin() + i);
+			// A command behind it on the same device may start now
+			i = 0;
+		}
+		for (std::coroutine_handle<> h : done) h.resume();
+	}
+
+	/// Descriptors to watch, each once even if devices share them
+	std::vector<omron_pollfd> pollfds() const
+	{
+		std::vector<omron_pollfd> fds;
+		omron_pollfd buf[16];
+
+		for (const pending_cmd& p : pending_) {
+			// The device is locked by the blocking call
+			if (p.call) continue;
+			int n = omron_get_pollfds(p.dev, buf, 16);
+			for (int i = 0; i < n && i < 16; ++i) {
+				bool seen = false;
+				for (const omron_pollfd& f : fds) seen = seen || f.fd == buf[i].fd;
+				if (!seen) fds.push_back(buf[i]);
+			}
+		}
+		return fds;
+	}
+
+	/// Milliseconds until dispatch() is due even if no descriptor is ready, -1 if idle
+	int timeout() const
+	{
+		int timeout_ms = -1;
+
+		for (const pending_cmd& p : pending_) {
+			int t;
+
+			if (p.started) {
+				t = p.call ? blocking_poll_ms : omron_cmd_timeout(p.dev, p.cmd);
+			} else {
+				t = busy(p.dev) ? -1 : 0;
+			}
+			if (t >= 0 && (timeout_ms < 0 || t < timeout_ms)) timeout_ms = t;
+		}
+		return timeout_ms;
+	}
+
+	/// Wait for the next descriptor or timeout (at most max_wait_ms if >= 0) and dispatch
+	void run_once(int max_wait_ms = -1)
+	{
+		int timeout_ms = timeout();
+
+		if (max_wait_ms >= 0 && (timeout_ms < 0 || timeout_ms > max_wait_ms)) timeout_ms = max_wait_ms;
+		if (timeout_ms != 0) {
+#if !defined(_WIN32)
+			std::vector<omron_pollfd> fds = pollfds();
+			std::vector<struct pollfd> pfds(fds.size());
+			for (std::size_t i = 0; i < fds.size(); ++i) {
+				pfds[i].fd = fds[i].fd;
+				pfds[i].events = fds[i].events;
+				pfds[i].revents = 0;
+			}
+			poll(pfds.data(), pfds.size(), timeout_ms);
+#else
+			Sleep(timeout_ms < 0 ? INFINITE : timeout_ms);
+#endif
+		}
+		dispatch();
+	}
+
+	/// Run until every spawned coroutine has finished, rethrowing the first error one threw
+	void run()
+	{
+		dispatch();
+		while (!pending_.empty()) run_once();
+		if (error_) std::rethrow_exception(std::exchange(error_, nullptr));
+	}
+
+	/// Awaitable that runs a command on a device and returns it once done
+	auto exchange(omron_device* dev, const omron_async_cmd& cmd)
+	{
+		struct awaiter
+		{
+			loop* owner;
+			omron_device* dev;
+			omron_async_cmd cmd;
+
+			bool await_ready() const noexcept { return false; }
+			void await_suspend(std::coroutine_handle<> h)
+			{
+				owner->pending_.push_back(pending_cmd{dev, &cmd, h, false, nullptr});
+			}
+			omron_async_cmd await_resume() const noexcept { return cmd; }
+		};
+		return awaiter{this, dev, cmd};
+	}
+
+	/// Awaitable that runs a blocking call (returning a status) on a device
+	/// in a thread of its own, and returns what it returned. The device runs
+	/// no command meanwhile.
+	auto blocking(omron_device* dev, std::function<int()> fn)
+	{
+		struct awaiter
+		{
+			loop* owner;
+			omron_device* dev;
+			blocking_call call;
+
+			bool await_ready() const noexcept { return false; }
+			void await_suspend(std::coroutine_handle<> h)
+			{
+				owner->pending_.push_back(pending_cmd{dev, nullptr, h, false, &call});
+			}
+			int await_resume() const noexcept { return call.status; }
+		};
+		return awaiter{this, dev, blocking_call(std::move(fn))};
+	}
+
+private:
+	/// How often a blocking call is checked for having returned [ms]
+	static constexpr int blocking_poll_ms = 5;
+
+	struct blocking_call
+	{
+		explicit blocking_call(std::function<int()> f) : fn(std::move(f)) {}
+
+		void run() { status = fn(); }
+
+		std::function<int()> fn;
+		int status = 0;
+		std::thread thread;
+		std::atomic<bool> done{false};
+	};
+
+	struct pending_cmd
+	{
+		omron_device* dev;
+		omron_async_cmd* cmd;
+		std::coroutine_handle<> waiter;
+		bool started;
+		/// Set instead of cmd for a blocking call
+		blocking_call* call;
+	};
+
+	/// Spawned coroutines free themselves when they finish
+	struct detached
+	{
+		struct promise_type
+		{
+			detached get_return_object() const noexcept { return {}; }
+			std::suspend_never initial_suspend() const noexcept { return {}; }
+			std::suspend_never final_suspend() const noexcept { return {}; }
+			void return_void() const noexcept {}
+			void unhandled_exception() const noexcept { std::terminate(); }
+		};
+	};
+
+	static detached detach(loop* self, task<void> t)
+	{
+		++self->active_;
+		try {
+			co_await std::move(t);
+		} catch (...) {
+			if (!self->error_) self->error_ = std::current_exception();
+		}
+		--self->active_;
+	}
+
+	bool busy(omron_device* dev) const noexcept
+	{
+		for (const pending_cmd& p : pending_) {
+			if (p.started && p.dev == dev) return true;
+		}
+		return false;
+	}
+
+	std::vector<pending_cmd> pending_;
+	std::exception_ptr error_;
+	int active_ = 0;
+};
+
+/**
+ * An owned omron_device whose data calls are awaitable
+ */
+class device
+{
+public:
+	explicit device(loop& l) : loop_(&l), dev_(omron_create())
+	{
+		if (!dev_) throw std::bad_alloc();
+	}
+	device(device&& other) noexcept
+		: loop_(other.loop_), dev_(std::exchange(other.dev_, nullptr)), open_(std::exchange(other.open_, false))
+	{
+	}
+	device& operator=(device&& other) noexcept
+	{
+		if (this != &other) {
+			reset();
+			loop_ = other.loop_;
+			dev_ = std::exchange(other.dev_, nullptr);
+			open_ = std::exchange(other.open_, false);
+		}
+		return *this;
+	}
+	device(const device&) = delete;
+	device& operator=(const device&) = delete;
+	~device() { reset(); }
+
+	/// The device, for calls not wrapped here
+	omron_device* get() const noexcept { return dev_; }
+
+	/// Open the device_index'th matching device (see omron_open())
+	void open(unsigned int device_index = 0, int vid = OMRON_VID, int pid = OMRON_PID)
+	{
+		check(omron_open(dev_, vid, pid, device_index));
+		open_ = true;
+	}
+
+	/// Open a simulated device (see omron_open_sim())
+	void open_sim(const omron_sim_config* config = nullptr)
+	{
+		check(omron_open_sim(dev_, config));
+		open_ = true;
+	}
+
+	void close()
+	{
+		if (open_) check(omron_close(dev_));
+		open_ = false;
+	}
+
+	/// Number of blood pressure records in a bank
+	task<int> daily_count(int bank)
+	{
+		omron_async_cmd cmd;
+
+		check(omron_cmd_daily_data_count(&cmd, bank));
+		omron_async_cmd done = co_await loop_->exchange(dev_, cmd);
+		co_return check(omron_decode_daily_data_count(&done));
+	}
+
+	/// Blood pressure records of a bank, read pipelined with
+	/// omron_get_daily_bp_range() in a thread of its own
+	task<std::vector<omron_bp_day_info>> daily_bp(int bank, range records)
+	{
+		if (records.first < 0 || records.last < records.first) throw error(OMRON_ERR_BADARG);
+		std::vector<omron_bp_day_info> result(records.last - records.first + 1);
+		std::vector<int> status(result.size());
+		omron_device* dev = dev_;
+
+		check(co_await loop_->blocking(dev, [&] {
+			return omron_get_daily_bp_range(dev, bank, records.first, records.last, result.data(), status.data());
+		}));
+		for (int s : status) check(s);
+		co_return result;
+	}
+
+	/// Number of days and hours the pedometer has stored
+	task<omron_pd_count_info> pd_count()
+	{
+		omron_async_cmd cmd;
+		omron_pd_count_info count;
+
+		check(omron_cmd_pd_data_count(&cmd));
+		omron_async_cmd done = co_await loop_->exchange(dev_, cmd);
+		check(omron_decode_pd_data_count(&done, &count));
+		co_return count;
+	}
+
+	/// Pedometer totals of one day
+	task<omron_pd_daily_data> pd_daily(int day)
+	{
+		omron_async_cmd cmd;
+		omron_pd_daily_data data;
+
+		check(omron_cmd_pd_daily_data(&cmd, day));
+		omron_async_cmd done = co_await loop_->exchange(dev_, cmd);
+		check(omron_decode_pd_daily_data(&done, &data));
+		co_return data;
+	}
+
+	/// Pedometer totals of every day stored, one day at a time
+	generator<omron_pd_daily_data> pd_days()
+	{
+		omron_pd_count_info count = co_await pd_count();
+
+		for (int day = 0; day < count.daily_count; ++day) {
+			co_yield co_await pd_daily(day);
+		}
+	}
+
+private:
+	void reset() noexcept
+	{
+		if (!dev_) return;
+		if (open_) omron_close(dev_);
+		omron_delete(dev_);
+		dev_ = nullptr;
+		open_ = false;
+	}
+
+	loop* loop_;
+	omron_device* dev_;
+	bool open_ = false;
+};
+
+} // namespace omron
+
+#endif // LIBOMRON_HPP
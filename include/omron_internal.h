@@ -26,12 +26,27 @@
 //
 ///////////////////////////////////////////////////////////////////////////////
 
+/*
+ * Atomic access to ints shared between threads. The loads and stores are
+ * relaxed, they only have to be untorn.
+ */
+#if defined(WIN32)
+#define OMRON_ATOMIC_LOAD(p)         (*(volatile int*)(p))
+#define OMRON_ATOMIC_STORE(p, v)     (*(volatile int*)(p) = (v))
+#define OMRON_ATOMIC_CAS(p, old, v)  (InterlockedCompareExchange((LONG volatile*)(p), (v), (old)) == (old))
+#else
+#define OMRON_ATOMIC_LOAD(p)         __atomic_load_n((p), __ATOMIC_RELAXED)
+#define OMRON_ATOMIC_STORE(p, v)     __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define OMRON_ATOMIC_CAS(p, old, v)  __extension__ ({ int _expected = (old); \
+        __atomic_compare_exchange_n((p), &_expected, (v), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED); })
+#endif
+
 extern int _omron_debug_level;
 
 #define DEBUG_DEFAULT_LEVEL 0
 #define DEBUG_ENV_VAR "LIBOMRON_DEBUG"
 
-#define IF_DEBUG(level, stmt)     if (_omron_debug_level >= (level)) { stmt; }
+#define IF_DEBUG(level, stmt)     if (OMRON_ATOMIC_LOAD(&_omron_debug_level) >= (level)) { stmt; }
 #define DPRINTF(level, fmt, ...)  \
         IF_DEBUG(level, fprintf(stderr, "%s: " fmt, __func__, ##__VA_ARGS__))
 
@@ -45,6 +60,16 @@ extern int _omron_debug_level;
 #define MSG_HEXDUMP(level, msg, data, len) \
         IF_DEBUG(level, fprintf(stderr, "%s: %s", __func__, msg); omron_hexdump(data, len);)
 
+/*
+ * Record an event in the device's event log if it is on, or else hex dump
+ * its data (if any) at the given debug level. Formatting is left to the
+ * log's reader, so the log is cheap enough to keep on.
+ */
+#define MSG_EVENT(dev, id, level, msg, status, data, len) do { \
+        if ((dev)->events) { omron_log_event(dev, id, status, data, len); } \
+        else if ((len) > 0) { MSG_HEXDUMP(level, msg, data, len); } \
+        } while (0)
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 // Platform Specific Functions
@@ -53,12 +78,217 @@ extern int _omron_debug_level;
 
 omron_device* omron_create_device(void);
 
+/*
+ * Report level transport a device is opened on. omron_set_mode(),
+ * omron_read_data(), omron_write_data() and omron_close() dispatch through
+ * dev->transport, so the protocol code runs unchanged on top of real
+ * hardware or the simulator.
+ */
+typedef struct omron_transport {
+	/// Short name for debug output
+	const char* name;
+	int (*set_mode)(omron_device* dev, omron_mode mode);
+	int (*read_data)(omron_device* dev, uint8_t* report_buf, int report_size, int timeout);
+	int (*write_data)(omron_device* dev, uint8_t* report_buf, int report_size, int timeout);
+	/*
+	 * Discard any input reports already queued by the backend or the
+	 * OS, returning as soon as the input endpoint is empty instead of
+	 * waiting out a fixed read timeout. The endpoint only counts as
+	 * empty once it has stayed quiet for omron_drain_wait_ms(), so the
+	 * answers to commands still in flight are discarded too.
+	 *
+	 * Returns the number of bytes discarded, or < 0 on error.
+	 */
+	int (*drain_input)(omron_device* dev);
+	int (*close)(omron_device* dev);
+	/*
+	 * Hand out an input report that has already arrived, without
+	 * waiting for one.
+	 *
+	 * Returns the report size, 0 if there is none, or < 0 on error.
+	 */
+	int (*poll_read)(omron_device* dev, uint8_t* report_buf, int report_size);
+	/*
+	 * Fill in (up to max_fds of) the descriptors an event loop has to
+	 * watch for the transport, and lower *timeout_ms (-1 for none) to
+	 * when it needs servicing even if none of them is ready. NULL for
+	 * transports without descriptors.
+	 *
+	 * Returns the number of descriptors, which may exceed max_fds, or < 0
+	 * on error.
+	 */
+	int (*get_pollfds)(omron_device* dev, omron_pollfd* fds, int max_fds, int* timeout_ms);
+} omron_transport;
+
+/// Transport of the platform USB backend (libusb or win32 HID)
+extern const omron_transport omron_usb_transport;
+
+/*
+ * Device scan and open of the platform USB backend, behind omron_get_count()
+ * and omron_open().
+ */
+int omron_usb_get_count(omron_device* dev, int VID, int PID);
+int omron_usb_open(omron_device* dev, int VID, int PID, unsigned int device_index);
+
+/*
+ * Discard queued input, see omron_transport::drain_input.
+ */
+int omron_drain_input(omron_device* dev);
+
+/*
+ * Take an input report that has already arrived, see
+ * omron_transport::poll_read.
+ */
+int omron_poll_read(omron_device* dev, uint8_t* report_buf, int report_size);
+
+/*
+ * Nonzero if the environment (SIM_BACKEND_ENV_VAR=sim) asks for the
+ * simulated device instead of real hardware.
+ */
+#define SIM_BACKEND_ENV_VAR "LIBOMRON_BACKEND"
+int omron_sim_selected(void);
+
+/*
+ * If set, omron_open() records every session to the trace file it names,
+ * see omron_trace_start().
+ */
+#define TRACE_ENV_VAR "LIBOMRON_TRACE"
+
+#if !defined(WIN32)
+/*
+ * libusb backend entry points used by the fleet code. A NULL context makes
+ * the device create (and own) its own libusb context.
+ */
+omron_device* omron_create_device_with_context(struct libusb_context* context);
+int omron_open_usb_device(omron_device* dev, struct libusb_device* usb_dev);
+#endif
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 // Utility functions called from the platform-specific C files
 //
 ///////////////////////////////////////////////////////////////////////////////
 
+/*
+ * Set the platform independent fields of a newly created device to their
+ * defaults and create its lock. Returns < 0 if that fails, the device must
+ * then be deleted.
+ */
+int omron_init_device(omron_device* dev);
+
+/*
+ * Destroy the device lock, called when the device is deleted.
+ */
+void omron_free_lock(omron_device* dev);
+
+/*
+ * Whether the calling thread holds the device lock.
+ */
+int omron_lock_held(omron_device* dev);
+
+/*
+ * Forget everything known about the state of the device and its link (mode,
+ * responses in flight, round trip time) and refill the retry budget. Called
+ * by the platform open code after (re)opening.
+ */
+void omron_reset_session(omron_device* dev);
+
+/*
+ * (Re)carve the scratch arena for the current input_size/output_size.
+ * Called by the platform open code once the report sizes are known; the
+ * allocation only grows, so reopening a device does not reallocate.
+ */
+int omron_alloc_arena(omron_device* dev);
+
+/*
+ * Release the scratch arena, called when the device is deleted.
+ */
+void omron_free_arena(omron_device* dev);
+
 void omron_hexdump(const uint8_t *data, int n_bytes);
 
+/*
+ * Append an event to dev->events (which must be on), see MSG_EVENT.
+ */
+void omron_log_event(omron_device* dev, int id, int status, const uint8_t* data, int len);
+
+/*
+ * Release the event log, called when the device is deleted.
+ */
+void omron_free_event_log(omron_device* dev);
+
+/*
+ * Counters behind omron_get_stats(). omron_stats_of() returns the live
+ * counters of a device, allocating them on first use (NULL if that fails).
+ * omron_stats_command_sent() (once the command is out, with the time the
+ * send started) and omron_stats_command_done() bracket the round trip of
+ * each command, the latter returns the round trip time [us] (< 0 if not
+ * known), omron_stats_flushed() forgets the commands whose
+ * responses a flush threw away.
+ */
+omron_stats* omron_stats_of(omron_device* dev);
+void omron_histogram_add(omron_histogram* histogram, int64_t us);
+void omron_stats_command_sent(omron_device* dev, int size, const unsigned char* cmd, int64_t sent_us);
+int64_t omron_stats_command_done(omron_device* dev, int status);
+void omron_stats_flushed(omron_device* dev);
+void omron_free_stats(omron_device* dev);
+
+/*
+ * Protocol layer in omron.c, declared here for the benchmarks: command
+ * framing into output reports, response reassembly and checksum, and BCD
+ * field decoding.
+ */
+int omron_send_command(omron_device* dev, int size, const unsigned char* buf);
+int omron_get_command_return(omron_device* dev, int size, unsigned char* data);
+int bcd_to_int2(unsigned char *data, int start_nibble, int len_nibbles);
+
+/*
+ * The steps of omron_get_command_return(), for the non-blocking commands in
+ * omron_async.c. omron_add_response_report() appends an input report to the
+ * response of size bytes being put together in data (*total bytes so far)
+ * and returns 1 if more reports are to come, 0 if the response is complete,
+ * or < 0 on error. omron_check_response() then returns what
+ * omron_get_command_return() would, and omron_response_done() does the
+ * bookkeeping for the response to the given attempt (0 for the first) at a
+ * command, passing status through.
+ */
+int omron_add_response_report(omron_device* dev, const unsigned char* input_report,
+			      int size, unsigned char* data, int* total);
+int omron_check_response(omron_device* dev, int size, const unsigned char* data, int total);
+int omron_response_done(omron_device* dev, int status, int attempt);
+
+/// Responses worth resending the command for
+#define OMRON_RETRYABLE(status) ((status) == OMRON_ERR_BADDATA || (status) == OMRON_ERR_TIMEOUT)
+
+/*
+ * Retry policy arithmetic: the response timeout [ms] for an attempt at a
+ * command, and omron_take_retry(), which takes a resend out of the retry
+ * budget and returns the backoff [ms] to wait before it, or < 0 if the
+ * budget is used up.
+ */
+int omron_response_timeout(omron_device* dev, int attempt);
+int omron_take_retry(omron_device* dev, int attempt);
+
+/*
+ * How long a drain has to let the input stay quiet before taking it to be
+ * empty [ms], on top of the transport's own settle time. Responses still
+ * owed (pending_responses, including ones that timed out) can take a whole
+ * round trip to start arriving, so this is the response timeout then, and
+ * 0 otherwise.
+ */
+int omron_drain_wait_ms(omron_device* dev);
+
+/*
+ * Time of a blood pressure reading as YYYYMMDDhhmmss (device local time),
+ * the timestamp of sync states and archives.
+ */
+int64_t omron_bp_timestamp(const omron_bp_day_info* r);
+
+/*
+ * Monotonic clock [us], and sleeping until a time on it (returns at once if
+ * t_us has passed).
+ */
+int64_t omron_now_us(void);
+void omron_sleep_until_us(int64_t t_us);
+
 #endif // _OMRON_INTERNAL_H
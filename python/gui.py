@@ -176,6 +176,7 @@ class Gui(object):
             self.data.add(tsec, bp_data.sys, bp_data.dia, bp_data.pulse)
             continue
 
+        self.data.commit()
         self.cb_update_plot()
         return
 
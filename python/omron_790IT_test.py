@@ -1,6 +1,6 @@
 #!/usr/bin/env python
 
-import omron, store, device
+import omron, store, device, records
 import os, sys
 
 print sys.path
@@ -42,27 +42,32 @@ if data_count < 0:
     print 'Cannot get device prf!'
 
 def bad_data(r):
-    return not r.day and not r.month and not r.year and \
-        not r.hour and not r.minute and not r.second and \
-        not r.sys and not r.dia and not r.pulse
+    return not r['present'] or \
+        not r['day'] and not r['month'] and not r['year'] and \
+        not r['hour'] and not r['minute'] and not r['second'] and \
+        not r['sys'] and not r['dia'] and not r['pulse']
 
 
+# One bulk read, records the device failed to send come back with present == 0
 d = store.Data()
+bp = records.daily_bp(o, 0, 0, data_count-1)
 for ind in range(data_count-1,-1,-1):
-    for trial in range(3):
-        r = o.get_daily_bp_data(ind)
-        print ind,trial,r.year,r.month,r.day,r.hour,r.minute,r.second
-        if bad_data(r): continue
-        break
-
-    ts = store.ymdhms2seconds(r.year,r.month,r.day,r.hour,r.minute,r.second)
-    print trial, ts,r.sys,r.dia,r.pulse
+    r = bp[ind]
+    if bad_data(r):
+        for trial in range(3):
+            r = o.get_daily_bp_data(ind)
+            r = {'present': 1, 'year': r.year, 'month': r.month, 'day': r.day,
+                 'hour': r.hour, 'minute': r.minute, 'second': r.second,
+                 'sys': r.sys, 'dia': r.dia, 'pulse': r.pulse}
+            print ind,trial,r['year'],r['month'],r['day'],r['hour'],r['minute'],r['second']
+            if bad_data(r): continue
+            break
 
     if bad_data(r): continue
 
-    d.add(ts,r.sys,r.dia,r.pulse)
-
-    continue
-
+    ts = store.ymdhms2seconds(r['year'],r['month'],r['day'],r['hour'],r['minute'],r['second'])
+    print ts,r['sys'],r['dia'],r['pulse']
 
+    d.add(ts,r['sys'],r['dia'],r['pulse'])
 
+d.commit()
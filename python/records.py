@@ -0,0 +1,60 @@
+#!/usr/bin/env python
+
+"""
+NumPy views of the records the Omron bulk reads return.
+
+The bulk reads (Omron.read_daily_bp, read_pd_daily and read_pd_hourly) fill
+a caller supplied buffer with an array of the C structures, one call per
+download instead of a Python object per record. The dtypes here follow the
+layout the extension itself reports, so they match whatever padding the
+compiler used.
+"""
+
+import numpy
+import omron
+
+def _dtype(layout, itemsize):
+    names, formats, offsets = [], [], []
+    for field in layout.split(','):
+        name, fmt, offset = field.split(':')
+        names.append(name)
+        formats.append('=' + fmt)
+        offsets.append(int(offset))
+    return numpy.dtype({'names': names, 'formats': formats,
+                        'offsets': offsets, 'itemsize': itemsize})
+
+BP_DAY = _dtype(omron.Omron.bp_day_layout(), omron.Omron.bp_day_size())
+PD_DAILY = _dtype(omron.Omron.pd_daily_layout(), omron.Omron.pd_daily_size())
+PD_HOURLY = _dtype(omron.Omron.pd_hourly_layout(), omron.Omron.pd_hourly_size())
+
+def _check(ret, what):
+    if ret < 0:
+        raise IOError('Cannot read %s: error %d' % (what, ret))
+    return ret
+
+def daily_bp(o, bank=0, first=0, last=None):
+    """Blood pressure records first..last (default all) of a bank.
+    Records that could not be read have present == 0."""
+    if last is None:
+        last = _check(o.get_daily_data_count(bank), 'record count') - 1
+    if last < first:
+        return numpy.zeros(0, dtype=BP_DAY)
+    out = numpy.zeros(last - first + 1, dtype=BP_DAY)
+    _check(o.read_daily_bp(bank, first, last, out), 'blood pressure records')
+    return out
+
+def pd_daily(o, first=0, count=None):
+    """Pedometer totals of count days (default all) from day first on."""
+    if count is None:
+        count = _check(o.get_pd_data_count().daily_count, 'day count') - first
+    out = numpy.zeros(max(count, 0), dtype=PD_DAILY)
+    if count <= 0:
+        return out
+    n = _check(o.read_pd_daily(first, count, out), 'pedometer days')
+    return out[:n]
+
+def pd_hourly(o, day):
+    """The 24 hourly pedometer records of a day."""
+    out = numpy.zeros(24, dtype=PD_HOURLY)
+    _check(o.read_pd_hourly(day, out), 'pedometer hours')
+    return out
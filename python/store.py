@@ -11,6 +11,10 @@ class Data(object):
     def __init__(self,filename="omron.sqlite3",tablename="omron"):
         self.tablename = tablename
         self.conn = sqlite3.connect(filename)
+        # Same settings as the library's omron_db sink: commits need no
+        # fsync of their own
+        self.conn.execute('pragma journal_mode=WAL')
+        self.conn.execute('pragma synchronous=NORMAL')
 
         try:
             self.initdb(tablename)
@@ -30,13 +34,17 @@ class Data(object):
         return
 
     def add(self,timestamp,sys,dia,pulse,by_day = True):
+        '''Add a reading, it is only stored once commit() is called'''
         if by_day: by_day = 0
         else: by_day = 1
-        c = self.conn.cursor()
-        c.execute('''replace into %s values (%d,%d,%d,%d,%d)'''%\
-                      (self.tablename,timestamp,sys,dia,pulse,by_day))
+        self.conn.execute('''replace into %s values (?,?,?,?,?)'''%\
+                              self.tablename,
+                          (int(timestamp),sys,dia,pulse,by_day))
+        return
+
+    def commit(self):
+        '''Store the readings added since the last commit, once per download'''
         self.conn.commit()
-        c.close()
         return
 
     def all(self,by_day = True):
@@ -17,7 +17,10 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <math.h>
+#if !defined(WIN32)
+#include <time.h>
+#include <pthread.h>
+#endif
 
 // Global constants declared in omron.h
 const uint32_t OMRON_VID = 0x0590;
@@ -34,7 +37,11 @@ static const char *err_msgs[] = {
 	"Bad or unrecognized command",			// NEGRESP (-5)
 	"Unexpected END response received",		// ENDRESP (-6)
 	"Device returned bad data",			// BADDATA (-7)
-	"Unknown error",				// <= -8
+	"Not supported on this platform",		// UNSUPPORTED (-8)
+	"Device did not respond in time",		// TIMEOUT (-9)
+	"Aborted by callback",				// ABORTED (-10)
+	"Device busy with another command",		// BUSY    (-11)
+	"Unknown error",				// <= -12
 };
 
 OMRON_DECLSPEC const char *omron_strerror(int code) {
@@ -56,9 +63,10 @@ OMRON_DECLSPEC void omron_set_debug_level(int level) {
 	char *env_setting;
 	char *endptr;
 	int new_level;
+	int initial = (level < 0);
 
-	if (level < 0) {
-		if (_omron_debug_level < 0) {
+	if (initial) {
+		if (OMRON_ATOMIC_LOAD(&_omron_debug_level) < 0) {
 			level = DEBUG_DEFAULT_LEVEL;
 		} else {
 			return;
@@ -77,54 +85,167 @@ OMRON_DECLSPEC void omron_set_debug_level(int level) {
 			new_level = level;
 		}
 	}
-	_omron_debug_level = new_level;
+	if (initial) {
+		// Don't undo a level another thread has set meanwhile
+		OMRON_ATOMIC_CAS(&_omron_debug_level, -1, new_level);
+	} else {
+		OMRON_ATOMIC_STORE(&_omron_debug_level, new_level);
+	}
+}
+
+int64_t omron_now_us(void)
+{
+#if defined(WIN32)
+	LARGE_INTEGER freq, now;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (int64_t)(now.QuadPart * 1000000.0 / freq.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+void omron_sleep_until_us(int64_t t_us)
+{
+	int64_t delta = t_us - omron_now_us();
+
+	if (delta <= 0) return;
+#if defined(WIN32)
+	Sleep((DWORD)((delta + 999) / 1000));
+#else
+	{
+		struct timespec ts;
+		ts.tv_sec = delta / 1000000;
+		ts.tv_nsec = (delta % 1000000) * 1000;
+		nanosleep(&ts, NULL);
+	}
+#endif
 }
 
 void omron_hexdump(const uint8_t *data, int n_bytes)
 {
-	while (n_bytes--) {
-		fprintf(stderr, " %02x", *(unsigned char*) data);
+	static const char hex[] = "0123456789abcdef";
+	char line[3 * 64 + 2];
+	int len = 0;
+
+	// Built up and printed in one go, so concurrent dumps do not interleave
+	while (n_bytes-- > 0) {
+		line[len++] = ' ';
+		line[len++] = hex[*data >> 4];
+		line[len++] = hex[*data & 0xf];
 		data++;
+		if (len == 3 * 64) {
+			fwrite(line, 1, len, stderr);
+			len = 0;
+		}
 	}
-	fprintf(stderr, "\n");
+	line[len++] = '\n';
+	fwrite(line, 1, len, stderr);
 }
 
-int bcd_to_int(unsigned char *data, int start, int length)
+/*
+ * BCD decoding
+ *
+ * Numbers come as runs of BCD nibbles that need not start on a byte
+ * boundary. Whole bytes are decoded two digits at a time through a lookup
+ * table. Nibbles above 9 are not rejected, they just weigh in at their
+ * face value like they always have.
+ */
+#define BCD_ROW(h) \
+	h*10+0, h*10+1, h*10+2, h*10+3, h*10+4, h*10+5, h*10+6, h*10+7, \
+	h*10+8, h*10+9, h*10+10, h*10+11, h*10+12, h*10+13, h*10+14, h*10+15
+static const uint8_t bcd_byte_value[256] = {
+	BCD_ROW(0), BCD_ROW(1), BCD_ROW(2), BCD_ROW(3),
+	BCD_ROW(4), BCD_ROW(5), BCD_ROW(6), BCD_ROW(7),
+	BCD_ROW(8), BCD_ROW(9), BCD_ROW(10), BCD_ROW(11),
+	BCD_ROW(12), BCD_ROW(13), BCD_ROW(14), BCD_ROW(15)
+};
+#undef BCD_ROW
+
+/// Location of a BCD number within a record
+typedef struct {
+	/// First nibble (0 is the high nibble of byte 0)
+	uint8_t nibble;
+	/// Number of digits
+	uint8_t length;
+	/// Divisor that turns the digits into the field's unit
+	uint16_t scale;
+} omron_bcd_field;
+
+static int bcd_decode(const unsigned char *data, int nibble, int length)
 {
+	const unsigned char *p = data + nibble / 2;
 	int ret = 0;
-	int pos = start;
-	int i;
-	for(i = 0; i < length; ++i)
-	{
-		if(!(i % 2))
-		{
-			if(i >= 2)
-				pos++;
-			ret += (data[pos] >> 4) * (pow(10, length - i - 1));
-		}
-		else
-		{
-			ret += (data[pos] & 0x0f) * (pow(10, length - i - 1));
-		}
+
+	if (nibble & 1) {
+		ret = *p++ & 0x0f;
+		--length;
+	}
+	for (; length >= 2; length -= 2) {
+		ret = ret * 100 + bcd_byte_value[*p++];
+	}
+	if (length) {
+		ret = ret * 10 + (*p >> 4);
 	}
 	return ret;
 }
 
+static int bcd_field(const unsigned char *data, const omron_bcd_field *f)
+{
+	return bcd_decode(data, f->nibble, f->length);
+}
+
+int bcd_to_int(unsigned char *data, int start, int length)
+{
+	return bcd_decode(data, start * 2, length);
+}
+
 /*
 * For data not starting on byte boundaries
 */
 int bcd_to_int2(unsigned char *data, int start_nibble, int len_nibbles)
 {
-	int ret = 0;
-	int nib, abs_nib, i;
-	for(i=0; i < len_nibbles; i++) {
-		abs_nib = start_nibble + i;
-		nib = (data[abs_nib / 2] >> (4 * (1 - abs_nib % 2))) & 0x0F;
-		ret += nib * pow(10, len_nibbles - i - 1);
-	}
-	return ret;
+	return bcd_decode(data, start_nibble, len_nibbles);
 }
 
+/// Fields of a daily pedometer (MES) record
+enum {
+	PD_DAILY_STEPS,
+	PD_DAILY_AEROBIC_STEPS,
+	PD_DAILY_AEROBIC_TIME,
+	PD_DAILY_CALORIES,
+	PD_DAILY_DISTANCE,
+	PD_DAILY_FAT_BURN,
+	PD_DAILY_NUM_FIELDS
+};
+
+static const omron_bcd_field pd_daily_fields[PD_DAILY_NUM_FIELDS] = {
+	{ 6, 5, 1 },	// total_steps
+	{ 11, 5, 1 },	// total_aerobic_steps
+	{ 16, 4, 1 },	// total_aerobic_walking_time
+	{ 20, 5, 1 },	// total_calories
+	{ 25, 5, 100 },	// total_distance
+	{ 30, 4, 10 },	// total_fat_burn
+	// Unknown: 17..19
+};
+
+/// Fields of a pedometer profile (PRF) record, after the "OK" and checksum
+enum {
+	PD_PROFILE_WEIGHT,
+	PD_PROFILE_STRIDE,
+	PD_PROFILE_NUM_FIELDS
+};
+
+static const omron_bcd_field pd_profile_fields[PD_PROFILE_NUM_FIELDS] = {
+	// Unknown: 0..1
+	{ 4, 4, 10 },	// weight
+	// Unknown: 4..5
+	{ 12, 4, 10 },	// stride
+	// Unknown: 8..10
+};
+
 short short_to_bcd(int number)
 {
 	return ((number/10) << 4) | (number % 10);
@@ -135,7 +256,8 @@ int omron_send_command(omron_device* dev, int size, const unsigned char* buf)
 {
 	int total_write_size = 0;
 	int current_write_size;
-	unsigned char output_report[dev->output_size];
+	unsigned char* output_report = dev->arena.output_report;
+	int64_t start_us = omron_now_us();
 	int status;
 
 	if (buf[0] == 0) {
@@ -143,7 +265,11 @@ int omron_send_command(omron_device* dev, int size, const unsigned char* buf)
 	} else {
 		MSG_INFO("Sending %c%c%c command...\n", buf[0], buf[1], buf[2]);
 	}
-	MSG_HEXDUMP(OMRON_DEBUG_PROTO, "Command: ", buf, size);
+	MSG_EVENT(dev, OMRON_EVENT_COMMAND, OMRON_DEBUG_PROTO, "Command: ", size, buf, size);
+	if (!output_report) {
+		MSG_ERROR("Device not open\n");
+		return OMRON_ERR_NOTOPEN;
+	}
 
 	while(total_write_size < size)
 	{
@@ -155,11 +281,16 @@ int omron_send_command(omron_device* dev, int size, const unsigned char* buf)
 		memcpy(output_report + 1, buf+total_write_size,
 		       current_write_size);
 
-		status = omron_write_data(dev, output_report, sizeof(output_report), 1000);
-		if (status < 0) return status;
+		status = omron_write_data(dev, output_report, dev->output_size, 1000);
+		if (status < 0) {
+			dev->input_dirty = 1;
+			return status;
+		}
 		total_write_size += current_write_size;
 	}
 
+	omron_stats_command_sent(dev, size, buf, start_us);
+	dev->pending_responses++;
 	return 0;
 }
 
@@ -180,29 +311,33 @@ int omron_check_success(unsigned char *input_report)
  * device on the other end again.
  */
 static int omron_flush(omron_device *dev) {
-	int status;
-	unsigned char input_report[dev->input_size];
-	int flushed = 0;
+	omron_stats* stats = omron_stats_of(dev);
+	int flushed;
 
+	if (!dev->input_dirty && !dev->pending_responses) {
+		MSG_DETAIL("Input known to be empty, skipping flush.\n");
+		if (stats) stats->flushes_skipped++;
+		return 0;
+	}
 	MSG_DETAIL("Flushing any extra input...\n");
-	while (1) {
-		/* We use a shorter-than-usual timeout (0.1s) because we know we're going to hit it eventually (so we want to keep it short) and we're only really concerned about queued input (which should be immediately retrievable) */
-		/* Note: The negative value for 'timeout' means it's "expected" and should not generate an error (just a 0 result) */
-		status = omron_read_data(dev, input_report, sizeof(input_report), -100);
-		if (status < 0) return status;
-		if (status == 0) {
-			/* Timeout (this is expected sooner or later) */
-			break;
-		}
-		flushed += status;
-		MSG_DETAIL("Discarding %d bytes of extra data...\n", status);
-	};
+	flushed = omron_drain_input(dev);
+	if (flushed < 0) return flushed;
+	if (flushed) {
+		MSG_DETAIL("Discarded %d bytes of extra data.\n", flushed);
+	}
+	if (stats) {
+		stats->flushes++;
+		stats->flushed_bytes += flushed;
+	}
+	omron_stats_flushed(dev);
+	dev->input_dirty = 0;
+	dev->pending_responses = 0;
 	MSG_DETAIL("Flush complete.\n");
 	return flushed;
 }
 
 static int
-xor_checksum(unsigned char *data, int len)
+xor_checksum(const unsigned char *data, int len)
 {
 	unsigned char checksum = 0;
 
@@ -215,68 +350,53 @@ xor_checksum(unsigned char *data, int len)
 	return checksum;
 }
 
-/*
-  omron_get_command_return returns:
-  >=0 : Valid response ("OK..."). Returns # of bytes (including "OK").
-  OMRON_ERR_NEGRESP: "NO" response
-  OMRON_ERR_BADDATA: Garbled response
-  <0 : Other error
-*/
-
-int omron_get_command_return(omron_device* dev, int size, unsigned char* data)
+int omron_add_response_report(omron_device* dev, const unsigned char* input_report,
+			      int size, unsigned char* data, int* total)
 {
-	int total_read_size = 0;
-	int current_read_size = 0;
-	unsigned char input_report[dev->input_size];
-	int read_result;
-	const int max_data_chunk = sizeof(input_report) - 1;
-
-	do {
-		read_result = omron_read_data(dev, input_report, sizeof(input_report), 1000);
-		if (read_result < 0) return read_result;
-
-		current_read_size = input_report[0];
-		if (current_read_size < 0) {
-			MSG_ERROR("Invalid size byte: %d\n", current_read_size);
-			return OMRON_ERR_DEVIO;
-		} else if (current_read_size > sizeof(input_report)) {
-			MSG_ERROR("Invalid size byte: %d\n", current_read_size);
-			return OMRON_ERR_DEVIO;
-		} else if (current_read_size > max_data_chunk) {
-			MSG_WARN("(size byte == report size.  Adjusting to report size - 1)\n");
-			current_read_size = max_data_chunk; /* FIXME? Bug? */
-		}
+	int total_read_size = *total;
+	int current_read_size = input_report[0];
+	const int max_data_chunk = dev->input_size - 1;
+
+	if (current_read_size > dev->input_size) {
+		MSG_ERROR("Invalid size byte: %d\n", current_read_size);
+		return OMRON_ERR_DEVIO;
+	} else if (current_read_size > max_data_chunk) {
+		MSG_WARN("(size byte == report size.  Adjusting to report size - 1)\n");
+		current_read_size = max_data_chunk; /* FIXME? Bug? */
+	}
 
-		/* printf(" current_read=%d size=%d total_read_size=%d.\n", */
-		/* 		current_read_size, size, total_read_size); */
+	if (current_read_size > size - total_read_size) {
+		// This shouldn't happen.  Just ignore any extra we got
+		// back..
+		MSG_WARN("Received more data than expected (%d > %d).  Ignoring extra.", total_read_size + current_read_size, size);
+		current_read_size = size - total_read_size;
+	}
 
-		if (current_read_size > size - total_read_size) {
-			// This shouldn't happen.  Just ignore any extra we got
-			// back..
-			MSG_WARN("Received more data than expected (%d > %d).  Ignoring extra.", total_read_size + current_read_size, size);
-			current_read_size = size - total_read_size;
-		}
+	memcpy(data + total_read_size, input_report + 1,
+	       current_read_size);
+	total_read_size += current_read_size;
+	*total = total_read_size;
 
-		memcpy(data + total_read_size, input_report + 1,
-		       current_read_size);
-		total_read_size += current_read_size;
+	if (current_read_size < max_data_chunk) {
+		// Short chunks should only occur as the last chunk of
+		// a response.  Stop here (even if we haven't read as
+		// much as we were expecting) because trying to read
+		// further will just result in a timeout.
+		return 0;
+	}
+	if (data[0] != 'O' || data[1] != 'K') {
+		// Only "OK" responses have the potential to span more
+		// than one report.  We either have a "NO", an "END",
+		// or a garbled response.  In any case, we should stop
+		// here.
+		return 0;
+	}
+	return total_read_size < size;
+}
 
-		if (current_read_size < max_data_chunk) {
-			// Short chunks should only occur as the last chunk of
-			// a response.  Stop here (even if we haven't read as
-			// much as we were expecting) because trying to read
-			// further will just result in a timeout.
-			break;
-		}
-		if (data[0] != 'O' || data[1] != 'K') {
-			// Only "OK" responses have the potential to span more
-			// than one report.  We either have a "NO", an "END",
-			// or a garbled response.  In any case, we should stop
-			// here.
-			break;
-		}
-	} while (total_read_size < size);
-	MSG_HEXDUMP(OMRON_DEBUG_PROTO, "Response: ", data, total_read_size);
+int omron_check_response(omron_device* dev, int size, const unsigned char* data, int total_read_size)
+{
+	MSG_EVENT(dev, OMRON_EVENT_RESPONSE, OMRON_DEBUG_PROTO, "Response: ", total_read_size, data, total_read_size);
 
 	if (total_read_size < 2) {
 		MSG_ERROR("Response is too short: bad data.\n");
@@ -305,25 +425,165 @@ int omron_get_command_return(omron_device* dev, int size, unsigned char* data)
 	return OMRON_ERR_BADDATA;
 }
 
+/*
+  omron_get_command_return returns:
+  >=0 : Valid response ("OK..."). Returns # of bytes (including "OK").
+  OMRON_ERR_NEGRESP: "NO" response
+  OMRON_ERR_BADDATA: Garbled response
+  OMRON_ERR_TIMEOUT: No (complete) response in time
+  <0 : Other error
+*/
+
+static int omron_read_command_return(omron_device* dev, int size, unsigned char* data, int timeout)
+{
+	int total_read_size = 0;
+	unsigned char* input_report = dev->arena.input_report;
+	int read_result;
+
+	if (!input_report) {
+		MSG_ERROR("Device not open\n");
+		return OMRON_ERR_NOTOPEN;
+	}
+	do {
+		read_result = omron_read_data(dev, input_report, dev->input_size, -timeout);
+		if (read_result < 0) return read_result;
+		if (read_result == 0) {
+			MSG_DETAIL("No response within %dms\n", timeout);
+			return OMRON_ERR_TIMEOUT;
+		}
+		read_result = omron_add_response_report(dev, input_report, size, data, &total_read_size);
+		if (read_result < 0) return read_result;
+	} while (read_result);
+	return omron_check_response(dev, size, data, total_read_size);
+}
+
+/*
+ * Feed a round trip time into the smoothed estimate (the TCP retransmit
+ * timer of RFC 6298).
+ */
+static void omron_update_rtt(omron_device* dev, int64_t rtt_us)
+{
+	int32_t sample = rtt_us > 0x3fffffff ? 0x3fffffff : (int32_t)rtt_us;
+	int32_t error;
+
+	if (!dev->rtt_us) {
+		dev->rtt_us = sample ? sample : 1;
+		dev->rtt_var_us = sample / 2;
+		return;
+	}
+	error = sample - dev->rtt_us;
+	dev->rtt_var_us += ((error < 0 ? -error : error) - dev->rtt_var_us) / 4;
+	dev->rtt_us += error / 8;
+	if (dev->rtt_us < 1) dev->rtt_us = 1;
+}
+
+int omron_response_timeout(omron_device* dev, int attempt)
+{
+	const omron_retry_policy* policy = &dev->retry_policy;
+	int64_t timeout = policy->max_timeout_ms;
+
+	if (dev->rtt_us) {
+		timeout = (dev->rtt_us + (int64_t)policy->rtt_deviations * dev->rtt_var_us) / 1000 + 1;
+		if (timeout < policy->min_timeout_ms) timeout = policy->min_timeout_ms;
+	}
+	while (attempt-- > 0 && timeout < policy->max_timeout_ms) timeout *= 2;
+	if (timeout > policy->max_timeout_ms) timeout = policy->max_timeout_ms;
+	return (int)timeout;
+}
+
+int omron_take_retry(omron_device* dev, int attempt)
+{
+	const omron_retry_policy* policy = &dev->retry_policy;
+	int64_t backoff = policy->backoff_ms;
+
+	if (policy->retry_budget >= 0) {
+		if (dev->retries_left <= 0) {
+			omron_stats* stats = omron_stats_of(dev);
+
+			MSG_WARN("Retry budget of %d used up, not retrying\n", policy->retry_budget);
+			if (stats) stats->retries_denied++;
+			return -1;
+		}
+		dev->retries_left--;
+	}
+	while (attempt-- > 0 && backoff < policy->max_backoff_ms) backoff *= 2;
+	if (backoff > policy->max_backoff_ms) backoff = policy->max_backoff_ms;
+	return (int)backoff;
+}
+
+int omron_drain_wait_ms(omron_device* dev)
+{
+	return dev->pending_responses ? omron_response_timeout(dev, 0) : 0;
+}
+
+/*
+ * Take a resend out of the retry budget of the running operation (refilled
+ * by the outermost omron_lock()) and wait out the backoff before it.
+ * Returns 0 if the budget is used up.
+ */
+static int omron_retry_backoff(omron_device* dev, int attempt)
+{
+	int backoff = omron_take_retry(dev, attempt);
+
+	if (backoff < 0) return 0;
+	if (backoff > 0) omron_sleep_until_us(omron_now_us() + backoff * (int64_t)1000);
+	return 1;
+}
+
+int omron_response_done(omron_device* dev, int status, int attempt)
+{
+	int64_t rtt_us = omron_stats_command_done(dev, status);
+
+	// A command that timed out may still be answered, so it stays owed
+	// until a flush has waited for it
+	if (dev->pending_responses > 0 && status != OMRON_ERR_TIMEOUT) dev->pending_responses--;
+	// Anything but a well-formed response may leave stray reports behind
+	if (status < 0 && status != OMRON_ERR_NEGRESP && status != OMRON_ERR_ENDRESP) {
+		dev->input_dirty = 1;
+	} else if (attempt == 0 && rtt_us >= 0) {
+		// Resent commands are left out, their responses may be late ones
+		omron_update_rtt(dev, rtt_us);
+	}
+	return status;
+}
+
+static int omron_read_response(omron_device* dev, int size, unsigned char* data, int attempt)
+{
+	int status = omron_read_command_return(dev, size, data, omron_response_timeout(dev, attempt));
+
+	return omron_response_done(dev, status, attempt);
+}
+
+int omron_get_command_return(omron_device* dev, int size, unsigned char* data)
+{
+	return omron_read_response(dev, size, data, 0);
+}
+
 int omron_send_clear(omron_device* dev)
 {
 	static const unsigned char zero[12]; /* = all zeroes */
 	unsigned char response[2];
+	omron_stats* stats = omron_stats_of(dev);
+	int64_t start_us = omron_now_us();
 	int status;
-	int retry_count = 3;
+	int attempt;
 
 	MSG_INFO("Performing clear...\n")
-	do {
+	for (attempt = 0; ; attempt++) {
 		status = omron_flush(dev);
 		if (status < 0) break;
 		status = omron_send_command(dev, sizeof(zero), zero);
 		if (status < 0) break;
-		status = omron_get_command_return(dev, sizeof(response), response);
-		if (status != OMRON_ERR_BADDATA) break;
-	} while (retry_count--);
+		status = omron_read_response(dev, sizeof(response), response, attempt);
+		if (!OMRON_RETRYABLE(status)) break;
+		if (attempt + 1 >= dev->retry_policy.clear_attempts) break;
+		if (!omron_retry_backoff(dev, attempt)) break;
+	}
 
+	if (stats) omron_histogram_add(&stats->clear, omron_now_us() - start_us);
 	if (status < 0) {
 		MSG_ERROR("Clear failed: %d\n", status);
+		if (stats) stats->clear_errors++;
 		return status;
 	}
 	MSG_INFO("Clear successful.\n")
@@ -340,51 +600,70 @@ int omron_check_mode(omron_device* dev, omron_mode mode)
 	ret = omron_set_mode(dev, mode);
 	if(ret == 0)
 	{
-		dev->device_mode = mode;
+		OMRON_ATOMIC_STORE(&dev->device_mode, mode);
 		return omron_send_clear(dev);
 	}
 	return ret;
 }
 
-static int omron_exchange_cmd(omron_device *dev,
-			       omron_mode mode,
-			       int cmd_len,
-			       const unsigned char *cmd,
-			       int response_len,
-			       unsigned char *response)
+static int omron_run_exchange(omron_device *dev,
+			      omron_mode mode,
+			      int cmd_len,
+			      const unsigned char *cmd,
+			      int response_len,
+			      unsigned char *response)
 {
+	const omron_retry_policy* policy = &dev->retry_policy;
+	omron_stats* stats = omron_stats_of(dev);
+	int attempt;
 	int status;
 	
 	status = omron_check_mode(dev, mode);
 	if (status < 0) return status;
 
-	status = omron_send_command(dev, cmd_len, cmd);
-	if (status < 0) return status;
-	status = omron_get_command_return(dev, response_len, response);
-	if (status != OMRON_ERR_BADDATA) return status;
-
-	// Got a garbled response.  Do a flush and try again.
-	MSG_WARN("Bad response from device.  Retrying...\n");
-	status = omron_flush(dev);
-	if (status < 0) return status;
-	status = omron_send_command(dev, cmd_len, cmd);
-	if (status < 0) return status;
-	status = omron_get_command_return(dev, response_len, response);
-	if (status != OMRON_ERR_BADDATA) return status;
-
-	// Hmm.. still garbled.  Try doing a full clear/resync and try again.
-	MSG_WARN("Bad response from device.  Resyncing and retrying...\n");
-	status = omron_set_mode(dev, mode);
-	if (status < 0) return status;
-	status = omron_send_clear(dev);
-	if (status < 0) return status;
-	status = omron_send_command(dev, cmd_len, cmd);
-	if (status < 0) return status;
-	status = omron_get_command_return(dev, response_len, response);
-	if (status != OMRON_ERR_BADDATA) return status;
+	for (attempt = 0; ; attempt++) {
+		status = omron_send_command(dev, cmd_len, cmd);
+		if (status < 0) return status;
+		status = omron_read_response(dev, response_len, response, attempt);
+		if (!OMRON_RETRYABLE(status)) return status;
+		if (attempt >= policy->retries + policy->resyncs) break;
+		if (!omron_retry_backoff(dev, attempt)) break;
+
+		if (attempt < policy->retries) {
+			// Got a garbled or late response.  Do a flush and try again.
+			MSG_WARN("Bad response from device.  Retrying...\n");
+			if (stats) stats->retries++;
+			status = omron_flush(dev);
+			if (status < 0) return status;
+		} else {
+			// Hmm.. still garbled.  Try doing a full clear/resync and try again.
+			MSG_WARN("Bad response from device.  Resyncing and retrying...\n");
+			if (stats) stats->resyncs++;
+			status = omron_set_mode(dev, mode);
+			if (status < 0) return status;
+			status = omron_send_clear(dev);
+			if (status < 0) return status;
+		}
+	}
 
 	// Ok, we still can't get a valid response.  Time to just give up.
 	MSG_ERROR("Unable to get a valid response from device.\n");
+	if (stats) stats->failed_exchanges++;
+	return status;
+}
+
+static int omron_exchange_cmd(omron_device *dev,
+			       omron_mode mode,
+			       int cmd_len,
+			       const unsigned char *cmd,
+			       int response_len,
+			       unsigned char *response)
+{
+	int status;
+
+	omron_lock(dev);
+	status = omron_run_exchange(dev, mode, cmd_len, cmd, response_len, response);
+	omron_unlock(dev);
 	return status;
 }
 
@@ -394,77 +673,405 @@ omron_dev_info_command(omron_device* dev,
 		       unsigned char *result,
 		       int result_max_len)
 {
-	unsigned char tmp[result_max_len+3];
+	unsigned char* tmp = dev->arena.response;
 	int status;
 
+	if (result_max_len + 3 > OMRON_MAX_RESPONSE_SIZE) return OMRON_ERR_BUFSIZE;
+	// The response lands in the device's scratch space, keep it until copied
+	omron_lock(dev);
 	status = omron_exchange_cmd(dev, PEDOMETER_MODE, strlen(cmd),
 			   (const unsigned char*) cmd,
 			   result_max_len+3, tmp);
-	if (status < 0) return status;
-        if (status < 3) return OMRON_ERR_DEVIO;
-	memcpy(result, tmp + 3, status - 3);
-	return status - 3;
+	if (status >= 0 && status < 3) status = OMRON_ERR_DEVIO;
+	if (status >= 0) {
+		memcpy(result, tmp + 3, status - 3);
+		status -= 3;
+	}
+	omron_unlock(dev);
+	return status;
+}
+
+/*
+ * Device lock, recursive so that public functions can call each other (and
+ * be called between omron_lock() and omron_unlock()). depth counts the
+ * nested holds of the owner, the outermost one is an operation that gets
+ * the whole retry budget.
+ */
+struct omron_lock {
+#if defined(WIN32)
+	CRITICAL_SECTION section;
+#else
+	pthread_mutex_t mutex;
+#endif
+	int depth;
+};
+
+static int omron_create_lock(omron_device* dev)
+{
+	struct omron_lock* lock = malloc(sizeof(*lock));
+#if !defined(WIN32)
+	pthread_mutexattr_t attr;
+#endif
+
+	dev->lock = NULL;
+	if (!lock) return OMRON_ERR_DEVIO;
+	lock->depth = 0;
+#if defined(WIN32)
+	InitializeCriticalSection(&lock->section);
+#else
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	if (pthread_mutex_init(&lock->mutex, &attr)) {
+		pthread_mutexattr_destroy(&attr);
+		free(lock);
+		return OMRON_ERR_DEVIO;
+	}
+	pthread_mutexattr_destroy(&attr);
+#endif
+	dev->lock = lock;
+	return 0;
+}
+
+void omron_free_lock(omron_device* dev)
+{
+	if (!dev->lock) return;
+#if defined(WIN32)
+	DeleteCriticalSection(&dev->lock->section);
+#else
+	pthread_mutex_destroy(&dev->lock->mutex);
+#endif
+	free(dev->lock);
+	dev->lock = NULL;
+}
+
+OMRON_DECLSPEC void omron_lock(omron_device* dev)
+{
+#if defined(WIN32)
+	EnterCriticalSection(&dev->lock->section);
+#else
+	pthread_mutex_lock(&dev->lock->mutex);
+#endif
+	if (dev->lock->depth++ == 0) dev->retries_left = dev->retry_policy.retry_budget;
+}
+
+OMRON_DECLSPEC void omron_unlock(omron_device* dev)
+{
+	dev->lock->depth--;
+#if defined(WIN32)
+	LeaveCriticalSection(&dev->lock->section);
+#else
+	pthread_mutex_unlock(&dev->lock->mutex);
+#endif
+}
+
+int omron_lock_held(omron_device* dev)
+{
+	int held;
+
+	// A recursive lock held by another thread cannot be taken, one held
+	// by this thread can (and then has depth > 1)
+#if defined(WIN32)
+	if (!TryEnterCriticalSection(&dev->lock->section)) return 0;
+	held = dev->lock->depth > 0;
+	LeaveCriticalSection(&dev->lock->section);
+#else
+	if (pthread_mutex_trylock(&dev->lock->mutex)) return 0;
+	held = dev->lock->depth > 0;
+	pthread_mutex_unlock(&dev->lock->mutex);
+#endif
+	return held;
 }
 
 //platform independant functions
-OMRON_DECLSPEC omron_device* omron_create()
+int omron_init_device(omron_device* dev)
 {
-	omron_set_debug_level(-1); // Initialize to default if not already set
-	MSG_INFO("Creating new device.\n");
-	return omron_create_device();
+	dev->pipeline_depth = OMRON_DEFAULT_PIPELINE_DEPTH;
+	memset(&dev->arena, 0, sizeof(dev->arena));
+	dev->transport = NULL;
+	dev->transport_data = NULL;
+	dev->events = NULL;
+	dev->stats = NULL;
+	omron_default_retry_policy(&dev->retry_policy);
+	omron_reset_session(dev);
+	return omron_create_lock(dev);
 }
 
-OMRON_DECLSPEC int omron_get_device_version(omron_device* dev, unsigned char* data, int data_size)
+void omron_reset_session(omron_device* dev)
+{
+	OMRON_ATOMIC_STORE(&dev->device_mode, NULL_MODE);
+	dev->pending_responses = 0;
+	dev->input_dirty = 1;
+	dev->rtt_us = 0;
+	dev->rtt_var_us = 0;
+	dev->retries_left = dev->retry_policy.retry_budget;
+}
+
+int omron_alloc_arena(omron_device* dev)
+{
+	omron_arena* a = &dev->arena;
+	int platform_size = (dev->input_size > dev->output_size ? dev->input_size : dev->output_size) + 1;
+	int size = dev->output_size + dev->input_size + OMRON_MAX_RESPONSE_SIZE + platform_size;
+
+	if (size > a->size) {
+		uint8_t* base = realloc(a->base, size);
+		if (!base) {
+			MSG_ERROR("Cannot allocate %d bytes of scratch space\n", size);
+			return OMRON_ERR_DEVIO;
+		}
+		a->base = base;
+		a->size = size;
+	}
+	a->output_report = a->base;
+	a->input_report = a->output_report + dev->output_size;
+	a->response = a->input_report + dev->input_size;
+	a->platform = a->response + OMRON_MAX_RESPONSE_SIZE;
+	return 0;
+}
+
+void omron_free_arena(omron_device* dev)
 {
+	free(dev->arena.base);
+	memset(&dev->arena, 0, sizeof(dev->arena));
+}
+
+//transport dispatch
+OMRON_DECLSPEC int omron_get_count(omron_device* dev, int VID, int PID)
+{
+	if (omron_sim_selected()) return 1;
+	return omron_usb_get_count(dev, VID, PID);
+}
+
+OMRON_DECLSPEC int omron_open(omron_device* dev, int VID, int PID, uint32_t device_index)
+{
+	const char* trace_path = getenv(TRACE_ENV_VAR);
 	int status;
-	const int response_size = 12;
 
-	if (data_size <= response_size) {
-		MSG_ERROR("Supplied buffer too small (%d < %d)\n", data_size, response_size + 1);
-		return OMRON_ERR_BUFSIZE;
+	if (omron_sim_selected()) {
+		if (device_index != 0) {
+			MSG_ERROR("Could not find requested device (%d) to open\n", device_index);
+			return OMRON_ERR_BADARG;
+		}
+		status = omron_open_sim(dev, NULL);
+	} else {
+		status = omron_usb_open(dev, VID, PID, device_index);
+	}
+	if (status < 0 || !trace_path || !*trace_path) return status;
+	if (omron_trace_start(dev, trace_path) < 0) {
+		MSG_WARN("Cannot record session to %s, continuing without\n", trace_path);
 	}
-	status = omron_dev_info_command(dev, "VER00", data, response_size);
-	if (status < 0) return status;
-	data[status] = 0;
 	return status;
 }
 
-OMRON_DECLSPEC int omron_get_bp_profile(omron_device* dev, unsigned char* data, int data_size)
+OMRON_DECLSPEC int omron_close(omron_device* dev)
 {
 	int status;
-	const int response_size = 11;
 
-	if (data_size <= response_size) {
-		MSG_ERROR("Supplied buffer too small (%d < %d)\n", data_size, response_size + 1);
-		return OMRON_ERR_BUFSIZE;
+	omron_lock(dev);
+	if (!dev->transport) {
+		omron_unlock(dev);
+		MSG_ERROR("Device not open\n");
+		return OMRON_ERR_NOTOPEN;
 	}
-	status = omron_dev_info_command(dev, "PRF00", data, response_size);
-	if (status < 0) return status;
-	data[status] = 0;
+	status = dev->transport->close(dev);
+	if (status == 0) {
+		dev->transport = NULL;
+		dev->transport_data = NULL;
+	}
+	omron_unlock(dev);
 	return status;
 }
 
-OMRON_DECLSPEC int omron_get_device_serial(omron_device* dev, unsigned char* data, int data_size)
+OMRON_DECLSPEC int omron_set_mode(omron_device* dev, omron_mode mode)
 {
+	omron_stats* stats;
+	int64_t start_us = omron_now_us();
 	int status;
-	const int response_size = 8;
 
-	if (data_size <= response_size) {
-		MSG_ERROR("Supplied buffer too small (%d < %d)\n", data_size, response_size + 1);
-		return OMRON_ERR_BUFSIZE;
+	omron_lock(dev);
+	if (!dev->transport) {
+		omron_unlock(dev);
+		return OMRON_ERR_NOTOPEN;
 	}
-	status = omron_dev_info_command(dev, "SRL00", data, response_size);
-	if (status < 0) return status;
-	data[status] = 0;
+	status = dev->transport->set_mode(dev, mode);
+	stats = omron_stats_of(dev);
+	if (stats) {
+		omron_histogram_add(&stats->set_mode, omron_now_us() - start_us);
+		if (status < 0) stats->set_mode_errors++;
+	}
+	if (dev->events) {
+		uint8_t feature_report[2] = {(mode & 0xff00) >> 8, (mode & 0x00ff)};
+		omron_log_event(dev, OMRON_EVENT_MODE, status, feature_report, 2);
+	}
+	omron_unlock(dev);
 	return status;
 }
 
-//daily data information
-OMRON_DECLSPEC int omron_get_daily_data_count(omron_device* dev, unsigned char bank)
+OMRON_DECLSPEC int omron_read_data(omron_device* dev, uint8_t *report_buf, int report_size, int timeout)
 {
-	unsigned char data[8];
-	unsigned char command[8] =
-		{ 'G', 'D', 'C', 0x00, bank, 0x00, 0x00, bank };
+	int status;
+
+	omron_lock(dev);
+	if (!dev->transport) {
+		omron_unlock(dev);
+		return OMRON_ERR_NOTOPEN;
+	}
+	status = dev->transport->read_data(dev, report_buf, report_size, timeout);
+	MSG_EVENT(dev, OMRON_EVENT_READ, OMRON_DEBUG_DEVIO, "read: ", status, report_buf, status);
+	omron_unlock(dev);
+	return status;
+}
+
+OMRON_DECLSPEC int omron_write_data(omron_device* dev, uint8_t *report_buf, int report_size, int timeout)
+{
+	int status;
+
+	omron_lock(dev);
+	if (!dev->transport) {
+		omron_unlock(dev);
+		return OMRON_ERR_NOTOPEN;
+	}
+	status = dev->transport->write_data(dev, report_buf, report_size, timeout);
+	MSG_EVENT(dev, OMRON_EVENT_WRITE, OMRON_DEBUG_DEVIO, "wrote: ", status, report_buf, status);
+	omron_unlock(dev);
+	return status;
+}
+
+int omron_poll_read(omron_device* dev, uint8_t* report_buf, int report_size)
+{
+	int status;
+
+	if (!dev->transport) return OMRON_ERR_NOTOPEN;
+	if (!dev->transport->poll_read) return OMRON_ERR_UNSUPPORTED;
+	status = dev->transport->poll_read(dev, report_buf, report_size);
+	// Empty polls are not worth an event
+	if (status) {
+		MSG_EVENT(dev, OMRON_EVENT_READ, OMRON_DEBUG_DEVIO, "read: ", status, report_buf, status);
+	}
+	return status;
+}
+
+int omron_drain_input(omron_device* dev)
+{
+	int status;
+
+	if (!dev->transport) return OMRON_ERR_NOTOPEN;
+	status = dev->transport->drain_input(dev);
+	if (dev->events) omron_log_event(dev, OMRON_EVENT_DRAIN, status, NULL, 0);
+	return status;
+}
+
+OMRON_DECLSPEC omron_device* omron_create()
+{
+	omron_device* dev;
+
+	omron_set_debug_level(-1); // Initialize to default if not already set
+	MSG_INFO("Creating new device.\n");
+	dev = omron_create_device();
+	if (dev && omron_init_device(dev) < 0) {
+		MSG_ERROR("Cannot create device lock\n");
+		omron_delete(dev);
+		return NULL;
+	}
+	return dev;
+}
+
+OMRON_DECLSPEC int omron_set_pipeline_depth(omron_device* dev, int depth)
+{
+	if (depth < 1 || depth > OMRON_MAX_PIPELINE_DEPTH) {
+		MSG_ERROR("Invalid pipeline depth %d\n", depth);
+		return OMRON_ERR_BADARG;
+	}
+	omron_lock(dev);
+	dev->pipeline_depth = depth;
+	omron_unlock(dev);
+	return 0;
+}
+
+OMRON_DECLSPEC void omron_default_retry_policy(omron_retry_policy* policy)
+{
+	policy->retries = 1;
+	policy->resyncs = 1;
+	policy->clear_attempts = 4;
+	policy->min_timeout_ms = 100;
+	policy->max_timeout_ms = 1000;
+	policy->rtt_deviations = 4;
+	policy->backoff_ms = 10;
+	policy->max_backoff_ms = 200;
+	policy->retry_budget = 32;
+}
+
+OMRON_DECLSPEC int omron_set_retry_policy(omron_device* dev, const omron_retry_policy* policy)
+{
+	omron_retry_policy defaults;
+
+	if (!policy) {
+		omron_default_retry_policy(&defaults);
+		policy = &defaults;
+	} else if (policy->retries < 0 || policy->resyncs < 0 || policy->clear_attempts < 1 ||
+		   policy->min_timeout_ms < 1 || policy->max_timeout_ms < policy->min_timeout_ms ||
+		   policy->rtt_deviations < 0 || policy->backoff_ms < 0 ||
+		   policy->max_backoff_ms < policy->backoff_ms || policy->retry_budget < -1) {
+		MSG_ERROR("Invalid retry policy\n");
+		return OMRON_ERR_BADARG;
+	}
+	omron_lock(dev);
+	dev->retry_policy = *policy;
+	dev->retries_left = dev->retry_policy.retry_budget;
+	omron_unlock(dev);
+	return 0;
+}
+
+OMRON_DECLSPEC int omron_get_device_version(omron_device* dev, unsigned char* data, int data_size)
+{
+	int status;
+	const int response_size = 12;
+
+	if (data_size <= response_size) {
+		MSG_ERROR("Supplied buffer too small (%d < %d)\n", data_size, response_size + 1);
+		return OMRON_ERR_BUFSIZE;
+	}
+	status = omron_dev_info_command(dev, "VER00", data, response_size);
+	if (status < 0) return status;
+	data[status] = 0;
+	return status;
+}
+
+OMRON_DECLSPEC int omron_get_bp_profile(omron_device* dev, unsigned char* data, int data_size)
+{
+	int status;
+	const int response_size = 11;
+
+	if (data_size <= response_size) {
+		MSG_ERROR("Supplied buffer too small (%d < %d)\n", data_size, response_size + 1);
+		return OMRON_ERR_BUFSIZE;
+	}
+	status = omron_dev_info_command(dev, "PRF00", data, response_size);
+	if (status < 0) return status;
+	data[status] = 0;
+	return status;
+}
+
+OMRON_DECLSPEC int omron_get_device_serial(omron_device* dev, unsigned char* data, int data_size)
+{
+	int status;
+	const int response_size = 8;
+
+	if (data_size <= response_size) {
+		MSG_ERROR("Supplied buffer too small (%d < %d)\n", data_size, response_size + 1);
+		return OMRON_ERR_BUFSIZE;
+	}
+	status = omron_dev_info_command(dev, "SRL00", data, response_size);
+	if (status < 0) return status;
+	data[status] = 0;
+	return status;
+}
+
+//daily data information
+OMRON_DECLSPEC int omron_get_daily_data_count(omron_device* dev, unsigned char bank)
+{
+	unsigned char data[8];
+	unsigned char command[8] =
+		{ 'G', 'D', 'C', 0x00, bank, 0x00, 0x00, bank };
 	int status;
 
 	status = omron_exchange_cmd(dev, DAILY_INFO_MODE, sizeof(command), command,
@@ -479,44 +1086,186 @@ OMRON_DECLSPEC int omron_get_daily_data_count(omron_device* dev, unsigned char b
 	return (int)data[6];
 }
 
-OMRON_DECLSPEC omron_bp_day_info omron_get_daily_bp_data(omron_device* dev, int bank, int index)
+static void omron_fill_bp_day_command(unsigned char *command, int bank, int index)
+{
+	command[0] = 'G';
+	command[1] = 'M';
+	command[2] = 'E';
+	command[3] = 0x00;
+	command[4] = bank;
+	command[5] = 0x00;
+	command[6] = index;
+	command[7] = index ^ bank;
+}
+
+/*
+ * Validate a GME response and unpack it. Returns 0 on success, or < 0 if the
+ * response is not a complete "OK" record.
+ */
+static int omron_parse_bp_day(int status, const unsigned char *data, omron_bp_day_info *r)
+{
+	memset(r, 0, sizeof(*r));
+	if (status < 0) {
+		return status;
+	} else if (status != 17) {
+		MSG_ERROR("Returned data size (%d) does not match expected size (%d)!\n", status, 17);
+		return OMRON_ERR_BADDATA;
+	} else if (omron_check_success((unsigned char*)data)) {
+		MSG_ERROR("Request failed.\n");
+		return OMRON_ERR_BADDATA;
+	}
+	r->present = 1;
+	r->year = data[3];
+	r->month = data[4];
+	r->day = data[5];
+	r->hour = data[6];
+	r->minute = data[7];
+	r->second = data[8];
+	// Unknown: 9..10
+	r->sys = data[11];
+	r->dia = data[12];
+	r->pulse = data[13];
+	// Unknown: 14..16
+	return 0;
+}
+
+static int omron_get_bp_day(omron_device* dev, int bank, int index, omron_bp_day_info *r)
 {
-	omron_bp_day_info r;
 	unsigned char data[17];
-	unsigned char command[8] = {'G', 'M', 'E', 0x00, bank, 0x00,
-				    index, index ^ bank};
+	unsigned char command[8];
 	int status;
 
-	memset(&r, 0 , sizeof(r));
+	omron_fill_bp_day_command(command, bank, index);
 	memset(data, 0, sizeof(data));
-
 	status = omron_exchange_cmd(dev, DAILY_INFO_MODE, sizeof(command), command,
 			   sizeof(data), data);
+	return omron_parse_bp_day(status, data, r);
+}
 
-	if (status != sizeof(data)) {
-		MSG_ERROR("Returned data size (%d) does not match expected size (%lu)!\n", status, sizeof(data));
-		//FIXME: We need a way to return an error result from this function
-		r.present = 0;
-	} else if (omron_check_success(data)) {
-		MSG_ERROR("Request failed.\n");
-		r.present = 0;
-	} else {
-		r.present = 1;
-		r.year = data[3];
-		r.month = data[4];
-		r.day = data[5];
-		r.hour = data[6];
-		r.minute = data[7];
-		r.second = data[8];
-		// Unknown: 9..10
-		r.sys = data[11];
-		r.dia = data[12];
-		r.pulse = data[13];
-		// Unknown: 14..16
-	}
+OMRON_DECLSPEC omron_bp_day_info omron_get_daily_bp_data(omron_device* dev, int bank, int index)
+{
+	omron_bp_day_info r;
+
+	//FIXME: We need a way to return an error result from this function
+	//       (use omron_get_daily_bp_range() if you need one)
+	omron_get_bp_day(dev, bank, index, &r);
 	return r;
 }
 
+/*
+ * Nonzero if record i sorts strictly between the nearest present records
+ * around it (index 0 is the newest). No two readings share a second, so
+ * a record with a neighbour's timestamp is that neighbour's answer.
+ */
+static int omron_bp_in_order(const omron_bp_day_info* data, int count, int i)
+{
+	int64_t t = omron_bp_timestamp(&data[i]);
+	int j;
+
+	for (j = i - 1; j >= 0 && !data[j].present; --j);
+	if (j >= 0 && omron_bp_timestamp(&data[j]) <= t) return 0;
+	for (j = i + 1; j < count && !data[j].present; ++j);
+	if (j < count && omron_bp_timestamp(&data[j]) >= t) return 0;
+	return 1;
+}
+
+static int omron_read_bp_range(omron_device* dev, int bank, int first, int last, omron_bp_day_info* data, int* status)
+{
+	unsigned char response[17];
+	unsigned char command[8];
+	int count = last - first + 1;
+	int sent = 0;
+	int received = 0;
+	int read_ok = 0;
+	int rec_status;
+	int send_status = 0;
+	omron_stats* stats;
+	int ret;
+	int i;
+
+	if (first < 0 || count < 1 || !data) {
+		MSG_ERROR("Invalid range %d..%d\n", first, last);
+		return OMRON_ERR_BADARG;
+	}
+	for (i = 0; i < count; ++i) {
+		memset(&data[i], 0, sizeof(data[i]));
+		if (status) status[i] = OMRON_ERR_BADDATA;
+	}
+
+	ret = omron_check_mode(dev, DAILY_INFO_MODE);
+	if (ret < 0) return ret;
+
+	// Keep up to pipeline_depth GME commands queued ahead of the response
+	// we're waiting on. Anything other than a clean "OK" or "NO" means the
+	// stream is out of step, so stop pipelining and finish one at a time.
+	MSG_INFO("Reading records %d..%d (pipeline depth %d)\n", first, last, dev->pipeline_depth);
+	while (received < count) {
+		while (sent < count && sent - received < dev->pipeline_depth) {
+			omron_fill_bp_day_command(command, bank, first + sent);
+			send_status = omron_send_command(dev, sizeof(command), command);
+			if (send_status < 0) break;
+			++sent;
+		}
+		if (send_status < 0) {
+			ret = send_status;
+			break;
+		}
+
+		memset(response, 0, sizeof(response));
+		ret = omron_get_command_return(dev, sizeof(response), response);
+		if (ret == OMRON_ERR_NEGRESP) {
+			// Device asks us to requery, done below
+			if (status) status[received] = ret;
+			++received;
+			continue;
+		}
+		rec_status = omron_parse_bp_day(ret, response, &data[received]);
+		if (rec_status < 0) break;
+		if (status) status[received] = 0;
+		++read_ok;
+		++received;
+	}
+
+	if (received < count) {
+		MSG_WARN("Pipelined read broke off at index %d (%d).  Resyncing...\n", first + received, ret);
+		stats = omron_stats_of(dev);
+		if (stats) stats->pipeline_breaks++;
+		ret = omron_flush(dev);
+		if (ret < 0) return ret;
+	}
+
+	// Everything not read cleanly above (including "NO" responses) gets
+	// one more try through the normal retrying exchange. A GME response
+	// does not say which record it is, so one that is out of order with
+	// the records around it may be a late answer to a command from before
+	// the break. Fail that record rather than store it at the wrong index,
+	// it may as well be genuine (the clock was set back), so the caller
+	// decides.
+	for (i = 0; i < count; ++i) {
+		if (data[i].present) continue;
+		rec_status = omron_get_bp_day(dev, bank, first + i, &data[i]);
+		if (rec_status == 0 && !omron_bp_in_order(data, count, i)) {
+			MSG_WARN("Record %d is out of order with its neighbours\n", first + i);
+			memset(&data[i], 0, sizeof(data[i]));
+			rec_status = OMRON_ERR_BADDATA;
+			dev->input_dirty = 1;
+		}
+		if (status) status[i] = rec_status;
+		if (rec_status == 0) ++read_ok;
+	}
+	return read_ok;
+}
+
+OMRON_DECLSPEC int omron_get_daily_bp_range(omron_device* dev, int bank, int first, int last, omron_bp_day_info* data, int* status)
+{
+	int ret;
+
+	omron_lock(dev);
+	ret = omron_read_bp_range(dev, bank, first, last, data, status);
+	omron_unlock(dev);
+	return ret;
+}
+
 OMRON_DECLSPEC omron_bp_week_info omron_get_weekly_bp_data(omron_device* dev, int bank, int index, int evening)
 {
 	omron_bp_week_info r;
@@ -561,24 +1310,31 @@ OMRON_DECLSPEC omron_bp_week_info omron_get_weekly_bp_data(omron_device* dev, in
 	return r;
 }
 
-OMRON_DECLSPEC omron_pd_profile_info omron_get_pd_profile(omron_device* dev)
+OMRON_DECLSPEC int omron_read_pd_profile(omron_device* dev, omron_pd_profile_info* profile_info)
 {
 	unsigned char data[11];
-	omron_pd_profile_info profile_info;
+	const omron_bcd_field* f = pd_profile_fields;
 	int status;
 
+	memset(profile_info, 0, sizeof(*profile_info));
 	status = omron_dev_info_command(dev, "PRF00", data, sizeof(data));
-	if (status == sizeof(data)) {
-		// Unknown: 0..1
-		profile_info.weight = bcd_to_int(data, 2, 4) / 10;
-		// Unknown: 4..5
-		profile_info.stride = bcd_to_int(data, 6, 4) / 10;
-		// Unknown: 8..10
-	} else {
+	if (status < 0) return status;
+	if (status != sizeof(data)) {
 		MSG_ERROR("Returned data size (%d) does not match expected size (%lu)!\n", status, sizeof(data));
-		//FIXME: We need a way to return an error result from this function
-		memset(&profile_info, 0, sizeof(profile_info));
+		return OMRON_ERR_BADDATA;
 	}
+	profile_info->weight = bcd_field(data, &f[PD_PROFILE_WEIGHT]) / f[PD_PROFILE_WEIGHT].scale;
+	profile_info->stride = bcd_field(data, &f[PD_PROFILE_STRIDE]) / f[PD_PROFILE_STRIDE].scale;
+	return 0;
+}
+
+OMRON_DECLSPEC omron_pd_profile_info omron_get_pd_profile(omron_device* dev)
+{
+	omron_pd_profile_info profile_info;
+
+	//FIXME: We need a way to return an error result from this function
+	//       (use omron_read_pd_profile() if you need one)
+	omron_read_pd_profile(dev, &profile_info);
 	return profile_info;
 }
 
@@ -593,76 +1349,112 @@ OMRON_DECLSPEC int omron_clear_pd_memory(omron_device* dev)
 	return omron_check_success(data);
 }
 
-OMRON_DECLSPEC omron_pd_count_info omron_get_pd_data_count(omron_device* dev)
+OMRON_DECLSPEC int omron_read_pd_data_count(omron_device* dev, omron_pd_count_info* count_info)
 {
-	omron_pd_count_info count_info;
 	unsigned char data[5];
 	int status;
 
+	memset(count_info, 0, sizeof(*count_info));
 	status = omron_dev_info_command(dev, "CNT00", data, sizeof(data));
-	if (status == sizeof(data)) {
-		// Unknown: 0
-		count_info.daily_count = data[1];
-		// Unknown: 2
-		count_info.hourly_count = data[3];
-		// Unknown: 4
-	} else {
+	if (status < 0) return status;
+	if (status != sizeof(data)) {
 		MSG_ERROR("Returned data size (%d) does not match expected size (%lu)!\n", status, sizeof(data));
-		//FIXME: We need a way to return an error result from this function
-		memset(&count_info, 0, sizeof(count_info));
+		return OMRON_ERR_BADDATA;
 	}
+	// Unknown: 0
+	count_info->daily_count = data[1];
+	// Unknown: 2
+	count_info->hourly_count = data[3];
+	// Unknown: 4
+	return 0;
+}
+
+OMRON_DECLSPEC omron_pd_count_info omron_get_pd_data_count(omron_device* dev)
+{
+	omron_pd_count_info count_info;
+
+	//FIXME: We need a way to return an error result from this function
+	//       (use omron_read_pd_data_count() if you need one)
+	omron_read_pd_data_count(dev, &count_info);
 	return count_info;
 }
 
-OMRON_DECLSPEC omron_pd_daily_data omron_get_pd_daily_data(omron_device* dev, int day)
+static void omron_decode_pd_daily(const unsigned char *data, int day, omron_pd_daily_data* daily_data)
+{
+	const omron_bcd_field* f = pd_daily_fields;
+
+	daily_data->total_steps = bcd_field(data, &f[PD_DAILY_STEPS]);
+	daily_data->total_aerobic_steps = bcd_field(data, &f[PD_DAILY_AEROBIC_STEPS]);
+	daily_data->total_aerobic_walking_time = bcd_field(data, &f[PD_DAILY_AEROBIC_TIME]);
+	daily_data->total_calories = bcd_field(data, &f[PD_DAILY_CALORIES]);
+	daily_data->total_distance = bcd_field(data, &f[PD_DAILY_DISTANCE]) / (double)f[PD_DAILY_DISTANCE].scale;
+	daily_data->total_fat_burn = bcd_field(data, &f[PD_DAILY_FAT_BURN]) / (double)f[PD_DAILY_FAT_BURN].scale;
+	daily_data->day_serial = day;
+}
+
+OMRON_DECLSPEC void omron_decode_pd_daily_records(const uint8_t* raw, int count, int first_day, omron_pd_daily_data* data)
+{
+	int i;
+
+	for (i = 0; i < count; ++i) {
+		omron_decode_pd_daily(raw + i * OMRON_PD_DAILY_RECORD_SIZE, first_day + i, &data[i]);
+	}
+}
+
+OMRON_DECLSPEC int omron_read_pd_daily_raw(omron_device* dev, int day, uint8_t* raw)
 {
-	omron_pd_daily_data daily_data;
-	unsigned char data[20];
 	unsigned char command[7] =
 		{ 'M', 'E', 'S', 0x00, 0x00, day, 0x00 ^ day};
 	int status;
 
 	status = omron_exchange_cmd(dev, PEDOMETER_MODE, sizeof(command), command,
-			   sizeof(data), data);
-	if (status == sizeof(data)) {
-		daily_data.total_steps = bcd_to_int2(data, 6, 5);
-		daily_data.total_aerobic_steps = bcd_to_int2(data, 11, 5);
-		daily_data.total_aerobic_walking_time = bcd_to_int2(data, 16, 4);
-		daily_data.total_calories = bcd_to_int2(data, 20, 5);
-		daily_data.total_distance = bcd_to_int2(data, 25, 5) / 100.0;
-		daily_data.total_fat_burn = bcd_to_int2(data, 30, 4) / 10.0;
-		// Unknown: 17..19
-		daily_data.day_serial = day;
-	} else {
-		MSG_ERROR("Returned data size (%d) does not match expected size (%lu)!\n", status, sizeof(data));
-		//FIXME: We need a way to return an error result from this function
-		memset(&daily_data, 0, sizeof(daily_data));
+			   OMRON_PD_DAILY_RECORD_SIZE, raw);
+	if (status < 0) return status;
+	if (status != OMRON_PD_DAILY_RECORD_SIZE) {
+		MSG_ERROR("Returned data size (%d) does not match expected size (%d)!\n", status, OMRON_PD_DAILY_RECORD_SIZE);
+		return OMRON_ERR_BADDATA;
 	}
+	return 0;
+}
+
+OMRON_DECLSPEC int omron_read_pd_daily_data(omron_device* dev, int day, omron_pd_daily_data* daily_data)
+{
+	unsigned char data[OMRON_PD_DAILY_RECORD_SIZE];
+	int status;
+
+	memset(daily_data, 0, sizeof(*daily_data));
+	status = omron_read_pd_daily_raw(dev, day, data);
+	if (status < 0) return status;
+	omron_decode_pd_daily(data, day, daily_data);
+	return 0;
+}
+
+OMRON_DECLSPEC omron_pd_daily_data omron_get_pd_daily_data(omron_device* dev, int day)
+{
+	omron_pd_daily_data daily_data;
+
+	//FIXME: We need a way to return an error result from this function
+	//       (use omron_read_pd_daily_data() if you need one)
+	omron_read_pd_daily_data(dev, day, &daily_data);
 	return daily_data;
 }
 
-OMRON_DECLSPEC omron_pd_hourly_data* omron_get_pd_hourly_data(omron_device* dev, int day)
+OMRON_DECLSPEC int omron_read_pd_hourly_data(omron_device* dev, int day, omron_pd_hourly_data* hourly_data)
 {
-	omron_pd_hourly_data* hourly_data = malloc(sizeof(omron_pd_hourly_data) * 24);
 	unsigned char data[37];
 	int status;
-
-	if (!hourly_data) {
-		return NULL;
-	}
 	int i, j;
+
 	for(i = 0; i < 3; ++i)
 	{
 		unsigned char command[8] =
 			{ 'G', 'T', 'D', 0x00, 0, day, i + 1, day ^ (i + 1)};
 		status = omron_exchange_cmd(dev, PEDOMETER_MODE, sizeof(command), command,
 						   sizeof(data), data);
+		if (status < 0) return status;
 		if (status != sizeof(data)) {
 			MSG_ERROR("Returned data size (%d) does not match expected size (%lu)!\n", status, sizeof(data));
-			//FIXME: would be better if we had a way to return an
-			//       actual error code instead of just NULL
-			free(hourly_data);
-			return NULL;
+			return OMRON_ERR_BADDATA;
 		}
 		for(j = 0; j <= 7; ++j)
 		{
@@ -676,5 +1468,354 @@ OMRON_DECLSPEC omron_pd_hourly_data* omron_get_pd_hourly_data(omron_device* dev,
 			hourly_data[hour].day_serial = day;
 		}
 	}
+	return 0;
+}
+
+OMRON_DECLSPEC omron_pd_hourly_data* omron_get_pd_hourly_data(omron_device* dev, int day)
+{
+	omron_pd_hourly_data* hourly_data = malloc(sizeof(omron_pd_hourly_data) * 24);
+
+	if (!hourly_data) {
+		return NULL;
+	}
+	//FIXME: would be better if we had a way to return an
+	//       actual error code instead of just NULL
+	//       (use omron_read_pd_hourly_data() if you need one)
+	if (omron_read_pd_hourly_data(dev, day, hourly_data) < 0) {
+		free(hourly_data);
+		return NULL;
+	}
 	return hourly_data;
 }
+
+/// Commands per day of a pedometer history: MES, then GTD blocks 1..3
+#define PD_DAY_COMMANDS 4
+/// Size of a GTD response (8 hours, including "OK")
+#define PD_HOURLY_BLOCK_SIZE 37
+
+/*
+ * Fill the command for one part of a day of pedometer data, the MES daily
+ * record for block 0 and GTD hourly block 1..3 otherwise. Returns the
+ * command length.
+ */
+static int omron_fill_pd_command(unsigned char *command, int day, int block)
+{
+	if (block == 0) {
+		command[0] = 'M';
+		command[1] = 'E';
+		command[2] = 'S';
+		command[3] = 0x00;
+		command[4] = 0x00;
+		command[5] = day;
+		command[6] = 0x00 ^ day;
+		return 7;
+	}
+	command[0] = 'G';
+	command[1] = 'T';
+	command[2] = 'D';
+	command[3] = 0x00;
+	command[4] = 0x00;
+	command[5] = day;
+	command[6] = block;
+	command[7] = day ^ block;
+	return 8;
+}
+
+static int omron_pd_response_size(int block)
+{
+	return block == 0 ? OMRON_PD_DAILY_RECORD_SIZE : PD_HOURLY_BLOCK_SIZE;
+}
+
+/*
+ * Validate the response to omron_fill_pd_command() and decode it into
+ * entry index of a history. Returns 0 on success, or < 0 on error.
+ */
+static int omron_parse_pd_block(int status, const unsigned char *data, omron_pd_history* history, int index, int block)
+{
+	int size = omron_pd_response_size(block);
+	int base = index * 24 + (block - 1) * 8;
+	int offset;
+	int j;
+
+	if (status < 0) return status;
+	if (status != size) {
+		MSG_ERROR("Returned data size (%d) does not match expected size (%d)!\n", status, size);
+		return OMRON_ERR_BADDATA;
+	}
+	if (block == 0) {
+		omron_decode_pd_daily(data, history->first_day + index, &history->daily[index]);
+		return 0;
+	}
+	for (j = 0; j < 8; ++j) {
+		offset = j * 4 + 4;
+		history->is_attached[base + j] = (data[offset] & (1 << 6)) > 0;
+		history->regular_steps[base + j] = ((data[offset] & (~0xc0)) << 8) | data[offset + 1];
+		history->event[base + j] = (data[offset + 2] & (1 << 6)) > 0;
+		history->aerobic_steps[base + j] = ((data[offset + 2] & (~0xc0)) << 8) | data[offset + 3];
+	}
+	return 0;
+}
+
+static int omron_get_pd_history_day(omron_device* dev, omron_pd_history* history, int index)
+{
+	unsigned char data[PD_HOURLY_BLOCK_SIZE];
+	unsigned char command[8];
+	int status;
+	int block;
+	int len;
+
+	for (block = 0; block < PD_DAY_COMMANDS; ++block) {
+		len = omron_fill_pd_command(command, history->first_day + index, block);
+		memset(data, 0, sizeof(data));
+		status = omron_exchange_cmd(dev, PEDOMETER_MODE, len, command,
+					    omron_pd_response_size(block), data);
+		status = omron_parse_pd_block(status, data, history, index, block);
+		if (status < 0) return status;
+	}
+	return 0;
+}
+
+OMRON_DECLSPEC omron_pd_history* omron_pd_history_create(int days)
+{
+	omron_pd_history* history;
+	size_t hours;
+
+	if (days < 1) return NULL;
+	hours = (size_t)days * 24;
+	// Widest columns first, so each one stays aligned
+	history = calloc(1, sizeof(*history) +
+			 days * (sizeof(*history->daily) + sizeof(*history->status)) +
+			 hours * (sizeof(*history->regular_steps) + sizeof(*history->aerobic_steps) +
+				  sizeof(*history->is_attached) + sizeof(*history->event)));
+	if (!history) return NULL;
+	history->max_days = days;
+	history->daily = (omron_pd_daily_data*)(history + 1);
+	history->status = (int32_t*)(history->daily + days);
+	history->regular_steps = history->status + days;
+	history->aerobic_steps = history->regular_steps + hours;
+	history->is_attached = (uint8_t*)(history->aerobic_steps + hours);
+	history->event = history->is_attached + hours;
+	return history;
+}
+
+OMRON_DECLSPEC void omron_pd_history_delete(omron_pd_history* history)
+{
+	free(history);
+}
+
+/*
+ * Nonzero if the daily totals of entry index of a history add up to its
+ * hours, as they do on real units. Today is still being counted, so it
+ * always passes.
+ */
+static int omron_pd_day_consistent(const omron_pd_history* history, int index)
+{
+	int steps = 0;
+	int aerobic = 0;
+	int hour;
+
+	if (history->first_day + index == 0) return 1;
+	for (hour = index * 24; hour < (index + 1) * 24; ++hour) {
+		steps += history->regular_steps[hour];
+		aerobic += history->aerobic_steps[hour];
+	}
+	return history->daily[index].total_steps == steps &&
+		history->daily[index].total_aerobic_steps == aerobic;
+}
+
+static int omron_read_pd_history(omron_device* dev, int first, int last, omron_pd_history* history)
+{
+	unsigned char response[PD_HOURLY_BLOCK_SIZE];
+	unsigned char command[8];
+	int count = last - first + 1;
+	int total = count * PD_DAY_COMMANDS;
+	int sent = 0;
+	int received = 0;
+	int read_ok = 0;
+	int day_ok = 0;
+	int send_status = 0;
+	omron_stats* stats;
+	int index;
+	int block;
+	int ret;
+	int i;
+
+	if (first < 0 || count < 1 || !history || count > history->max_days) {
+		MSG_ERROR("Invalid range %d..%d\n", first, last);
+		return OMRON_ERR_BADARG;
+	}
+	history->first_day = first;
+	history->days = count;
+	for (i = 0; i < count; ++i) {
+		history->status[i] = OMRON_ERR_BADDATA;
+	}
+	memset(history->daily, 0, count * sizeof(*history->daily));
+	memset(history->regular_steps, 0, count * 24 * sizeof(*history->regular_steps));
+	memset(history->aerobic_steps, 0, count * 24 * sizeof(*history->aerobic_steps));
+	memset(history->is_attached, 0, count * 24 * sizeof(*history->is_attached));
+	memset(history->event, 0, count * 24 * sizeof(*history->event));
+
+	ret = omron_check_mode(dev, PEDOMETER_MODE);
+	if (ret < 0) return ret;
+
+	// Same as omron_read_bp_range(), only with four commands per day. A
+	// day counts once its MES and all three GTD blocks came back "OK" and
+	// its totals match its hours.
+	MSG_INFO("Reading pedometer days %d..%d (pipeline depth %d)\n", first, last, dev->pipeline_depth);
+	while (received < total) {
+		while (sent < total && sent - received < dev->pipeline_depth) {
+			i = omron_fill_pd_command(command, first + sent / PD_DAY_COMMANDS, sent % PD_DAY_COMMANDS);
+			send_status = omron_send_command(dev, i, command);
+			if (send_status < 0) break;
+			++sent;
+		}
+		if (send_status < 0) {
+			ret = send_status;
+			break;
+		}
+
+		index = received / PD_DAY_COMMANDS;
+		block = received % PD_DAY_COMMANDS;
+		if (block == 0) day_ok = 1;
+		memset(response, 0, sizeof(response));
+		ret = omron_get_command_return(dev, omron_pd_response_size(block), response);
+		if (ret == OMRON_ERR_NEGRESP) {
+			// Device asks us to requery, the whole day is done again below
+			day_ok = 0;
+		} else {
+			ret = omron_parse_pd_block(ret, response, history, index, block);
+			if (ret < 0) break;
+		}
+		++received;
+		// A day that doesn't add up is read again below
+		if (block == PD_DAY_COMMANDS - 1 && day_ok && omron_pd_day_consistent(history, index)) {
+			history->status[index] = 0;
+			++read_ok;
+		}
+	}
+
+	if (received < total) {
+		MSG_WARN("Pipelined read broke off at day %d (%d).  Resyncing...\n", first + received / PD_DAY_COMMANDS, ret);
+		stats = omron_stats_of(dev);
+		if (stats) stats->pipeline_breaks++;
+		ret = omron_flush(dev);
+		if (ret < 0) return ret;
+	}
+
+	// As for BP ranges, a day read again after a break may be made up of
+	// late answers to commands from before it. Its totals won't match its
+	// hours then, so fail that day rather than keep it.
+	for (i = 0; i < count; ++i) {
+		if (history->status[i] == 0) continue;
+		history->status[i] = omron_get_pd_history_day(dev, history, i);
+		if (history->status[i] == 0 && !omron_pd_day_consistent(history, i)) {
+			MSG_WARN("Totals of day %d do not match its hours\n", first + i);
+			memset(&history->daily[i], 0, sizeof(history->daily[i]));
+			memset(history->regular_steps + i * 24, 0, 24 * sizeof(*history->regular_steps));
+			memset(history->aerobic_steps + i * 24, 0, 24 * sizeof(*history->aerobic_steps));
+			memset(history->is_attached + i * 24, 0, 24 * sizeof(*history->is_attached));
+			memset(history->event + i * 24, 0, 24 * sizeof(*history->event));
+			history->status[i] = OMRON_ERR_BADDATA;
+			dev->input_dirty = 1;
+		}
+		if (history->status[i] == 0) ++read_ok;
+	}
+	return read_ok;
+}
+
+OMRON_DECLSPEC int omron_get_pd_history(omron_device* dev, int first, int last, omron_pd_history* history)
+{
+	int ret;
+
+	omron_lock(dev);
+	ret = omron_read_pd_history(dev, first, last, history);
+	omron_unlock(dev);
+	return ret;
+}
+
+OMRON_DECLSPEC void omron_pd_history_hours(const omron_pd_history* history, int index, omron_pd_hourly_data* data)
+{
+	int base = index * 24;
+	int hour;
+
+	for (hour = 0; hour < 24; ++hour) {
+		data[hour].day_serial = history->first_day + index;
+		data[hour].hour_serial = hour;
+		data[hour].is_attached = history->is_attached[base + hour];
+		data[hour].event = history->event[base + hour];
+		data[hour].regular_steps = history->regular_steps[base + hour];
+		data[hour].aerobic_steps = history->aerobic_steps[base + hour];
+	}
+}
+
+//non-blocking command builders and decoders
+
+OMRON_DECLSPEC int omron_cmd_daily_data_count(omron_async_cmd* cmd, int bank)
+{
+	unsigned char command[8] =
+		{ 'G', 'D', 'C', 0x00, bank, 0x00, 0x00, bank };
+
+	return omron_cmd_init(cmd, DAILY_INFO_MODE, command, sizeof(command), 8);
+}
+
+OMRON_DECLSPEC int omron_decode_daily_data_count(const omron_async_cmd* cmd)
+{
+	if (cmd->status < 0) return cmd->status;
+	if (cmd->status != 8) {
+		MSG_ERROR("Returned data size (%d) does not match expected size (%d)!\n", cmd->status, 8);
+		return OMRON_ERR_BADDATA;
+	}
+	return (int)cmd->response[6];
+}
+
+OMRON_DECLSPEC int omron_cmd_daily_bp_data(omron_async_cmd* cmd, int bank, int index)
+{
+	unsigned char command[8];
+
+	omron_fill_bp_day_command(command, bank, index);
+	return omron_cmd_init(cmd, DAILY_INFO_MODE, command, sizeof(command), 17);
+}
+
+OMRON_DECLSPEC int omron_decode_daily_bp_data(const omron_async_cmd* cmd, omron_bp_day_info* data)
+{
+	return omron_parse_bp_day(cmd->status, cmd->response, data);
+}
+
+OMRON_DECLSPEC int omron_cmd_pd_data_count(omron_async_cmd* cmd)
+{
+	return omron_cmd_init(cmd, PEDOMETER_MODE, (const uint8_t*)"CNT00", 5, 8);
+}
+
+OMRON_DECLSPEC int omron_decode_pd_data_count(const omron_async_cmd* cmd, omron_pd_count_info* data)
+{
+	memset(data, 0, sizeof(*data));
+	if (cmd->status < 0) return cmd->status;
+	if (cmd->status != 8) {
+		MSG_ERROR("Returned data size (%d) does not match expected size (%d)!\n", cmd->status, 8);
+		return OMRON_ERR_BADDATA;
+	}
+	// Same layout as for omron_get_pd_data_count(), after "OK" and one byte
+	data->daily_count = cmd->response[4];
+	data->hourly_count = cmd->response[6];
+	return 0;
+}
+
+OMRON_DECLSPEC int omron_cmd_pd_daily_data(omron_async_cmd* cmd, int day)
+{
+	unsigned char command[7] =
+		{ 'M', 'E', 'S', 0x00, 0x00, day, 0x00 ^ day};
+
+	return omron_cmd_init(cmd, PEDOMETER_MODE, command, sizeof(command), OMRON_PD_DAILY_RECORD_SIZE);
+}
+
+OMRON_DECLSPEC int omron_decode_pd_daily_data(const omron_async_cmd* cmd, omron_pd_daily_data* data)
+{
+	memset(data, 0, sizeof(*data));
+	if (cmd->status < 0) return cmd->status;
+	if (cmd->status != OMRON_PD_DAILY_RECORD_SIZE) {
+		MSG_ERROR("Returned data size (%d) does not match expected size (%d)!\n", cmd->status, OMRON_PD_DAILY_RECORD_SIZE);
+		return OMRON_ERR_BADDATA;
+	}
+	omron_decode_pd_daily(cmd->response, cmd->command[5], data);
+	return 0;
+}
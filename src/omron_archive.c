@@ -0,0 +1,620 @@
+/*
+ * Columnar archive of downloaded readings for Omron Health User Space Driver
+ *
+ * Copyright (c) 2009-2010 Kyle Machulis <kyle@nonpolynomial.com>
+ *
+ * More info on Nonpolynomial Labs @ http://www.nonpolynomial.com
+ *
+ * Sourceforge project @ http://www.github.com/qdot/libomron/
+ *
+ * This library is covered by the BSD License
+ * Read LICENSE_BSD.txt for details.
+ */
+
+#include "libomron/omron.h"
+#include "omron_internal.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(WIN32)
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/// First bytes of every archive, bump the digit if the format changes
+#define ARCHIVE_MAGIC "OMARCH1\n"
+#define ARCHIVE_MAGIC_LEN 8
+/// Stored in native byte order after the magic, so foreign archives do not match
+#define ARCHIVE_BYTE_ORDER 0x01020304
+/// Size of the file header (magic, byte order, reserved word)
+#define ARCHIVE_HEADER_LEN 16
+/// First word of every block ("BLK1" on little endian machines)
+#define ARCHIVE_BLOCK_MAGIC 0x314b4c42
+/// Columns start on multiples of this, so the mapped values are aligned
+#define ARCHIVE_ALIGN 8
+/// Most columns of any table
+#define ARCHIVE_MAX_COLUMNS 9
+/// stdio buffer for archives, holds a block of the wider table
+#define ARCHIVE_BUFFER_SIZE 65536
+
+/*
+ * A block is this header followed by its columns, each padded to
+ * ARCHIVE_ALIGN. All values are in native byte order.
+ */
+typedef struct {
+	uint32_t magic;
+	uint16_t table;
+	uint16_t columns;
+	uint32_t rows;
+	/// Size of the block, header included
+	uint32_t size;
+	int64_t min_timestamp;
+	int64_t max_timestamp;
+	char source[OMRON_ARCHIVE_SOURCE_LEN];
+} archive_block_header;
+
+/// Column of a table: bytes per value and values per row
+typedef struct {
+	int size;
+	int width;
+} archive_column;
+
+/*
+ * Columns of each table in the order they are stored, which is also the
+ * order of the pointers in omron_archive_block.
+ */
+static const archive_column bp_columns[] = {
+	{ 8, 1 },	/* timestamp */
+	{ 2, 1 },	/* sys */
+	{ 2, 1 },	/* dia */
+	{ 2, 1 }	/* pulse */
+};
+
+static const archive_column pd_columns[] = {
+	{ 8, 1 },	/* timestamp */
+	{ 4, 1 },	/* total_steps */
+	{ 4, 1 },	/* total_aerobic_steps */
+	{ 4, 1 },	/* total_aerobic_walking_time */
+	{ 4, 1 },	/* total_calories */
+	{ 4, 1 },	/* total_distance */
+	{ 4, 1 },	/* total_fat_burn */
+	{ 2, 24 },	/* hourly_steps */
+	{ 2, 24 }	/* hourly_aerobic_steps */
+};
+
+typedef struct {
+	int count;
+	const archive_column* columns;
+} archive_table;
+
+/// Indexed by OMRON_ARCHIVE_* table
+static const archive_table archive_tables[] = {
+	{ 0, NULL },
+	{ sizeof(bp_columns) / sizeof(bp_columns[0]), bp_columns },
+	{ sizeof(pd_columns) / sizeof(pd_columns[0]), pd_columns }
+};
+
+#define ARCHIVE_TABLES ((int)(sizeof(archive_tables) / sizeof(archive_tables[0])))
+
+/// Rows of a table waiting to be written as a block
+typedef struct {
+	int rows;
+	int64_t min_timestamp;
+	int64_t max_timestamp;
+	uint8_t* columns[ARCHIVE_MAX_COLUMNS];
+} archive_pending;
+
+struct omron_archive {
+	FILE* file;
+	char source[OMRON_ARCHIVE_SOURCE_LEN];
+	archive_pending pending[ARCHIVE_TABLES];
+};
+
+struct omron_archive_map {
+	const uint8_t* data;
+	size_t size;
+	/// Offsets of the complete blocks
+	size_t* blocks;
+	int num_blocks;
+#if defined(WIN32)
+	HANDLE file;
+	HANDLE mapping;
+#endif
+};
+
+static size_t archive_align(size_t size)
+{
+	return (size + ARCHIVE_ALIGN - 1) & ~(size_t)(ARCHIVE_ALIGN - 1);
+}
+
+static size_t archive_column_bytes(const archive_column* column, uint32_t rows)
+{
+	return (size_t)column->size * column->width * rows;
+}
+
+static size_t archive_block_size(int table, uint32_t rows)
+{
+	const archive_table* t = &archive_tables[table];
+	size_t size = sizeof(archive_block_header);
+	int i;
+
+	for (i = 0; i < t->count; i++) {
+		size += archive_align(archive_column_bytes(&t->columns[i], rows));
+	}
+	return size;
+}
+
+/*
+ * Size of the block with this header at offset in a file of file_size
+ * bytes, or 0 if there is no complete block there.
+ */
+static size_t archive_check_block(const archive_block_header* header, uint64_t offset, uint64_t file_size)
+{
+	size_t size;
+
+	if (header->magic != ARCHIVE_BLOCK_MAGIC || header->table < 1 || header->table >= ARCHIVE_TABLES ||
+	    header->columns != archive_tables[header->table].count ||
+	    header->rows < 1 || header->rows > OMRON_ARCHIVE_BLOCK_ROWS ||
+	    !memchr(header->source, 0, sizeof(header->source))) {
+		return 0;
+	}
+	size = archive_block_size(header->table, header->rows);
+	if (header->size != size || offset + size > file_size) return 0;
+	return size;
+}
+
+static void archive_file_header(uint8_t* header)
+{
+	uint32_t order = ARCHIVE_BYTE_ORDER;
+
+	memset(header, 0, ARCHIVE_HEADER_LEN);
+	memcpy(header, ARCHIVE_MAGIC, ARCHIVE_MAGIC_LEN);
+	memcpy(header + ARCHIVE_MAGIC_LEN, &order, sizeof(order));
+}
+
+static int archive_file_header_ok(const uint8_t* header)
+{
+	uint8_t expected[ARCHIVE_HEADER_LEN];
+
+	archive_file_header(expected);
+	return !memcmp(header, expected, ARCHIVE_MAGIC_LEN + sizeof(uint32_t));
+}
+
+static uint16_t archive_u16(int32_t value)
+{
+	return value < 0 ? 0 : (value > 0xffff ? 0xffff : (uint16_t)value);
+}
+
+//writing
+
+static int archive_write_block(omron_archive* archive, int table)
+{
+	static const uint8_t zero[ARCHIVE_ALIGN]; /* = all zeroes */
+	archive_pending* pending = &archive->pending[table];
+	const archive_table* t = &archive_tables[table];
+	archive_block_header header;
+	size_t size, pad;
+	int i;
+
+	if (!pending->rows) return 0;
+	memset(&header, 0, sizeof(header));
+	header.magic = ARCHIVE_BLOCK_MAGIC;
+	header.table = table;
+	header.columns = t->count;
+	header.rows = pending->rows;
+	header.size = archive_block_size(table, pending->rows);
+	header.min_timestamp = pending->min_timestamp;
+	header.max_timestamp = pending->max_timestamp;
+	memcpy(header.source, archive->source, sizeof(header.source));
+	if (fwrite(&header, sizeof(header), 1, archive->file) != 1) goto fail;
+	for (i = 0; i < t->count; i++) {
+		size = archive_column_bytes(&t->columns[i], pending->rows);
+		pad = archive_align(size) - size;
+		if (fwrite(pending->columns[i], 1, size, archive->file) != size ||
+		    fwrite(zero, 1, pad, archive->file) != pad) goto fail;
+	}
+	pending->rows = 0;
+	return 0;
+
+fail:
+	MSG_ERROR("Cannot write archive block\n");
+	return OMRON_ERR_DEVIO;
+}
+
+static int archive_write_blocks(omron_archive* archive)
+{
+	int status;
+	int i;
+
+	for (i = 1; i < ARCHIVE_TABLES; i++) {
+		status = archive_write_block(archive, i);
+		if (status < 0) return status;
+	}
+	return 0;
+}
+
+/*
+ * Make room for a row in the pending block of a table, writing the block
+ * out if it is full. Returns the row index, or < 0 on error.
+ */
+static int archive_add_row(omron_archive* archive, int table, int64_t timestamp)
+{
+	archive_pending* pending = &archive->pending[table];
+	const archive_table* t = &archive_tables[table];
+	int status;
+	int i;
+
+	if (pending->rows == OMRON_ARCHIVE_BLOCK_ROWS) {
+		status = archive_write_block(archive, table);
+		if (status < 0) return status;
+	}
+	for (i = 0; i < t->count; i++) {
+		if (pending->columns[i]) continue;
+		pending->columns[i] = malloc(archive_column_bytes(&t->columns[i], OMRON_ARCHIVE_BLOCK_ROWS));
+		if (!pending->columns[i]) {
+			MSG_ERROR("Cannot allocate archive block\n");
+			return OMRON_ERR_DEVIO;
+		}
+	}
+	if (!pending->rows || timestamp < pending->min_timestamp) pending->min_timestamp = timestamp;
+	if (!pending->rows || timestamp > pending->max_timestamp) pending->max_timestamp = timestamp;
+	return pending->rows++;
+}
+
+#if defined(WIN32)
+typedef __int64 archive_off;
+#define archive_seek _fseeki64
+#define archive_tell _ftelli64
+#else
+typedef off_t archive_off;
+#define archive_seek fseeko
+#define archive_tell ftello
+#endif
+
+static int archive_truncate(FILE* file, archive_off size)
+{
+#if defined(WIN32)
+	return _chsize_s(_fileno(file), size) ? -1 : 0;
+#else
+	return ftruncate(fileno(file), size);
+#endif
+}
+
+/*
+ * Whether the tail bytes of an archive after its last complete block
+ * (read from the current position of the file) are a block cut short by
+ * a crash. That is a block header that is good but for running past the
+ * end of the file, or too little of one to tell, and no other block
+ * starting after it.
+ */
+static int archive_torn_tail(FILE* file, archive_off offset, archive_off tail)
+{
+	archive_block_header header;
+	uint8_t* data;
+	uint32_t magic;
+	size_t size, rest, i;
+	int torn = 1;
+
+	if (tail < (archive_off)sizeof(header)) return 1;
+	if (fread(&header, sizeof(header), 1, file) != 1) return 0;
+	size = archive_check_block(&header, offset, (uint64_t)-1);
+	if (!size || (archive_off)size <= tail) return 0;
+
+	// Blocks start on ARCHIVE_ALIGN, look for one past the torn block
+	rest = (size_t)tail - sizeof(header);
+	data = malloc(rest + 1);
+	if (!data) return 0;
+	if (fread(data, 1, rest, file) != rest) torn = 0;
+	for (i = 0; torn && i + sizeof(magic) <= rest; i += ARCHIVE_ALIGN) {
+		memcpy(&magic, data + i, sizeof(magic));
+		if (magic == ARCHIVE_BLOCK_MAGIC) torn = 0;
+	}
+	free(data);
+	return torn;
+}
+
+OMRON_DECLSPEC omron_archive* omron_archive_open(const char* path)
+{
+	omron_archive* archive;
+	uint8_t header[ARCHIVE_HEADER_LEN];
+	archive_block_header block;
+	archive_off file_size, end;
+	size_t size;
+
+	archive = calloc(1, sizeof(*archive));
+	if (!archive) return NULL;
+	archive->file = fopen(path, "a+b");
+	if (!archive->file) {
+		MSG_ERROR("Cannot open archive %s\n", path);
+		free(archive);
+		return NULL;
+	}
+	setvbuf(archive->file, NULL, _IOFBF, ARCHIVE_BUFFER_SIZE);
+
+	archive_seek(archive->file, 0, SEEK_END);
+	file_size = archive_tell(archive->file);
+	if (file_size < 0) {
+		MSG_ERROR("Cannot read archive %s\n", path);
+		goto fail;
+	}
+	if (file_size == 0) {
+		archive_file_header(header);
+		if (fwrite(header, 1, sizeof(header), archive->file) != sizeof(header)) {
+			MSG_ERROR("Cannot write archive %s\n", path);
+			goto fail;
+		}
+		return archive;
+	}
+	archive_seek(archive->file, 0, SEEK_SET);
+	if (fread(header, 1, sizeof(header), archive->file) != sizeof(header) ||
+	    !archive_file_header_ok(header)) {
+		MSG_ERROR("%s is not an archive (or from a machine of other byte order)\n", path);
+		goto fail;
+	}
+
+	// Skip over the complete blocks, a crash may have left a partial one behind
+	end = ARCHIVE_HEADER_LEN;
+	while (fread(&block, sizeof(block), 1, archive->file) == 1) {
+		size = archive_check_block(&block, end, file_size);
+		if (!size) break;
+		end += size;
+		archive_seek(archive->file, end, SEEK_SET);
+	}
+	if (end < file_size) {
+		// Only ever cut a torn last block, never anything that may be followed by good blocks
+		archive_seek(archive->file, end, SEEK_SET);
+		if (!archive_torn_tail(archive->file, end, file_size - end)) {
+			MSG_ERROR("%s has a damaged block at byte %lld, not opening it\n", path, (long long)end);
+			goto fail;
+		}
+		MSG_WARN("Cutting %lld bytes of a partly written block off %s\n", (long long)(file_size - end), path);
+		fflush(archive->file);
+		if (archive_truncate(archive->file, end) < 0) {
+			MSG_ERROR("Cannot truncate archive %s\n", path);
+			goto fail;
+		}
+	}
+	// Writes in "a" mode always go to the end of the file
+	return archive;
+
+fail:
+	fclose(archive->file);
+	free(archive);
+	return NULL;
+}
+
+OMRON_DECLSPEC int omron_archive_set_source(omron_archive* archive, const char* source)
+{
+	int status;
+
+	if (!source) source = "";
+	if (strlen(source) >= OMRON_ARCHIVE_SOURCE_LEN) return OMRON_ERR_BADARG;
+	if (!strcmp(source, archive->source)) return 0;
+	status = archive_write_blocks(archive);
+	if (status < 0) return status;
+	memset(archive->source, 0, sizeof(archive->source));
+	strcpy(archive->source, source);
+	return 0;
+}
+
+OMRON_DECLSPEC int omron_archive_add_bp(omron_archive* archive, const omron_bp_day_info* record)
+{
+	archive_pending* pending = &archive->pending[OMRON_ARCHIVE_BP];
+	int64_t timestamp = omron_bp_timestamp(record);
+	int row;
+
+	row = archive_add_row(archive, OMRON_ARCHIVE_BP, timestamp);
+	if (row < 0) return row;
+	((int64_t*)pending->columns[0])[row] = timestamp;
+	((uint16_t*)pending->columns[1])[row] = archive_u16(record->sys);
+	((uint16_t*)pending->columns[2])[row] = archive_u16(record->dia);
+	((uint16_t*)pending->columns[3])[row] = archive_u16(record->pulse);
+	return 0;
+}
+
+OMRON_DECLSPEC int omron_archive_add_pd(omron_archive* archive, int64_t day, const omron_pd_daily_data* daily, const omron_pd_hourly_data* hourly)
+{
+	archive_pending* pending = &archive->pending[OMRON_ARCHIVE_PD];
+	uint16_t* steps;
+	uint16_t* aerobic_steps;
+	int row;
+	int i;
+
+	row = archive_add_row(archive, OMRON_ARCHIVE_PD, day);
+	if (row < 0) return row;
+	((int64_t*)pending->columns[0])[row] = day;
+	((int32_t*)pending->columns[1])[row] = daily->total_steps;
+	((int32_t*)pending->columns[2])[row] = daily->total_aerobic_steps;
+	((int32_t*)pending->columns[3])[row] = daily->total_aerobic_walking_time;
+	((int32_t*)pending->columns[4])[row] = daily->total_calories;
+	((float*)pending->columns[5])[row] = daily->total_distance;
+	((float*)pending->columns[6])[row] = daily->total_fat_burn;
+	steps = (uint16_t*)pending->columns[7] + row * 24;
+	aerobic_steps = (uint16_t*)pending->columns[8] + row * 24;
+	for (i = 0; i < 24; i++) {
+		steps[i] = hourly ? archive_u16(hourly[i].regular_steps) : 0;
+		aerobic_steps[i] = hourly ? archive_u16(hourly[i].aerobic_steps) : 0;
+	}
+	return 0;
+}
+
+OMRON_DECLSPEC int omron_archive_flush(omron_archive* archive)
+{
+	int status;
+
+	status = archive_write_blocks(archive);
+	if (status < 0) return status;
+	return fflush(archive->file) ? OMRON_ERR_DEVIO : 0;
+}
+
+OMRON_DECLSPEC int omron_archive_close(omron_archive* archive)
+{
+	int status;
+	int i, j;
+
+	if (!archive) return 0;
+	status = archive_write_blocks(archive);
+	if (fclose(archive->file) && status == 0) status = OMRON_ERR_DEVIO;
+	for (i = 0; i < ARCHIVE_TABLES; i++) {
+		for (j = 0; j < ARCHIVE_MAX_COLUMNS; j++) {
+			free(archive->pending[i].columns[j]);
+		}
+	}
+	free(archive);
+	return status;
+}
+
+//reading
+
+static void archive_unmap(omron_archive_map* map)
+{
+#if defined(WIN32)
+	if (map->data) UnmapViewOfFile(map->data);
+	if (map->mapping) CloseHandle(map->mapping);
+	if (map->file && map->file != INVALID_HANDLE_VALUE) CloseHandle(map->file);
+#else
+	if (map->data) munmap((void*)map->data, map->size);
+#endif
+	free(map->blocks);
+	free(map);
+}
+
+OMRON_DECLSPEC omron_archive_map* omron_archive_map_open(const char* path)
+{
+	omron_archive_map* map;
+	const archive_block_header* header;
+	size_t offset, size;
+	int capacity = 0;
+#if defined(WIN32)
+	LARGE_INTEGER file_size;
+#else
+	struct stat st;
+	void* data;
+	int fd;
+#endif
+
+	map = calloc(1, sizeof(*map));
+	if (!map) return NULL;
+#if defined(WIN32)
+	map->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+				OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (map->file == INVALID_HANDLE_VALUE || !GetFileSizeEx(map->file, &file_size)) {
+		MSG_ERROR("Cannot open archive %s\n", path);
+		goto fail;
+	}
+	map->size = (size_t)file_size.QuadPart;
+	if (map->size >= ARCHIVE_HEADER_LEN) {
+		map->mapping = CreateFileMappingA(map->file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (map->mapping) map->data = MapViewOfFile(map->mapping, FILE_MAP_READ, 0, 0, 0);
+		if (!map->data) {
+			MSG_ERROR("Cannot map archive %s\n", path);
+			goto fail;
+		}
+	}
+#else
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		MSG_ERROR("Cannot open archive %s\n", path);
+		if (fd >= 0) close(fd);
+		goto fail;
+	}
+	map->size = st.st_size;
+	if (map->size >= ARCHIVE_HEADER_LEN) {
+		data = mmap(NULL, map->size, PROT_READ, MAP_SHARED, fd, 0);
+		if (data == MAP_FAILED) {
+			MSG_ERROR("Cannot map archive %s\n", path);
+			close(fd);
+			goto fail;
+		}
+		map->data = data;
+	}
+	close(fd);
+#endif
+	if (!map->data || !archive_file_header_ok(map->data)) {
+		MSG_ERROR("%s is not an archive (or from a machine of other byte order)\n", path);
+		goto fail;
+	}
+
+	offset = ARCHIVE_HEADER_LEN;
+	while (offset + sizeof(*header) <= map->size) {
+		header = (const archive_block_header*)(map->data + offset);
+		size = archive_check_block(header, offset, map->size);
+		if (!size) break;
+		if (map->num_blocks == capacity) {
+			size_t* blocks;
+
+			capacity = capacity ? 2 * capacity : 64;
+			blocks = realloc(map->blocks, capacity * sizeof(*blocks));
+			if (!blocks) goto fail;
+			map->blocks = blocks;
+		}
+		map->blocks[map->num_blocks++] = offset;
+		offset += size;
+	}
+	if (offset != map->size) {
+		// A block still being written, or left partly written by a crash
+		MSG_WARN("Ignoring %lu bytes at the end of %s\n", (unsigned long)(map->size - offset), path);
+	}
+	return map;
+
+fail:
+	archive_unmap(map);
+	return NULL;
+}
+
+OMRON_DECLSPEC int omron_archive_map_blocks(omron_archive_map* map)
+{
+	return map->num_blocks;
+}
+
+OMRON_DECLSPEC int omron_archive_map_block(omron_archive_map* map, int index, omron_archive_block* block)
+{
+	const archive_block_header* header;
+	const archive_table* t;
+	const uint8_t* column[ARCHIVE_MAX_COLUMNS];
+	const uint8_t* p;
+	int i;
+
+	if (index < 0 || index >= map->num_blocks || !block) return OMRON_ERR_BADARG;
+	header = (const archive_block_header*)(map->data + map->blocks[index]);
+	t = &archive_tables[header->table];
+	p = (const uint8_t*)(header + 1);
+	for (i = 0; i < t->count; i++) {
+		column[i] = p;
+		p += archive_align(archive_column_bytes(&t->columns[i], header->rows));
+	}
+
+	memset(block, 0, sizeof(*block));
+	block->table = header->table;
+	block->rows = header->rows;
+	block->source = header->source;
+	block->min_timestamp = header->min_timestamp;
+	block->max_timestamp = header->max_timestamp;
+	block->timestamp = (const int64_t*)column[0];
+	if (header->table == OMRON_ARCHIVE_BP) {
+		block->sys = (const uint16_t*)column[1];
+		block->dia = (const uint16_t*)column[2];
+		block->pulse = (const uint16_t*)column[3];
+	} else {
+		block->total_steps = (const int32_t*)column[1];
+		block->total_aerobic_steps = (const int32_t*)column[2];
+		block->total_aerobic_walking_time = (const int32_t*)column[3];
+		block->total_calories = (const int32_t*)column[4];
+		block->total_distance = (const float*)column[5];
+		block->total_fat_burn = (const float*)column[6];
+		block->hourly_steps = (const uint16_t*)column[7];
+		block->hourly_aerobic_steps = (const uint16_t*)column[8];
+	}
+	return 0;
+}
+
+OMRON_DECLSPEC void omron_archive_map_close(omron_archive_map* map)
+{
+	if (map) archive_unmap(map);
+}
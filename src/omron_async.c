@@ -0,0 +1,362 @@
+/*
+ * Non-blocking commands for Omron Health User Space Driver
+ *
+ * Copyright (c) 2009-2010 Kyle Machulis <kyle@nonpolynomial.com>
+ *
+ * More info on Nonpolynomial Labs @ http://www.nonpolynomial.com
+ *
+ * Sourceforge project @ http://www.github.com/qdot/libomron/
+ *
+ * This library is covered by the BSD License
+ * Read LICENSE_BSD.txt for details.
+ */
+
+#include "libomron/omron.h"
+#include "omron_internal.h"
+#include <string.h>
+
+/// How long the input must stay quiet before a flush considers it empty (one HID polling interval)
+#define CMD_FLUSH_SETTLE_MS 10
+
+/*
+ * omron_run_exchange() taken apart at the points where it would block.
+ * cmd->clearing is set while the clear command of a mode change is out,
+ * which counts its attempts in cmd->clear_attempt.
+ */
+enum {
+	/// Done (or never started)
+	CMD_IDLE = 0,
+	/// Mode to be set, followed by a clear
+	CMD_MODE,
+	/// Discarding stray input until the endpoint stays quiet
+	CMD_FLUSH,
+	/// Command (or clear) to be sent
+	CMD_SEND,
+	/// Putting the response together
+	CMD_WAIT,
+	/// Waiting out the backoff before cmd->next_state
+	CMD_BACKOFF
+};
+
+static int omron_cmd_done(omron_device* dev, omron_async_cmd* cmd, int status)
+{
+	cmd->status = status;
+	cmd->state = CMD_IDLE;
+	dev->cmd_active = 0;
+	omron_unlock(dev);
+	return 0;
+}
+
+/*
+ * Quiet time that ends a flush [us]. With responses still owed, they get
+ * a round trip to turn up, like in omron_drain_input().
+ */
+static int64_t omron_cmd_settle_us(omron_device* dev)
+{
+	int wait = omron_drain_wait_ms(dev);
+
+	return (wait > CMD_FLUSH_SETTLE_MS ? wait : CMD_FLUSH_SETTLE_MS) * (int64_t)1000;
+}
+
+static void omron_cmd_flush(omron_device* dev, omron_async_cmd* cmd)
+{
+	cmd->state = CMD_SEND;
+	if (!dev->input_dirty && !dev->pending_responses) {
+		omron_stats* stats = omron_stats_of(dev);
+
+		MSG_DETAIL("Input known to be empty, skipping flush.\n");
+		if (stats) stats->flushes_skipped++;
+		return;
+	}
+	MSG_DETAIL("Flushing any extra input...\n");
+	cmd->flushed = 0;
+	cmd->deadline_us = omron_now_us() + omron_cmd_settle_us(dev);
+	cmd->state = CMD_FLUSH;
+}
+
+/*
+ * The input stayed quiet, finish the flush like omron_flush()
+ */
+static void omron_cmd_flushed(omron_device* dev, omron_async_cmd* cmd)
+{
+	omron_stats* stats = omron_stats_of(dev);
+
+	if (cmd->flushed) {
+		MSG_DETAIL("Discarded %d bytes of extra data.\n", cmd->flushed);
+	}
+	if (stats) {
+		stats->flushes++;
+		stats->flushed_bytes += cmd->flushed;
+	}
+	omron_stats_flushed(dev);
+	dev->input_dirty = 0;
+	dev->pending_responses = 0;
+	MSG_DETAIL("Flush complete.\n");
+	cmd->state = CMD_SEND;
+}
+
+static void omron_cmd_backoff(omron_async_cmd* cmd, int backoff, int next_state)
+{
+	cmd->deadline_us = omron_now_us() + backoff * (int64_t)1000;
+	cmd->next_state = next_state;
+	cmd->state = CMD_BACKOFF;
+}
+
+/*
+ * Act on the response to the clear command, like omron_send_clear()
+ */
+static int omron_cmd_cleared(omron_device* dev, omron_async_cmd* cmd, int status)
+{
+	omron_stats* stats = omron_stats_of(dev);
+	int backoff;
+
+	if (OMRON_RETRYABLE(status) && cmd->clear_attempt + 1 < dev->retry_policy.clear_attempts) {
+		backoff = omron_take_retry(dev, cmd->clear_attempt);
+		if (backoff >= 0) {
+			cmd->clear_attempt++;
+			omron_cmd_backoff(cmd, backoff, CMD_FLUSH);
+			return 1;
+		}
+	}
+	if (stats) omron_histogram_add(&stats->clear, omron_now_us() - cmd->clear_start_us);
+	if (status < 0) {
+		MSG_ERROR("Clear failed: %d\n", status);
+		if (stats) stats->clear_errors++;
+		return omron_cmd_done(dev, cmd, status);
+	}
+	MSG_INFO("Clear successful.\n");
+	cmd->clearing = 0;
+	cmd->state = CMD_SEND;
+	return 1;
+}
+
+/*
+ * Act on the response to the command, like omron_run_exchange()
+ */
+static int omron_cmd_answered(omron_device* dev, omron_async_cmd* cmd, int status)
+{
+	const omron_retry_policy* policy = &dev->retry_policy;
+	omron_stats* stats = omron_stats_of(dev);
+	int backoff;
+
+	if (!OMRON_RETRYABLE(status)) return omron_cmd_done(dev, cmd, status);
+	if (cmd->attempt < policy->retries + policy->resyncs) {
+		backoff = omron_take_retry(dev, cmd->attempt);
+		if (backoff >= 0) {
+			if (cmd->attempt < policy->retries) {
+				MSG_WARN("Bad response from device.  Retrying...\n");
+				if (stats) stats->retries++;
+				omron_cmd_backoff(cmd, backoff, CMD_FLUSH);
+			} else {
+				MSG_WARN("Bad response from device.  Resyncing and retrying...\n");
+				if (stats) stats->resyncs++;
+				omron_cmd_backoff(cmd, backoff, CMD_MODE);
+			}
+			cmd->attempt++;
+			return 1;
+		}
+	}
+	MSG_ERROR("Unable to get a valid response from device.\n");
+	if (stats) stats->failed_exchanges++;
+	return omron_cmd_done(dev, cmd, status);
+}
+
+static int omron_cmd_response(omron_device* dev, omron_async_cmd* cmd, int status)
+{
+	if (cmd->clearing) {
+		status = omron_response_done(dev, status, cmd->clear_attempt);
+		return omron_cmd_cleared(dev, cmd, status);
+	}
+	status = omron_response_done(dev, status, cmd->attempt);
+	return omron_cmd_answered(dev, cmd, status);
+}
+
+OMRON_DECLSPEC int omron_cmd_init(omron_async_cmd* cmd, omron_mode mode, const uint8_t* command, int command_len, int response_len)
+{
+	if (command_len < 1 || command_len > OMRON_MAX_COMMAND_SIZE ||
+	    response_len < 2 || response_len > OMRON_MAX_RESPONSE_SIZE) {
+		MSG_ERROR("Invalid command (%d bytes) or response size (%d bytes)\n", command_len, response_len);
+		return OMRON_ERR_BADARG;
+	}
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->mode = mode;
+	memcpy(cmd->command, command, command_len);
+	cmd->command_len = command_len;
+	cmd->response_len = response_len;
+	return 0;
+}
+
+OMRON_DECLSPEC int omron_cmd_start(omron_device* dev, omron_async_cmd* cmd)
+{
+	if (cmd->command_len < 1 || cmd->command_len > OMRON_MAX_COMMAND_SIZE ||
+	    cmd->response_len < 2 || cmd->response_len > OMRON_MAX_RESPONSE_SIZE) {
+		return OMRON_ERR_BADARG;
+	}
+	omron_lock(dev);
+	if (!dev->transport || !dev->arena.input_report) {
+		omron_unlock(dev);
+		MSG_ERROR("Device not open\n");
+		return OMRON_ERR_NOTOPEN;
+	}
+	if (!dev->transport->poll_read) {
+		omron_unlock(dev);
+		MSG_ERROR("The %s transport cannot run non-blocking commands\n", dev->transport->name);
+		return OMRON_ERR_UNSUPPORTED;
+	}
+	// The lock is recursive, so it doesn't keep the thread running a
+	// command from starting another one on top of it
+	if (dev->cmd_active) {
+		omron_unlock(dev);
+		MSG_ERROR("Device is already running a command\n");
+		return OMRON_ERR_BUSY;
+	}
+	dev->cmd_active = 1;
+	cmd->status = 0;
+	cmd->clearing = 0;
+	cmd->attempt = 0;
+	cmd->state = dev->device_mode == cmd->mode ? CMD_SEND : CMD_MODE;
+	return 0;
+}
+
+OMRON_DECLSPEC int omron_cmd_step(omron_device* dev, omron_async_cmd* cmd)
+{
+	static const unsigned char zero[12]; /* = all zeroes */
+	unsigned char* input_report = dev->arena.input_report;
+	int status;
+
+	// The command holds the device lock, which only its thread may use
+	if (cmd->state != CMD_IDLE && !omron_lock_held(dev)) {
+		MSG_ERROR("Command stepped from a thread that did not start it\n");
+		return OMRON_ERR_BUSY;
+	}
+	while (1) {
+		switch (cmd->state) {
+		case CMD_IDLE:
+			return 0;
+
+		case CMD_MODE:
+			status = omron_set_mode(dev, cmd->mode);
+			if (status < 0) return omron_cmd_done(dev, cmd, status);
+			OMRON_ATOMIC_STORE(&dev->device_mode, cmd->mode);
+			MSG_INFO("Performing clear...\n");
+			cmd->clearing = 1;
+			cmd->clear_attempt = 0;
+			cmd->clear_start_us = omron_now_us();
+			omron_cmd_flush(dev, cmd);
+			break;
+
+		case CMD_FLUSH:
+			status = omron_poll_read(dev, input_report, dev->input_size);
+			if (status < 0) return omron_cmd_done(dev, cmd, status);
+			if (status > 0) {
+				// Not quiet yet, start the settle time over
+				cmd->flushed += status;
+				cmd->deadline_us = omron_now_us() + omron_cmd_settle_us(dev);
+				break;
+			}
+			if (omron_now_us() < cmd->deadline_us) return 1;
+			omron_cmd_flushed(dev, cmd);
+			break;
+
+		case CMD_SEND:
+			if (cmd->clearing) {
+				status = omron_send_command(dev, sizeof(zero), zero);
+			} else {
+				status = omron_send_command(dev, cmd->command_len, cmd->command);
+			}
+			if (status < 0) return omron_cmd_done(dev, cmd, status);
+			cmd->received = 0;
+			status = omron_response_timeout(dev, cmd->clearing ? cmd->clear_attempt : cmd->attempt);
+			cmd->deadline_us = omron_now_us() + status * (int64_t)1000;
+			cmd->state = CMD_WAIT;
+			break;
+
+		case CMD_WAIT:
+		{
+			int size = cmd->clearing ? 2 : cmd->response_len;
+
+			status = omron_poll_read(dev, input_report, dev->input_size);
+			if (status == 0) {
+				if (omron_now_us() < cmd->deadline_us) return 1;
+				MSG_DETAIL("No response in time\n");
+				status = OMRON_ERR_TIMEOUT;
+			} else if (status > 0) {
+				status = omron_add_response_report(dev, input_report, size, cmd->response, &cmd->received);
+				if (status > 0) break;
+				if (status == 0) status = omron_check_response(dev, size, cmd->response, cmd->received);
+			}
+			if (!omron_cmd_response(dev, cmd, status)) return 0;
+			break;
+		}
+
+		case CMD_BACKOFF:
+			if (omron_now_us() < cmd->deadline_us) return 1;
+			if (cmd->next_state == CMD_FLUSH) {
+				omron_cmd_flush(dev, cmd);
+			} else {
+				cmd->state = cmd->next_state;
+			}
+			break;
+
+		default:
+			MSG_ERROR("Command in unknown state %d\n", cmd->state);
+			return omron_cmd_done(dev, cmd, OMRON_ERR_BADARG);
+		}
+	}
+}
+
+OMRON_DECLSPEC int omron_cmd_timeout(omron_device* dev, omron_async_cmd* cmd)
+{
+	int64_t wait_us;
+	int timeout_ms;
+
+	switch (cmd->state) {
+	case CMD_IDLE:
+		return -1;
+	case CMD_FLUSH:
+	case CMD_WAIT:
+	case CMD_BACKOFF:
+		wait_us = cmd->deadline_us - omron_now_us();
+		timeout_ms = wait_us <= 0 ? 0 : (int)((wait_us + 999) / 1000);
+		break;
+	default:
+		return 0;
+	}
+	// The transport may have to be serviced (or have input due) sooner
+	if (timeout_ms > 0 && dev->transport && dev->transport->get_pollfds) {
+		if (dev->transport->get_pollfds(dev, NULL, 0, &timeout_ms) < 0) timeout_ms = 0;
+	}
+	return timeout_ms;
+}
+
+OMRON_DECLSPEC void omron_cmd_cancel(omron_device* dev, omron_async_cmd* cmd)
+{
+	if (cmd->state == CMD_IDLE) return;
+	if (!omron_lock_held(dev)) {
+		MSG_ERROR("Command cancelled from a thread that did not start it, ignored\n");
+		return;
+	}
+	MSG_INFO("Command cancelled\n");
+	// Whatever is still on its way must not be taken for the next response
+	OMRON_ATOMIC_STORE(&dev->device_mode, NULL_MODE);
+	dev->input_dirty = 1;
+	omron_cmd_done(dev, cmd, OMRON_ERR_TIMEOUT);
+}
+
+OMRON_DECLSPEC int omron_get_pollfds(omron_device* dev, omron_pollfd* fds, int max_fds)
+{
+	int timeout_ms = -1;
+	int status;
+
+	if (max_fds < 0 || (max_fds > 0 && !fds)) return OMRON_ERR_BADARG;
+	omron_lock(dev);
+	if (!dev->transport) {
+		status = OMRON_ERR_NOTOPEN;
+	} else if (!dev->transport->get_pollfds) {
+		status = 0;
+	} else {
+		status = dev->transport->get_pollfds(dev, fds, max_fds, &timeout_ms);
+	}
+	omron_unlock(dev);
+	return status;
+}
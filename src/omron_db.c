@@ -0,0 +1,291 @@
+/*
+ * SQLite sink for Omron Health User Space Driver
+ *
+ * Copyright (c) 2009-2010 Kyle Machulis <kyle@nonpolynomial.com>
+ *
+ * More info on Nonpolynomial Labs @ http://www.nonpolynomial.com
+ *
+ * Sourceforge project @ http://www.github.com/qdot/libomron/
+ *
+ * This library is covered by the BSD License
+ * Read LICENSE_BSD.txt for details.
+ */
+
+#include "libomron/omron.h"
+#include "omron_internal.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(OMRON_HAVE_SQLITE3)
+
+#include <sqlite3.h>
+#include <time.h>
+
+/// Longest SQL statement built here
+#define DB_SQL_MAX 256
+
+/// Type column of blood pressure rows, as in python/store.py
+#define DB_TYPE_DAILY  0
+#define DB_TYPE_WEEKLY 1
+
+struct omron_db {
+	sqlite3* db;
+	sqlite3_stmt* insert_bp;
+	sqlite3_stmt* insert_pd;
+	sqlite3_stmt* insert_pd_hourly;
+	int in_transaction;
+};
+
+static int omron_db_exec(omron_db* db, const char* sql)
+{
+	char* err = NULL;
+
+	if (sqlite3_exec(db->db, sql, NULL, NULL, &err) != SQLITE_OK) {
+		MSG_ERROR("%s: %s\n", sql, err ? err : sqlite3_errmsg(db->db));
+		sqlite3_free(err);
+		return OMRON_ERR_DEVIO;
+	}
+	return 0;
+}
+
+static int omron_db_prepare(omron_db* db, const char* format, const char* table, sqlite3_stmt** stmt)
+{
+	char sql[DB_SQL_MAX];
+
+	snprintf(sql, sizeof(sql), format, table);
+	if (sqlite3_prepare_v2(db->db, sql, -1, stmt, NULL) != SQLITE_OK) {
+		MSG_ERROR("%s: %s\n", sql, sqlite3_errmsg(db->db));
+		return OMRON_ERR_DEVIO;
+	}
+	return 0;
+}
+
+static int omron_db_create(omron_db* db, const char* format, const char* table)
+{
+	char sql[DB_SQL_MAX];
+
+	snprintf(sql, sizeof(sql), format, table);
+	return omron_db_exec(db, sql);
+}
+
+/*
+ * Run an insert statement with its parameters bound, inside the open
+ * transaction (beginning one if needed).
+ */
+static int omron_db_insert(omron_db* db, sqlite3_stmt* stmt)
+{
+	int status;
+
+	if (!db->in_transaction) {
+		status = omron_db_exec(db, "BEGIN");
+		if (status < 0) {
+			sqlite3_reset(stmt);
+			return status;
+		}
+		db->in_transaction = 1;
+	}
+	status = sqlite3_step(stmt);
+	if (status != SQLITE_DONE) {
+		MSG_ERROR("Cannot insert row: %s\n", sqlite3_errmsg(db->db));
+	}
+	sqlite3_reset(stmt);
+	return status == SQLITE_DONE ? 0 : OMRON_ERR_DEVIO;
+}
+
+/*
+ * Seconds since the epoch of a device local time, like
+ * store.ymdhms2seconds()
+ */
+static int64_t omron_db_seconds(int year, int month, int day, int hour, int minute, int second)
+{
+	struct tm t;
+
+	memset(&t, 0, sizeof(t));
+	t.tm_year = year - 1900;
+	t.tm_mon = month - 1;
+	t.tm_mday = day;
+	t.tm_hour = hour;
+	t.tm_min = minute;
+	t.tm_sec = second;
+	t.tm_isdst = -1;
+	return (int64_t)mktime(&t);
+}
+
+static int omron_db_table_ok(const char* table)
+{
+	const char* c;
+
+	if (!*table || strlen(table) > OMRON_DB_TABLE_MAX || (*table >= '0' && *table <= '9')) return 0;
+	for (c = table; *c; c++) {
+		if (!((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9') || *c == '_')) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+OMRON_DECLSPEC omron_db* omron_db_open(const char* path, const char* table)
+{
+	omron_db* db;
+
+	if (!table) table = "omron";
+	if (!omron_db_table_ok(table)) {
+		MSG_ERROR("Invalid table name %s\n", table);
+		return NULL;
+	}
+	db = calloc(1, sizeof(*db));
+	if (!db) return NULL;
+	if (sqlite3_open(path, &db->db) != SQLITE_OK) {
+		MSG_ERROR("Cannot open database %s: %s\n", path, db->db ? sqlite3_errmsg(db->db) : "out of memory");
+		goto fail;
+	}
+	// WAL only syncs at checkpoints, and commits need no fsync of their own
+	if (omron_db_exec(db, "PRAGMA journal_mode=WAL") < 0 ||
+	    omron_db_exec(db, "PRAGMA synchronous=NORMAL") < 0 ||
+	    omron_db_create(db, "create table if not exists %s "
+			    "(timestamp INTEGER PRIMARY KEY ON CONFLICT REPLACE, "
+			    "sys int, dia int, pulse int, type int)", table) < 0 ||
+	    omron_db_create(db, "create table if not exists %s_pd "
+			    "(timestamp INTEGER PRIMARY KEY ON CONFLICT REPLACE, "
+			    "steps int, aerobic_steps int, aerobic_walking_time int, "
+			    "calories int, distance real, fat_burn real)", table) < 0 ||
+	    omron_db_create(db, "create table if not exists %s_pd_hourly "
+			    "(timestamp INTEGER PRIMARY KEY ON CONFLICT REPLACE, "
+			    "steps int, aerobic_steps int, event int)", table) < 0 ||
+	    omron_db_prepare(db, "replace into %s values (?, ?, ?, ?, ?)", table, &db->insert_bp) < 0 ||
+	    omron_db_prepare(db, "replace into %s_pd values (?, ?, ?, ?, ?, ?, ?)", table, &db->insert_pd) < 0 ||
+	    omron_db_prepare(db, "replace into %s_pd_hourly values (?, ?, ?, ?)", table, &db->insert_pd_hourly) < 0) {
+		goto fail;
+	}
+	return db;
+
+fail:
+	omron_db_close(db);
+	return NULL;
+}
+
+static int omron_db_add_bp_row(omron_db* db, int64_t timestamp, int sys, int dia, int pulse, int type)
+{
+	sqlite3_stmt* stmt = db->insert_bp;
+
+	sqlite3_bind_int64(stmt, 1, timestamp);
+	sqlite3_bind_int(stmt, 2, sys);
+	sqlite3_bind_int(stmt, 3, dia);
+	sqlite3_bind_int(stmt, 4, pulse);
+	sqlite3_bind_int(stmt, 5, type);
+	return omron_db_insert(db, stmt);
+}
+
+OMRON_DECLSPEC int omron_db_add_bp(omron_db* db, const omron_bp_day_info* r)
+{
+	return omron_db_add_bp_row(db, omron_db_seconds(2000 + r->year, r->month, r->day, r->hour, r->minute, r->second),
+				   r->sys, r->dia, r->pulse, DB_TYPE_DAILY);
+}
+
+OMRON_DECLSPEC int omron_db_add_weekly_bp(omron_db* db, const omron_bp_week_info* r)
+{
+	return omron_db_add_bp_row(db, omron_db_seconds(2000 + r->year, r->month, r->day, 0, 0, 0),
+				   r->sys, r->dia, r->pulse, DB_TYPE_WEEKLY);
+}
+
+OMRON_DECLSPEC int omron_db_add_pd(omron_db* db, int64_t day, const omron_pd_daily_data* daily, const omron_pd_hourly_data* hourly)
+{
+	sqlite3_stmt* stmt = db->insert_pd;
+	int date = (int)(day / 1000000);
+	int status;
+	int i;
+
+	sqlite3_bind_int64(stmt, 1, omron_db_seconds(date / 10000, (date / 100) % 100, date % 100, 0, 0, 0));
+	sqlite3_bind_int(stmt, 2, daily->total_steps);
+	sqlite3_bind_int(stmt, 3, daily->total_aerobic_steps);
+	sqlite3_bind_int(stmt, 4, daily->total_aerobic_walking_time);
+	sqlite3_bind_int(stmt, 5, daily->total_calories);
+	sqlite3_bind_double(stmt, 6, daily->total_distance);
+	sqlite3_bind_double(stmt, 7, daily->total_fat_burn);
+	status = omron_db_insert(db, stmt);
+	if (status < 0 || !hourly) return status;
+
+	stmt = db->insert_pd_hourly;
+	for (i = 0; i < 24; i++) {
+		sqlite3_bind_int64(stmt, 1, omron_db_seconds(date / 10000, (date / 100) % 100, date % 100, i, 0, 0));
+		sqlite3_bind_int(stmt, 2, hourly[i].regular_steps);
+		sqlite3_bind_int(stmt, 3, hourly[i].aerobic_steps);
+		sqlite3_bind_int(stmt, 4, hourly[i].event);
+		status = omron_db_insert(db, stmt);
+		if (status < 0) return status;
+	}
+	return 0;
+}
+
+OMRON_DECLSPEC int omron_db_commit(omron_db* db)
+{
+	int status;
+
+	if (!db->in_transaction) return 0;
+	status = omron_db_exec(db, "COMMIT");
+	// A failed COMMIT (e.g. SQLITE_BUSY) can leave the transaction open
+	db->in_transaction = !sqlite3_get_autocommit(db->db);
+	return status;
+}
+
+OMRON_DECLSPEC int omron_db_rollback(omron_db* db)
+{
+	if (!db->in_transaction) return 0;
+	db->in_transaction = 0;
+	return omron_db_exec(db, "ROLLBACK");
+}
+
+OMRON_DECLSPEC int omron_db_close(omron_db* db)
+{
+	int status;
+
+	if (!db) return 0;
+	status = db->db ? omron_db_commit(db) : 0;
+	sqlite3_finalize(db->insert_bp);
+	sqlite3_finalize(db->insert_pd);
+	sqlite3_finalize(db->insert_pd_hourly);
+	if (sqlite3_close(db->db) != SQLITE_OK && status == 0) status = OMRON_ERR_DEVIO;
+	free(db);
+	return status;
+}
+
+#else
+
+OMRON_DECLSPEC omron_db* omron_db_open(const char* path, const char* table)
+{
+	MSG_ERROR("libomron was built without SQLite\n");
+	return NULL;
+}
+
+OMRON_DECLSPEC int omron_db_add_bp(omron_db* db, const omron_bp_day_info* record)
+{
+	return OMRON_ERR_UNSUPPORTED;
+}
+
+OMRON_DECLSPEC int omron_db_add_weekly_bp(omron_db* db, const omron_bp_week_info* record)
+{
+	return OMRON_ERR_UNSUPPORTED;
+}
+
+OMRON_DECLSPEC int omron_db_add_pd(omron_db* db, int64_t day, const omron_pd_daily_data* daily, const omron_pd_hourly_data* hourly)
+{
+	return OMRON_ERR_UNSUPPORTED;
+}
+
+OMRON_DECLSPEC int omron_db_commit(omron_db* db)
+{
+	return OMRON_ERR_UNSUPPORTED;
+}
+
+OMRON_DECLSPEC int omron_db_rollback(omron_db* db)
+{
+	return OMRON_ERR_UNSUPPORTED;
+}
+
+OMRON_DECLSPEC int omron_db_close(omron_db* db)
+{
+	return 0;
+}
+
+#endif
@@ -0,0 +1,211 @@
+/*
+ * Per-device event log for Omron Health User Space Driver
+ *
+ * Copyright (c) 2009-2010 Kyle Machulis <kyle@nonpolynomial.com>
+ *
+ * More info on Nonpolynomial Labs @ http://www.nonpolynomial.com
+ *
+ * Sourceforge project @ http://www.github.com/qdot/libomron/
+ *
+ * This library is covered by the BSD License
+ * Read LICENSE_BSD.txt for details.
+ */
+
+#include "libomron/omron.h"
+#include "omron_internal.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(WIN32)
+#include <windows.h>
+#endif
+
+/// Largest ring omron_set_event_log() accepts
+#define EVENT_LOG_MAX_CAPACITY (1 << 20)
+/// Events omron_dump_events() takes out of the ring at a time
+#define EVENT_DUMP_BATCH 16
+
+/*
+ * The ring is a sequence lock per slot. A writer claims the next sequence
+ * number with an atomic increment of head, marks the slot busy (stamp 0),
+ * fills it in and publishes it by storing stamp = sequence + 1 (1 for the
+ * last sequence number before the wrap, so no event is published as busy).
+ * Writers never wait, a writer that laps the reader simply overwrites the
+ * slot.
+ *
+ * The single reader keeps its own tail. It copies a slot and checks the
+ * stamp before and after the copy, a slot that changed underneath it was
+ * overwritten and counts as lost.
+ */
+typedef struct {
+	volatile uint32_t stamp;
+	omron_event event;
+} omron_event_slot;
+
+struct omron_event_log {
+	uint32_t mask;
+	volatile uint32_t head;
+	uint32_t tail;
+	omron_event_slot* slots;
+};
+
+#if defined(WIN32)
+#define EVENT_CLAIM(p)          ((uint32_t)InterlockedIncrement((LONG volatile*)(p)) - 1)
+#define EVENT_LOAD(p)           (*(p))
+#define EVENT_STORE(p, v)       (*(p) = (v))
+#define EVENT_FENCE_RELEASE()   MemoryBarrier()
+#define EVENT_FENCE_ACQUIRE()   MemoryBarrier()
+#else
+#define EVENT_CLAIM(p)          __atomic_fetch_add((p), 1, __ATOMIC_RELAXED)
+#define EVENT_LOAD(p)           __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define EVENT_STORE(p, v)       __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define EVENT_FENCE_RELEASE()   __atomic_thread_fence(__ATOMIC_RELEASE)
+#define EVENT_FENCE_ACQUIRE()   __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#endif
+
+/// Stamp of a published event, never the busy marker 0
+#define EVENT_STAMP(seq)        ((uint32_t)((seq) + 1) ? (uint32_t)((seq) + 1) : 1)
+
+static const char* event_names[] = {
+	"?", "mode", "write", "read", "drain", "command", "response"
+};
+
+void omron_log_event(omron_device* dev, int id, int status, const uint8_t* data, int len)
+{
+	struct omron_event_log* log = dev->events;
+	uint32_t seq = EVENT_CLAIM(&log->head);
+	omron_event_slot* slot = &log->slots[seq & log->mask];
+	omron_event* event = &slot->event;
+
+	slot->stamp = 0;
+	EVENT_FENCE_RELEASE();
+	if (len < 0 || !data) len = 0;
+	if (len > OMRON_EVENT_MAX_DATA) len = OMRON_EVENT_MAX_DATA;
+	event->sequence = seq;
+	event->id = (uint16_t)id;
+	// Callers hold the device lock, but nothing enforces that, so the
+	// mode is read (and written) atomically
+	event->mode = (uint16_t)OMRON_ATOMIC_LOAD(&dev->device_mode);
+	event->time_us = omron_now_us();
+	event->status = status;
+	event->size = (uint16_t)len;
+	memcpy(event->data, data, len);
+	EVENT_STORE(&slot->stamp, EVENT_STAMP(seq));
+}
+
+void omron_free_event_log(omron_device* dev)
+{
+	if (!dev->events) return;
+	free(dev->events->slots);
+	free(dev->events);
+	dev->events = NULL;
+}
+
+OMRON_DECLSPEC int omron_set_event_log(omron_device* dev, int capacity)
+{
+	struct omron_event_log* log = NULL;
+	uint32_t size = 1;
+
+	if (capacity < 0 || capacity > EVENT_LOG_MAX_CAPACITY) {
+		MSG_ERROR("Invalid event log capacity %d\n", capacity);
+		return OMRON_ERR_BADARG;
+	}
+	if (capacity > 0) {
+		while (size < (uint32_t)capacity) size <<= 1;
+		log = calloc(1, sizeof(*log));
+		if (log) log->slots = calloc(size, sizeof(*log->slots));
+		if (!log || !log->slots) {
+			MSG_ERROR("Cannot allocate an event log of %u events\n", size);
+			free(log);
+			return OMRON_ERR_DEVIO;
+		}
+		log->mask = size - 1;
+	}
+	omron_lock(dev);
+	omron_free_event_log(dev);
+	dev->events = log;
+	omron_unlock(dev);
+	return 0;
+}
+
+OMRON_DECLSPEC int omron_read_events(omron_device* dev, omron_event* events, int max, uint32_t* lost)
+{
+	struct omron_event_log* log = dev->events;
+	uint32_t capacity, skipped = 0;
+	int count = 0;
+
+	if (lost) *lost = 0;
+	if (!log) return 0;
+	if (max < 0 || (max > 0 && !events)) return OMRON_ERR_BADARG;
+	capacity = log->mask + 1;
+
+	while (count < max) {
+		uint32_t head = EVENT_LOAD(&log->head);
+		omron_event_slot* slot;
+		uint32_t stamp;
+
+		if (head - log->tail > capacity) {
+			skipped += head - capacity - log->tail;
+			log->tail = head - capacity;
+		}
+		if (log->tail == head) break;
+
+		slot = &log->slots[log->tail & log->mask];
+		stamp = EVENT_LOAD(&slot->stamp);
+		if (stamp != EVENT_STAMP(log->tail)) {
+			/*
+			 * Either the writer of this event is not done yet, or a
+			 * writer that lapped us has taken the slot over. Only the
+			 * latter shows in head.
+			 */
+			if (EVENT_LOAD(&log->head) - log->tail > capacity) continue;
+			break;
+		}
+		events[count] = slot->event;
+		EVENT_FENCE_ACQUIRE();
+		if (slot->stamp != stamp) continue;
+		log->tail++;
+		count++;
+	}
+	if (lost) *lost = skipped;
+	return count;
+}
+
+OMRON_DECLSPEC int omron_format_event(const omron_event* event, char* buf, int size)
+{
+	const char* name = event->id < sizeof(event_names) / sizeof(event_names[0]) ? event_names[event->id] : "?";
+	int len, i;
+
+	if (size <= 0) return 0;
+	len = snprintf(buf, size, "%10u %lld.%06d %-8s mode %04x status %d:",
+		       event->sequence,
+		       (long long)(event->time_us / 1000000), (int)(event->time_us % 1000000),
+		       name, event->mode, event->status);
+	for (i = 0; i < event->size && len >= 0 && len + 3 < size; i++) {
+		len += snprintf(buf + len, size - len, " %02x", event->data[i]);
+	}
+	if (len >= size) len = size - 1;
+	return len;
+}
+
+OMRON_DECLSPEC int omron_dump_events(omron_device* dev)
+{
+	omron_event events[EVENT_DUMP_BATCH];
+	char line[128 + 3 * OMRON_EVENT_MAX_DATA];
+	uint32_t lost;
+	int total = 0;
+	int count, i;
+
+	do {
+		count = omron_read_events(dev, events, EVENT_DUMP_BATCH, &lost);
+		if (count < 0) return count;
+		if (lost) fprintf(stderr, "(%u events lost)\n", lost);
+		for (i = 0; i < count; i++) {
+			omron_format_event(&events[i], line, sizeof(line));
+			fprintf(stderr, "%s\n", line);
+		}
+		total += count;
+	} while (count == EVENT_DUMP_BATCH);
+	return total;
+}
@@ -0,0 +1,471 @@
+/*
+ * Multi-device download functions for Omron Health User Space Driver - libusb version
+ *
+ * Copyright (c) 2009-2010 Kyle Machulis/Nonpolynomial Labs <kyle@nonpolynomial.com>
+ *
+ * More info on Nonpolynomial Labs @ http://www.nonpolynomial.com
+ *
+ * Source code available at http://www.github.com/qdot/libomron/
+ *
+ * This library is covered by the BSD License
+ * Read LICENSE_BSD.txt for details.
+ */
+
+#include "libomron/omron.h"
+#include "omron_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+ * All fleet devices share the fleet's libusb context. A dedicated thread
+ * keeps handling events for it, so transfers on idle devices still complete;
+ * worker threads may handle events too while they wait (libusb arbitrates
+ * between them).
+ *
+ * While watching, hotplug notifications are delivered on the event thread
+ * too; each arriving device gets its own watcher thread that opens it and
+ * runs the user's job.
+ */
+struct omron_fleet_watcher {
+	struct omron_fleet_watcher* next;
+	omron_fleet* fleet;
+	struct libusb_device* usb_dev;
+	pthread_t thread;
+	/// Set (under watch_lock) when the thread is about to exit
+	int done;
+};
+
+struct omron_fleet {
+	struct libusb_context* context;
+	pthread_t event_thread;
+	/// Set to stop the event thread (also its libusb "completed" flag)
+	int stop;
+	omron_device** devices;
+	int count;
+	/// Serializes user callbacks across worker threads
+	pthread_mutex_t cb_lock;
+	/// Hotplug state, guarded by watch_lock
+	pthread_mutex_t watch_lock;
+	int watching;
+	libusb_hotplug_callback_handle hotplug_handle;
+	omron_hotplug_job watch_job;
+	void* watch_user_data;
+	struct omron_fleet_watcher* watchers;
+};
+
+struct omron_fleet_worker {
+	omron_fleet* fleet;
+	int index;
+	omron_fleet_job job;
+	void* user_data;
+	int result;
+};
+
+struct omron_fleet_sync_args {
+	omron_fleet* fleet;
+	int bank;
+	const char* state_dir;
+	omron_fleet_bp_cb bp_cb;
+	omron_fleet_pd_cb pd_cb;
+	void* user_data;
+};
+
+struct omron_fleet_sync_ctx {
+	struct omron_fleet_sync_args* args;
+	int index;
+};
+
+static void* omron_fleet_event_thread(void* arg)
+{
+	omron_fleet* fleet = arg;
+	struct timeval tv;
+
+	while (!OMRON_ATOMIC_LOAD(&fleet->stop)) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 100000;
+		libusb_handle_events_timeout_completed(fleet->context, &tv, &fleet->stop);
+	}
+	return NULL;
+}
+
+OMRON_DECLSPEC omron_fleet* omron_fleet_create(void)
+{
+	omron_fleet* fleet;
+	int status;
+
+	omron_set_debug_level(-1); // Initialize to default if not already set
+	fleet = calloc(1, sizeof(*fleet));
+	if (!fleet) return NULL;
+	status = libusb_init(&fleet->context);
+	if (status < 0) {
+		MSG_ERROR("libusb_init returned %d\n", status);
+		free(fleet);
+		return NULL;
+	}
+	pthread_mutex_init(&fleet->cb_lock, NULL);
+	pthread_mutex_init(&fleet->watch_lock, NULL);
+	if (pthread_create(&fleet->event_thread, NULL, omron_fleet_event_thread, fleet)) {
+		MSG_ERROR("Cannot start event thread\n");
+		pthread_mutex_destroy(&fleet->cb_lock);
+		pthread_mutex_destroy(&fleet->watch_lock);
+		libusb_exit(fleet->context);
+		free(fleet);
+		return NULL;
+	}
+	return fleet;
+}
+
+static void omron_fleet_close_devices(omron_fleet* fleet)
+{
+	int i;
+
+	for (i = 0; i < fleet->count; ++i) {
+		omron_close(fleet->devices[i]);
+		omron_delete(fleet->devices[i]);
+	}
+	free(fleet->devices);
+	fleet->devices = NULL;
+	fleet->count = 0;
+}
+
+OMRON_DECLSPEC void omron_fleet_delete(omron_fleet* fleet)
+{
+	if (!fleet) return;
+	omron_fleet_unwatch(fleet);
+	omron_fleet_close_devices(fleet);
+	OMRON_ATOMIC_STORE(&fleet->stop, 1);
+	pthread_join(fleet->event_thread, NULL);
+	pthread_mutex_destroy(&fleet->cb_lock);
+	pthread_mutex_destroy(&fleet->watch_lock);
+	libusb_exit(fleet->context);
+	free(fleet);
+}
+
+OMRON_DECLSPEC int omron_fleet_open_all(omron_fleet* fleet, int device_vid, int device_pid)
+{
+	struct libusb_device **devs;
+	struct libusb_device *usb_dev;
+	ssize_t num_devs;
+	size_t i = 0;
+	int status;
+
+	omron_fleet_close_devices(fleet);
+	num_devs = libusb_get_device_list(fleet->context, &devs);
+	if (num_devs < 0) {
+		MSG_ERROR("libusb_get_device_list returned %d\n", (int)num_devs);
+		return OMRON_ERR_DEVIO;
+	}
+	fleet->devices = calloc(num_devs ? num_devs : 1, sizeof(omron_device*));
+	if (!fleet->devices) {
+		libusb_free_device_list(devs, 1);
+		return OMRON_ERR_DEVIO;
+	}
+
+	while ((usb_dev = devs[i++]) != NULL)
+	{
+		struct libusb_device_descriptor desc;
+		omron_device* dev;
+
+		status = libusb_get_device_descriptor(usb_dev, &desc);
+		if (status < 0) {
+			MSG_WARN("libusb_get_device_descriptor returned %d for device %02x:%02x\n", status, libusb_get_bus_number(usb_dev), libusb_get_device_address(usb_dev));
+			continue;
+		}
+		if (desc.idVendor != device_vid || desc.idProduct != device_pid) continue;
+
+		dev = omron_create_device_with_context(fleet->context);
+		if (!dev) break;
+		if (omron_init_device(dev) < 0) {
+			omron_delete(dev);
+			break;
+		}
+		status = omron_open_usb_device(dev, usb_dev);
+		if (status < 0) {
+			MSG_WARN("Skipping device %02x:%02x (%s)\n", libusb_get_bus_number(usb_dev), libusb_get_device_address(usb_dev), omron_strerror(status));
+			if (dev->device._is_open) omron_close(dev);
+			omron_delete(dev);
+			continue;
+		}
+		fleet->devices[fleet->count++] = dev;
+	}
+	libusb_free_device_list(devs, 1);
+	MSG_INFO("Opened %d fleet devices\n", fleet->count);
+	return fleet->count;
+}
+
+OMRON_DECLSPEC int omron_fleet_get_count(omron_fleet* fleet)
+{
+	return fleet->count;
+}
+
+OMRON_DECLSPEC omron_device* omron_fleet_get_device(omron_fleet* fleet, int device_index)
+{
+	if (device_index < 0 || device_index >= fleet->count) return NULL;
+	return fleet->devices[device_index];
+}
+
+static void* omron_fleet_worker_thread(void* arg)
+{
+	struct omron_fleet_worker* w = arg;
+
+	w->result = w->job(w->fleet->devices[w->index], w->index, w->user_data);
+	return NULL;
+}
+
+OMRON_DECLSPEC int omron_fleet_run(omron_fleet* fleet, omron_fleet_job job, void* user_data, int* results)
+{
+	struct omron_fleet_worker* workers;
+	pthread_t* threads;
+	int succeeded = 0;
+	int i;
+
+	if (!job) return OMRON_ERR_BADARG;
+	if (!fleet->count) return 0;
+	workers = calloc(fleet->count, sizeof(*workers));
+	threads = calloc(fleet->count, sizeof(*threads));
+	if (!workers || !threads) {
+		free(workers);
+		free(threads);
+		return OMRON_ERR_DEVIO;
+	}
+
+	for (i = 0; i < fleet->count; ++i) {
+		workers[i].fleet = fleet;
+		workers[i].index = i;
+		workers[i].job = job;
+		workers[i].user_data = user_data;
+		if (pthread_create(&threads[i], NULL, omron_fleet_worker_thread, &workers[i])) {
+			// Run it here instead, we still want every device done
+			MSG_WARN("Cannot start worker thread for device %d, running inline\n", i);
+			omron_fleet_worker_thread(&workers[i]);
+			threads[i] = pthread_self();
+		}
+	}
+	for (i = 0; i < fleet->count; ++i) {
+		if (!pthread_equal(threads[i], pthread_self())) {
+			pthread_join(threads[i], NULL);
+		}
+		if (results) results[i] = workers[i].result;
+		if (workers[i].result >= 0) ++succeeded;
+	}
+	free(workers);
+	free(threads);
+	return succeeded;
+}
+
+static int omron_fleet_bp_record(void* user_data, int index, const omron_bp_day_info* record)
+{
+	struct omron_fleet_sync_ctx* ctx = user_data;
+	int ret;
+
+	// The callback gets the device index instead of the record's
+	(void)index;
+	pthread_mutex_lock(&ctx->args->fleet->cb_lock);
+	ret = ctx->args->bp_cb(ctx->args->user_data, ctx->index, record);
+	pthread_mutex_unlock(&ctx->args->fleet->cb_lock);
+	return ret;
+}
+
+static int omron_fleet_pd_record(void* user_data, const omron_pd_daily_data* daily, const omron_pd_hourly_data* hourly)
+{
+	struct omron_fleet_sync_ctx* ctx = user_data;
+	int ret;
+
+	pthread_mutex_lock(&ctx->args->fleet->cb_lock);
+	ret = ctx->args->pd_cb(ctx->args->user_data, ctx->index, daily, hourly);
+	pthread_mutex_unlock(&ctx->args->fleet->cb_lock);
+	return ret;
+}
+
+static int omron_fleet_sync_bp_job(omron_device* dev, int device_index, void* user_data)
+{
+	struct omron_fleet_sync_ctx ctx;
+
+	ctx.args = user_data;
+	ctx.index = device_index;
+	return omron_sync_daily_bp(dev, ctx.args->bank, ctx.args->state_dir,
+				   ctx.args->bp_cb ? omron_fleet_bp_record : NULL, &ctx);
+}
+
+static int omron_fleet_sync_pd_job(omron_device* dev, int device_index, void* user_data)
+{
+	struct omron_fleet_sync_ctx ctx;
+
+	ctx.args = user_data;
+	ctx.index = device_index;
+	return omron_sync_pd(dev, ctx.args->state_dir,
+			     ctx.args->pd_cb ? omron_fleet_pd_record : NULL, &ctx);
+}
+
+OMRON_DECLSPEC int omron_fleet_sync_bp(omron_fleet* fleet, int bank, const char* state_dir, omron_fleet_bp_cb cb, void* user_data, int* results)
+{
+	struct omron_fleet_sync_args args;
+
+	memset(&args, 0, sizeof(args));
+	args.fleet = fleet;
+	args.bank = bank;
+	args.state_dir = state_dir;
+	args.bp_cb = cb;
+	args.user_data = user_data;
+	return omron_fleet_run(fleet, omron_fleet_sync_bp_job, &args, results);
+}
+
+OMRON_DECLSPEC int omron_fleet_sync_pd(omron_fleet* fleet, const char* state_dir, omron_fleet_pd_cb cb, void* user_data, int* results)
+{
+	struct omron_fleet_sync_args args;
+
+	memset(&args, 0, sizeof(args));
+	args.fleet = fleet;
+	args.state_dir = state_dir;
+	args.pd_cb = cb;
+	args.user_data = user_data;
+	return omron_fleet_run(fleet, omron_fleet_sync_pd_job, &args, results);
+}
+
+static void* omron_fleet_watcher_thread(void* arg)
+{
+	struct omron_fleet_watcher* w = arg;
+	omron_fleet* fleet = w->fleet;
+	omron_device* dev;
+	int status;
+
+	dev = omron_create_device_with_context(fleet->context);
+	if (dev) {
+		status = omron_init_device(dev);
+		if (status == 0) status = omron_open_usb_device(dev, w->usb_dev);
+		if (status == 0) {
+			status = fleet->watch_job(dev, fleet->watch_user_data);
+			MSG_INFO("Job for device %02x:%02x finished (%d)\n", libusb_get_bus_number(w->usb_dev), libusb_get_device_address(w->usb_dev), status);
+		} else {
+			MSG_WARN("Cannot open device %02x:%02x (%s)\n", libusb_get_bus_number(w->usb_dev), libusb_get_device_address(w->usb_dev), omron_strerror(status));
+		}
+		if (dev->device._is_open) omron_close(dev);
+		omron_delete(dev);
+	}
+	pthread_mutex_lock(&fleet->watch_lock);
+	w->done = 1;
+	pthread_mutex_unlock(&fleet->watch_lock);
+	return NULL;
+}
+
+/*
+ * Join and free watchers whose thread has finished. Called with watch_lock
+ * held.
+ */
+static void omron_fleet_reap_watchers(omron_fleet* fleet)
+{
+	struct omron_fleet_watcher** link = &fleet->watchers;
+
+	while (*link) {
+		struct omron_fleet_watcher* w = *link;
+		if (!w->done) {
+			link = &w->next;
+			continue;
+		}
+		pthread_join(w->thread, NULL);
+		libusb_unref_device(w->usb_dev);
+		*link = w->next;
+		free(w);
+	}
+}
+
+static int LIBUSB_CALL omron_fleet_hotplug_cb(struct libusb_context* context, struct libusb_device* usb_dev, libusb_hotplug_event event, void* user_data)
+{
+	omron_fleet* fleet = user_data;
+	struct omron_fleet_watcher* w;
+
+	(void)context;
+	pthread_mutex_lock(&fleet->watch_lock);
+	omron_fleet_reap_watchers(fleet);
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED && fleet->watching) {
+		MSG_INFO("Device %02x:%02x arrived\n", libusb_get_bus_number(usb_dev), libusb_get_device_address(usb_dev));
+		w = calloc(1, sizeof(*w));
+		if (w) {
+			w->fleet = fleet;
+			w->usb_dev = libusb_ref_device(usb_dev);
+			if (pthread_create(&w->thread, NULL, omron_fleet_watcher_thread, w)) {
+				MSG_ERROR("Cannot start watcher thread\n");
+				libusb_unref_device(w->usb_dev);
+				free(w);
+			} else {
+				w->next = fleet->watchers;
+				fleet->watchers = w;
+			}
+		}
+	} else if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) {
+		// The job's pending transfers fail with NO_DEVICE, which ends
+		// it; the watcher is reaped once its thread exits.
+		MSG_INFO("Device %02x:%02x left\n", libusb_get_bus_number(usb_dev), libusb_get_device_address(usb_dev));
+	}
+	pthread_mutex_unlock(&fleet->watch_lock);
+	return 0;
+}
+
+OMRON_DECLSPEC int omron_fleet_watch(omron_fleet* fleet, int device_vid, int device_pid, omron_hotplug_job job, void* user_data)
+{
+	int status;
+
+	if (!job) return OMRON_ERR_BADARG;
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		MSG_ERROR("libusb has no hotplug support on this platform\n");
+		return OMRON_ERR_UNSUPPORTED;
+	}
+	pthread_mutex_lock(&fleet->watch_lock);
+	if (fleet->watching) {
+		pthread_mutex_unlock(&fleet->watch_lock);
+		return OMRON_ERR_BADARG;
+	}
+	fleet->watch_job = job;
+	fleet->watch_user_data = user_data;
+	fleet->watching = 1;
+	pthread_mutex_unlock(&fleet->watch_lock);
+
+	// With ENUMERATE, devices already present are reported from inside
+	// this call
+	status = libusb_hotplug_register_callback(fleet->context,
+						  LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+						  LIBUSB_HOTPLUG_ENUMERATE, device_vid, device_pid,
+						  LIBUSB_HOTPLUG_MATCH_ANY, omron_fleet_hotplug_cb, fleet,
+						  &fleet->hotplug_handle);
+	if (status < 0) {
+		MSG_ERROR("libusb_hotplug_register_callback returned %d\n", status);
+		pthread_mutex_lock(&fleet->watch_lock);
+		fleet->watching = 0;
+		pthread_mutex_unlock(&fleet->watch_lock);
+		return OMRON_ERR_DEVIO;
+	}
+	MSG_INFO("Watching for %04x:%04x devices\n", device_vid, device_pid);
+	return 0;
+}
+
+OMRON_DECLSPEC void omron_fleet_unwatch(omron_fleet* fleet)
+{
+	struct omron_fleet_watcher* watchers;
+	struct omron_fleet_watcher* w;
+
+	pthread_mutex_lock(&fleet->watch_lock);
+	if (!fleet->watching) {
+		pthread_mutex_unlock(&fleet->watch_lock);
+		return;
+	}
+	fleet->watching = 0;
+	pthread_mutex_unlock(&fleet->watch_lock);
+
+	libusb_hotplug_deregister_callback(fleet->context, fleet->hotplug_handle);
+
+	// No more callbacks can add watchers now, but one may still be
+	// running on the event thread and reaping. Take the list from it,
+	// then wait for the running watchers without the lock (they take it
+	// to finish).
+	pthread_mutex_lock(&fleet->watch_lock);
+	watchers = fleet->watchers;
+	fleet->watchers = NULL;
+	pthread_mutex_unlock(&fleet->watch_lock);
+	while ((w = watchers) != NULL) {
+		pthread_join(w->thread, NULL);
+		libusb_unref_device(w->usb_dev);
+		watchers = w->next;
+		free(w);
+	}
+}
@@ -14,17 +14,342 @@
 
 #include "libomron/omron.h"
 #include "omron_internal.h"
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
 
 #define OMRON_INTERFACE 0
 #define OMRON_OUT_ENDPT 0x02
 #define OMRON_IN_ENDPT  0x81
 
-omron_device* omron_create_device()
+/*
+ * Asynchronous transport
+ *
+ * Input reports are pre-posted as interrupt transfers as soon as the device
+ * is opened, and completed reports are stored in a small queue that
+ * omron_usb_read_data() pops from. Output reports are submitted without waiting
+ * for completion, so all reports of a command go out back-to-back; a failed
+ * transfer is remembered and reported once by the next read or write call,
+ * after which input transfers are posted again. Only a device that has gone
+ * away fails every call from then on.
+ *
+ * Transfer callbacks may run on whichever thread is handling libusb events
+ * (e.g. a fleet event thread), so all of the state below is guarded by
+ * lock. Never hold lock across libusb event handling.
+ */
+
+/// Number of input transfers kept posted on the IN endpoint
+#define OMRON_ASYNC_IN_TRANSFERS  4
+/// Number of output transfers that may be in flight at once
+#define OMRON_ASYNC_OUT_TRANSFERS 8
+/// Number of completed input reports that can be queued (must be >= OMRON_ASYNC_IN_TRANSFERS)
+#define OMRON_ASYNC_QUEUE_LEN     16
+/// How long the input endpoint must stay quiet before a drain considers it empty (one HID polling interval)
+#define OMRON_DRAIN_SETTLE_MS     10
+/// Largest report size we handle (HID full speed interrupt endpoints are <= 64 bytes)
+#define OMRON_ASYNC_MAX_REPORT    64
+
+struct omron_libusb_async {
+	omron_device* dev;
+	struct libusb_transfer* in_xfer[OMRON_ASYNC_IN_TRANSFERS];
+	int in_busy[OMRON_ASYNC_IN_TRANSFERS];
+	int in_flight;
+	struct libusb_transfer* out_xfer[OMRON_ASYNC_OUT_TRANSFERS];
+	int out_busy[OMRON_ASYNC_OUT_TRANSFERS];
+	int out_flight;
+	/// Ring of completed input reports
+	uint8_t queue[OMRON_ASYNC_QUEUE_LEN][OMRON_ASYNC_MAX_REPORT];
+	int queue_len[OMRON_ASYNC_QUEUE_LEN];
+	int queue_head;
+	int queue_count;
+	/// Transport error, returned once by the next read or write
+	int error;
+	/// Set once the device is gone, every call fails from then on
+	int gone;
+	/// Set by transfer callbacks so event handling returns promptly
+	int event;
+	int stopping;
+	pthread_mutex_t lock;
+};
+
+static long omron_async_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/*
+ * Run libusb event handling for at most timeout_ms, returning early once any
+ * of our transfers has completed. The caller must clear a->event (with the
+ * lock held) after checking its condition and before calling this.
+ */
+static int omron_async_wait(omron_device* dev, long timeout_ms)
+{
+	struct omron_libusb_async* a = dev->device._async;
+	struct timeval tv;
+	int status;
+
+	if (timeout_ms < 0) timeout_ms = 0;
+	tv.tv_sec = timeout_ms / 1000;
+	tv.tv_usec = (timeout_ms % 1000) * 1000;
+	status = libusb_handle_events_timeout_completed(dev->device._context, &tv, &a->event);
+	if (status < 0 && status != LIBUSB_ERROR_INTERRUPTED) {
+		MSG_ERROR("libusb_handle_events_timeout_completed returned %d\n", status);
+		return OMRON_ERR_DEVIO;
+	}
+	return 0;
+}
+
+static void omron_async_fill_in(struct omron_libusb_async* a);
+static void omron_async_stop(omron_device* dev);
+
+/*
+ * Remember a failed transfer. Called with a->lock held.
+ */
+static void omron_async_failed(struct omron_libusb_async* a, int no_device)
+{
+	a->error = OMRON_ERR_DEVIO;
+	if (no_device) a->gone = 1;
+}
+
+/*
+ * Hand out the pending transport error, if any. Unless the device is gone
+ * the error is cleared and the input transfers posted again, so a transient
+ * failure (timeout, stall) only fails the call that sees it. Called with
+ * a->lock held.
+ */
+static int omron_async_take_error(struct omron_libusb_async* a)
+{
+	int status = a->error;
+
+	if (!status || a->gone) return status;
+	a->error = 0;
+	omron_async_fill_in(a);
+	return status;
+}
+
+static void LIBUSB_CALL omron_async_in_cb(struct libusb_transfer* xfer)
+{
+	struct omron_libusb_async* a = xfer->user_data;
+	int i;
+	int slot;
+
+	pthread_mutex_lock(&a->lock);
+	for (i = 0; i < OMRON_ASYNC_IN_TRANSFERS; ++i) {
+		if (a->in_xfer[i] == xfer) a->in_busy[i] = 0;
+	}
+	a->in_flight--;
+
+	if (xfer->status == LIBUSB_TRANSFER_CANCELLED || a->stopping) {
+		// Nothing to queue
+	} else if (xfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		MSG_ERROR("Input transfer failed with status %d\n", xfer->status);
+		omron_async_failed(a, xfer->status == LIBUSB_TRANSFER_NO_DEVICE);
+	} else {
+		slot = (a->queue_head + a->queue_count) % OMRON_ASYNC_QUEUE_LEN;
+		memcpy(a->queue[slot], xfer->buffer, xfer->actual_length);
+		a->queue_len[slot] = xfer->actual_length;
+		a->queue_count++;
+		omron_async_fill_in(a);
+	}
+	a->event = 1;
+	pthread_mutex_unlock(&a->lock);
+}
+
+static void LIBUSB_CALL omron_async_out_cb(struct libusb_transfer* xfer)
+{
+	struct omron_libusb_async* a = xfer->user_data;
+	int i;
+
+	pthread_mutex_lock(&a->lock);
+	for (i = 0; i < OMRON_ASYNC_OUT_TRANSFERS; ++i) {
+		if (a->out_xfer[i] == xfer) a->out_busy[i] = 0;
+	}
+	a->out_flight--;
+
+	if (xfer->status == LIBUSB_TRANSFER_CANCELLED || a->stopping) {
+		// Nothing to check
+	} else if (xfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		MSG_ERROR("Output transfer failed with status %d\n", xfer->status);
+		omron_async_failed(a, xfer->status == LIBUSB_TRANSFER_NO_DEVICE);
+	} else if (xfer->actual_length != xfer->length) {
+		MSG_ERROR("Transfer size (%d) did not match expected (%d)\n", xfer->actual_length, xfer->length);
+		omron_async_failed(a, 0);
+	}
+	a->event = 1;
+	pthread_mutex_unlock(&a->lock);
+}
+
+/*
+ * Keep input transfers posted, as long as the queue has room for everything
+ * that could complete. Called with a->lock held.
+ */
+static void omron_async_fill_in(struct omron_libusb_async* a)
+{
+	int i;
+	int status;
+
+	for (i = 0; i < OMRON_ASYNC_IN_TRANSFERS; ++i) {
+		if (a->stopping || a->error) return;
+		if (a->in_flight + a->queue_count >= OMRON_ASYNC_QUEUE_LEN) return;
+		if (a->in_busy[i]) continue;
+		status = libusb_submit_transfer(a->in_xfer[i]);
+		if (status < 0) {
+			MSG_ERROR("libusb_submit_transfer returned %d\n", status);
+			omron_async_failed(a, status == LIBUSB_ERROR_NO_DEVICE);
+			return;
+		}
+		a->in_busy[i] = 1;
+		a->in_flight++;
+	}
+}
+
+static void omron_async_free(struct omron_libusb_async* a)
+{
+	int i;
+
+	for (i = 0; i < OMRON_ASYNC_IN_TRANSFERS; ++i) {
+		if (a->in_xfer[i]) {
+			free(a->in_xfer[i]->buffer);
+			libusb_free_transfer(a->in_xfer[i]);
+		}
+	}
+	for (i = 0; i < OMRON_ASYNC_OUT_TRANSFERS; ++i) {
+		if (a->out_xfer[i]) {
+			free(a->out_xfer[i]->buffer);
+			libusb_free_transfer(a->out_xfer[i]);
+		}
+	}
+	pthread_mutex_destroy(&a->lock);
+	free(a);
+}
+
+static int omron_async_start(omron_device* dev)
+{
+	struct omron_libusb_async* a;
+	int error, posted;
+	int i;
+
+	if (dev->input_size > OMRON_ASYNC_MAX_REPORT || dev->output_size > OMRON_ASYNC_MAX_REPORT) {
+		MSG_ERROR("Report size too large for async transport (%d/%d > %d)\n", dev->input_size, dev->output_size, OMRON_ASYNC_MAX_REPORT);
+		return OMRON_ERR_DEVIO;
+	}
+	a = calloc(1, sizeof(*a));
+	if (!a) return OMRON_ERR_DEVIO;
+	a->dev = dev;
+	pthread_mutex_init(&a->lock, NULL);
+
+	for (i = 0; i < OMRON_ASYNC_IN_TRANSFERS; ++i) {
+		unsigned char* buf = malloc(dev->input_size);
+		a->in_xfer[i] = libusb_alloc_transfer(0);
+		if (!buf || !a->in_xfer[i]) {
+			free(buf);
+			omron_async_free(a);
+			return OMRON_ERR_DEVIO;
+		}
+		libusb_fill_interrupt_transfer(a->in_xfer[i], dev->device._device, OMRON_IN_ENDPT, buf, dev->input_size, omron_async_in_cb, a, 0);
+	}
+	for (i = 0; i < OMRON_ASYNC_OUT_TRANSFERS; ++i) {
+		unsigned char* buf = malloc(dev->output_size);
+		a->out_xfer[i] = libusb_alloc_transfer(0);
+		if (!buf || !a->out_xfer[i]) {
+			free(buf);
+			omron_async_free(a);
+			return OMRON_ERR_DEVIO;
+		}
+		libusb_fill_interrupt_transfer(a->out_xfer[i], dev->device._device, OMRON_OUT_ENDPT, buf, dev->output_size, omron_async_out_cb, a, 0);
+	}
+
+	dev->device._async = a;
+	pthread_mutex_lock(&a->lock);
+	omron_async_fill_in(a);
+	// The posted transfers may complete (and change these) once unlocked
+	error = a->error;
+	posted = a->in_flight;
+	pthread_mutex_unlock(&a->lock);
+	if (error) {
+		// Transfers posted before the failure have to be cancelled first
+		omron_async_stop(dev);
+		return OMRON_ERR_DEVIO;
+	}
+	MSG_DEVIO("Async transport started (%d input transfers posted)\n", posted);
+	return 0;
+}
+
+static void omron_async_stop(omron_device* dev)
+{
+	struct omron_libusb_async* a = dev->device._async;
+	int i;
+	int tries = 100;
+
+	if (!a) return;
+	pthread_mutex_lock(&a->lock);
+	a->stopping = 1;
+	for (i = 0; i < OMRON_ASYNC_IN_TRANSFERS; ++i) {
+		if (a->in_busy[i]) libusb_cancel_transfer(a->in_xfer[i]);
+	}
+	for (i = 0; i < OMRON_ASYNC_OUT_TRANSFERS; ++i) {
+		if (a->out_busy[i]) libusb_cancel_transfer(a->out_xfer[i]);
+	}
+	while ((a->in_flight || a->out_flight) && tries--) {
+		a->event = 0;
+		pthread_mutex_unlock(&a->lock);
+		omron_async_wait(dev, 10);
+		pthread_mutex_lock(&a->lock);
+	}
+	pthread_mutex_unlock(&a->lock);
+	if (a->in_flight || a->out_flight) {
+		// Freeing transfers libusb still owns would be worse than a leak
+		MSG_ERROR("Transfers still pending after cancel, leaking async state\n");
+	} else {
+		omron_async_free(a);
+	}
+	dev->device._async = NULL;
+}
+
+/*
+ * Wait for every submitted output report to reach the device.
+ */
+static int omron_async_flush_writes(omron_device* dev, int timeout)
+{
+	struct omron_libusb_async* a = dev->device._async;
+	long deadline = omron_async_now_ms() + timeout;
+	int status = 0;
+
+	pthread_mutex_lock(&a->lock);
+	while (a->out_flight && !a->error) {
+		long remaining = deadline - omron_async_now_ms();
+		if (remaining <= 0) {
+			MSG_ERROR("USB operation timed out.\n");
+			status = OMRON_ERR_DEVIO;
+			break;
+		}
+		a->event = 0;
+		pthread_mutex_unlock(&a->lock);
+		status = omron_async_wait(dev, remaining);
+		pthread_mutex_lock(&a->lock);
+		if (status < 0) break;
+	}
+	if (status == 0) status = omron_async_take_error(a);
+	pthread_mutex_unlock(&a->lock);
+	return status;
+}
+
+omron_device* omron_create_device_with_context(struct libusb_context* context)
 {
 	int status;
 	omron_device* s = (omron_device*)malloc(sizeof(omron_device));
+	if (!s) return NULL;
 	s->device._is_open = 0;
+	s->device._async = NULL;
+	s->device._enum = NULL;
+	if (context) {
+		s->device._context = context;
+		return s;
+	}
 	status = libusb_init(&s->device._context);
 	if (status < 0) {
 		MSG_ERROR("libusb_init returned %d\n", status);
@@ -34,20 +359,86 @@ omron_device* omron_create_device()
 	return s;
 }
 
-int omron_get_count(omron_device* s, int device_vid, int device_pid)
+omron_device* omron_create_device()
+{
+	return omron_create_device_with_context(NULL);
+}
+
+/*
+ * Enumeration snapshot
+ *
+ * Matching devices are referenced, so entries stay usable after the libusb
+ * device list is freed. The snapshot is replaced by the next enumeration,
+ * and dropped when opening from it shows it has gone stale.
+ */
+struct omron_libusb_enum {
+	int vid;
+	int pid;
+	int count;
+	omron_device_entry* entries;
+};
+
+static void omron_enum_free(omron_device* s)
+{
+	struct omron_libusb_enum* e = s->device._enum;
+	int i;
+
+	if (!e) return;
+	for (i = 0; i < e->count; ++i) {
+		libusb_unref_device(e->entries[i]._handle);
+	}
+	free(e->entries);
+	free(e);
+	s->device._enum = NULL;
+}
+
+static void omron_enum_fill_entry(omron_device_entry* entry, struct libusb_device* dev, const struct libusb_device_descriptor* desc)
+{
+	uint8_t ports[7];
+	int len;
+	int n;
+	int i;
+
+	entry->bus_number = libusb_get_bus_number(dev);
+	entry->address = libusb_get_device_address(dev);
+	entry->vid = desc->idVendor;
+	entry->pid = desc->idProduct;
+	entry->bcd_device = desc->bcdDevice;
+	len = snprintf(entry->port_path, sizeof(entry->port_path), "%d", entry->bus_number);
+	n = libusb_get_port_numbers(dev, ports, sizeof(ports));
+	for (i = 0; i < n; ++i) {
+		len += snprintf(entry->port_path + len, sizeof(entry->port_path) - len,
+				"%c%d", i ? '.' : '-', ports[i]);
+	}
+	entry->_handle = libusb_ref_device(dev);
+}
+
+static int omron_enum_refresh(omron_device* s, int device_vid, int device_pid)
 {
 	struct libusb_device **devs;
 	struct libusb_device *dev;
+	struct omron_libusb_enum* e;
+	ssize_t num_devs;
 	size_t i = 0;
-	int count = 0;
 	int status;
 
-	status = libusb_get_device_list(s->device._context, &devs);
-	if (status < 0)
+	omron_enum_free(s);
+	num_devs = libusb_get_device_list(s->device._context, &devs);
+	if (num_devs < 0)
 	{
-		MSG_ERROR("libusb_get_device_list returned %d\n", status);
+		MSG_ERROR("libusb_get_device_list returned %d\n", (int)num_devs);
+		return OMRON_ERR_DEVIO;
+	}
+	e = calloc(1, sizeof(*e));
+	if (e) e->entries = calloc(num_devs ? num_devs : 1, sizeof(omron_device_entry));
+	if (!e || !e->entries)
+	{
+		free(e);
+		libusb_free_device_list(devs, 1);
 		return OMRON_ERR_DEVIO;
 	}
+	e->vid = device_vid;
+	e->pid = device_pid;
 
 	while ((dev = devs[i++]) != NULL)
 	{
@@ -56,72 +447,60 @@ int omron_get_count(omron_device* s, int device_vid, int device_pid)
 		if (status < 0)
 		{
 			MSG_WARN("libusb_get_device_descriptor returned %d for device %02x:%02x\n", status, libusb_get_bus_number(dev), libusb_get_device_address(dev));
-			break;
+			continue;
 		}
 		if (desc.idVendor == device_vid && desc.idProduct == device_pid)
 		{
-			++count;
+			omron_enum_fill_entry(&e->entries[e->count++], dev, &desc);
 		}
 	}
 
 	libusb_free_device_list(devs, 1);
-	return count;
+	s->device._enum = e;
+	MSG_DEVIO("Enumerated %d matching devices\n", e->count);
+	return e->count;
 }
 
-int omron_open(omron_device* s, int device_vid, int device_pid, unsigned int device_index)
+/*
+ * Make sure there is a snapshot for device_vid/device_pid. Returns 1 if
+ * an existing one is reused (so it may be stale), 0 if freshly taken.
+ */
+static int omron_enum_get(omron_device* s, int device_vid, int device_pid)
 {
-	struct libusb_device **devs;
-	struct libusb_device *found = NULL;
-	struct libusb_device *dev;
-	size_t i = 0;
-	int count = 0;
+	struct omron_libusb_enum* e = s->device._enum;
 	int status;
 
-	status = libusb_get_device_list(s->device._context, &devs);
-	if (status < 0) {
-		MSG_ERROR("libusb_get_device_list returned %d\n", status);
-		return OMRON_ERR_DEVIO;
-	}
+	if (e && e->vid == device_vid && e->pid == device_pid) return 1;
+	status = omron_enum_refresh(s, device_vid, device_pid);
+	return status < 0 ? status : 0;
+}
 
-	while ((dev = devs[i++]) != NULL)
-	{
-		struct libusb_device_descriptor desc;
-		status = libusb_get_device_descriptor(dev, &desc);
-		if (status < 0)
-		{
-			MSG_ERROR("libusb_get_device_descriptor returned %d for device %02x:%02x\n", status, libusb_get_bus_number(dev), libusb_get_device_address(dev));
-			libusb_free_device_list(devs, 1);
-			return OMRON_ERR_DEVIO;
-		}
-		if (desc.idVendor == device_vid && desc.idProduct == device_pid)
-		{
-			if(count == device_index)
-			{
-				found = dev;
-				break;
-			}
-			++count;
-		}
-	}
+int omron_usb_get_count(omron_device* s, int device_vid, int device_pid)
+{
+	return omron_enum_refresh(s, device_vid, device_pid);
+}
 
-	if (found)
-	{
-		dev = found;
-		status = libusb_open(found, &s->device._device);
-		libusb_free_device_list(devs, 1);
-		if (status < 0)
-		{
-			MSG_ERROR("libusb_open returned %d for device %02x:%02x\n", status, libusb_get_bus_number(dev), libusb_get_device_address(dev));
-			return OMRON_ERR_DEVIO;
-		}
-	}
-	else
+int omron_enumerate(omron_device* s, int device_vid, int device_pid, const omron_device_entry** entries)
+{
+	int status = omron_enum_refresh(s, device_vid, device_pid);
+	if (entries) *entries = status < 0 ? NULL : s->device._enum->entries;
+	return status;
+}
+
+int omron_open_usb_device(omron_device* s, struct libusb_device* dev)
+{
+	int status;
+
+	status = libusb_open(dev, &s->device._device);
+	if (status < 0)
 	{
-		libusb_free_device_list(devs, 1);
-		MSG_ERROR("Could not find requested device (%d) to open\n", device_index);
-		return OMRON_ERR_BADARG;
+		MSG_ERROR("libusb_open returned %d for device %02x:%02x\n", status, libusb_get_bus_number(dev), libusb_get_device_address(dev));
+		return OMRON_ERR_DEVIO;
 	}
-	MSG_DEVIO("Opened device %d (USB device %02x:%02x)\n", device_index, libusb_get_bus_number(dev), libusb_get_device_address(dev));
+	// Only a device that got opened is on the USB transport
+	s->transport = &omron_usb_transport;
+	s->transport_data = NULL;
+	MSG_DEVIO("Opened USB device %02x:%02x\n", libusb_get_bus_number(dev), libusb_get_device_address(dev));
 	s->input_size = libusb_get_max_packet_size(dev, OMRON_IN_ENDPT);
 	s->output_size = libusb_get_max_packet_size(dev, OMRON_OUT_ENDPT);
 	s->device._is_open = 1;
@@ -131,6 +510,8 @@ int omron_open(omron_device* s, int device_vid, int device_pid, unsigned int dev
 		MSG_ERROR("libusb_get_max_packet_size returned an invalid value\n");
 		return OMRON_ERR_DEVIO;
 	}
+	status = omron_alloc_arena(s);
+	if (status < 0) return status;
 
 	if(libusb_kernel_driver_active(s->device._device, OMRON_INTERFACE))
 	{
@@ -145,10 +526,84 @@ int omron_open(omron_device* s, int device_vid, int device_pid, unsigned int dev
 		return OMRON_ERR_DEVIO;
 	}
 
-	return 0;
+	// Nothing is known about the device state after (re)opening
+	omron_reset_session(s);
+	return omron_async_start(s);
+}
+
+int omron_open_handle(omron_device* s, const omron_device_entry* entry)
+{
+	if (!entry || !entry->_handle) return OMRON_ERR_BADARG;
+	MSG_DEVIO("Opening device at %s\n", entry->port_path);
+	return omron_open_usb_device(s, entry->_handle);
+}
+
+/*
+ * Open the snapshot entry chosen by match(), retaking the snapshot once if
+ * the cached one has no such entry or the device could not be opened.
+ */
+static int omron_open_matching(omron_device* s, int device_vid, int device_pid,
+			       int (*match)(const omron_device_entry*, int, const void*), const void* key)
+{
+	struct omron_libusb_enum* e;
+	int cached;
+	int status;
+	int i;
+
+	cached = omron_enum_get(s, device_vid, device_pid);
+	for (;;) {
+		if (cached < 0) return cached;
+		e = s->device._enum;
+		for (i = 0; i < e->count; ++i) {
+			if (match(&e->entries[i], i, key)) break;
+		}
+		if (i < e->count) {
+			status = omron_open_handle(s, &e->entries[i]);
+			// Only retry if nothing was opened, i.e. the device is gone
+			if (status == 0 || s->device._is_open || !cached) return status;
+		} else if (!cached) {
+			return OMRON_ERR_BADARG;
+		}
+		MSG_DEVIO("Cached enumeration is stale, enumerating again\n");
+		cached = omron_enum_refresh(s, device_vid, device_pid);
+		if (cached > 0) cached = 0;
+	}
+}
+
+static int omron_match_index(const omron_device_entry* entry, int index, const void* key)
+{
+	(void)entry;
+	return index == (int)*(const unsigned int*)key;
 }
 
-int omron_close(omron_device* s)
+static int omron_match_path(const omron_device_entry* entry, int index, const void* key)
+{
+	(void)index;
+	return !strcmp(entry->port_path, key);
+}
+
+int omron_usb_open(omron_device* s, int device_vid, int device_pid, unsigned int device_index)
+{
+	int status = omron_open_matching(s, device_vid, device_pid, omron_match_index, &device_index);
+	if (status == OMRON_ERR_BADARG) {
+		MSG_ERROR("Could not find requested device (%d) to open\n", device_index);
+	}
+	return status;
+}
+
+int omron_open_path(omron_device* s, int device_vid, int device_pid, const char* port_path)
+{
+	int status;
+
+	if (!port_path) return OMRON_ERR_BADARG;
+	status = omron_open_matching(s, device_vid, device_pid, omron_match_path, port_path);
+	if (status == OMRON_ERR_BADARG) {
+		MSG_ERROR("No device at port %s\n", port_path);
+	}
+	return status;
+}
+
+static int omron_usb_close(omron_device* s)
 {
 	int status;
 
@@ -157,6 +612,7 @@ int omron_close(omron_device* s)
 		MSG_ERROR("Device not open\n");
 		return OMRON_ERR_NOTOPEN;
 	}
+	omron_async_stop(s);
 	status = libusb_release_interface(s->device._device, OMRON_INTERFACE);
 	if (status < 0)
 	{
@@ -171,10 +627,15 @@ int omron_close(omron_device* s)
 
 void omron_delete(omron_device* dev)
 {
+	omron_enum_free(dev);
+	omron_free_arena(dev);
+	omron_free_event_log(dev);
+	omron_free_stats(dev);
+	omron_free_lock(dev);
 	free(dev);
 }
 
-int omron_set_mode(omron_device* dev, omron_mode mode)
+static int omron_usb_set_mode(omron_device* dev, omron_mode mode)
 {
 
 	uint8_t feature_report[2] = {(mode & 0xff00) >> 8, (mode & 0x00ff)};
@@ -183,6 +644,13 @@ int omron_set_mode(omron_device* dev, omron_mode mode)
 	const int REQ_HID_SET_REPORT = 0x09;
 	const int HID_REPORT_TYPE_FEATURE = 3;
 	int num_bytes_transferred;
+	int status;
+
+	// The mode change must not overtake output reports still in flight
+	if (dev->device._async) {
+		status = omron_async_flush_writes(dev, 1000);
+		if (status < 0) return status;
+	}
 
 	MSG_INFO("Setting mode to %04x\n", mode);
 	num_bytes_transferred = libusb_control_transfer(dev->device._device, LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE, REQ_HID_SET_REPORT, (HID_REPORT_TYPE_FEATURE << 8) | feature_report_id, feature_interface_num, feature_report, sizeof(feature_report), 1000);
@@ -195,33 +663,61 @@ int omron_set_mode(omron_device* dev, omron_mode mode)
 	return 0;
 }
 
-int omron_read_data(omron_device* dev, uint8_t* report_buf, int report_size, int timeout)
+/*
+ * Take the next queued input report, waiting up to timeout ms for one. If
+ * none comes, returns 0 if timeout_ok, or else fails.
+ */
+static int omron_usb_read_report(omron_device* dev, uint8_t* report_buf, int report_size, int timeout, int timeout_ok)
 {
+	struct omron_libusb_async* a = dev->device._async;
+	long deadline;
 	int trans;
 	int status;
-	int timeout_ok = (timeout < 0);
 
-	if (timeout_ok) {
-		timeout = -timeout;
-	}
 	if (report_size < dev->input_size) {
 		MSG_ERROR("Supplied buffer too small (%d < %d)\n", report_size, dev->input_size);
 		return OMRON_ERR_BUFSIZE;
 	}
-	status = libusb_bulk_transfer(dev->device._device, OMRON_IN_ENDPT, report_buf, dev->input_size, &trans, timeout);
-	if (status != 0) {
-		if (status == LIBUSB_ERROR_TIMEOUT) {
+	if (!a) {
+		MSG_ERROR("Device not open\n");
+		return OMRON_ERR_NOTOPEN;
+	}
+	deadline = omron_async_now_ms() + timeout;
+	pthread_mutex_lock(&a->lock);
+	while (!a->queue_count) {
+		long remaining;
+
+		status = omron_async_take_error(a);
+		remaining = deadline - omron_async_now_ms();
+		if (!status && remaining <= 0) {
 			if (timeout_ok) {
-				MSG_DEVIO("(USB operation timed out)\n");
-				return 0;
+				if (timeout) MSG_DEVIO("(USB operation timed out)\n");
+			} else {
+				MSG_ERROR("USB operation timed out.\n");
+				status = OMRON_ERR_DEVIO;
 			}
-			MSG_ERROR("USB operation timed out.\n");
-			return OMRON_ERR_DEVIO;
+			pthread_mutex_unlock(&a->lock);
+			return status;
+		}
+		if (!status) {
+			a->event = 0;
+			pthread_mutex_unlock(&a->lock);
+			status = omron_async_wait(dev, remaining);
+			pthread_mutex_lock(&a->lock);
+		}
+		if (status < 0) {
+			pthread_mutex_unlock(&a->lock);
+			return status;
 		}
-		MSG_ERROR("libusb_bulk_transfer returned %d\n", status);
-		return OMRON_ERR_DEVIO;
 	}
-	MSG_HEXDUMP(OMRON_DEBUG_DEVIO, "read: ", report_buf, trans);
+
+	trans = a->queue_len[a->queue_head];
+	memcpy(report_buf, a->queue[a->queue_head], trans);
+	a->queue_head = (a->queue_head + 1) % OMRON_ASYNC_QUEUE_LEN;
+	a->queue_count--;
+	omron_async_fill_in(a);
+	pthread_mutex_unlock(&a->lock);
+
 	if (trans != dev->input_size) {
 		MSG_ERROR("Transfer size (%d) did not match expected (%d)\n", trans, dev->input_size);
 		return OMRON_ERR_DEVIO;
@@ -229,11 +725,41 @@ int omron_read_data(omron_device* dev, uint8_t* report_buf, int report_size, int
 	return trans;
 }
 
-int omron_write_data(omron_device* dev, uint8_t* report_buf, int report_size, int timeout)
+static int omron_usb_read_data(omron_device* dev, uint8_t* report_buf, int report_size, int timeout)
 {
-	int trans;
+	if (timeout < 0) {
+		return omron_usb_read_report(dev, report_buf, report_size, -timeout, 1);
+	}
+	return omron_usb_read_report(dev, report_buf, report_size, timeout, 0);
+}
+
+static int omron_usb_poll_read(omron_device* dev, uint8_t* report_buf, int report_size)
+{
+	struct omron_libusb_async* a = dev->device._async;
 	int status;
+
+	if (!a) {
+		MSG_ERROR("Device not open\n");
+		return OMRON_ERR_NOTOPEN;
+	}
+	// Complete the transfers whose descriptors the caller saw ready,
+	// without waiting for any more
+	pthread_mutex_lock(&a->lock);
+	a->event = 0;
+	pthread_mutex_unlock(&a->lock);
+	status = omron_async_wait(dev, 0);
+	if (status < 0) return status;
+	return omron_usb_read_report(dev, report_buf, report_size, 0, 1);
+}
+
+static int omron_usb_write_data(omron_device* dev, uint8_t* report_buf, int report_size, int timeout)
+{
+	struct omron_libusb_async* a = dev->device._async;
+	struct libusb_transfer* xfer = NULL;
 	int timeout_ok = (timeout < 0);
+	long deadline;
+	int i;
+	int status;
 
 	if (timeout_ok) {
 		timeout = -timeout;
@@ -242,24 +768,152 @@ int omron_write_data(omron_device* dev, uint8_t* report_buf, int report_size, in
 		MSG_ERROR("Supplied buffer too large (%d > %d)\n", report_size, dev->output_size);
 		return OMRON_ERR_BUFSIZE;
 	}
-	status = libusb_bulk_transfer(dev->device._device, OMRON_OUT_ENDPT, report_buf, report_size, &trans, timeout);
-	if (status != 0) {
-		if (status == LIBUSB_ERROR_TIMEOUT) {
+	if (!a) {
+		MSG_ERROR("Device not open\n");
+		return OMRON_ERR_NOTOPEN;
+	}
+	deadline = omron_async_now_ms() + timeout;
+	pthread_mutex_lock(&a->lock);
+	while (1) {
+		long remaining;
+
+		status = omron_async_take_error(a);
+		if (status) break;
+		for (i = 0; i < OMRON_ASYNC_OUT_TRANSFERS; ++i) {
+			if (!a->out_busy[i]) {
+				xfer = a->out_xfer[i];
+				break;
+			}
+		}
+		if (xfer) break;
+		remaining = deadline - omron_async_now_ms();
+		if (remaining <= 0) {
 			if (timeout_ok) {
 				MSG_DEVIO("(USB operation timed out)\n");
-				return 0;
+			} else {
+				MSG_ERROR("USB operation timed out.\n");
+				status = OMRON_ERR_DEVIO;
 			}
-			MSG_ERROR("USB operation timed out.\n");
-			return OMRON_ERR_DEVIO;
+			break;
 		}
-		MSG_ERROR("libusb_bulk_transfer returned %d\n", status);
-		return OMRON_ERR_DEVIO;
+		a->event = 0;
+		pthread_mutex_unlock(&a->lock);
+		status = omron_async_wait(dev, remaining);
+		pthread_mutex_lock(&a->lock);
+		if (status < 0) break;
 	}
-	MSG_HEXDUMP(OMRON_DEBUG_DEVIO, "wrote: ", report_buf, trans);
-	if (trans != report_size) {
-		MSG_ERROR("Transfer size (%d) did not match expected (%d)\n", trans, dev->input_size);
+	if (!xfer) {
+		pthread_mutex_unlock(&a->lock);
+		return status;
+	}
+
+	memcpy(xfer->buffer, report_buf, report_size);
+	xfer->length = report_size;
+	xfer->timeout = timeout;
+	status = libusb_submit_transfer(xfer);
+	if (status < 0) {
+		if (status == LIBUSB_ERROR_NO_DEVICE) omron_async_failed(a, 1);
+		pthread_mutex_unlock(&a->lock);
+		MSG_ERROR("libusb_submit_transfer returned %d\n", status);
 		return OMRON_ERR_DEVIO;
 	}
-	return trans;
+	a->out_busy[i] = 1;
+	a->out_flight++;
+	pthread_mutex_unlock(&a->lock);
+	return report_size;
+}
+
+static int omron_usb_drain_input(omron_device* dev)
+{
+	struct omron_libusb_async* a = dev->device._async;
+	int drained = 0;
+	int status;
+	int wait;
+
+	if (!a) {
+		MSG_ERROR("Device not open\n");
+		return OMRON_ERR_NOTOPEN;
+	}
+	pthread_mutex_lock(&a->lock);
+	while (1) {
+		long deadline;
+
+		while (a->queue_count) {
+			MSG_HEXDUMP(OMRON_DEBUG_DEVIO, "drained: ", a->queue[a->queue_head], a->queue_len[a->queue_head]);
+			drained += a->queue_len[a->queue_head];
+			a->queue_head = (a->queue_head + 1) % OMRON_ASYNC_QUEUE_LEN;
+			a->queue_count--;
+		}
+		omron_async_fill_in(a);
+		if (a->error) {
+			drained = omron_async_take_error(a);
+			break;
+		}
+
+		// Input transfers are already posted, so anything the device
+		// still has queued completes within a polling interval. Return
+		// as soon as that interval passes quietly, or with commands still
+		// unanswered, once they have had a round trip to answer.
+		wait = omron_drain_wait_ms(dev);
+		deadline = omron_async_now_ms() + (wait > OMRON_DRAIN_SETTLE_MS ? wait : OMRON_DRAIN_SETTLE_MS);
+		status = 0;
+		while (!a->queue_count && !a->error) {
+			long remaining = deadline - omron_async_now_ms();
+			if (remaining <= 0) break;
+			a->event = 0;
+			pthread_mutex_unlock(&a->lock);
+			status = omron_async_wait(dev, remaining);
+			pthread_mutex_lock(&a->lock);
+			if (status < 0) break;
+		}
+		if (status < 0) {
+			drained = status;
+			break;
+		}
+		if (!a->queue_count) break;
+	}
+	pthread_mutex_unlock(&a->lock);
+	return drained;
+}
+
+static int omron_usb_get_pollfds(omron_device* dev, omron_pollfd* fds, int max_fds, int* timeout_ms)
+{
+	const struct libusb_pollfd** pollfds;
+	struct timeval tv;
+	int count;
+
+	if (!dev->device._async) {
+		MSG_ERROR("Device not open\n");
+		return OMRON_ERR_NOTOPEN;
+	}
+	pollfds = libusb_get_pollfds(dev->device._context);
+	if (!pollfds) {
+		MSG_ERROR("libusb has no pollable descriptors on this platform\n");
+		return OMRON_ERR_UNSUPPORTED;
+	}
+	for (count = 0; pollfds[count]; ++count) {
+		if (count < max_fds) {
+			fds[count].fd = pollfds[count]->fd;
+			fds[count].events = pollfds[count]->events;
+		}
+	}
+	libusb_free_pollfds(pollfds);
+
+	// Some platforms need libusb to time out transfers itself
+	if (libusb_get_next_timeout(dev->device._context, &tv) == 1) {
+		long ms = tv.tv_sec * 1000L + (tv.tv_usec + 999) / 1000;
+		if (*timeout_ms < 0 || ms < *timeout_ms) *timeout_ms = (int)ms;
+	}
+	return count;
 }
 
+const omron_transport omron_usb_transport = {
+	"usb",
+	omron_usb_set_mode,
+	omron_usb_read_data,
+	omron_usb_write_data,
+	omron_usb_drain_input,
+	omron_usb_close,
+	omron_usb_poll_read,
+	omron_usb_get_pollfds
+};
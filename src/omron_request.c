@@ -0,0 +1,111 @@
+/*
+ * Request planner for Omron Health User Space Driver
+ *
+ * Copyright (c) 2009-2010 Kyle Machulis <kyle@nonpolynomial.com>
+ *
+ * More info on Nonpolynomial Labs @ http://www.nonpolynomial.com
+ *
+ * Sourceforge project @ http://www.github.com/qdot/libomron/
+ *
+ * This library is covered by the BSD License
+ * Read LICENSE_BSD.txt for details.
+ */
+
+#include "libomron/omron.h"
+#include "omron_internal.h"
+
+/// Number of distinct values in omron_mode
+#define NUM_MODES 5
+
+/*
+ * Mode each request type runs in (must match the mode used by the
+ * function the request wraps, see omron.c)
+ */
+static omron_mode omron_request_mode(omron_request_type type)
+{
+	switch (type) {
+	case OMRON_REQ_DAILY_DATA_COUNT:
+	case OMRON_REQ_DAILY_BP_DATA:
+		return DAILY_INFO_MODE;
+	case OMRON_REQ_WEEKLY_BP_DATA:
+		return WEEKLY_INFO_MODE;
+	default:
+		// Device info commands are sent in pedometer mode too
+		return PEDOMETER_MODE;
+	}
+}
+
+static int omron_run_request(omron_device* dev, omron_request* req)
+{
+	switch (req->type) {
+	case OMRON_REQ_DEVICE_VERSION:
+		return omron_get_device_version(dev, req->result.str, sizeof(req->result.str));
+	case OMRON_REQ_DEVICE_SERIAL:
+		return omron_get_device_serial(dev, req->result.str, sizeof(req->result.str));
+	case OMRON_REQ_BP_PROFILE:
+		return omron_get_bp_profile(dev, req->result.str, sizeof(req->result.str));
+	case OMRON_REQ_DAILY_DATA_COUNT:
+		req->result.count = omron_get_daily_data_count(dev, req->bank);
+		return req->result.count < 0 ? req->result.count : 0;
+	case OMRON_REQ_DAILY_BP_DATA:
+	{
+		int status;
+		int ret = omron_get_daily_bp_range(dev, req->bank, req->index, req->index,
+						   &req->result.bp_day, &status);
+		return ret < 0 ? ret : status;
+	}
+	case OMRON_REQ_WEEKLY_BP_DATA:
+		req->result.bp_week = omron_get_weekly_bp_data(dev, req->bank, req->index, req->evening);
+		return req->result.bp_week.present ? 0 : OMRON_ERR_BADDATA;
+	case OMRON_REQ_PD_PROFILE:
+		return omron_read_pd_profile(dev, &req->result.pd_profile);
+	case OMRON_REQ_PD_DATA_COUNT:
+		return omron_read_pd_data_count(dev, &req->result.pd_count);
+	case OMRON_REQ_PD_DAILY_DATA:
+		return omron_read_pd_daily_data(dev, req->index, &req->result.pd_daily);
+	case OMRON_REQ_PD_HOURLY_DATA:
+		return omron_read_pd_hourly_data(dev, req->index, req->result.pd_hourly);
+	}
+	MSG_ERROR("Unknown request type %d\n", req->type);
+	return OMRON_ERR_BADARG;
+}
+
+OMRON_DECLSPEC int omron_execute_requests(omron_device* dev, omron_request* requests, int count)
+{
+	omron_mode order[NUM_MODES];
+	int num_modes = 0;
+	int succeeded = 0;
+	int i, m;
+
+	if (count < 0 || (count && !requests)) return OMRON_ERR_BADARG;
+
+	// The plan is only good while no other thread changes the mode
+	omron_lock(dev);
+
+	// Plan: the mode we're already in goes first, then the others in
+	// order of first use.
+	for (i = 0; i < count; ++i) {
+		if (omron_request_mode(requests[i].type) == dev->device_mode) {
+			order[num_modes++] = dev->device_mode;
+			break;
+		}
+	}
+	for (i = 0; i < count; ++i) {
+		omron_mode mode = omron_request_mode(requests[i].type);
+		for (m = 0; m < num_modes; ++m) {
+			if (order[m] == mode) break;
+		}
+		if (m == num_modes) order[num_modes++] = mode;
+	}
+	MSG_INFO("Running %d requests in %d mode groups\n", count, num_modes);
+
+	for (m = 0; m < num_modes; ++m) {
+		for (i = 0; i < count; ++i) {
+			if (omron_request_mode(requests[i].type) != order[m]) continue;
+			requests[i].status = omron_run_request(dev, &requests[i]);
+			if (requests[i].status >= 0) ++succeeded;
+		}
+	}
+	omron_unlock(dev);
+	return succeeded;
+}
@@ -0,0 +1,664 @@
+/*
+ * Simulated device backend for Omron Health User Space Driver
+ *
+ * Copyright (c) 2009-2010 Kyle Machulis <kyle@nonpolynomial.com>
+ *
+ * More info on Nonpolynomial Labs @ http://www.nonpolynomial.com
+ *
+ * Sourceforge project @ http://www.github.com/qdot/libomron/
+ *
+ * This library is covered by the BSD License
+ * Read LICENSE_BSD.txt for details.
+ */
+
+#include "libomron/omron.h"
+#include "omron_internal.h"
+#include <string.h>
+#include <stdlib.h>
+
+/*
+ * The simulated unit speaks the protocol described in
+ * doc/omron_protocol_notes.asciidoc: commands arrive as 8 byte output
+ * reports, responses go back as 8 byte input reports, each with a leading
+ * count byte.
+ *
+ * Timing is modelled per endpoint. Every report occupies its endpoint for
+ * latency_us (plus jitter); a response is queued once the command's last
+ * report is through and the answer to the one before has gone out (plus
+ * turnaround_us), and a read blocks until the report it returns has
+ * "arrived". Writes do not block, like the libusb async transport, so
+ * pipelined downloads overlap on the simulator the way they do on a real
+ * unit. A drain only discards what arrives before the input goes quiet,
+ * so answers that are slow to start survive it as they would on the wire.
+ */
+
+/// Report size of real units, in both directions
+#define SIM_REPORT_SIZE 8
+/// Number of input reports the simulated unit can hold
+#define SIM_QUEUE_LEN 128
+/// Longest command we accept (clearing block)
+#define SIM_MAX_COMMAND 16
+/// Longest response we generate (GTD)
+#define SIM_MAX_RESPONSE 40
+
+/// Environment variables read by omron_sim_default_config()
+#define SIM_LATENCY_ENV_VAR  "LIBOMRON_SIM_LATENCY_US"
+#define SIM_JITTER_ENV_VAR   "LIBOMRON_SIM_JITTER_US"
+#define SIM_TURNAROUND_ENV_VAR "LIBOMRON_SIM_TURNAROUND_US"
+#define SIM_CORRUPT_ENV_VAR  "LIBOMRON_SIM_CORRUPT"
+#define SIM_NEGATIVE_ENV_VAR "LIBOMRON_SIM_NEGATIVE"
+#define SIM_SEED_ENV_VAR     "LIBOMRON_SIM_SEED"
+
+typedef struct {
+	omron_sim_config config;
+	omron_mode mode;
+	uint32_t rng;
+	uint8_t serial[7];
+	/// Command being received
+	uint8_t command[SIM_MAX_COMMAND];
+	int command_len;
+	/// Queued input reports, and when each one reaches the host [us]
+	uint8_t queue[SIM_QUEUE_LEN][SIM_REPORT_SIZE];
+	int64_t ready_us[SIM_QUEUE_LEN];
+	int queue_head;
+	int queue_count;
+	/// When each endpoint is free for the next report [us]
+	int64_t out_free_us;
+	int64_t in_free_us;
+} omron_sim;
+
+typedef struct {
+	const char* name;
+	int length;
+} omron_sim_command;
+
+/// Commands the unit understands, with their total length
+static const omron_sim_command sim_commands[] = {
+	{ "VER", 5 },
+	{ "PRF", 5 },
+	{ "SRL", 5 },
+	{ "CNT", 5 },
+	{ "CTD", 5 },
+	{ "END", 5 },
+	{ "MES", 7 },
+	{ "GDC", 8 },
+	{ "GME", 8 },
+	{ "GTD", 8 },
+	{ "GMA", 9 },
+	{ "GEA", 9 },
+};
+
+/// Clearing block: all zero, 12 bytes (see omron_send_clear())
+#define SIM_CLEAR_LENGTH 12
+
+/// xorshift32, for faults and jitter
+static uint32_t omron_sim_random(omron_sim* sim)
+{
+	uint32_t x = sim->rng;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	sim->rng = x;
+	return x;
+}
+
+static int omron_sim_chance(omron_sim* sim, double rate)
+{
+	return rate > 0 && omron_sim_random(sim) < rate * 4294967296.0;
+}
+
+/// Stateless hash, so generated records do not depend on request order
+static uint32_t omron_sim_hash(uint32_t seed, uint32_t a, uint32_t b)
+{
+	uint32_t h = seed ^ (a * 0x9e3779b1u) ^ (b * 0x85ebca6bu);
+	h ^= h >> 16;
+	h *= 0x7feb352du;
+	h ^= h >> 15;
+	h *= 0x846ca68bu;
+	h ^= h >> 16;
+	return h;
+}
+
+static int64_t omron_sim_report_time(omron_sim* sim)
+{
+	int64_t t = sim->config.latency_us;
+	if (sim->config.jitter_us > 0) {
+		t += omron_sim_random(sim) % (sim->config.jitter_us + 1);
+	}
+	return t;
+}
+
+/*
+ * Date days_back days before the simulated "today" (2010-06-30)
+ */
+static void omron_sim_date(int days_back, int* year, int* month, int* day)
+{
+	static const int month_days[12] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+	int y = 2010, m = 6, d = 30;
+
+	while (days_back >= d) {
+		days_back -= d;
+		if (--m == 0) {
+			m = 12;
+			--y;
+		}
+		d = month_days[m - 1] + (m == 2 && y % 4 == 0);
+	}
+	*year = y - 2000;
+	*month = m;
+	*day = d - days_back;
+}
+
+static void omron_sim_put_bcd(uint8_t* data, int nibble, int length, int value)
+{
+	int i;
+
+	for (i = nibble + length - 1; i >= nibble; --i) {
+		int digit = value % 10;
+		value /= 10;
+		if (i & 1) {
+			data[i / 2] = (data[i / 2] & 0xf0) | digit;
+		} else {
+			data[i / 2] = (data[i / 2] & 0x0f) | (digit << 4);
+		}
+	}
+}
+
+/// Steps walked during one hour of one day
+static void omron_sim_hour(omron_sim* sim, int day, int hour, int* steps, int* aerobic)
+{
+	uint32_t h = omron_sim_hash(sim->config.seed, 0x100 + day, hour);
+
+	if (hour < 7 || hour > 21) {
+		*steps = h % 20;
+		*aerobic = 0;
+	} else {
+		*steps = 200 + h % 1500;
+		*aerobic = (h >> 16) % 4 ? 0 : *steps / 2;
+	}
+}
+
+/*
+ * Queue a response, split into input reports. The leading "OK" of
+ * successful responses is added here, along with the checksum.
+ */
+static void omron_sim_respond(omron_sim* sim, const uint8_t* data, int len)
+{
+	int64_t t = sim->out_free_us > sim->in_free_us ? sim->out_free_us : sim->in_free_us;
+	int sent = 0;
+
+	// The unit works through commands one at a time
+	t += sim->config.turnaround_us;
+
+	MSG_HEXDUMP(OMRON_DEBUG_DEVIO, "sim response: ", data, len);
+	while (sent < len) {
+		int chunk = len - sent;
+		int slot;
+
+		if (chunk > SIM_REPORT_SIZE - 1) chunk = SIM_REPORT_SIZE - 1;
+		if (sim->queue_count == SIM_QUEUE_LEN) {
+			MSG_WARN("Simulated input queue full, dropping response\n");
+			return;
+		}
+		slot = (sim->queue_head + sim->queue_count) % SIM_QUEUE_LEN;
+		memset(sim->queue[slot], 0, SIM_REPORT_SIZE);
+		sim->queue[slot][0] = chunk;
+		memcpy(sim->queue[slot] + 1, data + sent, chunk);
+		t += omron_sim_report_time(sim);
+		sim->ready_us[slot] = t;
+		sim->queue_count++;
+		sent += chunk;
+	}
+	sim->in_free_us = t;
+}
+
+static void omron_sim_respond_ok(omron_sim* sim, uint8_t* data, int len)
+{
+	uint8_t checksum = 0;
+	int i;
+
+	data[0] = 'O';
+	data[1] = 'K';
+	if (len > 2) {
+		for (i = 2; i < len - 1; ++i) {
+			checksum ^= data[i];
+		}
+		data[len - 1] = checksum;
+	}
+	omron_sim_respond(sim, data, len);
+}
+
+static void omron_sim_respond_no(omron_sim* sim)
+{
+	static const uint8_t no[2] = { 'N', 'O' };
+	omron_sim_respond(sim, no, sizeof(no));
+}
+
+static int omron_sim_bp_record(omron_sim* sim, int bank, int index, uint8_t* r)
+{
+	uint32_t h = omron_sim_hash(sim->config.seed, bank, index);
+	int year, month, day;
+
+	// Readings after the clock was set back sort before the older ones
+	omron_sim_date(index / 2 + (index < sim->config.bp_clock_back ? 7 : 0), &year, &month, &day);
+	r[3] = year;
+	r[4] = month;
+	r[5] = day;
+	r[6] = index & 1 ? 7 : 19;
+	r[7] = h % 60;
+	r[8] = (h >> 8) % 60;
+	r[11] = 105 + (h >> 12) % 40;
+	r[12] = 65 + (h >> 18) % 25;
+	r[13] = 55 + (h >> 24) % 35;
+	return 17;
+}
+
+static int omron_sim_week_record(omron_sim* sim, int bank, int index, int evening, uint8_t* r)
+{
+	uint32_t h = omron_sim_hash(sim->config.seed, 0x200 + bank * 2 + evening, index);
+	int year, month, day;
+
+	r[3] = 0x80;
+	r[4] = index;
+	if (sim->config.bp_count[bank] > index * 14) {
+		omron_sim_date(index * 7, &year, &month, &day);
+		r[5] = year;
+		r[6] = month;
+		r[7] = day;
+		r[8] = 85 + h % 30;
+		r[9] = 65 + (h >> 8) % 25;
+		r[10] = 55 + (h >> 16) % 35;
+	}
+	return 12;
+}
+
+static int omron_sim_daily_record(omron_sim* sim, int day, uint8_t* r)
+{
+	int steps = 0, aerobic = 0;
+	int s, a;
+	int hour;
+	int calories;
+
+	for (hour = 0; hour < 24; ++hour) {
+		omron_sim_hour(sim, day, hour, &s, &a);
+		steps += s;
+		aerobic += a;
+	}
+	calories = steps / 20;
+	omron_sim_put_bcd(r, 6, 5, steps);
+	omron_sim_put_bcd(r, 11, 5, aerobic);
+	omron_sim_put_bcd(r, 16, 4, aerobic / 100);
+	omron_sim_put_bcd(r, 20, 5, calories);
+	// 30 inch stride, in hundredths of a mile
+	omron_sim_put_bcd(r, 25, 5, (int)(steps * 3000LL / 63360));
+	omron_sim_put_bcd(r, 30, 4, calories * 10 / 15);
+	return OMRON_PD_DAILY_RECORD_SIZE;
+}
+
+static int omron_sim_hourly_record(omron_sim* sim, int day, int block, uint8_t* r)
+{
+	int steps, aerobic;
+	int j;
+
+	for (j = 0; j < 8; ++j) {
+		uint8_t* p = r + 4 + j * 4;
+		omron_sim_hour(sim, day, block * 8 + j, &steps, &aerobic);
+		p[0] = (steps >> 8) | (steps ? 0x40 : 0);
+		p[1] = steps & 0xff;
+		p[2] = aerobic >> 8;
+		p[3] = aerobic & 0xff;
+	}
+	return 37;
+}
+
+static int omron_sim_mode_ok(omron_sim* sim, const char* name)
+{
+	if (!strcmp(name, "GDC") || !strcmp(name, "GME")) {
+		return sim->mode == DAILY_INFO_MODE;
+	}
+	if (!strcmp(name, "GMA") || !strcmp(name, "GEA")) {
+		return sim->mode == WEEKLY_INFO_MODE;
+	}
+	if (!strcmp(name, "CNT") || !strcmp(name, "CTD") || !strcmp(name, "MES") || !strcmp(name, "GTD")) {
+		return sim->mode == PEDOMETER_MODE;
+	}
+	// Device information works in any mode
+	return sim->mode != NULL_MODE;
+}
+
+static void omron_sim_execute(omron_sim* sim, const char* name)
+{
+	static const char version[] = "M7080IT 207";
+	const uint8_t* c = sim->command;
+	uint8_t r[SIM_MAX_RESPONSE];
+	uint8_t checksum = 0;
+	int len = 0;
+	int i;
+
+	for (i = 3; i < sim->command_len; ++i) {
+		checksum ^= c[i];
+	}
+	if (checksum || !omron_sim_mode_ok(sim, name)) {
+		omron_sim_respond_no(sim);
+		return;
+	}
+
+	memset(r, 0, sizeof(r));
+	if (!strcmp(name, "VER")) {
+		memcpy(r + 3, version, sizeof(version) - 1);
+		len = 15;
+	} else if (!strcmp(name, "PRF")) {
+		// 195.0 lbs, 30.0 inch stride
+		omron_sim_put_bcd(r + 3, 4, 4, 1950);
+		omron_sim_put_bcd(r + 3, 12, 4, 300);
+		len = 14;
+	} else if (!strcmp(name, "SRL")) {
+		memcpy(r + 3, sim->serial, sizeof(sim->serial));
+		len = 11;
+	} else if (!strcmp(name, "END")) {
+		static const uint8_t off[5] = { 'O', 'F', 'F', '\r', '\n' };
+		omron_sim_respond(sim, off, sizeof(off));
+		return;
+	} else if (!strcmp(name, "CNT")) {
+		r[4] = sim->config.pd_days;
+		r[6] = sim->config.pd_days;
+		len = 8;
+	} else if (!strcmp(name, "CTD")) {
+		sim->config.pd_days = 0;
+		len = 2;
+	} else if (!strcmp(name, "MES")) {
+		if (c[5] >= sim->config.pd_days) {
+			omron_sim_respond_no(sim);
+			return;
+		}
+		len = omron_sim_daily_record(sim, c[5], r);
+	} else if (!strcmp(name, "GTD")) {
+		if (c[5] >= sim->config.pd_days || c[6] < 1 || c[6] > 3) {
+			omron_sim_respond_no(sim);
+			return;
+		}
+		len = omron_sim_hourly_record(sim, c[5], c[6] - 1, r);
+	} else if (!strcmp(name, "GDC")) {
+		if (c[4] > 1) {
+			omron_sim_respond_no(sim);
+			return;
+		}
+		r[6] = sim->config.bp_count[c[4]];
+		len = 8;
+	} else if (!strcmp(name, "GME")) {
+		if (c[4] > 1 || c[6] >= sim->config.bp_count[c[4]] ||
+		    omron_sim_chance(sim, sim->config.negative_rate)) {
+			omron_sim_respond_no(sim);
+			return;
+		}
+		len = omron_sim_bp_record(sim, c[4], c[6], r);
+	} else if (!strcmp(name, "GMA") || !strcmp(name, "GEA")) {
+		if (c[4] > 1) {
+			omron_sim_respond_no(sim);
+			return;
+		}
+		len = omron_sim_week_record(sim, c[4], c[5], name[1] == 'E', r);
+	}
+	omron_sim_respond_ok(sim, r, len);
+}
+
+/*
+ * Feed command bytes received in one output report to the unit, answering
+ * once a whole command is in.
+ */
+static void omron_sim_receive(omron_sim* sim, const uint8_t* data, int len)
+{
+	int expected = 0;
+	char name[4];
+	unsigned int i;
+
+	if (sim->command_len + len > SIM_MAX_COMMAND) {
+		MSG_WARN("Simulated unit got an overlong command, discarding\n");
+		sim->command_len = 0;
+		omron_sim_respond_no(sim);
+		return;
+	}
+	memcpy(sim->command + sim->command_len, data, len);
+	sim->command_len += len;
+	if (sim->command_len < 3) return;
+
+	memcpy(name, sim->command, 3);
+	name[3] = 0;
+	if (!sim->command[0] && !sim->command[1] && !sim->command[2]) {
+		expected = SIM_CLEAR_LENGTH;
+	} else {
+		for (i = 0; i < sizeof(sim_commands) / sizeof(sim_commands[0]); ++i) {
+			if (!strcmp(sim_commands[i].name, name)) {
+				expected = sim_commands[i].length;
+				break;
+			}
+		}
+	}
+	if (!expected) {
+		MSG_DETAIL("Simulated unit got unknown command %02x %02x %02x\n", sim->command[0], sim->command[1], sim->command[2]);
+		sim->command_len = 0;
+		omron_sim_respond_no(sim);
+		return;
+	}
+	if (sim->command_len < expected) return;
+
+	MSG_HEXDUMP(OMRON_DEBUG_DEVIO, "sim command: ", sim->command, sim->command_len);
+	if (expected == SIM_CLEAR_LENGTH && !sim->command[0]) {
+		static uint8_t ok[2] = { 'O', 'K' };
+		omron_sim_respond(sim, ok, sizeof(ok));
+	} else {
+		sim->command_len = expected;
+		omron_sim_execute(sim, name);
+	}
+	sim->command_len = 0;
+}
+
+static int omron_sim_set_mode(omron_device* dev, omron_mode mode)
+{
+	omron_sim* sim = dev->transport_data;
+	int64_t t;
+
+	MSG_INFO("Setting mode to %04x\n", mode);
+	// Control transfers block until the unit acknowledges them
+	t = sim->out_free_us > sim->in_free_us ? sim->out_free_us : sim->in_free_us;
+	if (t < omron_now_us()) t = omron_now_us();
+	t += omron_sim_report_time(sim);
+	omron_sleep_until_us(t);
+	sim->out_free_us = t;
+	sim->mode = mode;
+	sim->command_len = 0;
+	return 0;
+}
+
+static int omron_sim_read_data(omron_device* dev, uint8_t* report_buf, int report_size, int timeout)
+{
+	omron_sim* sim = dev->transport_data;
+	int timeout_ok = (timeout < 0);
+	int64_t deadline;
+	int slot;
+
+	if (timeout_ok) {
+		timeout = -timeout;
+	}
+	if (report_size < SIM_REPORT_SIZE) {
+		MSG_ERROR("Supplied buffer too small (%d < %d)\n", report_size, SIM_REPORT_SIZE);
+		return OMRON_ERR_BUFSIZE;
+	}
+	deadline = omron_now_us() + (int64_t)timeout * 1000;
+	if (!sim->queue_count || sim->ready_us[sim->queue_head] > deadline) {
+		omron_sleep_until_us(deadline);
+		if (timeout_ok) {
+			MSG_DEVIO("(USB operation timed out)\n");
+			return 0;
+		}
+		MSG_ERROR("USB operation timed out.\n");
+		return OMRON_ERR_DEVIO;
+	}
+
+	slot = sim->queue_head;
+	omron_sleep_until_us(sim->ready_us[slot]);
+	memcpy(report_buf, sim->queue[slot], SIM_REPORT_SIZE);
+	sim->queue_head = (sim->queue_head + 1) % SIM_QUEUE_LEN;
+	sim->queue_count--;
+	if (report_buf[0] && omron_sim_chance(sim, sim->config.corrupt_rate)) {
+		int byte = 1 + omron_sim_random(sim) % report_buf[0];
+		report_buf[byte] ^= 1 << (omron_sim_random(sim) % 8);
+		MSG_DEVIO("(simulated corruption of byte %d)\n", byte);
+	}
+	return SIM_REPORT_SIZE;
+}
+
+static int omron_sim_poll_read(omron_device* dev, uint8_t* report_buf, int report_size)
+{
+	omron_sim* sim = dev->transport_data;
+
+	if (!sim->queue_count || sim->ready_us[sim->queue_head] > omron_now_us()) return 0;
+	return omron_sim_read_data(dev, report_buf, report_size, 0);
+}
+
+/*
+ * The simulator has no descriptors, but an event loop has to come back when
+ * the next report "arrives".
+ */
+static int omron_sim_get_pollfds(omron_device* dev, omron_pollfd* fds, int max_fds, int* timeout_ms)
+{
+	omron_sim* sim = dev->transport_data;
+	int64_t wait_us;
+	int ms;
+
+	(void)fds;
+	(void)max_fds;
+	if (!sim->queue_count) return 0;
+	wait_us = sim->ready_us[sim->queue_head] - omron_now_us();
+	ms = wait_us <= 0 ? 0 : (int)((wait_us + 999) / 1000);
+	if (*timeout_ms < 0 || ms < *timeout_ms) *timeout_ms = ms;
+	return 0;
+}
+
+static int omron_sim_write_data(omron_device* dev, uint8_t* report_buf, int report_size, int timeout)
+{
+	omron_sim* sim = dev->transport_data;
+	int64_t now = omron_now_us();
+	int len;
+
+	(void)timeout;
+	if (report_size > SIM_REPORT_SIZE) {
+		MSG_ERROR("Supplied buffer too large (%d > %d)\n", report_size, SIM_REPORT_SIZE);
+		return OMRON_ERR_BUFSIZE;
+	}
+	if (sim->out_free_us < now) sim->out_free_us = now;
+	sim->out_free_us += omron_sim_report_time(sim);
+
+	len = report_buf[0];
+	if (len > report_size - 1) len = report_size - 1;
+	omron_sim_receive(sim, report_buf + 1, len);
+	return report_size;
+}
+
+static int omron_sim_drain_input(omron_device* dev)
+{
+	omron_sim* sim = dev->transport_data;
+	int64_t wait_us = omron_drain_wait_ms(dev) * (int64_t)1000;
+	int64_t quiet_us = sim->config.latency_us + sim->config.jitter_us;
+	int drained = 0;
+
+	// Like a host draining the endpoint: take whatever arrives before the
+	// input has been quiet for one report time, or for the round trip
+	// that commands still owed an answer may take
+	if (quiet_us < wait_us) quiet_us = wait_us;
+	while (sim->queue_count && sim->ready_us[sim->queue_head] <= omron_now_us() + quiet_us) {
+		omron_sleep_until_us(sim->ready_us[sim->queue_head]);
+		drained += sim->queue[sim->queue_head][0] + 1;
+		sim->queue_head = (sim->queue_head + 1) % SIM_QUEUE_LEN;
+		sim->queue_count--;
+	}
+	return drained;
+}
+
+static int omron_sim_close(omron_device* dev)
+{
+	free(dev->transport_data);
+	return 0;
+}
+
+static const omron_transport omron_sim_transport = {
+	"sim",
+	omron_sim_set_mode,
+	omron_sim_read_data,
+	omron_sim_write_data,
+	omron_sim_drain_input,
+	omron_sim_close,
+	omron_sim_poll_read,
+	omron_sim_get_pollfds
+};
+
+int omron_sim_selected(void)
+{
+	const char* backend = getenv(SIM_BACKEND_ENV_VAR);
+	return backend && !strcmp(backend, "sim");
+}
+
+OMRON_DECLSPEC void omron_sim_default_config(omron_sim_config* config)
+{
+	const char* env;
+
+	memset(config, 0, sizeof(*config));
+	config->latency_us = 10000;
+	config->seed = 1;
+	config->bp_count[0] = 84;
+	config->bp_count[1] = 84;
+	config->pd_days = 42;
+
+	if ((env = getenv(SIM_LATENCY_ENV_VAR)) != NULL) config->latency_us = atoi(env);
+	if ((env = getenv(SIM_JITTER_ENV_VAR)) != NULL) config->jitter_us = atoi(env);
+	if ((env = getenv(SIM_TURNAROUND_ENV_VAR)) != NULL) config->turnaround_us = atoi(env);
+	if ((env = getenv(SIM_CORRUPT_ENV_VAR)) != NULL) config->corrupt_rate = atof(env);
+	if ((env = getenv(SIM_NEGATIVE_ENV_VAR)) != NULL) config->negative_rate = atof(env);
+	if ((env = getenv(SIM_SEED_ENV_VAR)) != NULL) config->seed = strtoul(env, NULL, 0);
+}
+
+OMRON_DECLSPEC int omron_open_sim(omron_device* dev, const omron_sim_config* config)
+{
+	omron_sim* sim;
+	int status;
+	int i;
+
+	if (dev->transport) {
+		MSG_ERROR("Device already open\n");
+		return OMRON_ERR_BADARG;
+	}
+	sim = calloc(1, sizeof(*sim));
+	if (!sim) return OMRON_ERR_DEVIO;
+	if (config) {
+		sim->config = *config;
+	} else {
+		omron_sim_default_config(&sim->config);
+	}
+	for (i = 0; i < 2; ++i) {
+		if (sim->config.bp_count[i] < 0) sim->config.bp_count[i] = 0;
+		if (sim->config.bp_count[i] > 255) sim->config.bp_count[i] = 255;
+	}
+	if (sim->config.pd_days < 0) sim->config.pd_days = 0;
+	if (sim->config.pd_days > 255) sim->config.pd_days = 255;
+	sim->rng = sim->config.seed ? sim->config.seed : 1;
+	for (i = 0; i < (int)sizeof(sim->serial); ++i) {
+		sim->serial[i] = omron_sim_hash(sim->config.seed, 0x300, i);
+	}
+	sim->mode = NULL_MODE;
+
+	dev->input_size = SIM_REPORT_SIZE;
+	dev->output_size = SIM_REPORT_SIZE;
+	status = omron_alloc_arena(dev);
+	if (status < 0) {
+		free(sim);
+		return status;
+	}
+	dev->transport = &omron_sim_transport;
+	dev->transport_data = sim;
+	// Nothing is known about the device state after (re)opening
+	omron_reset_session(dev);
+	MSG_INFO("Opened simulated device (latency %dus, jitter %dus, turnaround %dus, corruption %g, NO rate %g)\n",
+		 sim->config.latency_us, sim->config.jitter_us, sim->config.turnaround_us,
+		 sim->config.corrupt_rate, sim->config.negative_rate);
+	return 0;
+}
@@ -0,0 +1,204 @@
+/*
+ * Per-device counters and latency histograms for Omron Health User Space
+ * Driver
+ *
+ * Copyright (c) 2009-2010 Kyle Machulis <kyle@nonpolynomial.com>
+ *
+ * More info on Nonpolynomial Labs @ http://www.nonpolynomial.com
+ *
+ * Sourceforge project @ http://www.github.com/qdot/libomron/
+ *
+ * This library is covered by the BSD License
+ * Read LICENSE_BSD.txt for details.
+ */
+
+#include "libomron/omron.h"
+#include "omron_internal.h"
+#include <string.h>
+#include <stdlib.h>
+
+/// Histogram bucket resolution: 2^HISTOGRAM_SUB_BITS buckets per power of two
+#define HISTOGRAM_SUB_BITS 2
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+/// Largest sample kept apart, anything above lands in the last bucket
+#define HISTOGRAM_MAX_US ((1u << 29) - 1)
+
+/// Commands the round trip clock can follow at once
+#define STATS_MAX_INFLIGHT (OMRON_MAX_PIPELINE_DEPTH + 1)
+
+/*
+ * Sent commands wait in a FIFO for their responses, which come back in
+ * order even when the download functions pipeline them.
+ */
+typedef struct {
+	/// Index into stats.commands, -1 for the clear command
+	int command;
+	int64_t sent_us;
+} omron_stats_inflight;
+
+struct omron_stats_state {
+	omron_stats stats;
+	omron_stats_inflight inflight[STATS_MAX_INFLIGHT];
+	int inflight_head;
+	int inflight_count;
+};
+
+static int omron_histogram_bucket(uint32_t us)
+{
+	int magnitude = 0;
+
+	if (us < HISTOGRAM_SUB_BUCKETS) return us;
+	if (us > HISTOGRAM_MAX_US) us = HISTOGRAM_MAX_US;
+	while ((us >> magnitude) >= 2 * HISTOGRAM_SUB_BUCKETS) magnitude++;
+	return (magnitude + 1) * HISTOGRAM_SUB_BUCKETS + (us >> magnitude) - HISTOGRAM_SUB_BUCKETS;
+}
+
+/// Largest value that falls in a bucket
+static uint32_t omron_histogram_bucket_max(int bucket)
+{
+	int magnitude = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+
+	if (magnitude < 0) return bucket;
+	return ((uint32_t)(bucket % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS + 1) << magnitude) - 1;
+}
+
+void omron_histogram_add(omron_histogram* histogram, int64_t us)
+{
+	uint32_t value = us < 0 ? 0 : us > HISTOGRAM_MAX_US ? HISTOGRAM_MAX_US : (uint32_t)us;
+
+	if (!histogram->count || value < histogram->min_us) histogram->min_us = value;
+	if (value > histogram->max_us) histogram->max_us = value;
+	histogram->count++;
+	histogram->total_us += value;
+	histogram->buckets[omron_histogram_bucket(value)]++;
+}
+
+OMRON_DECLSPEC uint32_t omron_histogram_percentile(const omron_histogram* histogram, double percentile)
+{
+	uint64_t rank;
+	uint64_t seen = 0;
+	int i;
+
+	if (!histogram->count) return 0;
+	if (percentile < 0) percentile = 0;
+	if (percentile > 100) percentile = 100;
+	rank = (uint64_t)(percentile / 100 * histogram->count + 0.5);
+	if (rank < 1) rank = 1;
+	for (i = 0; i < OMRON_HISTOGRAM_BUCKETS; i++) {
+		seen += histogram->buckets[i];
+		if (seen >= rank) break;
+	}
+	if (i == OMRON_HISTOGRAM_BUCKETS) return histogram->max_us;
+	if (omron_histogram_bucket_max(i) > histogram->max_us) return histogram->max_us;
+	if (omron_histogram_bucket_max(i) < histogram->min_us) return histogram->min_us;
+	return omron_histogram_bucket_max(i);
+}
+
+omron_stats* omron_stats_of(omron_device* dev)
+{
+	if (!dev->stats) {
+		dev->stats = calloc(1, sizeof(*dev->stats));
+		if (!dev->stats) return NULL;
+	}
+	return &dev->stats->stats;
+}
+
+void omron_free_stats(omron_device* dev)
+{
+	free(dev->stats);
+	dev->stats = NULL;
+}
+
+static int omron_stats_command_index(omron_stats* stats, const unsigned char* cmd)
+{
+	char name[4];
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		name[i] = (cmd[i] >= 0x20 && cmd[i] < 0x7f) ? cmd[i] : '?';
+	}
+	name[3] = 0;
+	for (i = 0; i < stats->num_commands; i++) {
+		if (!memcmp(stats->commands[i].command, name, 4)) return i;
+	}
+	if (stats->num_commands >= OMRON_STATS_MAX_COMMANDS - 1) {
+		// Out of room, the last entry takes everything else
+		i = OMRON_STATS_MAX_COMMANDS - 1;
+		if (stats->num_commands < OMRON_STATS_MAX_COMMANDS) {
+			strcpy(stats->commands[i].command, "*");
+			stats->num_commands++;
+		}
+		return i;
+	}
+	i = stats->num_commands++;
+	memcpy(stats->commands[i].command, name, 4);
+	return i;
+}
+
+void omron_stats_command_sent(omron_device* dev, int size, const unsigned char* cmd, int64_t sent_us)
+{
+	struct omron_stats_state* state;
+	omron_stats_inflight* entry;
+
+	if (!omron_stats_of(dev)) return;
+	state = dev->stats;
+	if (state->inflight_count == STATS_MAX_INFLIGHT) {
+		// Lost track (responses never read), start over
+		state->inflight_count = 0;
+	}
+	entry = &state->inflight[(state->inflight_head + state->inflight_count) % STATS_MAX_INFLIGHT];
+	entry->command = (size >= 3 && cmd[0]) ? omron_stats_command_index(&state->stats, cmd) : -1;
+	entry->sent_us = sent_us;
+	state->inflight_count++;
+}
+
+int64_t omron_stats_command_done(omron_device* dev, int status)
+{
+	struct omron_stats_state* state = dev->stats;
+	omron_stats_inflight* entry;
+	omron_command_stats* command;
+	int64_t rtt_us;
+
+	if (!state || !state->inflight_count) return -1;
+	entry = &state->inflight[state->inflight_head];
+	state->inflight_head = (state->inflight_head + 1) % STATS_MAX_INFLIGHT;
+	state->inflight_count--;
+	rtt_us = omron_now_us() - entry->sent_us;
+	if (status == OMRON_ERR_BADDATA) state->stats.bad_data++;
+	if (entry->command < 0) return rtt_us;
+
+	command = &state->stats.commands[entry->command];
+	if (status >= 0) command->ok++;
+	else if (status == OMRON_ERR_NEGRESP) command->negative++;
+	else if (status == OMRON_ERR_ENDRESP) command->end++;
+	else if (status == OMRON_ERR_BADDATA) command->bad_data++;
+	else command->errors++;
+	omron_histogram_add(&command->latency, rtt_us);
+	return rtt_us;
+}
+
+void omron_stats_flushed(omron_device* dev)
+{
+	if (dev->stats) dev->stats->inflight_count = 0;
+}
+
+OMRON_DECLSPEC int omron_get_stats(omron_device* dev, omron_stats* stats)
+{
+	if (!stats) return OMRON_ERR_BADARG;
+	omron_lock(dev);
+	if (dev->stats) {
+		memcpy(stats, &dev->stats->stats, sizeof(*stats));
+	} else {
+		memset(stats, 0, sizeof(*stats));
+	}
+	omron_unlock(dev);
+	return 0;
+}
+
+OMRON_DECLSPEC void omron_reset_stats(omron_device* dev)
+{
+	// Commands in flight would land in the zeroed table, so forget them too
+	omron_lock(dev);
+	if (dev->stats) memset(dev->stats, 0, sizeof(*dev->stats));
+	omron_unlock(dev);
+}
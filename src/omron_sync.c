@@ -0,0 +1,358 @@
+/*
+ * Incremental sync functions for Omron Health User Space Driver
+ *
+ * Copyright (c) 2009-2010 Kyle Machulis <kyle@nonpolynomial.com>
+ *
+ * More info on Nonpolynomial Labs @ http://www.nonpolynomial.com
+ *
+ * Sourceforge project @ http://www.github.com/qdot/libomron/
+ *
+ * This library is covered by the BSD License
+ * Read LICENSE_BSD.txt for details.
+ */
+
+#include "libomron/omron.h"
+#include "omron_internal.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+
+/// Magic first word of a state file, bump the digit if the format changes
+#define SYNC_STATE_MAGIC "omron-sync-1"
+
+OMRON_DECLSPEC int omron_sync_load_state(const char* path, omron_sync_state* state)
+{
+	FILE* f;
+	char magic[16];
+	long long ts;
+	long count;
+	int n;
+
+	memset(state, 0, sizeof(*state));
+	f = fopen(path, "r");
+	if (!f) {
+		if (errno == ENOENT) return 0;
+		MSG_ERROR("Cannot open state file %s\n", path);
+		return OMRON_ERR_BADARG;
+	}
+	n = fscanf(f, "%15s %16s %lld %ld", magic, state->serial, &ts, &count);
+	fclose(f);
+	if (n != 4 || strcmp(magic, SYNC_STATE_MAGIC)) {
+		MSG_WARN("Ignoring malformed state file %s\n", path);
+		memset(state, 0, sizeof(*state));
+		return 0;
+	}
+	state->last_timestamp = ts;
+	state->record_count = count;
+	return 1;
+}
+
+OMRON_DECLSPEC int omron_sync_save_state(const char* path, const omron_sync_state* state)
+{
+	char tmp_path[OMRON_SYNC_PATH_MAX + 4];
+	FILE* f;
+	int status;
+
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path)) {
+		return OMRON_ERR_BADARG;
+	}
+	f = fopen(tmp_path, "w");
+	if (!f) {
+		MSG_ERROR("Cannot create state file %s\n", tmp_path);
+		return OMRON_ERR_BADARG;
+	}
+	fprintf(f, "%s %s %lld %ld\n", SYNC_STATE_MAGIC, state->serial,
+		(long long)state->last_timestamp, (long)state->record_count);
+	status = fclose(f);
+	if (status) {
+		MSG_ERROR("Cannot write state file %s\n", tmp_path);
+		remove(tmp_path);
+		return OMRON_ERR_BADARG;
+	}
+#if defined(WIN32)
+	// rename() will not replace an existing file on windows
+	remove(path);
+#endif
+	if (rename(tmp_path, path)) {
+		MSG_ERROR("Cannot replace state file %s\n", path);
+		remove(tmp_path);
+		return OMRON_ERR_BADARG;
+	}
+	return 0;
+}
+
+/*
+ * Build "<state_dir>/<serial>.<suffix>" and prime state->serial. Without a
+ * state_dir the path is left empty and the state blank (full download).
+ */
+static int omron_sync_state_path(omron_device* dev, const char* state_dir, const char* suffix,
+				 char* path, omron_sync_state* state)
+{
+	unsigned char serial[9];
+	char serial_hex[17];
+	int status;
+	int i;
+
+	memset(state, 0, sizeof(*state));
+	path[0] = 0;
+	if (!state_dir) return 0;
+
+	status = omron_get_device_serial(dev, serial, sizeof(serial));
+	if (status < 0) return status;
+	for (i = 0; i < status; ++i) {
+		sprintf(serial_hex + i * 2, "%02x", serial[i]);
+	}
+	serial_hex[status * 2] = 0;
+
+	if (snprintf(path, OMRON_SYNC_PATH_MAX, "%s/%s.%s", state_dir, serial_hex, suffix) >= OMRON_SYNC_PATH_MAX) {
+		MSG_ERROR("State directory path too long\n");
+		return OMRON_ERR_BADARG;
+	}
+	status = omron_sync_load_state(path, state);
+	if (status < 0) return status;
+	if (status && strcmp(state->serial, serial_hex)) {
+		MSG_WARN("State file %s belongs to serial %s, ignoring\n", path, state->serial);
+		memset(state, 0, sizeof(*state));
+	}
+	strcpy(state->serial, serial_hex);
+	MSG_INFO("Sync state for %s: last=%lld count=%d\n", serial_hex,
+		 (long long)state->last_timestamp, (int)state->record_count);
+	return 0;
+}
+
+int64_t omron_bp_timestamp(const omron_bp_day_info* r)
+{
+	return (((((int64_t)(2000 + r->year) * 100 + r->month) * 100 + r->day) * 100
+		 + r->hour) * 100 + r->minute) * 100 + r->second;
+}
+
+static int omron_run_sync_daily_bp(omron_device* dev, int bank, const char* state_dir, omron_bp_sync_cb cb, void* user_data)
+{
+	char path[OMRON_SYNC_PATH_MAX];
+	char suffix[8];
+	omron_sync_state state;
+	omron_bp_day_info* records;
+	int* rec_status;
+	int count;
+	int fetched = 0;
+	int window;
+	int expected;
+	int new_count = -1;
+	int status;
+	int i;
+
+	sprintf(suffix, "bp%d", bank);
+	status = omron_sync_state_path(dev, state_dir, suffix, path, &state);
+	if (status < 0) return status;
+
+	count = omron_get_daily_data_count(dev, bank);
+	if (count <= 0) return count;
+
+	records = malloc(count * sizeof(omron_bp_day_info));
+	rec_status = malloc(count * sizeof(int));
+	if (!records || !rec_status) {
+		free(records);
+		free(rec_status);
+		return OMRON_ERR_DEVIO;
+	}
+
+	// Index 0 is the newest record. The change in count since last time
+	// tells where the high-water record should be now; read up to there
+	// and check it is the one by its timestamp. If it isn't (memory
+	// wrapped or was cleared) keep widening the window and look for it.
+	// Timestamps are only compared for equality, readings after the
+	// device clock was set back sort before the high-water mark.
+	expected = state.last_timestamp ? count - state.record_count : -1;
+	window = expected + 1;
+	if (window < 2) window = 2;
+	while (new_count < 0 && fetched < count) {
+		int last = fetched + window - 1;
+		if (last >= count) last = count - 1;
+
+		status = omron_get_daily_bp_range(dev, bank, fetched, last,
+						  records + fetched, rec_status + fetched);
+		if (status < 0) goto out;
+		for (i = fetched; i <= last; ++i) {
+			// Out of order with its neighbours, which a clock set back
+			// makes genuine. On its own the record is not checked.
+			if (rec_status[i] == OMRON_ERR_BADDATA) {
+				status = omron_get_daily_bp_range(dev, bank, i, i, &records[i], &rec_status[i]);
+				if (status < 0) goto out;
+			}
+			if (rec_status[i] < 0) {
+				MSG_ERROR("Cannot read record %d, aborting sync\n", i);
+				status = rec_status[i];
+				goto out;
+			}
+		}
+		if (expected >= fetched && expected <= last &&
+		    omron_bp_timestamp(&records[expected]) == state.last_timestamp) {
+			new_count = expected;
+		}
+		for (i = fetched; new_count < 0 && i <= last; ++i) {
+			if (omron_bp_timestamp(&records[i]) == state.last_timestamp) new_count = i;
+		}
+		fetched = last + 1;
+		window *= 2;
+	}
+	if (new_count < 0) new_count = count;
+	MSG_INFO("%d new records (%d read, %d on device)\n", new_count, fetched, count);
+
+	for (i = new_count - 1; i >= 0; --i) {
+		if (cb && cb(user_data, i, &records[i])) {
+			MSG_INFO("Sync aborted by callback\n");
+			status = OMRON_ERR_ABORTED;
+			goto out;
+		}
+	}
+
+	if (new_count > 0) {
+		state.last_timestamp = omron_bp_timestamp(&records[0]);
+	}
+	state.record_count = count;
+	status = path[0] ? omron_sync_save_state(path, &state) : 0;
+	if (status == 0) status = new_count;
+
+out:
+	free(records);
+	free(rec_status);
+	return status;
+}
+
+OMRON_DECLSPEC int omron_sync_daily_bp(omron_device* dev, int bank, const char* state_dir, omron_bp_sync_cb cb, void* user_data)
+{
+	int ret;
+
+	// One operation, sharing a retry budget
+	omron_lock(dev);
+	ret = omron_run_sync_daily_bp(dev, bank, state_dir, cb, user_data);
+	omron_unlock(dev);
+	return ret;
+}
+
+static int64_t omron_sync_today(void)
+{
+	time_t now = time(NULL);
+	struct tm t;
+
+	// Syncs run on fleet worker threads, so no localtime()
+#if defined(WIN32)
+	localtime_s(&t, &now);
+#else
+	localtime_r(&now, &t);
+#endif
+	return ((int64_t)(t.tm_year + 1900) * 10000 + (t.tm_mon + 1) * 100 + t.tm_mday) * 1000000;
+}
+
+/*
+ * Whole days between two YYYYMMDDhhmmss stamps (time of day ignored).
+ */
+static int omron_sync_days_between(int64_t from, int64_t to)
+{
+	struct tm a, b;
+	int64_t d;
+
+	memset(&a, 0, sizeof(a));
+	memset(&b, 0, sizeof(b));
+	d = from / 1000000;
+	a.tm_year = d / 10000 - 1900; a.tm_mon = (d / 100) % 100 - 1; a.tm_mday = d % 100; a.tm_hour = 12;
+	d = to / 1000000;
+	b.tm_year = d / 10000 - 1900; b.tm_mon = (d / 100) % 100 - 1; b.tm_mday = d % 100; b.tm_hour = 12;
+	return (int)((difftime(mktime(&b), mktime(&a)) + 43200) / 86400);
+}
+
+static int omron_run_sync_pd(omron_device* dev, const char* state_dir, omron_pd_sync_cb cb, void* user_data)
+{
+	char path[OMRON_SYNC_PATH_MAX];
+	omron_sync_state state;
+	omron_pd_count_info c;
+	omron_pd_history* history;
+	omron_pd_history* day = NULL;
+	int64_t today = omron_sync_today();
+	int data_count;
+	int days;
+	int status;
+	int i;
+
+	status = omron_sync_state_path(dev, state_dir, "pd", path, &state);
+	if (status < 0) return status;
+
+	status = omron_read_pd_data_count(dev, &c);
+	if (status < 0) {
+		MSG_ERROR("Cannot read day count, aborting sync\n");
+		return status;
+	}
+	data_count = c.daily_count < c.hourly_count ? c.daily_count : c.hourly_count;
+
+	// Day 0 is today. Re-read the day the last sync ran on, since it was
+	// probably still in progress then.
+	if (state.last_timestamp) {
+		days = omron_sync_days_between(state.last_timestamp, today) + 1;
+		if (days < 1) days = 1;
+	} else {
+		days = data_count;
+	}
+	if (days > data_count) days = data_count;
+	MSG_INFO("Syncing %d of %d days\n", days, data_count);
+
+	if (days > 0) {
+		history = omron_pd_history_create(days);
+		if (!history) return OMRON_ERR_DEVIO;
+		status = omron_get_pd_history(dev, 0, days - 1, history);
+		for (i = days - 1; i >= 0 && status >= 0; --i) {
+			omron_pd_history* from = history;
+			int index = i;
+			omron_pd_hourly_data h[24];
+
+			// A day that doesn't add up gets one more read on its own,
+			// if it still doesn't it is skipped rather than stop every
+			// sync from here on
+			if (history->status[i] == OMRON_ERR_BADDATA) {
+				if (!day) day = omron_pd_history_create(1);
+				if (!day) {
+					status = OMRON_ERR_DEVIO;
+					break;
+				}
+				status = omron_get_pd_history(dev, i, i, day);
+				if (status < 0) break;
+				if (day->status[0] == OMRON_ERR_BADDATA) {
+					MSG_WARN("Totals of day %d do not match its hours, skipping it\n", i);
+					continue;
+				}
+				from = day;
+				index = 0;
+			}
+			status = from->status[index];
+			if (status < 0) {
+				MSG_ERROR("Cannot read data for day %d, aborting sync\n", i);
+				break;
+			}
+			omron_pd_history_hours(from, index, h);
+			if (cb && cb(user_data, &from->daily[index], h)) {
+				MSG_INFO("Sync aborted by callback\n");
+				status = OMRON_ERR_ABORTED;
+			}
+		}
+		omron_pd_history_delete(history);
+		omron_pd_history_delete(day);
+		if (status < 0) return status;
+	}
+
+	state.last_timestamp = today;
+	state.record_count = data_count;
+	status = path[0] ? omron_sync_save_state(path, &state) : 0;
+	if (status < 0) return status;
+	return days;
+}
+
+OMRON_DECLSPEC int omron_sync_pd(omron_device* dev, const char* state_dir, omron_pd_sync_cb cb, void* user_data)
+{
+	int ret;
+
+	omron_lock(dev);
+	ret = omron_run_sync_pd(dev, state_dir, cb, user_data);
+	omron_unlock(dev);
+	return ret;
+}
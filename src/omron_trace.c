@@ -0,0 +1,492 @@
+/*
+ * Session recording and replay for Omron Health User Space Driver
+ *
+ * Copyright (c) 2009-2010 Kyle Machulis <kyle@nonpolynomial.com>
+ *
+ * More info on Nonpolynomial Labs @ http://www.nonpolynomial.com
+ *
+ * Sourceforge project @ http://www.github.com/qdot/libomron/
+ *
+ * This library is covered by the BSD License
+ * Read LICENSE_BSD.txt for details.
+ */
+
+#include "libomron/omron.h"
+#include "omron_internal.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/// First bytes of every trace file, bump the digit if the format changes
+#define TRACE_MAGIC "OMTRACE1"
+#define TRACE_MAGIC_LEN 8
+/// Size of a record header on disk
+#define TRACE_HEADER_LEN 8
+/// stdio buffer for reading traces (recording flushes every record)
+#define TRACE_BUFFER_SIZE 65536
+
+struct omron_trace {
+	FILE* file;
+	int append;
+};
+
+/*
+ * Recording wraps the transport the device was opened on. Calls go through
+ * to the wrapped transport with its own private data swapped back in.
+ */
+typedef struct {
+	const omron_transport* inner;
+	void* inner_data;
+	omron_trace* trace;
+	int64_t last_us;
+} omron_trace_recorder;
+
+typedef struct {
+	omron_trace* trace;
+	int flags;
+	/// Records consumed so far, for error messages
+	long position;
+	/// Replay clock: when the previous record happened [us]
+	int64_t clock_us;
+	/// Record read ahead by a poll that had no report to hand out
+	omron_trace_record next;
+	int have_next;
+} omron_trace_player;
+
+OMRON_DECLSPEC omron_trace* omron_trace_open(const char* path, int append)
+{
+	omron_trace* trace;
+	char magic[TRACE_MAGIC_LEN];
+
+	trace = calloc(1, sizeof(*trace));
+	if (!trace) return NULL;
+	trace->append = append;
+	trace->file = fopen(path, append ? "a+b" : "rb");
+	if (!trace->file) {
+		MSG_ERROR("Cannot open trace file %s\n", path);
+		free(trace);
+		return NULL;
+	}
+	setvbuf(trace->file, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+
+	fseek(trace->file, 0, SEEK_END);
+	if (append && ftell(trace->file) == 0) {
+		fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_LEN, trace->file);
+		return trace;
+	}
+	fseek(trace->file, 0, SEEK_SET);
+	if (fread(magic, 1, TRACE_MAGIC_LEN, trace->file) != TRACE_MAGIC_LEN ||
+	    memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_LEN)) {
+		MSG_ERROR("%s is not a trace file\n", path);
+		fclose(trace->file);
+		free(trace);
+		return NULL;
+	}
+	// Writes in "a" mode always go to the end of the file
+	return trace;
+}
+
+OMRON_DECLSPEC int omron_trace_read(omron_trace* trace, omron_trace_record* record)
+{
+	uint8_t header[TRACE_HEADER_LEN];
+	size_t n;
+
+	n = fread(header, 1, sizeof(header), trace->file);
+	if (n == 0 && feof(trace->file)) return 0;
+	if (n != sizeof(header)) {
+		MSG_ERROR("Truncated trace record\n");
+		return OMRON_ERR_BADDATA;
+	}
+	record->type = header[0];
+	record->size = header[1];
+	record->status = (int16_t)(header[2] | (header[3] << 8));
+	record->delta_us = header[4] | (header[5] << 8) | (header[6] << 16) | ((uint32_t)header[7] << 24);
+	if (record->size > OMRON_TRACE_MAX_PAYLOAD) {
+		MSG_ERROR("Trace record too large (%d > %d)\n", record->size, OMRON_TRACE_MAX_PAYLOAD);
+		return OMRON_ERR_BADDATA;
+	}
+	if (fread(record->data, 1, record->size, trace->file) != record->size) {
+		MSG_ERROR("Truncated trace record\n");
+		return OMRON_ERR_BADDATA;
+	}
+	return 1;
+}
+
+OMRON_DECLSPEC int omron_trace_write(omron_trace* trace, const omron_trace_record* record)
+{
+	uint8_t header[TRACE_HEADER_LEN];
+
+	if (!trace->append || record->size > OMRON_TRACE_MAX_PAYLOAD) return OMRON_ERR_BADARG;
+	header[0] = record->type;
+	header[1] = record->size;
+	header[2] = (uint16_t)record->status & 0xff;
+	header[3] = (uint16_t)record->status >> 8;
+	header[4] = record->delta_us & 0xff;
+	header[5] = (record->delta_us >> 8) & 0xff;
+	header[6] = (record->delta_us >> 16) & 0xff;
+	header[7] = record->delta_us >> 24;
+	if (fwrite(header, 1, sizeof(header), trace->file) != sizeof(header) ||
+	    fwrite(record->data, 1, record->size, trace->file) != record->size) {
+		MSG_ERROR("Cannot write trace record\n");
+		return OMRON_ERR_DEVIO;
+	}
+	return 0;
+}
+
+OMRON_DECLSPEC int omron_trace_close(omron_trace* trace)
+{
+	int status;
+
+	if (!trace) return 0;
+	status = fclose(trace->file);
+	free(trace);
+	return status ? OMRON_ERR_DEVIO : 0;
+}
+
+//recording
+
+static void omron_trace_put(omron_trace_recorder* rec, int type, int status, const uint8_t* data, int size)
+{
+	omron_trace_record record;
+	int64_t now = omron_now_us();
+	int64_t delta = now - rec->last_us;
+
+	if (size < 0) size = 0;
+	if (size > OMRON_TRACE_MAX_PAYLOAD) size = OMRON_TRACE_MAX_PAYLOAD;
+	record.type = type;
+	record.size = size;
+	record.status = status < -32768 ? -32768 : (status > 32767 ? 32767 : status);
+	record.delta_us = delta > 0xffffffffLL ? 0xffffffffu : (uint32_t)delta;
+	if (size) memcpy(record.data, data, size);
+	rec->last_us = now;
+	// A failed trace write must not break the session being traced. The
+	// trace is there for the failures, so a crash must not lose its tail.
+	if (omron_trace_write(rec->trace, &record) == 0) fflush(rec->trace->file);
+}
+
+static int omron_trace_rec_set_mode(omron_device* dev, omron_mode mode)
+{
+	omron_trace_recorder* rec = dev->transport_data;
+	uint8_t data[2] = { (mode & 0xff00) >> 8, mode & 0x00ff };
+	int status;
+
+	dev->transport_data = rec->inner_data;
+	status = rec->inner->set_mode(dev, mode);
+	dev->transport_data = rec;
+	omron_trace_put(rec, OMRON_TRACE_MODE, status, data, sizeof(data));
+	return status;
+}
+
+static int omron_trace_rec_read_data(omron_device* dev, uint8_t* report_buf, int report_size, int timeout)
+{
+	omron_trace_recorder* rec = dev->transport_data;
+	int status;
+
+	dev->transport_data = rec->inner_data;
+	status = rec->inner->read_data(dev, report_buf, report_size, timeout);
+	dev->transport_data = rec;
+	omron_trace_put(rec, OMRON_TRACE_READ, status, report_buf, status);
+	return status;
+}
+
+static int omron_trace_rec_write_data(omron_device* dev, uint8_t* report_buf, int report_size, int timeout)
+{
+	omron_trace_recorder* rec = dev->transport_data;
+	int status;
+
+	dev->transport_data = rec->inner_data;
+	status = rec->inner->write_data(dev, report_buf, report_size, timeout);
+	dev->transport_data = rec;
+	omron_trace_put(rec, OMRON_TRACE_WRITE, status, report_buf, report_size);
+	return status;
+}
+
+static int omron_trace_rec_drain_input(omron_device* dev)
+{
+	omron_trace_recorder* rec = dev->transport_data;
+	int status;
+
+	dev->transport_data = rec->inner_data;
+	status = rec->inner->drain_input(dev);
+	dev->transport_data = rec;
+	omron_trace_put(rec, OMRON_TRACE_DRAIN, status, NULL, 0);
+	return status;
+}
+
+static int omron_trace_rec_close(omron_device* dev)
+{
+	omron_trace_recorder* rec = dev->transport_data;
+	int status;
+
+	dev->transport_data = rec->inner_data;
+	status = rec->inner->close(dev);
+	if (status < 0) {
+		// Still open, keep recording
+		dev->transport_data = rec;
+		return status;
+	}
+	omron_trace_put(rec, OMRON_TRACE_CLOSE, status, NULL, 0);
+	omron_trace_close(rec->trace);
+	free(rec);
+	return status;
+}
+
+static int omron_trace_rec_poll_read(omron_device* dev, uint8_t* report_buf, int report_size)
+{
+	omron_trace_recorder* rec = dev->transport_data;
+	int status;
+
+	dev->transport_data = rec->inner_data;
+	status = rec->inner->poll_read ? rec->inner->poll_read(dev, report_buf, report_size) : OMRON_ERR_UNSUPPORTED;
+	dev->transport_data = rec;
+	// Empty polls depend on timing alone, replay would not make the same ones
+	if (status) omron_trace_put(rec, OMRON_TRACE_READ, status, report_buf, status);
+	return status;
+}
+
+static int omron_trace_rec_get_pollfds(omron_device* dev, omron_pollfd* fds, int max_fds, int* timeout_ms)
+{
+	omron_trace_recorder* rec = dev->transport_data;
+	int status = 0;
+
+	dev->transport_data = rec->inner_data;
+	if (rec->inner->get_pollfds) status = rec->inner->get_pollfds(dev, fds, max_fds, timeout_ms);
+	dev->transport_data = rec;
+	return status;
+}
+
+static const omron_transport omron_trace_rec_transport = {
+	"record",
+	omron_trace_rec_set_mode,
+	omron_trace_rec_read_data,
+	omron_trace_rec_write_data,
+	omron_trace_rec_drain_input,
+	omron_trace_rec_close,
+	omron_trace_rec_poll_read,
+	omron_trace_rec_get_pollfds
+};
+
+OMRON_DECLSPEC int omron_trace_start(omron_device* dev, const char* path)
+{
+	omron_trace_recorder* rec;
+	uint8_t sizes[2];
+
+	if (!dev->transport) {
+		MSG_ERROR("Device not open\n");
+		return OMRON_ERR_NOTOPEN;
+	}
+	rec = calloc(1, sizeof(*rec));
+	if (!rec) return OMRON_ERR_DEVIO;
+	rec->trace = omron_trace_open(path, 1);
+	if (!rec->trace) {
+		free(rec);
+		return OMRON_ERR_BADARG;
+	}
+	rec->inner = dev->transport;
+	rec->inner_data = dev->transport_data;
+	rec->last_us = omron_now_us();
+	dev->transport = &omron_trace_rec_transport;
+	dev->transport_data = rec;
+
+	sizes[0] = dev->input_size;
+	sizes[1] = dev->output_size;
+	omron_trace_put(rec, OMRON_TRACE_OPEN, 0, sizes, sizeof(sizes));
+	MSG_INFO("Recording %s session to %s\n", rec->inner->name, path);
+	return 0;
+}
+
+//replay
+
+/*
+ * Fetch the next record, which must be of the given type. Anything else
+ * means the library is not doing what it did while recording.
+ */
+static int omron_trace_next(omron_trace_player* player, int type, omron_trace_record* record)
+{
+	int status;
+
+	if (player->have_next) {
+		*record = player->next;
+		player->have_next = 0;
+		status = 1;
+	} else {
+		status = omron_trace_read(player->trace, record);
+	}
+	if (status == 0 || (status > 0 && record->type == OMRON_TRACE_OPEN)) {
+		MSG_ERROR("Replay ran past the end of the session (record %ld)\n", player->position);
+		return OMRON_ERR_DEVIO;
+	}
+	if (status < 0) return OMRON_ERR_DEVIO;
+	player->position++;
+	if (record->type != type) {
+		MSG_ERROR("Replay diverged at record %ld: expected type %d, trace has %d\n", player->position, type, record->type);
+		return OMRON_ERR_DEVIO;
+	}
+	player->clock_us += record->delta_us;
+	if (player->flags & OMRON_REPLAY_REALTIME) {
+		omron_sleep_until_us(player->clock_us);
+	}
+	return 0;
+}
+
+static int omron_trace_play_set_mode(omron_device* dev, omron_mode mode)
+{
+	omron_trace_player* player = dev->transport_data;
+	omron_trace_record record;
+	int status;
+
+	status = omron_trace_next(player, OMRON_TRACE_MODE, &record);
+	if (status < 0) return status;
+	if (record.size != 2 || ((record.data[0] << 8) | record.data[1]) != (int)mode) {
+		MSG_ERROR("Replay diverged at record %ld: mode %04x not in trace\n", player->position, mode);
+		return OMRON_ERR_DEVIO;
+	}
+	return record.status;
+}
+
+static int omron_trace_play_read_data(omron_device* dev, uint8_t* report_buf, int report_size, int timeout)
+{
+	omron_trace_player* player = dev->transport_data;
+	omron_trace_record record;
+	int status;
+
+	(void)timeout; // replayed reports are there at once
+	status = omron_trace_next(player, OMRON_TRACE_READ, &record);
+	if (status < 0) return status;
+	if (record.size > report_size) {
+		MSG_ERROR("Supplied buffer too small (%d < %d)\n", report_size, record.size);
+		return OMRON_ERR_BUFSIZE;
+	}
+	memcpy(report_buf, record.data, record.size);
+	return record.status;
+}
+
+static int omron_trace_play_write_data(omron_device* dev, uint8_t* report_buf, int report_size, int timeout)
+{
+	omron_trace_player* player = dev->transport_data;
+	omron_trace_record record;
+	int status;
+
+	(void)timeout;
+	status = omron_trace_next(player, OMRON_TRACE_WRITE, &record);
+	if (status < 0) return status;
+	if (record.size != report_size || memcmp(record.data, report_buf, report_size)) {
+		MSG_ERROR("Replay diverged at record %ld: report differs from trace\n", player->position);
+		MSG_HEXDUMP(OMRON_DEBUG_ERROR, "wrote: ", report_buf, report_size);
+		MSG_HEXDUMP(OMRON_DEBUG_ERROR, "trace: ", record.data, record.size);
+		return OMRON_ERR_DEVIO;
+	}
+	return record.status;
+}
+
+static int omron_trace_play_drain_input(omron_device* dev)
+{
+	omron_trace_player* player = dev->transport_data;
+	omron_trace_record record;
+	int status;
+
+	status = omron_trace_next(player, OMRON_TRACE_DRAIN, &record);
+	if (status < 0) return status;
+	return record.status;
+}
+
+static int omron_trace_play_close(omron_device* dev)
+{
+	omron_trace_player* player = dev->transport_data;
+
+	omron_trace_close(player->trace);
+	free(player);
+	return 0;
+}
+
+/*
+ * A poll only hands out the next record if it is a read, anything else is
+ * left for the call that made it when recording.
+ */
+static int omron_trace_play_poll_read(omron_device* dev, uint8_t* report_buf, int report_size)
+{
+	omron_trace_player* player = dev->transport_data;
+	int status;
+
+	if (!player->have_next) {
+		status = omron_trace_read(player->trace, &player->next);
+		if (status < 0) return OMRON_ERR_DEVIO;
+		if (status == 0) return 0;
+		player->have_next = 1;
+	}
+	if (player->next.type != OMRON_TRACE_READ) return 0;
+	if ((player->flags & OMRON_REPLAY_REALTIME) &&
+	    player->clock_us + player->next.delta_us > omron_now_us()) return 0;
+	return omron_trace_play_read_data(dev, report_buf, report_size, 0);
+}
+
+static const omron_transport omron_trace_play_transport = {
+	"replay",
+	omron_trace_play_set_mode,
+	omron_trace_play_read_data,
+	omron_trace_play_write_data,
+	omron_trace_play_drain_input,
+	omron_trace_play_close,
+	omron_trace_play_poll_read,
+	NULL
+};
+
+OMRON_DECLSPEC int omron_open_replay(omron_device* dev, const char* path, int session, int flags)
+{
+	omron_trace_player* player;
+	omron_trace_record record;
+	int found = -1;
+	int status;
+
+	if (dev->transport) {
+		MSG_ERROR("Device already open\n");
+		return OMRON_ERR_BADARG;
+	}
+	if (session < 0) {
+		MSG_ERROR("Invalid session %d\n", session);
+		return OMRON_ERR_BADARG;
+	}
+	player = calloc(1, sizeof(*player));
+	if (!player) return OMRON_ERR_DEVIO;
+	player->trace = omron_trace_open(path, 0);
+	if (!player->trace) {
+		free(player);
+		return OMRON_ERR_BADARG;
+	}
+	player->flags = flags;
+
+	// Skip to the start of the requested session
+	while (found < session) {
+		status = omron_trace_read(player->trace, &record);
+		if (status <= 0) {
+			MSG_ERROR("Trace %s has no session %d\n", path, session);
+			omron_trace_close(player->trace);
+			free(player);
+			return OMRON_ERR_BADARG;
+		}
+		if (record.type == OMRON_TRACE_OPEN) ++found;
+	}
+	if (record.size != 2) {
+		MSG_ERROR("Bad session record in %s\n", path);
+		omron_trace_close(player->trace);
+		free(player);
+		return OMRON_ERR_BADDATA;
+	}
+
+	dev->input_size = record.data[0];
+	dev->output_size = record.data[1];
+	status = omron_alloc_arena(dev);
+	if (status < 0) {
+		omron_trace_close(player->trace);
+		free(player);
+		return status;
+	}
+	player->clock_us = omron_now_us();
+	dev->transport = &omron_trace_play_transport;
+	dev->transport_data = player;
+	// Nothing is known about the device state after (re)opening
+	omron_reset_session(dev);
+	MSG_INFO("Replaying session %d of %s%s\n", session, path,
+		 (flags & OMRON_REPLAY_REALTIME) ? " in real time" : "");
+	return 0;
+}
@@ -287,6 +287,16 @@ int omron_open_win32(omron_device* dev, int VID, int PID, unsigned int device_in
 					GetDeviceCapabilities(dev->device._dev, &Capabilities);
 					dev->input_size = Capabilities.InputReportByteLength;
 					dev->output_size = Capabilities.OutputReportByteLength;
+					if (omron_alloc_arena(dev) < 0) {
+						CloseHandle(dev->device._dev);
+						free(detailData);
+						SetupDiDestroyDeviceInfoList(hDevInfo);
+						return OMRON_ERR_DEVIO;
+					}
+					dev->transport = &omron_usb_transport;
+					dev->transport_data = NULL;
+					// Nothing is known about the device state after (re)opening
+					omron_reset_session(dev);
 					break;
 				}
 			}
@@ -313,23 +323,41 @@ int omron_open_win32(omron_device* dev, int VID, int PID, unsigned int device_in
 	return OMRON_ERR_DEVIO;
 }
 
-OMRON_DECLSPEC int omron_get_count(omron_device* dev, int VID, int PID)
+int omron_usb_get_count(omron_device* dev, int VID, int PID)
 {
 	return omron_open_win32(dev, VID, PID, 0, 1);
 }
 
-OMRON_DECLSPEC int omron_open(omron_device* dev, int VID, int PID, unsigned int device_index)
+int omron_usb_open(omron_device* dev, int VID, int PID, unsigned int device_index)
 {
 	return omron_open_win32(dev, VID, PID, device_index, 0);
 }
 
-OMRON_DECLSPEC int omron_close(omron_device* dev)
+OMRON_DECLSPEC int omron_enumerate(omron_device* dev, int VID, int PID, const omron_device_entry** entries)
+{
+	//FIXME: HID paths could be snapshotted the same way, libusb only for now
+	if (entries) *entries = NULL;
+	MSG_ERROR("Device enumeration snapshots are not supported on windows\n");
+	return OMRON_ERR_UNSUPPORTED;
+}
+
+OMRON_DECLSPEC int omron_open_handle(omron_device* dev, const omron_device_entry* entry)
+{
+	return OMRON_ERR_UNSUPPORTED;
+}
+
+OMRON_DECLSPEC int omron_open_path(omron_device* dev, int VID, int PID, const char* port_path)
+{
+	return OMRON_ERR_UNSUPPORTED;
+}
+
+static int omron_usb_close(omron_device* dev)
 {
 	CloseHandle(dev->device._dev);
 	return 0;
 }
 
-int omron_set_mode(omron_device* dev, omron_mode mode)
+static int omron_usb_set_mode(omron_device* dev, omron_mode mode)
 {
 	char feature_report[3] = {0x0, (mode & 0xff00) >> 8, (mode & 0x00ff)};
 
@@ -344,16 +372,16 @@ int omron_set_mode(omron_device* dev, omron_mode mode)
 	return 0;
 }
 
-OMRON_DECLSPEC int omron_read_data(omron_device* dev, unsigned char *report_buf, int report_size, int timeout)
+/*
+ * Read an input report, waiting up to timeout ms for one. If none comes,
+ * returns 0 if timeout_ok, or else fails.
+ */
+static int omron_usb_read_report(omron_device* dev, unsigned char *report_buf, int report_size, int timeout, int timeout_ok)
 {
 	BOOL result;
-	char read_buf[dev->input_size + 1];
+	char* read_buf = (char*)dev->arena.platform;
 	DWORD trans;
-	int timeout_ok = (timeout < 0);
 
-	if (timeout_ok) {
-		timeout = -timeout;
-	}
 	if (report_size < dev->input_size) {
 		MSG_ERROR("Supplied buffer too small (%d < %d)\n", report_size, dev->input_size);
 		return OMRON_ERR_BUFSIZE;
@@ -367,7 +395,7 @@ OMRON_DECLSPEC int omron_read_data(omron_device* dev, unsigned char *report_buf,
 		// Windows uses zero to mean "failed"
 		if (GetLastError() == ERROR_IO_INCOMPLETE) {
 			if (timeout_ok) {
-				MSG_DEVIO("(USB operation timed out)\n");
+				if (timeout) MSG_DEVIO("(USB operation timed out)\n");
 				return 0;
 			}
 			MSG_ERROR("USB operation timed out.\n");
@@ -378,17 +406,30 @@ OMRON_DECLSPEC int omron_read_data(omron_device* dev, unsigned char *report_buf,
 	}
 	trans--;
 	memcpy(report_buf, read_buf + 1, trans);
-	MSG_HEXDUMP(OMRON_DEBUG_DEVIO, "read: ", report_buf, trans);
 	if (trans != dev->input_size) {
 		MSG_ERROR("Transfer size (%d) did not match expected (%d)\n", trans, dev->input_size);
 	}
 	return trans;
 }
 
-OMRON_DECLSPEC int omron_write_data(omron_device* dev, unsigned char *report_buf, int report_size, int timeout)
+static int omron_usb_read_data(omron_device* dev, unsigned char *report_buf, int report_size, int timeout)
+{
+	if (timeout < 0) {
+		return omron_usb_read_report(dev, report_buf, report_size, -timeout, 1);
+	}
+	return omron_usb_read_report(dev, report_buf, report_size, timeout, 0);
+}
+
+static int omron_usb_poll_read(omron_device* dev, unsigned char *report_buf, int report_size)
+{
+	// Reports the HID driver has buffered complete the read at once
+	return omron_usb_read_report(dev, report_buf, report_size, 0, 1);
+}
+
+static int omron_usb_write_data(omron_device* dev, unsigned char *report_buf, int report_size, int timeout)
 {
 	BOOL result;
-	char command[dev->output_size + 1];
+	char* command = (char*)dev->arena.platform;
 	DWORD trans;
 	int timeout_ok = (timeout < 0);
 
@@ -419,7 +460,6 @@ OMRON_DECLSPEC int omron_write_data(omron_device* dev, unsigned char *report_buf
 		MSG_ERROR("Write failed: %d\n", GetLastError());
 		return OMRON_ERR_DEVIO;
 	}
-	MSG_HEXDUMP(OMRON_DEBUG_DEVIO, "wrote: ", report_buf, trans);
 	if (trans != dev->output_size) {
 		MSG_ERROR("Transfer size (%d) did not match expected (%d)\n", trans, dev->output_size);
 		return OMRON_ERR_DEVIO;
@@ -436,5 +476,40 @@ OMRON_DECLSPEC omron_device* omron_create_device()
 
 OMRON_DECLSPEC void omron_delete(omron_device* dev)
 {
+	omron_free_arena(dev);
+	omron_free_event_log(dev);
+	omron_free_stats(dev);
+	omron_free_lock(dev);
 	free(dev);
 }
+
+static int omron_usb_drain_input(omron_device* dev)
+{
+	unsigned char* input_report = dev->arena.input_report;
+	int wait = omron_drain_wait_ms(dev);
+	int drained = 0;
+	int status;
+
+	// The HID class driver keeps polling the device into its own input
+	// buffer, so anything pending is readable immediately; a 1ms read
+	// timeout means the buffer is empty. Answers still owed get a round
+	// trip to turn up.
+	while (1) {
+		status = omron_usb_read_data(dev, input_report, dev->input_size, wait > 1 ? -wait : -1);
+		if (status < 0) return status;
+		if (status == 0) break;
+		drained += status;
+	}
+	return drained;
+}
+
+const omron_transport omron_usb_transport = {
+	"usb",
+	omron_usb_set_mode,
+	omron_usb_read_data,
+	omron_usb_write_data,
+	omron_usb_drain_input,
+	omron_usb_close,
+	omron_usb_poll_read,
+	NULL // No descriptors, event loops poll on omron_cmd_timeout()
+};
@@ -14,26 +14,49 @@ static const int PID = OMRON_PID;
 
 
 #include <string>
+#include <vector>
+#include <cstring>
+#include <cstddef>
+#include <cstdio>
+
+#define OMRON_FIELD(layout, type, field, format) \
+    add_field(layout, #field, format, offsetof(type, field))
 
 class Omron {
     omron_device* device;
+    bool opened;
+
+    // The object owns its device, copies would delete it twice
+    Omron(const Omron&);
+    Omron& operator=(const Omron&);
 public:
     typedef std::string data;
 
     Omron() {
         device = omron_create();
+        opened = false;
+    }
+    ~Omron() {
+	if (device) {
+	    if (opened) omron_close(device);
+	    omron_delete(device);
+	}
+	device = 0;
     }
-    ~Omron();
 
     int count(int vid=OMRON_VID, int pid=OMRON_PID) {
         return omron_get_count(device, vid, pid);
     }
 
     int open(int vid=OMRON_VID, int pid=OMRON_PID, int device_index = 0) {
-	return omron_open(device, vid, pid, device_index);
+	int ret = omron_open(device, vid, pid, device_index);
+	if (ret >= 0) opened = true;
+	return ret;
     }
 
     int close() {
+	if (!opened) return 0;
+	opened = false;
 	return omron_close(device);
     }
 
@@ -99,12 +122,116 @@ public:
     omron_pd_daily_data get_pd_daily_data(int day) {
 	return omron_get_pd_daily_data(device, day);	
     }
-    omron_pd_hourly_data* get_pd_hourly_data(int day) {
-	return omron_get_pd_hourly_data(device, day);
+    std::vector<omron_pd_hourly_data> get_pd_hourly_data(int day) {
+	std::vector<omron_pd_hourly_data> hours(24);
+	if (omron_read_pd_hourly_data(device, day, &hours[0]) < 0) hours.clear();
+	return hours;
+    }
+
+    // Bulk reads. These fill a caller supplied buffer (anything writable
+    // with the buffer protocol, e.g. a NumPy array with a dtype from
+    // python/records.py) with an array of the C structures, so no Python
+    // object is made per record. They return the number of records read,
+    // or < 0 on error.
+
+    // Records first..last of a bank, failed ones have present == 0
+    int read_daily_bp(int bank, int first, int last, char* buffer, size_t size) {
+	int count = last - first + 1;
+	if (count < 1) return OMRON_ERR_BADARG;
+	if (size < count * sizeof(omron_bp_day_info)) return OMRON_ERR_BUFSIZE;
+	if (aligned(buffer)) {
+	    return omron_get_daily_bp_range(device, bank, first, last, (omron_bp_day_info*)buffer, 0);
+	}
+	std::vector<omron_bp_day_info> records(count);
+	int ret = omron_get_daily_bp_range(device, bank, first, last, &records[0], 0);
+	std::memcpy(buffer, &records[0], count * sizeof(omron_bp_day_info));
+	return ret;
+    }
+
+    // Pedometer totals of days first..first+count-1, stops at the first failure
+    int read_pd_daily(int first, int count, char* buffer, size_t size) {
+	int ret;
+	int i;
+	if (count < 1) return OMRON_ERR_BADARG;
+	if (size < count * sizeof(omron_pd_daily_data)) return OMRON_ERR_BUFSIZE;
+	omron_pd_history* history = omron_pd_history_create(count);
+	if (!history) return OMRON_ERR_DEVIO;
+	// Pipelined, the days are requested without waiting for each other
+	ret = omron_get_pd_history(device, first, first + count - 1, history);
+	for (i = 0; ret >= 0 && i < count; ++i) {
+	    if (history->status[i] < 0) {
+		ret = history->status[i];
+		break;
+	    }
+	    std::memcpy(buffer + i * sizeof(omron_pd_daily_data), &history->daily[i], sizeof(omron_pd_daily_data));
+	}
+	omron_pd_history_delete(history);
+	return i ? i : ret;
+    }
+
+    // The 24 hours of a day
+    int read_pd_hourly(int day, char* buffer, size_t size) {
+	omron_pd_hourly_data hours[24];
+	if (size < sizeof(hours)) return OMRON_ERR_BUFSIZE;
+	int ret = omron_read_pd_hourly_data(device, day, hours);
+	if (ret < 0) return ret;
+	std::memcpy(buffer, hours, sizeof(hours));
+	return 24;
     }
 
+    // Layout of the records the bulk reads return, "name:type:offset"
+    // for each field (types as in NumPy, e.g. u4), for building dtypes
+    static std::string bp_day_layout() {
+	std::string layout;
+	OMRON_FIELD(layout, omron_bp_day_info, year, "u4");
+	OMRON_FIELD(layout, omron_bp_day_info, month, "u4");
+	OMRON_FIELD(layout, omron_bp_day_info, day, "u4");
+	OMRON_FIELD(layout, omron_bp_day_info, hour, "u4");
+	OMRON_FIELD(layout, omron_bp_day_info, minute, "u4");
+	OMRON_FIELD(layout, omron_bp_day_info, second, "u4");
+	OMRON_FIELD(layout, omron_bp_day_info, sys, "u4");
+	OMRON_FIELD(layout, omron_bp_day_info, dia, "u4");
+	OMRON_FIELD(layout, omron_bp_day_info, pulse, "u4");
+	OMRON_FIELD(layout, omron_bp_day_info, present, "u1");
+	return layout;
+    }
+    static std::string pd_daily_layout() {
+	std::string layout;
+	OMRON_FIELD(layout, omron_pd_daily_data, total_steps, "i4");
+	OMRON_FIELD(layout, omron_pd_daily_data, total_aerobic_steps, "i4");
+	OMRON_FIELD(layout, omron_pd_daily_data, total_aerobic_walking_time, "i4");
+	OMRON_FIELD(layout, omron_pd_daily_data, total_calories, "i4");
+	OMRON_FIELD(layout, omron_pd_daily_data, total_distance, "f4");
+	OMRON_FIELD(layout, omron_pd_daily_data, total_fat_burn, "f4");
+	OMRON_FIELD(layout, omron_pd_daily_data, day_serial, "i4");
+	return layout;
+    }
+    static std::string pd_hourly_layout() {
+	std::string layout;
+	OMRON_FIELD(layout, omron_pd_hourly_data, day_serial, "i4");
+	OMRON_FIELD(layout, omron_pd_hourly_data, hour_serial, "i4");
+	OMRON_FIELD(layout, omron_pd_hourly_data, is_attached, "u1");
+	OMRON_FIELD(layout, omron_pd_hourly_data, event, "u1");
+	OMRON_FIELD(layout, omron_pd_hourly_data, regular_steps, "i4");
+	OMRON_FIELD(layout, omron_pd_hourly_data, aerobic_steps, "i4");
+	return layout;
+    }
+    static int bp_day_size() { return sizeof(omron_bp_day_info); }
+    static int pd_daily_size() { return sizeof(omron_pd_daily_data); }
+    static int pd_hourly_size() { return sizeof(omron_pd_hourly_data); }
+
 private:
 
+    static bool aligned(const char* buffer) {
+	return (size_t)buffer % sizeof(uint32_t) == 0;
+    }
+
+    static void add_field(std::string& layout, const char* name, const char* type, size_t offset) {
+	char field[64];
+	snprintf(field, sizeof(field), "%s%s:%s:%u", layout.empty() ? "" : ",", name, type, (unsigned)offset);
+	layout += field;
+    }
+
     Omron::data datify(unsigned char* data, int maxlen) {
 	std::string ret;
 	for (int ind=0; ind<maxlen && data[ind]; ++ind) {
@@ -1,4 +1,6 @@
-%module omron
+// threads="1": every wrapped call releases the GIL while it runs, so USB
+// I/O on one device does not stall the other Python threads
+%module(threads="1") omron
 %{
 #include "libomron/omron.h"
 #include "Omron.h"
@@ -6,6 +8,20 @@
 
 %include "std_string.i"
 %include "carrays.i"
+%include "std_vector.i"
+
+ // bulk reads fill any writable buffer (NumPy array, bytearray, ...). The
+ // buffer is exported for the whole call, so it cannot be resized or freed
+ // while the read runs without the GIL
+%typemap(in) (char* buffer, size_t size) (Py_buffer view, int have_view = 0) {
+  if (PyObject_GetBuffer($input, &view, PyBUF_WRITABLE) < 0) SWIG_fail;
+  have_view = 1;
+  $1 = (char*)view.buf;
+  $2 = (size_t)view.len;
+}
+%typemap(freearg) (char* buffer, size_t size) {
+  if (have_view$argnum) PyBuffer_Release(&view$argnum);
+}
 
  // to access unknown_*[]
 %array_functions(unsigned char, CharArray);
@@ -22,4 +38,7 @@
 %typemap(out) uint32_t = int;
 
 %include "libomron/omron.h"
+
+%template(PdHourlyVector) std::vector<omron_pd_hourly_data>;
+
 %include "Omron.h"